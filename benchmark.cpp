@@ -0,0 +1,1294 @@
+/**
+ * Benchmark of the morphology kernels on synthetic DSMs.
+ *
+ * Sweeps image size, mask size and connectivity for every kernel in
+ * `kernels` below, prints a table and writes the results as JSON for
+ * regression tracking. Needs no input files and no GDAL.
+ *
+ * usage: tophat_benchmark [--sizes 512,1024,...] [--masks 3,5,...]
+ *                         [--connectivity 4,8] [--repeat N] [--seed S]
+ *                         [--max-work W] [--out results.json]
+ *
+ * --max-work skips (mask, connectivity) combinations whose estimated number
+ * of neighbor visits on a BENCH_WORK_SIZE x BENCH_WORK_SIZE image exceeds
+ * W, so the default sweep stays runnable. The cap grows with the image, so
+ * every size runs the same combinations.
+ */
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include "synthetic_dsm.h"
+#include "morph.h"
+#include "reconstruct.h"
+#include "erode_linear.h"
+#include "erode_paraboloid.h"
+#include "threshold_top_hat.h"
+#include "packed_binary.h"
+#include "rle_binary.h"
+#include "top_hat_extract.h"
+#include "max_tree.h"
+
+#define BENCH_WORK_SIZE 1024
+
+typedef struct BenchInput_tag {
+    float *image;
+    int size;
+    int mask_size;
+    int connectivity;
+} BenchInput;
+
+/**
+ * one kernel under test. setup runs untimed and returns kernel state, run is
+ * timed, teardown frees the state.
+ */
+typedef struct BenchKernel_tag {
+    const char *name;
+    bool sweeps_mask;
+    bool sweeps_connectivity;
+    double (*work)(const BenchInput *input);
+    void *(*setup)(const BenchInput *input);
+    void (*run)(void *state);
+    void (*teardown)(void *state);
+} BenchKernel;
+
+static double pixels(const BenchInput *input) {
+    return (double) input->size * input->size;
+}
+
+/*
+ * peak resident set size. On Linux the high-water mark is reset before
+ * every kernel so each result reports its own peak; elsewhere it is the
+ * process peak so far.
+ */
+static void peak_rss_reset() {
+#ifdef __linux__
+    FILE *file = fopen("/proc/self/clear_refs", "w");
+    if (file != NULL) {
+        fputs("5", file);
+        fclose(file);
+    }
+#endif
+}
+
+static double peak_rss_mb() {
+#ifdef __linux__
+    FILE *file = fopen("/proc/self/status", "r");
+    if (file != NULL) {
+        char line[256];
+        long kb = -1;
+        while (fgets(line, sizeof(line), file)) {
+            if (strncmp(line, "VmHWM:", 6) == 0) {
+                kb = strtol(line + 6, NULL, 10);
+                break;
+            }
+        }
+        fclose(file);
+        if (kb >= 0) return kb / 1024.0;
+    }
+#endif
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+    return usage.ru_maxrss / 1024.0;
+#endif
+}
+
+static int *ones_mask(int mask_size) {
+    int *mask = (int *) malloc(sizeof(int) * mask_size * mask_size);
+    for (int i = 0; i < mask_size * mask_size; ++i) mask[i] = 1;
+    return mask;
+}
+
+/*
+ * erodeGrayFlat: generic neighborhood walker erosion
+ */
+typedef struct ErodeState_tag {
+    float *in;
+    float *out;
+    int num_elements;
+    Neighborhood_T nhood;
+    NeighborhoodWalker_T walker;
+} ErodeState;
+
+static double erode_flat_work(const BenchInput *input) {
+    return pixels(input) * input->mask_size * input->mask_size;
+}
+
+static void *erode_flat_setup(const BenchInput *input) {
+    ErodeState *state = (ErodeState *) malloc(sizeof(ErodeState));
+    int *mask = ones_mask(input->mask_size);
+    int mask_size[2] = {input->mask_size, input->mask_size};
+    int image_size[2] = {input->size, input->size};
+    state->in = input->image;
+    state->num_elements = input->size * input->size;
+    state->out = (float *) malloc(sizeof(float) * state->num_elements);
+    state->nhood = create_neighborhood_general_template(mask, mask_size, NH_CENTER_MIDDLE_ROUNDDOWN);
+    state->walker = nhMakeNeighborhoodWalker(state->nhood, image_size, NH_USE_ALL);
+    free(mask);
+    return state;
+}
+
+static void erode_flat_run(void *p) {
+    ErodeState *state = (ErodeState *) p;
+    erodeGrayFlat(state->in, state->out, state->num_elements, state->walker);
+}
+
+static void erode_flat_teardown(void *p) {
+    ErodeState *state = (ErodeState *) p;
+    nhDestroyNeighborhoodWalker(state->walker);
+    nhDestroyNeighborhood(state->nhood);
+    free(state->out);
+    free(state);
+}
+
+/*
+ * erodeGrayFlatPadded: same erosion on a +inf padded copy, no bounds tests
+ */
+typedef struct ErodePaddedState_tag {
+    PaddedImage<float> *in;
+    PaddedImage<float> *out;
+    NeighborhoodWalker_T walker;
+} ErodePaddedState;
+
+static void *erode_padded_setup(const BenchInput *input) {
+    ErodePaddedState *state = (ErodePaddedState *) malloc(sizeof(ErodePaddedState));
+    int *mask = ones_mask(input->mask_size);
+    int mask_size[2] = {input->mask_size, input->mask_size};
+    int image_size[2] = {input->size, input->size};
+    Neighborhood_T nhood = create_neighborhood_general_template(mask, mask_size, NH_CENTER_MIDDLE_ROUNDDOWN);
+    state->walker = nhMakeNeighborhoodWalker(nhood, image_size, NH_USE_ALL);
+    nhDestroyNeighborhood(nhood);
+    free(mask);
+    float high = PaddedImage<float>::max_sentinel();
+    state->in = new PaddedImage<float>(input->size, input->size, padded_walker_reach(state->walker), high);
+    state->out = new PaddedImage<float>(input->size, input->size, 0, high);
+    state->in->load(input->image);
+    return state;
+}
+
+static void erode_padded_run(void *p) {
+    ErodePaddedState *state = (ErodePaddedState *) p;
+    erodeGrayFlatPadded(*state->in, *state->out, state->walker);
+}
+
+static void erode_padded_teardown(void *p) {
+    ErodePaddedState *state = (ErodePaddedState *) p;
+    nhDestroyNeighborhoodWalker(state->walker);
+    delete state->in;
+    delete state->out;
+    free(state);
+}
+
+/*
+ * erodeGrayRect: separable van Herk line erosion
+ */
+typedef struct RectState_tag {
+    float *in;
+    float *out;
+    int size;
+    int mask_size;
+} RectState;
+
+static double erode_rect_work(const BenchInput *input) {
+    return pixels(input) * 6;
+}
+
+static void *erode_rect_setup(const BenchInput *input) {
+    RectState *state = (RectState *) malloc(sizeof(RectState));
+    state->in = input->image;
+    state->size = input->size;
+    state->mask_size = input->mask_size;
+    state->out = (float *) malloc(sizeof(float) * input->size * input->size);
+    return state;
+}
+
+static void erode_rect_run(void *p) {
+    RectState *state = (RectState *) p;
+    erodeGrayRect(state->in, state->out, state->size, state->size,
+                  state->mask_size, state->mask_size);
+}
+
+static void erode_rect_teardown(void *p) {
+    RectState *state = (RectState *) p;
+    free(state->out);
+    free(state);
+}
+
+/*
+ * erodeGrayParaboloid: the curvature drops the paraboloid by mask_size / 4
+ * at half the mask size from its apex, so the mask size sweep covers flat
+ * to steep paraboloids; the cost should not depend on it
+ */
+static double paraboloid_work(const BenchInput *input) {
+    return pixels(input) * 10;
+}
+
+static void paraboloid_run(void *p) {
+    RectState *state = (RectState *) p;
+    erodeGrayParaboloid(state->in, state->out, state->size, state->size, 1.0 / state->mask_size);
+}
+
+/*
+ * compute_reconstruction: marker is the erosion of the image by the mask,
+ * as in top_hat_extract
+ */
+typedef struct ReconstructState_tag {
+    float *marker;
+    float *J;
+    float *I;
+    int num_elements;
+    NeighborhoodWalker_T walker;
+    NeighborhoodWalker_T trailing_walker;
+    NeighborhoodWalker_T leading_walker;
+} ReconstructState;
+
+static double reconstruct_work(const BenchInput *input) {
+    return pixels(input) * input->connectivity * 3;
+}
+
+static void *reconstruct_setup(const BenchInput *input) {
+    ReconstructState *state = (ReconstructState *) malloc(sizeof(ReconstructState));
+    int image_size[2] = {input->size, input->size};
+    state->num_elements = input->size * input->size;
+    state->I = input->image;
+    state->marker = (float *) malloc(sizeof(float) * state->num_elements);
+    state->J = (float *) malloc(sizeof(float) * state->num_elements);
+    erodeGrayRect(input->image, state->marker, input->size, input->size,
+                  input->mask_size, input->mask_size);
+
+    Neighborhood_T nhood = nhMakeNeighborhood(input->connectivity, NH_CENTER_MIDDLE_ROUNDDOWN);
+    state->trailing_walker = nhMakeNeighborhoodWalker(nhood, image_size,
+                                                      NH_SKIP_CENTER | NH_SKIP_LEADING);
+    state->leading_walker = nhMakeNeighborhoodWalker(nhood, image_size,
+                                                     NH_SKIP_CENTER | NH_SKIP_TRAILING);
+    state->walker = nhMakeNeighborhoodWalker(nhood, image_size, NH_SKIP_CENTER);
+    nhDestroyNeighborhood(nhood);
+    return state;
+}
+
+static void reconstruct_run(void *p) {
+    ReconstructState *state = (ReconstructState *) p;
+    memcpy(state->J, state->marker, sizeof(float) * state->num_elements);
+    compute_reconstruction(state->J, state->I, state->num_elements, state->walker,
+                           state->trailing_walker, state->leading_walker);
+}
+
+static void reconstruct_teardown(void *p) {
+    ReconstructState *state = (ReconstructState *) p;
+    nhDestroyNeighborhoodWalker(state->walker);
+    nhDestroyNeighborhoodWalker(state->trailing_walker);
+    nhDestroyNeighborhoodWalker(state->leading_walker);
+    free(state->marker);
+    free(state->J);
+    free(state);
+}
+
+/*
+ * compute_reconstruction of the same image and marker quantized to uint8
+ * (0.25 m steps) and uint16 (1 cm steps), which picks the hierarchical
+ * queue, against the hybrid kernels it replaces for them
+ */
+typedef struct ReconstructIntegerState_tag {
+    ReconstructState *dense;
+    uint8_t *marker8;
+    uint8_t *J8;
+    uint8_t *I8;
+    uint16_t *marker16;
+    uint16_t *J16;
+    uint16_t *I16;
+} ReconstructIntegerState;
+
+template <typename T>
+static void quantize(const float *in, T *out, int n, float scale) {
+    for (int i = 0; i < n; ++i) {
+        float v = floorf(in[i] * scale);
+        v = v < 0 ? 0 : v;
+        out[i] = v > (float) std::numeric_limits<T>::max() ? std::numeric_limits<T>::max() : (T) v;
+    }
+}
+
+static void *reconstruct_integer_setup(const BenchInput *input) {
+    ReconstructIntegerState *state = (ReconstructIntegerState *) malloc(sizeof(ReconstructIntegerState));
+    state->dense = (ReconstructState *) reconstruct_setup(input);
+    int n = state->dense->num_elements;
+    state->marker8 = (uint8_t *) malloc(n);
+    state->J8 = (uint8_t *) malloc(n);
+    state->I8 = (uint8_t *) malloc(n);
+    state->marker16 = (uint16_t *) malloc(sizeof(uint16_t) * n);
+    state->J16 = (uint16_t *) malloc(sizeof(uint16_t) * n);
+    state->I16 = (uint16_t *) malloc(sizeof(uint16_t) * n);
+    quantize(state->dense->marker, state->marker8, n, 4.0f);
+    quantize(state->dense->I, state->I8, n, 4.0f);
+    quantize(state->dense->marker, state->marker16, n, 100.0f);
+    quantize(state->dense->I, state->I16, n, 100.0f);
+    return state;
+}
+
+/*
+ * what compute_reconstruction ran for integer images before the
+ * hierarchical queue
+ */
+template <typename T>
+static void hybrid_reconstruction(T *J, T *I, int n, const ReconstructState *dense) {
+    typedef StatsCounter<false> Counter;
+    for (const StaticReconstructionKernel<T, Counter> *k = static_reconstruction_kernels<T, Counter>();
+         k->name; ++k) {
+        if (k->matches(dense->walker, dense->trailing_walker, dense->leading_walker)) {
+            k->reconstruct(J, I, n, dense->walker, dense->trailing_walker, dense->leading_walker, NULL);
+            return;
+        }
+    }
+    compute_reconstruction_impl<T, Counter>(J, I, n, dense->walker, dense->trailing_walker,
+                                            dense->leading_walker, NULL);
+}
+
+static void reconstruct_uint8_run(void *p) {
+    ReconstructIntegerState *state = (ReconstructIntegerState *) p;
+    int n = state->dense->num_elements;
+    memcpy(state->J8, state->marker8, n);
+    compute_reconstruction(state->J8, state->I8, n, state->dense->walker,
+                           state->dense->trailing_walker, state->dense->leading_walker);
+}
+
+static void reconstruct_uint8_hybrid_run(void *p) {
+    ReconstructIntegerState *state = (ReconstructIntegerState *) p;
+    int n = state->dense->num_elements;
+    memcpy(state->J8, state->marker8, n);
+    hybrid_reconstruction(state->J8, state->I8, n, state->dense);
+}
+
+static void reconstruct_uint16_run(void *p) {
+    ReconstructIntegerState *state = (ReconstructIntegerState *) p;
+    int n = state->dense->num_elements;
+    memcpy(state->J16, state->marker16, sizeof(uint16_t) * n);
+    compute_reconstruction(state->J16, state->I16, n, state->dense->walker,
+                           state->dense->trailing_walker, state->dense->leading_walker);
+}
+
+static void reconstruct_uint16_hybrid_run(void *p) {
+    ReconstructIntegerState *state = (ReconstructIntegerState *) p;
+    int n = state->dense->num_elements;
+    memcpy(state->J16, state->marker16, sizeof(uint16_t) * n);
+    hybrid_reconstruction(state->J16, state->I16, n, state->dense);
+}
+
+static void reconstruct_integer_teardown(void *p) {
+    ReconstructIntegerState *state = (ReconstructIntegerState *) p;
+    reconstruct_teardown(state->dense);
+    free(state->marker8);
+    free(state->J8);
+    free(state->I8);
+    free(state->marker16);
+    free(state->J16);
+    free(state->I16);
+    free(state);
+}
+
+/*
+ * compute_reconstruction_padded: same reconstruction on -inf padded copies
+ */
+typedef struct ReconstructPaddedState_tag {
+    ReconstructState *dense;
+    PaddedImage<float> *J;
+    PaddedImage<float> *I;
+    float *image;  // input made by the setup, freed with the state
+} ReconstructPaddedState;
+
+static void *reconstruct_padded_setup(const BenchInput *input) {
+    ReconstructPaddedState *state = (ReconstructPaddedState *) malloc(sizeof(ReconstructPaddedState));
+    state->dense = (ReconstructState *) reconstruct_setup(input);
+    float low = PaddedImage<float>::min_sentinel();
+    state->J = new PaddedImage<float>(input->size, input->size, 1, low);
+    state->I = new PaddedImage<float>(input->size, input->size, 1, low);
+    state->I->load(input->image);
+    state->image = NULL;
+    return state;
+}
+
+/*
+ * the DSM with everything below its 90th percentile flattened to it: open
+ * country with a few buildings, where the marker equals the image on most
+ * tiles
+ */
+static void *reconstruct_rural_setup(const BenchInput *input) {
+    int n = input->size * input->size;
+    float *rural = (float *) malloc(sizeof(float) * n);
+    memcpy(rural, input->image, sizeof(float) * n);
+    std::nth_element(rural, rural + n * 9 / 10, rural + n);
+    float ground = rural[n * 9 / 10];
+    for (int i = 0; i < n; ++i) rural[i] = input->image[i] > ground ? input->image[i] : ground;
+    BenchInput flat = *input;
+    flat.image = rural;
+    ReconstructPaddedState *state = (ReconstructPaddedState *) reconstruct_padded_setup(&flat);
+    state->image = rural;
+    return state;
+}
+
+/*
+ * a winding corridor: bands of WINDING_BENCH_WIDTH rows between walls two
+ * rows high, each wall open at alternate ends, and a marker at the start of
+ * the first band. Both scans stop at the first turn against them, so almost
+ * all of the reconstruction is FIFO propagation along the corridor
+ */
+#define WINDING_BENCH_WIDTH 8
+
+static void *reconstruct_winding_setup(const BenchInput *input) {
+    int size = input->size;
+    int period = WINDING_BENCH_WIDTH + 2;
+    float *winding = (float *) malloc(sizeof(float) * size * size);
+    for (int y = 0; y < size; ++y) {
+        bool wall = y % period >= WINDING_BENCH_WIDTH;
+        bool open_right = (y / period) % 2 == 0;
+        for (int x = 0; x < size; ++x) {
+            bool gap = open_right ? x >= size - WINDING_BENCH_WIDTH : x < WINDING_BENCH_WIDTH;
+            winding[y * size + x] = wall && !gap ? 0.0f : 10.0f;
+        }
+    }
+    BenchInput corridor = *input;
+    corridor.image = winding;
+    corridor.mask_size = 1;
+    ReconstructPaddedState *state = (ReconstructPaddedState *) reconstruct_padded_setup(&corridor);
+    float *marker = state->dense->marker;
+    for (int i = 0; i < size * size; ++i) marker[i] = 0.0f;
+    marker[0] = 10.0f;
+    state->image = winding;
+    return state;
+}
+
+static void reconstruct_padded_run(void *p) {
+    ReconstructPaddedState *state = (ReconstructPaddedState *) p;
+    state->J->load(state->dense->marker);
+    compute_reconstruction_padded(*state->J, *state->I, state->dense->walker,
+                                  state->dense->trailing_walker, state->dense->leading_walker);
+}
+
+static void reconstruct_pyramid_run(void *p) {
+    ReconstructPaddedState *state = (ReconstructPaddedState *) p;
+    state->J->load(state->dense->marker);
+    compute_reconstruction_pyramid(*state->J, *state->I, state->dense->walker,
+                                   state->dense->trailing_walker, state->dense->leading_walker);
+}
+
+static void reconstruct_padded_teardown(void *p) {
+    ReconstructPaddedState *state = (ReconstructPaddedState *) p;
+    reconstruct_teardown(state->dense);
+    delete state->J;
+    delete state->I;
+    free(state->image);
+    free(state);
+}
+
+/*
+ * top_hat_extract_levels: threshold decomposition of the whole top-hat on
+ * the DSM quantized to THRESHOLD_BENCH_LEVELS levels
+ */
+#define THRESHOLD_BENCH_LEVELS 8
+
+typedef struct LevelsState_tag {
+    float *image;
+    float *out;
+    int *mask;
+    int size;
+    int mask_size;
+    float levels[THRESHOLD_BENCH_LEVELS];
+    int num_levels;
+} LevelsState;
+
+static double levels_work(const BenchInput *input) {
+    return pixels(input) * (THRESHOLD_BENCH_LEVELS - 1) *
+           (1 + input->mask_size * input->mask_size / 32.0);
+}
+
+static void *levels_setup(const BenchInput *input) {
+    LevelsState *state = (LevelsState *) malloc(sizeof(LevelsState));
+    int n = input->size * input->size;
+    float low = input->image[0], high = input->image[0];
+    for (int i = 0; i < n; ++i) {
+        if (input->image[i] < low) low = input->image[i];
+        if (input->image[i] > high) high = input->image[i];
+    }
+    float step = (high - low) / (THRESHOLD_BENCH_LEVELS - 1) * 1.0001f;
+    if (step <= 0) step = 1;
+    state->image = (float *) malloc(sizeof(float) * n);
+    for (int i = 0; i < n; ++i) {
+        state->image[i] = low + floorf((input->image[i] - low) / step) * step;
+    }
+    state->out = (float *) malloc(sizeof(float) * n);
+    state->mask = ones_mask(input->mask_size);
+    state->size = input->size;
+    state->mask_size = input->mask_size;
+    state->num_levels = threshold_levels(image_view<const float>(state->image, input->size, input->size),
+                                         THRESHOLD_BENCH_LEVELS, state->levels);
+    return state;
+}
+
+static void levels_run(void *p) {
+    LevelsState *state = (LevelsState *) p;
+    top_hat_extract_levels(image_view<const float>(state->image, state->size, state->size),
+                           state->levels, state->num_levels, state->mask,
+                           state->mask_size, state->mask_size,
+                           image_view(state->out, state->size, state->size));
+}
+
+static void levels_teardown(void *p) {
+    LevelsState *state = (LevelsState *) p;
+    free(state->image);
+    free(state->out);
+    free(state->mask);
+    free(state);
+}
+
+/*
+ * packed binary erosion of the DSM thresholded at its mean, 32 or 64
+ * pixels per word, scalar or AVX2
+ */
+typedef struct PackedState_tag {
+    unsigned int *in32;
+    unsigned int *out32;
+    uint64_t *in64;
+    uint64_t *out64;
+    ptrdiff_t *rc_offsets;
+    int num_neighbors;
+    int size;
+} PackedState;
+
+static double packed_work(const BenchInput *input) {
+    return pixels(input) * input->mask_size * input->mask_size / 32.0;
+}
+
+static void *packed_setup(const BenchInput *input) {
+    PackedState *state = (PackedState *) malloc(sizeof(PackedState));
+    int n = input->size * input->size;
+    double mean = 0;
+    for (int i = 0; i < n; ++i) mean += input->image[i];
+    mean /= n;
+    int words = packed_row_words(input->size);
+    int words64 = (input->size + 63) / 64;
+    state->size = input->size;
+    state->in32 = (unsigned int *) malloc(sizeof(unsigned int) * words * input->size);
+    state->out32 = (unsigned int *) malloc(sizeof(unsigned int) * words * input->size);
+    state->in64 = (uint64_t *) calloc((size_t) words64 * input->size, sizeof(uint64_t));
+    state->out64 = (uint64_t *) malloc(sizeof(uint64_t) * words64 * input->size);
+    pack_threshold(image_view<const float>(input->image, input->size, input->size),
+                   (float) mean, false, state->in32);
+    for (int y = 0; y < input->size; ++y) {
+        for (int w = 0; w < words; ++w) {
+            state->in64[(size_t) y * words64 + w / 2] |=
+                    (uint64_t) state->in32[(size_t) y * words + w] << (32 * (w % 2));
+        }
+    }
+    int *mask = ones_mask(input->mask_size);
+    int mask_size[2] = {input->mask_size, input->mask_size};
+    Neighborhood_T nhood = create_neighborhood_general_template(mask, mask_size, NH_CENTER_MIDDLE_ROUNDDOWN);
+    state->rc_offsets = packed_rc_offsets(nhood);
+    state->num_neighbors = nhood->num_neighbors;
+    nhDestroyNeighborhood(nhood);
+    free(mask);
+    return state;
+}
+
+static void packed_uint32_run(void *p) {
+    PackedState *state = (PackedState *) p;
+    int words = packed_row_words(state->size);
+    // the uint32 kernel negates its offsets and ORs into its output
+    for (int k = 0; k < 2 * state->num_neighbors; ++k) state->rc_offsets[k] = -state->rc_offsets[k];
+    memset(state->out32, 0, sizeof(unsigned int) * words * state->size);
+    erode_packed_uint32(state->in32, state->out32, words, state->size, state->rc_offsets,
+                        state->num_neighbors, state->size);
+}
+
+static void packed_uint64_run(void *p) {
+    PackedState *state = (PackedState *) p;
+    erode_packed_uint64(state->in64, state->out64, (state->size + 63) / 64, state->size,
+                        state->rc_offsets, state->num_neighbors, state->size);
+}
+
+static void packed_uint32_avx2_run(void *p) {
+    PackedState *state = (PackedState *) p;
+    erode_packed_uint32_avx2(state->in32, state->out32, packed_row_words(state->size), state->size,
+                             state->rc_offsets, state->num_neighbors, state->size);
+}
+
+static void packed_uint64_avx2_run(void *p) {
+    PackedState *state = (PackedState *) p;
+    erode_packed_uint64_avx2(state->in64, state->out64, (state->size + 63) / 64, state->size,
+                             state->rc_offsets, state->num_neighbors, state->size);
+}
+
+static void packed_teardown(void *p) {
+    PackedState *state = (PackedState *) p;
+    free(state->in32);
+    free(state->out32);
+    free(state->in64);
+    free(state->out64);
+    free(state->rc_offsets);
+    free(state);
+}
+
+/*
+ * packed binary reconstruction of the DSM thresholded at its mean, from
+ * its packed erosion
+ */
+typedef struct PackedReconstructState_tag {
+    unsigned int *mask;
+    unsigned int *marker;
+    unsigned int *recon;
+    int size;
+    int connectivity;
+} PackedReconstructState;
+
+static double packed_reconstruct_work(const BenchInput *input) {
+    return pixels(input) * input->connectivity / 32.0;
+}
+
+static void *packed_reconstruct_setup(const BenchInput *input) {
+    PackedReconstructState *state = (PackedReconstructState *) malloc(sizeof(PackedReconstructState));
+    PackedState *packed = (PackedState *) packed_setup(input);
+    size_t total = (size_t) packed_row_words(input->size) * input->size;
+    state->size = input->size;
+    state->connectivity = input->connectivity;
+    state->mask = packed->in32;
+    state->marker = (unsigned int *) malloc(sizeof(unsigned int) * total);
+    state->recon = (unsigned int *) malloc(sizeof(unsigned int) * total);
+    erode_packed_uint32_avx2(packed->in32, state->marker, packed_row_words(input->size), input->size,
+                             packed->rc_offsets, packed->num_neighbors, input->size);
+    packed->in32 = NULL;
+    packed_teardown(packed);
+    return state;
+}
+
+static void packed_reconstruct_run(void *p) {
+    PackedReconstructState *state = (PackedReconstructState *) p;
+    memcpy(state->recon, state->marker,
+           sizeof(unsigned int) * packed_row_words(state->size) * state->size);
+    reconstruct_packed(state->recon, state->mask, state->size, state->size, state->connectivity);
+}
+
+static void packed_reconstruct_teardown(void *p) {
+    PackedReconstructState *state = (PackedReconstructState *) p;
+    free(state->mask);
+    free(state->marker);
+    free(state->recon);
+    free(state);
+}
+
+/*
+ * binary erosion of the DSM thresholded at its mean by a square of ones:
+ * the interior/edge walker kernel and the run-length rectangle engine
+ */
+typedef struct LogicalState_tag {
+    bool *in;
+    bool *out;
+    Neighborhood_T nhood;
+    NeighborhoodWalker_T walker;
+    int size;
+    int mask_size;
+} LogicalState;
+
+static double logical_twod_work(const BenchInput *input) {
+    return pixels(input) * input->mask_size * input->mask_size;
+}
+
+static double logical_rect_work(const BenchInput *input) {
+    return pixels(input) * 4;
+}
+
+static void *logical_setup(const BenchInput *input) {
+    LogicalState *state = (LogicalState *) malloc(sizeof(LogicalState));
+    int n = input->size * input->size;
+    double mean = 0;
+    for (int i = 0; i < n; ++i) mean += input->image[i];
+    mean /= n;
+    state->in = (bool *) malloc(sizeof(bool) * n);
+    state->out = (bool *) malloc(sizeof(bool) * n);
+    for (int i = 0; i < n; ++i) state->in[i] = input->image[i] > mean;
+    int *mask = ones_mask(input->mask_size);
+    int mask_size[2] = {input->mask_size, input->mask_size};
+    int image_size[2] = {input->size, input->size};
+    state->nhood = create_neighborhood_general_template(mask, mask_size, NH_CENTER_MIDDLE_ROUNDDOWN);
+    state->walker = nhMakeNeighborhoodWalker(state->nhood, image_size, NH_USE_ALL);
+    state->size = input->size;
+    state->mask_size = input->mask_size;
+    free(mask);
+    return state;
+}
+
+static void logical_twod_run(void *p) {
+    LogicalState *state = (LogicalState *) p;
+    // the walker kernel, as it ran before rectangles were routed to the
+    // run-length engine
+    memset(state->out, 0, sizeof(bool) * state->size * state->size);
+    erode_logical(state->in, state->out, state->size * state->size, state->walker);
+}
+
+static void logical_rect_run(void *p) {
+    LogicalState *state = (LogicalState *) p;
+    erode_logical_rect(state->in, state->out, state->size, state->size,
+                       state->mask_size, state->mask_size);
+}
+
+static void logical_teardown(void *p) {
+    LogicalState *state = (LogicalState *) p;
+    free(state->in);
+    free(state->out);
+    nhDestroyNeighborhoodWalker(state->walker);
+    nhDestroyNeighborhood(state->nhood);
+    free(state);
+}
+
+/*
+ * run-length erosion and dilation by a square of ones of a sparse mask:
+ * the 5% highest pixels of the DSM
+ */
+typedef struct RleState_tag {
+    RleImage *image;
+    int mask_size;
+} RleState;
+
+static double rle_work(const BenchInput *input) {
+    return pixels(input) * 0.05 * 4;
+}
+
+static void *rle_setup(const BenchInput *input) {
+    RleState *state = (RleState *) malloc(sizeof(RleState));
+    int n = input->size * input->size;
+    std::vector<float> sorted(input->image, input->image + n);
+    std::nth_element(sorted.begin(), sorted.begin() + n / 20, sorted.end(), std::greater<float>());
+    float threshold = sorted[n / 20];
+    std::vector<unsigned int> packed((size_t) packed_row_words(input->size) * input->size);
+    pack_threshold(image_view<const float>(input->image, input->size, input->size),
+                   threshold, false, packed.data());
+    state->image = new RleImage(rle_from_packed(packed.data(), input->size, input->size));
+    state->mask_size = input->mask_size;
+    return state;
+}
+
+static void rle_erode_run(void *p) {
+    RleState *state = (RleState *) p;
+    RleImage eroded = rle_erode_rect(*state->image, state->mask_size, state->mask_size);
+    (void) eroded;
+}
+
+static void rle_dilate_run(void *p) {
+    RleState *state = (RleState *) p;
+    RleImage dilated = rle_dilate_rect(*state->image, state->mask_size, state->mask_size);
+    (void) dilated;
+}
+
+static void rle_teardown(void *p) {
+    RleState *state = (RleState *) p;
+    delete state->image;
+    free(state);
+}
+
+/*
+ * erode_gray_nonflat_single with a ball-shaped structuring element (a
+ * square of ones whose heights drop like a sphere of radius mask_size)
+ */
+typedef struct NonflatState_tag {
+    ErodeState *flat;
+    double *heights;
+} NonflatState;
+
+static void *nonflat_setup(const BenchInput *input) {
+    NonflatState *state = (NonflatState *) malloc(sizeof(NonflatState));
+    state->flat = (ErodeState *) erode_flat_setup(input);
+    Neighborhood_T nhood = state->flat->nhood;
+    state->heights = (double *) malloc(sizeof(double) * nhood->num_neighbors);
+    double radius = input->mask_size;
+    for (int k = 0; k < nhood->num_neighbors; ++k) {
+        double dx = (double) nhood->array_coords[2 * k];
+        double dy = (double) nhood->array_coords[2 * k + 1];
+        state->heights[k] = sqrt(radius * radius - dx * dx - dy * dy) - radius;
+    }
+    return state;
+}
+
+static void nonflat_run(void *p) {
+    NonflatState *state = (NonflatState *) p;
+    erode_gray_nonflat_single(state->flat->in, state->flat->out, state->flat->num_elements,
+                              state->flat->walker, state->heights);
+}
+
+static void nonflat_teardown(void *p) {
+    NonflatState *state = (NonflatState *) p;
+    erode_flat_teardown(state->flat);
+    free(state->heights);
+    free(state);
+}
+
+/*
+ * top_hat_extract_ball: the whole rolling-ball top-hat, a sphere of
+ * diameter mask_size, exact and with the paraboloid that fits its top
+ */
+typedef struct BallState_tag {
+    float *image;
+    float *out;
+    int size;
+    double radius;
+} BallState;
+
+static double ball_work(const BenchInput *input) {
+    return pixels(input) * (30 + 0.8 * input->mask_size * input->mask_size);
+}
+
+static double ball_paraboloid_work(const BenchInput *input) {
+    return pixels(input) * 40;
+}
+
+static void *ball_setup(const BenchInput *input) {
+    BallState *state = (BallState *) malloc(sizeof(BallState));
+    state->image = input->image;
+    state->size = input->size;
+    state->radius = input->mask_size / 2.0;
+    state->out = (float *) malloc(sizeof(float) * input->size * input->size);
+    return state;
+}
+
+static void ball_run(void *p) {
+    BallState *state = (BallState *) p;
+    top_hat_extract_ball_view(image_view<const float>(state->image, state->size, state->size),
+                              image_view(state->out, state->size, state->size),
+                              state->radius, state->radius, false);
+}
+
+static void ball_paraboloid_run(void *p) {
+    BallState *state = (BallState *) p;
+    top_hat_extract_ball_view(image_view<const float>(state->image, state->size, state->size),
+                              image_view(state->out, state->size, state->size),
+                              state->radius, state->radius, true);
+}
+
+static void ball_teardown(void *p) {
+    BallState *state = (BallState *) p;
+    free(state->out);
+    free(state);
+}
+
+/*
+ * top_hat_profile: 8 squares, 3 to about 2 * mask_size + 1 pixels, against
+ * top_hat_extract run once per square
+ */
+#define PROFILE_BENCH_SCALES 8
+
+typedef struct ProfileState_tag {
+    float *image;
+    float *out;
+    int size;
+    int sizes[PROFILE_BENCH_SCALES];
+    int *masks[PROFILE_BENCH_SCALES];
+} ProfileState;
+
+static double profile_work(const BenchInput *input) {
+    return pixels(input) * PROFILE_BENCH_SCALES * 60;
+}
+
+static void *profile_setup(const BenchInput *input) {
+    ProfileState *state = (ProfileState *) malloc(sizeof(ProfileState));
+    state->image = input->image;
+    state->size = input->size;
+    int step = input->mask_size / 8 > 1 ? input->mask_size / 8 : 1;
+    for (int k = 0; k < PROFILE_BENCH_SCALES; ++k) {
+        state->sizes[k] = 2 * (k + 1) * step + 1;
+        state->masks[k] = ones_mask(state->sizes[k]);
+    }
+    state->out = (float *) malloc(sizeof(float) * input->size * input->size * PROFILE_BENCH_SCALES);
+    return state;
+}
+
+static void profile_run(void *p) {
+    ProfileState *state = (ProfileState *) p;
+    top_hat_profile_view(image_view<const float>(state->image, state->size, state->size),
+                         state->sizes, PROFILE_BENCH_SCALES, state->out);
+}
+
+static void profile_separate_run(void *p) {
+    ProfileState *state = (ProfileState *) p;
+    size_t plane = (size_t) state->size * state->size;
+    for (int k = 0; k < PROFILE_BENCH_SCALES; ++k) {
+        top_hat_extract_view(image_view<const float>(state->image, state->size, state->size),
+                             image_view(state->out + k * plane, state->size, state->size),
+                             state->masks[k], state->sizes[k], state->sizes[k]);
+    }
+}
+
+static void profile_teardown(void *p) {
+    ProfileState *state = (ProfileState *) p;
+    for (int k = 0; k < PROFILE_BENCH_SCALES; ++k) free(state->masks[k]);
+    free(state->out);
+    free(state);
+}
+
+/*
+ * MaxTree: the tree build on one thread and on four bands, and one
+ * attribute top-hat (area and height) on a built tree
+ */
+typedef struct MaxTreeState_tag {
+    float *image;
+    float *out;
+    int size;
+    int connectivity;
+    MaxTree *tree;
+} MaxTreeState;
+
+static double max_tree_work(const BenchInput *input) {
+    return pixels(input) * 40;
+}
+
+static void *max_tree_setup(const BenchInput *input) {
+    MaxTreeState *state = (MaxTreeState *) malloc(sizeof(MaxTreeState));
+    state->image = input->image;
+    state->size = input->size;
+    state->connectivity = input->connectivity;
+    state->out = (float *) malloc(sizeof(float) * input->size * input->size);
+    state->tree = NULL;
+    return state;
+}
+
+static void max_tree_build(MaxTreeState *state, int threads) {
+    delete state->tree;
+    state->tree = new MaxTree(image_view<const float>(state->image, state->size, state->size),
+                              state->connectivity, threads);
+}
+
+static void max_tree_run(void *p) {
+    max_tree_build((MaxTreeState *) p, 1);
+}
+
+static void max_tree_threads_run(void *p) {
+    max_tree_build((MaxTreeState *) p, 4);
+}
+
+static void *max_tree_filter_setup(const BenchInput *input) {
+    MaxTreeState *state = (MaxTreeState *) max_tree_setup(input);
+    max_tree_build(state, 1);
+    return state;
+}
+
+static void max_tree_filter_run(void *p) {
+    MaxTreeState *state = (MaxTreeState *) p;
+    AttributeCriteria criteria = {100, 2.0, 0};
+    state->tree->attribute_top_hat(criteria, image_view(state->out, state->size, state->size));
+}
+
+static void max_tree_teardown(void *p) {
+    MaxTreeState *state = (MaxTreeState *) p;
+    delete state->tree;
+    free(state->out);
+    free(state);
+}
+
+/*
+ * h-domes for four heights: one stack against one h_dome per height and
+ * against the marker image - h stored before a plain reconstruction; the
+ * regional maxima on the same image
+ */
+#define DOME_BENCH_HEIGHTS 4
+
+typedef struct DomeState_tag {
+    float *image;
+    float *out;
+    float *marker;
+    bool *maxima;
+    int size;
+    double heights[DOME_BENCH_HEIGHTS];
+} DomeState;
+
+static double dome_work(const BenchInput *input) {
+    return pixels(input) * DOME_BENCH_HEIGHTS * 60;
+}
+
+static void *dome_setup(const BenchInput *input) {
+    DomeState *state = (DomeState *) malloc(sizeof(DomeState));
+    state->image = input->image;
+    state->size = input->size;
+    size_t plane = (size_t) input->size * input->size;
+    state->out = (float *) malloc(sizeof(float) * plane * DOME_BENCH_HEIGHTS);
+    state->marker = (float *) malloc(sizeof(float) * plane);
+    state->maxima = (bool *) malloc(sizeof(bool) * plane);
+    static const double heights[DOME_BENCH_HEIGHTS] = {1.0, 2.5, 5.0, 10.0};
+    memcpy(state->heights, heights, sizeof(heights));
+    return state;
+}
+
+static void dome_stack_run(void *p) {
+    DomeState *state = (DomeState *) p;
+    h_dome_stack_view(image_view<const float>(state->image, state->size, state->size),
+                      state->heights, DOME_BENCH_HEIGHTS, state->out);
+}
+
+static void dome_single_run(void *p) {
+    DomeState *state = (DomeState *) p;
+    size_t plane = (size_t) state->size * state->size;
+    for (int k = 0; k < DOME_BENCH_HEIGHTS; ++k) {
+        h_dome_view(image_view<const float>(state->image, state->size, state->size),
+                    image_view(state->out + k * plane, state->size, state->size), state->heights[k]);
+    }
+}
+
+static void dome_materialized_run(void *p) {
+    DomeState *state = (DomeState *) p;
+    size_t plane = (size_t) state->size * state->size;
+    for (int k = 0; k < DOME_BENCH_HEIGHTS; ++k) {
+        float *out = state->out + k * plane;
+        for (size_t i = 0; i < plane; ++i) state->marker[i] = state->image[i] - (float) state->heights[k];
+        im_reconstruct_view(image_view<const float>(state->marker, state->size, state->size),
+                            image_view<const float>(state->image, state->size, state->size),
+                            image_view(out, state->size, state->size));
+        for (size_t i = 0; i < plane; ++i) out[i] = state->image[i] - out[i];
+    }
+}
+
+static void regional_maxima_run(void *p) {
+    DomeState *state = (DomeState *) p;
+    regional_maxima_view(image_view<const float>(state->image, state->size, state->size),
+                         image_view(state->maxima, state->size, state->size));
+}
+
+static void dome_teardown(void *p) {
+    DomeState *state = (DomeState *) p;
+    free(state->out);
+    free(state->marker);
+    free(state->maxima);
+    free(state);
+}
+
+/*
+ * hole filling alone, and as the first stage of a top-hat
+ */
+typedef struct FillState_tag {
+    float *image;
+    float *out;
+    int size;
+    int mask_size;
+    int *mask;
+} FillState;
+
+static double fill_work(const BenchInput *input) {
+    return pixels(input) * 60;
+}
+
+static void *fill_setup(const BenchInput *input) {
+    FillState *state = (FillState *) malloc(sizeof(FillState));
+    state->image = input->image;
+    state->size = input->size;
+    state->mask_size = input->mask_size;
+    state->mask = ones_mask(input->mask_size);
+    state->out = (float *) malloc(sizeof(float) * input->size * input->size);
+    return state;
+}
+
+static void fill_run(void *p) {
+    FillState *state = (FillState *) p;
+    fill_holes_view(image_view<const float>(state->image, state->size, state->size),
+                    image_view(state->out, state->size, state->size));
+}
+
+static void fill_top_hat_run(void *p) {
+    FillState *state = (FillState *) p;
+    top_hat_extract_view(image_view<const float>(state->image, state->size, state->size),
+                         image_view(state->out, state->size, state->size),
+                         state->mask, state->mask_size, state->mask_size, NULL, true);
+}
+
+static void fill_teardown(void *p) {
+    FillState *state = (FillState *) p;
+    free(state->mask);
+    free(state->out);
+    free(state);
+}
+
+static const BenchKernel kernels[] = {
+        {"erodeGrayFlat", true, false, erode_flat_work,
+                erode_flat_setup, erode_flat_run, erode_flat_teardown},
+        {"erode_gray_nonflat_single", true, false, erode_flat_work,
+                nonflat_setup, nonflat_run, nonflat_teardown},
+        {"erodeGrayFlatPadded", true, false, erode_flat_work,
+                erode_padded_setup, erode_padded_run, erode_padded_teardown},
+        {"erodeGrayRect", true, false, erode_rect_work,
+                erode_rect_setup, erode_rect_run, erode_rect_teardown},
+        {"erodeGrayParaboloid", true, false, paraboloid_work,
+                erode_rect_setup, paraboloid_run, erode_rect_teardown},
+        {"compute_reconstruction", true, true, reconstruct_work,
+                reconstruct_setup, reconstruct_run, reconstruct_teardown},
+        {"compute_reconstruction_padded", true, true, reconstruct_work,
+                reconstruct_padded_setup, reconstruct_padded_run, reconstruct_padded_teardown},
+        {"compute_reconstruction_padded(rural)", true, true, reconstruct_work,
+                reconstruct_rural_setup, reconstruct_padded_run, reconstruct_padded_teardown},
+        {"compute_reconstruction_pyramid", true, true, reconstruct_work,
+                reconstruct_padded_setup, reconstruct_pyramid_run, reconstruct_padded_teardown},
+        {"compute_reconstruction_padded(winding)", false, true, reconstruct_work,
+                reconstruct_winding_setup, reconstruct_padded_run, reconstruct_padded_teardown},
+        {"compute_reconstruction_pyramid(winding)", false, true, reconstruct_work,
+                reconstruct_winding_setup, reconstruct_pyramid_run, reconstruct_padded_teardown},
+        {"compute_reconstruction_uint8", true, true, reconstruct_work,
+                reconstruct_integer_setup, reconstruct_uint8_run, reconstruct_integer_teardown},
+        {"compute_reconstruction_uint8(hybrid)", true, true, reconstruct_work,
+                reconstruct_integer_setup, reconstruct_uint8_hybrid_run, reconstruct_integer_teardown},
+        {"compute_reconstruction_uint16", true, true, reconstruct_work,
+                reconstruct_integer_setup, reconstruct_uint16_run, reconstruct_integer_teardown},
+        {"compute_reconstruction_uint16(hybrid)", true, true, reconstruct_work,
+                reconstruct_integer_setup, reconstruct_uint16_hybrid_run, reconstruct_integer_teardown},
+        {"top_hat_extract_levels", true, false, levels_work,
+                levels_setup, levels_run, levels_teardown},
+        {"top_hat_extract_ball", true, false, ball_work,
+                ball_setup, ball_run, ball_teardown},
+        {"top_hat_extract_ball(paraboloid)", true, false, ball_paraboloid_work,
+                ball_setup, ball_paraboloid_run, ball_teardown},
+        {"erode_packed_uint32", true, false, packed_work,
+                packed_setup, packed_uint32_run, packed_teardown},
+        {"erode_packed_uint64", true, false, packed_work,
+                packed_setup, packed_uint64_run, packed_teardown},
+        {"erode_packed_uint32_avx2", true, false, packed_work,
+                packed_setup, packed_uint32_avx2_run, packed_teardown},
+        {"erode_packed_uint64_avx2", true, false, packed_work,
+                packed_setup, packed_uint64_avx2_run, packed_teardown},
+        {"erode_logical", true, false, logical_twod_work,
+                logical_setup, logical_twod_run, logical_teardown},
+        {"erode_logical_rect", true, false, logical_rect_work,
+                logical_setup, logical_rect_run, logical_teardown},
+        {"rle_erode_rect", true, false, rle_work,
+                rle_setup, rle_erode_run, rle_teardown},
+        {"rle_dilate_rect", true, false, rle_work,
+                rle_setup, rle_dilate_run, rle_teardown},
+        {"reconstruct_packed", true, true, packed_reconstruct_work,
+                packed_reconstruct_setup, packed_reconstruct_run, packed_reconstruct_teardown},
+        {"top_hat_profile", true, false, profile_work,
+                profile_setup, profile_run, profile_teardown},
+        {"top_hat_extract(per scale)", true, false, profile_work,
+                profile_setup, profile_separate_run, profile_teardown},
+        {"MaxTree", false, true, max_tree_work,
+                max_tree_setup, max_tree_run, max_tree_teardown},
+        {"MaxTree(4 threads)", false, true, max_tree_work,
+                max_tree_setup, max_tree_threads_run, max_tree_teardown},
+        {"MaxTree::attribute_top_hat", false, true, max_tree_work,
+                max_tree_filter_setup, max_tree_filter_run, max_tree_teardown},
+        {"h_dome_stack", false, false, dome_work,
+                dome_setup, dome_stack_run, dome_teardown},
+        {"h_dome(per height)", false, false, dome_work,
+                dome_setup, dome_single_run, dome_teardown},
+        {"h_dome(stored marker)", false, false, dome_work,
+                dome_setup, dome_materialized_run, dome_teardown},
+        {"regional_maxima", false, false, dome_work,
+                dome_setup, regional_maxima_run, dome_teardown},
+        {"fill_holes", false, false, fill_work,
+                fill_setup, fill_run, fill_teardown},
+        {"top_hat_extract(fill_holes)", true, false, fill_work,
+                fill_setup, fill_top_hat_run, fill_teardown},
+};
+
+static std::vector<int> parse_list(const char *text) {
+    std::vector<int> values;
+    const char *p = text;
+    while (*p) {
+        char *end;
+        long v = strtol(p, &end, 10);
+        if (end == p) break;
+        values.push_back((int) v);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return values;
+}
+
+int main(int argc, char **argv) {
+    std::vector<int> sizes = parse_list("512,1024,2048,4096,8192,16384");
+    std::vector<int> masks = parse_list("3,5,11,21,51,101");
+    std::vector<int> connectivities = parse_list("4,8");
+    int repeat = 3;
+    unsigned int seed = 1;
+    double max_work = 1e9;
+    std::string out_file = "benchmark.json";
+
+    for (int i = 1; i < argc; ++i) {
+        bool has_value = i + 1 < argc;
+        if (!strcmp(argv[i], "--sizes") && has_value) sizes = parse_list(argv[++i]);
+        else if (!strcmp(argv[i], "--masks") && has_value) masks = parse_list(argv[++i]);
+        else if (!strcmp(argv[i], "--connectivity") && has_value) connectivities = parse_list(argv[++i]);
+        else if (!strcmp(argv[i], "--repeat") && has_value) repeat = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--seed") && has_value) seed = (unsigned int) atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--max-work") && has_value) max_work = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--out") && has_value) out_file = argv[++i];
+        else {
+            fprintf(stderr, "unknown argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (repeat < 1) repeat = 1;
+
+    FILE *json = fopen(out_file.c_str(), "w");
+    if (json == NULL) {
+        fprintf(stderr, "cannot write %s\n", out_file.c_str());
+        return 1;
+    }
+    fprintf(json, "{\"seed\":%u,\"repeat\":%d,\"results\":[", seed, repeat);
+    bool first_result = true;
+
+    printf("%-30s %7s %5s %5s %10s %10s %10s %10s\n",
+           "kernel", "size", "mask", "conn", "seconds", "Mpix/s", "ns/pixel", "peak MB");
+
+    const int num_kernels = sizeof(kernels) / sizeof(kernels[0]);
+    for (size_t s = 0; s < sizes.size(); ++s) {
+        SyntheticDsmParams params;
+        synthetic_dsm_default_params(&params);
+        params.seed = seed;
+        BenchInput input;
+        input.size = sizes[s];
+        input.image = synthetic_dsm_generate(input.size, input.size, &params);
+
+        for (int k = 0; k < num_kernels; ++k) {
+            const BenchKernel &kernel = kernels[k];
+            size_t num_masks = kernel.sweeps_mask ? masks.size() : 1;
+            size_t num_conns = kernel.sweeps_connectivity ? connectivities.size() : 1;
+            for (size_t m = 0; m < num_masks; ++m) {
+                for (size_t c = 0; c < num_conns; ++c) {
+                    input.mask_size = kernel.sweeps_mask ? masks[m] : 0;
+                    input.connectivity = kernel.sweeps_connectivity ? connectivities[c] : 0;
+                    BenchInput reference = input;
+                    reference.size = BENCH_WORK_SIZE;
+                    if (kernel.work(&reference) > max_work) {
+                        printf("%-30s %7d %5d %5d    skipped (--max-work)\n", kernel.name,
+                               input.size, input.mask_size, input.connectivity);
+                        continue;
+                    }
+
+                    peak_rss_reset();
+                    void *state = kernel.setup(&input);
+                    double best = 1e300;
+                    for (int r = 0; r < repeat; ++r) {
+                        double start = stats_now();
+                        kernel.run(state);
+                        double elapsed = stats_now() - start;
+                        if (elapsed < best) best = elapsed;
+                    }
+                    double peak = peak_rss_mb();
+                    kernel.teardown(state);
+
+                    double mpix_per_s = pixels(&input) / best / 1e6;
+                    double ns_per_pixel = best * 1e9 / pixels(&input);
+                    printf("%-30s %7d %5d %5d %10.4f %10.2f %10.3f %10.1f\n", kernel.name,
+                           input.size, input.mask_size, input.connectivity,
+                           best, mpix_per_s, ns_per_pixel, peak);
+                    fflush(stdout);
+                    fprintf(json, "%s\n{\"kernel\":\"%s\",\"size\":%d,\"mask\":%d,\"connectivity\":%d,"
+                                  "\"seconds\":%.6f,\"mpix_per_s\":%.3f,\"ns_per_pixel\":%.4f,"
+                                  "\"peak_rss_mb\":%.1f}",
+                            first_result ? "" : ",", kernel.name, input.size, input.mask_size,
+                            input.connectivity, best, mpix_per_s, ns_per_pixel, peak);
+                    first_result = false;
+                }
+            }
+        }
+        free(input.image);
+    }
+
+    fprintf(json, "\n]}\n");
+    fclose(json);
+    return 0;
+}
@@ -0,0 +1,1689 @@
+/**
+ * Differential test: every erosion and reconstruction engine must give
+ * bit-for-bit the same result as the frozen walker implementations in
+ * reference_morph.h.
+ *
+ * Cases are random: image content (noise, few-level plateaus, synthetic DSM
+ * patches, quantized DSMs, constants), image shape (down to 1xN and Nx1),
+ * mask shape (including even sizes, sparse masks and masks larger than the
+ * image), NH_CENTER_* origin and connectivity.
+ *
+ * usage: tophat_differential [--cases N] [--seed S]
+ * exits with 1 if any engine disagrees with the reference.
+ */
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <queue>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "synthetic_dsm.h"
+#include "reference_morph.h"
+#include "erode_linear.h"
+#include "top_hat_extract.h"
+#include "packed_binary.h"
+#include "rle_binary.h"
+#include "max_tree.h"
+
+static std::mt19937 rng;
+static int num_checks = 0;
+static int num_failures = 0;
+
+static int random_int(int lo, int hi) {
+    std::uniform_int_distribution<int> dist(lo, hi);
+    return dist(rng);
+}
+
+/**
+ * compare an engine's output with the reference, report the first
+ * difference
+ */
+static bool check_same(const char *engine, const std::string &context,
+                       const float *expected, const float *actual, int rows, int cols) {
+    ++num_checks;
+    int n = rows * cols;
+    if (memcmp(expected, actual, sizeof(float) * n) == 0) {
+        return true;
+    }
+    ++num_failures;
+    for (int i = 0; i < n; ++i) {
+        if (memcmp(expected + i, actual + i, sizeof(float)) != 0) {
+            printf("FAIL %s [%s] image %dx%d: first difference at (%d, %d): expected %.9g got %.9g\n",
+                   engine, context.c_str(), rows, cols, i / cols, i % cols,
+                   expected[i], actual[i]);
+            break;
+        }
+    }
+    return false;
+}
+
+static float *random_image(int rows, int cols, int *kind_out) {
+    int n = rows * cols;
+    float *image = (float *) malloc(sizeof(float) * n);
+    int kind = random_int(0, 4);
+    if (kind == 0) {
+        std::uniform_real_distribution<float> dist(-50.0f, 50.0f);
+        for (int i = 0; i < n; ++i) image[i] = dist(rng);
+    } else if (kind == 1) {
+        // few levels, so plateaus and ties are common
+        int levels = random_int(2, 6);
+        for (int i = 0; i < n; ++i) image[i] = (float) random_int(0, levels - 1) * 2.5f;
+    } else if (kind == 2) {
+        SyntheticDsmParams params;
+        synthetic_dsm_default_params(&params);
+        params.seed = (unsigned int) rng();
+        params.building_min_size = 2;
+        params.building_max_size = 8;
+        params.terrain_wavelength = 40;
+        float *dsm = synthetic_dsm_generate(rows, cols, &params);
+        memcpy(image, dsm, sizeof(float) * n);
+        free(dsm);
+    } else if (kind == 3) {
+        for (int i = 0; i < n; ++i) image[i] = 7.0f;
+    } else {
+        // DSM quantized to a few dozen height levels
+        SyntheticDsmParams params;
+        synthetic_dsm_default_params(&params);
+        params.seed = (unsigned int) rng();
+        params.building_min_size = 2;
+        params.building_max_size = 8;
+        params.terrain_wavelength = 40;
+        float *dsm = synthetic_dsm_generate(rows, cols, &params);
+        float step = (float) random_int(1, 4);
+        for (int i = 0; i < n; ++i) image[i] = floorf(dsm[i] / step) * step;
+        free(dsm);
+    }
+    *kind_out = kind;
+    return image;
+}
+
+typedef struct TestMask_tag {
+    int *mask;
+    int mask_y;
+    int mask_x;
+    int center;
+    bool all_ones;
+} TestMask;
+
+static const char *center_name(int center) {
+    switch (center) {
+        case NH_CENTER_MIDDLE_ROUNDUP: return "roundup";
+        case NH_CENTER_MIDDLE_ROUNDDOWN: return "rounddown";
+        case NH_CENTER_UL: return "ul";
+        default: return "lr";
+    }
+}
+
+/**
+ * random mask; the origin pixel is always part of it so every pixel has at
+ * least one in-bounds neighbor
+ */
+static TestMask random_mask() {
+    static const int centers[4] = {NH_CENTER_MIDDLE_ROUNDUP, NH_CENTER_MIDDLE_ROUNDDOWN,
+                                   NH_CENTER_UL, NH_CENTER_LR};
+    TestMask m;
+    if (random_int(0, 3) == 0) {
+        // the shapes with compile-time kernels: square or cross, odd size
+        int size = 2 * random_int(1, 3) + 1;
+        bool cross = random_int(0, 1) == 0;
+        m.mask_y = m.mask_x = size;
+        m.center = NH_CENTER_MIDDLE_ROUNDDOWN;
+        m.mask = (int *) malloc(sizeof(int) * size * size);
+        for (int i = 0; i < size * size; ++i) {
+            m.mask[i] = !cross || i / size == size / 2 || i % size == size / 2;
+        }
+        m.all_ones = !cross;
+        return m;
+    }
+    m.mask_y = random_int(1, 7);
+    m.mask_x = random_int(1, 7);
+    m.center = centers[random_int(0, 3)];
+    m.mask = (int *) malloc(sizeof(int) * m.mask_y * m.mask_x);
+    bool dense = random_int(0, 1) == 0;
+    m.all_ones = true;
+    for (int i = 0; i < m.mask_y * m.mask_x; ++i) {
+        m.mask[i] = dense ? 1 : random_int(0, 1);
+        m.all_ones = m.all_ones && m.mask[i];
+    }
+    int cy, cx;
+    if (m.center == NH_CENTER_MIDDLE_ROUNDDOWN) {
+        cy = (m.mask_y - 1) / 2;
+        cx = (m.mask_x - 1) / 2;
+    } else if (m.center == NH_CENTER_MIDDLE_ROUNDUP) {
+        cy = (m.mask_y - 1) / 2 + (m.mask_y - 1) % 2;
+        cx = (m.mask_x - 1) / 2 + (m.mask_x - 1) % 2;
+    } else if (m.center == NH_CENTER_UL) {
+        cy = 0;
+        cx = 0;
+    } else {
+        cy = m.mask_y - 1;
+        cx = m.mask_x - 1;
+    }
+    m.mask[cy * m.mask_x + cx] = 1;
+    return m;
+}
+
+static std::string mask_context(int kind, const TestMask &m) {
+    char text[128];
+    snprintf(text, sizeof(text), "content %d, mask %dx%d %s%s", kind, m.mask_y, m.mask_x,
+             center_name(m.center), m.all_ones ? " ones" : "");
+    return std::string(text);
+}
+
+/**
+ * punch voids into a copy of an image: a few blocks and scattered pixels
+ * become invalid and hold NaN or VOID_NODATA, values that would win any
+ * minimum they took part in
+ */
+#define VOID_NODATA -9999.0f
+
+static void add_voids(float *image, bool *valid, int rows, int cols) {
+    int n = rows * cols;
+    for (int i = 0; i < n; ++i) valid[i] = true;
+    for (int b = random_int(0, 3); b > 0; --b) {
+        int y0 = random_int(0, rows - 1), x0 = random_int(0, cols - 1);
+        int y1 = std::min(rows, y0 + random_int(1, 10)), x1 = std::min(cols, x0 + random_int(1, 10));
+        for (int y = y0; y < y1; ++y) {
+            for (int x = x0; x < x1; ++x) valid[y * cols + x] = false;
+        }
+    }
+    int scattered = random_int(0, 10);
+    for (int i = 0; i < n; ++i) {
+        if (random_int(0, 99) < scattered) valid[i] = false;
+    }
+    for (int i = 0; i < n; ++i) {
+        if (!valid[i]) image[i] = random_int(0, 1) ? std::numeric_limits<float>::quiet_NaN() : VOID_NODATA;
+    }
+}
+
+/**
+ * masked erosion by definition: the minimum over the valid in-bounds
+ * neighbors; invalid pixels, and valid ones without a valid neighbor, keep
+ * their input value
+ */
+static void reference_erode_masked(const float *in, float *out, const bool *valid, int n,
+                                   NeighborhoodWalker_T walker) {
+    for (int p = 0; p < n; ++p) {
+        out[p] = in[p];
+        if (!valid[p]) continue;
+        bool found = false;
+        int q;
+        nhSetWalkerLocation(walker, p);
+        while (nhGetNextInboundsNeighbor(walker, &q, NULL)) {
+            if (!valid[q]) continue;
+            if (!found || in[q] < out[p]) out[p] = in[q];
+            found = true;
+        }
+    }
+}
+
+/**
+ * masked reconstruction by definition: J <- min(max of J over p and its
+ * valid neighbors, I) on the valid pixels, swept both ways until nothing
+ * changes; invalid pixels keep their marker value
+ */
+static void reference_reconstruct_masked(float *J, const float *I, const bool *valid, int n,
+                                         NeighborhoodWalker_T walker) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int k = 0; k < 2 * n; ++k) {
+            int p = k < n ? k : 2 * n - 1 - k;
+            if (!valid[p]) continue;
+            float top = J[p];
+            int q;
+            nhSetWalkerLocation(walker, p);
+            while (nhGetNextInboundsNeighbor(walker, &q, NULL)) {
+                if (valid[q] && J[q] > top) top = J[q];
+            }
+            float v = top < I[p] ? top : I[p];
+            if (v != J[p]) {
+                J[p] = v;
+                changed = true;
+            }
+        }
+    }
+}
+
+/**
+ * the voids must also come out of make_valid_mask, NaN and nodata alike
+ */
+static void check_valid_mask(const float *image, const bool *valid, int rows, int cols,
+                             const std::string &context) {
+    int n = rows * cols, num_invalid = -1, expected_invalid = 0;
+    bool *made = make_valid_mask(image, n, true, VOID_NODATA, &num_invalid);
+    for (int i = 0; i < n; ++i) expected_invalid += !valid[i];
+    ++num_checks;
+    if (memcmp(made, valid, sizeof(bool) * n) != 0 || num_invalid != expected_invalid) {
+        ++num_failures;
+        printf("FAIL make_valid_mask [%s] image %dx%d: %d invalid, expected %d\n",
+               context.c_str(), rows, cols, num_invalid, expected_invalid);
+    }
+    free(made);
+}
+
+static void check_erosion(float *image, int rows, int cols, int kind, const TestMask &m) {
+    int n = rows * cols;
+    int mask_size[2] = {m.mask_x, m.mask_y};
+    int image_size[2] = {cols, rows};
+    Neighborhood_T nhood = create_neighborhood_general_template(m.mask, mask_size, m.center);
+    NeighborhoodWalker_T walker = nhMakeNeighborhoodWalker(nhood, image_size, NH_USE_ALL);
+    std::string context = mask_context(kind, m);
+
+    float *expected = (float *) malloc(sizeof(float) * n);
+    float *actual = (float *) malloc(sizeof(float) * n);
+    bool *valid = (bool *) malloc(sizeof(bool) * n);
+    for (int i = 0; i < n; ++i) valid[i] = true;
+
+    reference_erode_gray_flat(image, expected, n, walker);
+
+    erodeGrayFlat(image, actual, n, walker);
+    check_same("erodeGrayFlat", context, expected, actual, rows, cols);
+
+    erodeGrayFlatMasked(image, actual, valid, n, walker);
+    check_same("erodeGrayFlatMasked", context, expected, actual, rows, cols);
+
+    {
+        PaddedImage<float> in(rows, cols, padded_walker_reach(walker), PaddedImage<float>::max_sentinel());
+        PaddedImage<float> out(rows, cols, 0, PaddedImage<float>::max_sentinel());
+        in.load(image);
+        erodeGrayFlatPadded(in, out, walker);
+        out.store(actual);
+        check_same("erodeGrayFlatPadded", context, expected, actual, rows, cols);
+    }
+
+    if (m.all_ones && m.center == NH_CENTER_MIDDLE_ROUNDDOWN) {
+        erodeGrayRect(image, actual, rows, cols, m.mask_y, m.mask_x);
+        check_same("erodeGrayRect", context, expected, actual, rows, cols);
+    }
+
+    if (m.center == NH_CENTER_MIDDLE_ROUNDDOWN) {
+        float *out = im_erode(image, rows, cols, m.mask, m.mask_y, m.mask_x);
+        check_same("im_erode", context, expected, out, rows, cols);
+        free(out);
+    }
+
+    // with voids: invalid pixels are skipped as neighbors and kept as is
+    float *voided = (float *) malloc(sizeof(float) * n);
+    memcpy(voided, image, sizeof(float) * n);
+    add_voids(voided, valid, rows, cols);
+    check_valid_mask(voided, valid, rows, cols, context);
+    reference_erode_masked(voided, expected, valid, n, walker);
+    erodeGrayFlatMasked(voided, actual, valid, n, walker);
+    check_same("erodeGrayFlatMasked(voids)", context, expected, actual, rows, cols);
+    if (m.center == NH_CENTER_MIDDLE_ROUNDDOWN) {
+        float *out = im_erode_masked(voided, valid, rows, cols, m.mask, m.mask_y, m.mask_x);
+        check_same("im_erode_masked(voids)", context, expected, out, rows, cols);
+        free(out);
+    }
+    free(voided);
+
+    free(expected);
+    free(actual);
+    free(valid);
+    nhDestroyNeighborhoodWalker(walker);
+    nhDestroyNeighborhood(nhood);
+}
+
+/**
+ * the semantics of the templated nonflat kernels, which differ from the
+ * frozen reference_gray_nonflat in two places:
+ *
+ * - float and double images compute in[q] -/+ height in the pixel type,
+ *   with the height converted to it first, not in double; with heights
+ *   that are not exact in float (0.1 steps) the results round differently.
+ * - a pixel without an in-bounds neighbor gets numeric_limits<T>::max()
+ *   (erosion) or lowest() (dilation); the macro body dilated float and
+ *   double from min(), the smallest positive value.
+ *
+ * Integer images give the same result as the frozen body: the sum is
+ * rounded to the nearest integer, halves up, and saturated.
+ */
+template <typename T>
+static void reference_gray_nonflat_typed(const T *in, T *out, int num_elements, NeighborhoodWalker_T walker,
+                                         const double *height, bool erode) {
+    for (int p = 0; p < num_elements; ++p) {
+        int q;
+        int neighbor_idx;
+        double val = erode ? (double) std::numeric_limits<T>::max() : (double) std::numeric_limits<T>::lowest();
+        nhSetWalkerLocation(walker, p);
+        while (nhGetNextInboundsNeighbor(walker, &q, &neighbor_idx)) {
+            double new_val;
+            if (std::numeric_limits<T>::is_integer) {
+                new_val = floor((erode ? (double) in[q] - height[neighbor_idx]
+                                       : (double) in[q] + height[neighbor_idx]) + 0.5);
+            } else {
+                T h = (T) height[neighbor_idx];
+                new_val = (double) (T) (erode ? in[q] - h : in[q] + h);
+            }
+            if (erode ? new_val < val : new_val > val) {
+                val = new_val;
+            }
+        }
+        if (std::numeric_limits<T>::is_integer) {
+            val = std::min(std::max(val, (double) std::numeric_limits<T>::min()),
+                           (double) std::numeric_limits<T>::max());
+        }
+        out[p] = (T) val;
+    }
+}
+
+/**
+ * one nonflat erosion/dilation pair against reference_gray_nonflat_typed,
+ * and against the frozen function body where the two agree (integer
+ * types, and floating point erosion with dyadic heights), on the image
+ * converted to T
+ */
+template <typename T>
+static void check_nonflat_type(const char *erode_name, const char *dilate_name,
+                               void (*erode)(T *, T *, int, NeighborhoodWalker_T, double *),
+                               void (*dilate)(T *, T *, int, NeighborhoodWalker_T, double *),
+                               const float *image, int rows, int cols, double scale, double bias,
+                               NeighborhoodWalker_T walker, double *heights, bool dyadic,
+                               const std::string &context) {
+    int n = rows * cols;
+    std::vector<T> in(n), expected(n), actual(n);
+    for (int i = 0; i < n; ++i) {
+        double v = image[i] * scale + bias;
+        if (std::numeric_limits<T>::is_integer) {
+            v = std::min(std::max(floor(v), (double) std::numeric_limits<T>::min()),
+                         (double) std::numeric_limits<T>::max());
+        }
+        in[i] = (T) v;
+    }
+    for (int pass = 0; pass < 4; ++pass) {
+        bool erode_pass = pass % 2 == 0;
+        bool frozen = pass >= 2;
+        if (frozen && !std::numeric_limits<T>::is_integer && !(dyadic && erode_pass)) continue;
+        std::string engine = erode_pass ? erode_name : dilate_name;
+        if (frozen) engine += "(frozen reference)";
+        if (frozen) {
+            reference_gray_nonflat(in.data(), expected.data(), n, walker, heights, erode_pass);
+        } else {
+            reference_gray_nonflat_typed(in.data(), expected.data(), n, walker, heights, erode_pass);
+        }
+        (erode_pass ? erode : dilate)(in.data(), actual.data(), n, walker, heights);
+        ++num_checks;
+        for (int i = 0; i < n; ++i) {
+            if (memcmp(&expected[i], &actual[i], sizeof(T)) != 0) {
+                ++num_failures;
+                printf("FAIL %s [%s] image %dx%d: first difference at (%d, %d): expected %.9g got %.9g\n",
+                       engine.c_str(), context.c_str(), rows, cols, i / cols, i % cols,
+                       (double) expected[i], (double) actual[i]);
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * nonflat erosion and dilation of every pixel type; the heights are
+ * sixteenths, whose floating point sums are exact in float and double
+ * alike, or have a tenths part, which rounds differently in the two
+ */
+static void check_nonflat(float *image, int rows, int cols, int kind, const TestMask &m) {
+    int mask_size[2] = {m.mask_x, m.mask_y};
+    int image_size[2] = {cols, rows};
+    Neighborhood_T nhood = create_neighborhood_general_template(m.mask, mask_size, m.center);
+    NeighborhoodWalker_T walker = nhMakeNeighborhoodWalker(nhood, image_size, NH_USE_ALL);
+    std::string context = mask_context(kind, m);
+
+    std::vector<double> heights(nhood->num_neighbors);
+    // large heights make the integer kernels saturate
+    double spread = random_int(0, 3) == 0 ? 400.0 : 4.0;
+    bool dyadic = random_int(0, 1) == 0;
+    for (size_t k = 0; k < heights.size(); ++k) {
+        heights[k] = spread * random_int(-16, 16) / 16.0 + (dyadic ? 0.0 : random_int(-9, 9) / 10.0);
+    }
+
+    check_nonflat_type<float>("erode_gray_nonflat_single", "dilate_gray_nonflat_single",
+                              erode_gray_nonflat_single, dilate_gray_nonflat_single,
+                              image, rows, cols, 1.0, 0.0, walker, heights.data(), dyadic, context);
+    check_nonflat_type<double>("erode_gray_nonflat_double", "dilate_gray_nonflat_double",
+                               erode_gray_nonflat_double, dilate_gray_nonflat_double,
+                               image, rows, cols, 1.0, 0.0, walker, heights.data(), dyadic, context);
+    check_nonflat_type<uint8_t>("erode_gray_nonflat_uint8", "dilate_gray_nonflat_uint8",
+                                erode_gray_nonflat_uint8, dilate_gray_nonflat_uint8,
+                                image, rows, cols, 2.0, 100.0, walker, heights.data(), dyadic, context);
+    check_nonflat_type<int8_t>("erode_gray_nonflat_int8", "dilate_gray_nonflat_int8",
+                               erode_gray_nonflat_int8, dilate_gray_nonflat_int8,
+                               image, rows, cols, 2.0, 0.0, walker, heights.data(), dyadic, context);
+    check_nonflat_type<uint16_t>("erode_gray_nonflat_uint16", "dilate_gray_nonflat_uint16",
+                                 erode_gray_nonflat_uint16, dilate_gray_nonflat_uint16,
+                                 image, rows, cols, 100.0, 0.0, walker, heights.data(), dyadic, context);
+    check_nonflat_type<int16_t>("erode_gray_nonflat_int16", "dilate_gray_nonflat_int16",
+                                erode_gray_nonflat_int16, dilate_gray_nonflat_int16,
+                                image, rows, cols, 1000.0, 0.0, walker, heights.data(), dyadic, context);
+    check_nonflat_type<uint32_t>("erode_gray_nonflat_uint32", "dilate_gray_nonflat_uint32",
+                                 erode_gray_nonflat_uint32, dilate_gray_nonflat_uint32,
+                                 image, rows, cols, 1e8, 1e9, walker, heights.data(), dyadic, context);
+    check_nonflat_type<int32_t>("erode_gray_nonflat_int32", "dilate_gray_nonflat_int32",
+                                erode_gray_nonflat_int32, dilate_gray_nonflat_int32,
+                                image, rows, cols, 3e7, 0.0, walker, heights.data(), dyadic, context);
+
+    nhDestroyNeighborhoodWalker(walker);
+    nhDestroyNeighborhood(nhood);
+}
+
+/**
+ * paraboloid erosion and dilation against the reference nonflat body with
+ * the paraboloid heights over a mask covering the whole image, and the
+ * paraboloid top-hat against the reference reconstruction of that marker.
+ * The curvatures are dyadic, so every sum is exact in double
+ */
+static void check_paraboloid(float *image, int rows, int cols, int kind) {
+    int n = rows * cols;
+    // the reference visits every pixel pair
+    if (n > 1600) return;
+    static const double curvatures[5] = {1.0 / 64, 0.25, 1.0, 2.5, 40.0};
+    double curvature = curvatures[random_int(0, 4)];
+    char text[96];
+    snprintf(text, sizeof(text), "content %d, paraboloid curvature %g", kind, curvature);
+    std::string context(text);
+
+    int mask_size[2] = {2 * cols - 1, 2 * rows - 1};
+    int image_size[2] = {cols, rows};
+    std::vector<int> ones((size_t) mask_size[0] * mask_size[1], 1);
+    Neighborhood_T nhood = create_neighborhood_general_template(ones.data(), mask_size,
+                                                                NH_CENTER_MIDDLE_ROUNDDOWN);
+    NeighborhoodWalker_T walker = nhMakeNeighborhoodWalker(nhood, image_size, NH_USE_ALL);
+    std::vector<double> heights(nhood->num_neighbors);
+    for (int k = 0; k < nhood->num_neighbors; ++k) {
+        double dx = (double) walker->array_coords[k * NUM_DIMS];
+        double dy = (double) walker->array_coords[k * NUM_DIMS + 1];
+        heights[k] = -curvature * (dx * dx + dy * dy);
+    }
+
+    std::vector<float> expected(n), actual(n);
+    reference_gray_nonflat(image, expected.data(), n, walker, heights.data(), true);
+    erodeGrayParaboloid(image, actual.data(), rows, cols, curvature);
+    check_same("erodeGrayParaboloid", context, expected.data(), actual.data(), rows, cols);
+
+    std::vector<float> in_place(image, image + n);
+    erodeGrayParaboloid(in_place.data(), in_place.data(), rows, cols, curvature);
+    check_same("erodeGrayParaboloid(in place)", context, expected.data(), in_place.data(), rows, cols);
+
+    // the top-hat: reconstruction of the eroded marker under the image
+    std::vector<float> marker(expected);
+    NeighborhoodWalker_T trailing, leading, recon_walker;
+    make_reconstruction_walkers(rows, cols, &recon_walker, &trailing, &leading);
+    reference_compute_reconstruction(marker.data(), image, n, recon_walker, trailing, leading);
+    for (int i = 0; i < n; ++i) marker[i] = image[i] - marker[i];
+    float *hat = top_hat_extract_paraboloid(image, rows, cols, curvature);
+    check_same("top_hat_extract_paraboloid", context, marker.data(), hat, rows, cols);
+    free(hat);
+
+    // the paraboloid route of the ball top-hat: a power of two radius and
+    // height 2 * radius^2 * curvature give back the curvature exactly
+    double radius = (double) (1 << random_int(0, 3));
+    hat = top_hat_extract_ball(image, rows, cols, radius, 2 * radius * radius * curvature, true);
+    check_same("top_hat_extract_ball(paraboloid)", context, marker.data(), hat, rows, cols);
+    free(hat);
+    nhDestroyNeighborhoodWalker(trailing);
+    nhDestroyNeighborhoodWalker(leading);
+    nhDestroyNeighborhoodWalker(recon_walker);
+
+    // negative dilations: the frozen body would clip them at min()
+    reference_gray_nonflat_typed(image, expected.data(), n, walker, heights.data(), false);
+    dilateGrayParaboloid(image, actual.data(), rows, cols, curvature);
+    check_same("dilateGrayParaboloid", context, expected.data(), actual.data(), rows, cols);
+
+    nhDestroyNeighborhoodWalker(walker);
+    nhDestroyNeighborhood(nhood);
+}
+
+/**
+ * check_same for binary images
+ */
+static bool check_same_binary(const char *engine, const std::string &context,
+                              const bool *expected, const bool *actual, int rows, int cols) {
+    int n = rows * cols;
+    std::vector<float> expected_float(expected, expected + n);
+    std::vector<float> actual_float(actual, actual + n);
+    return check_same(engine, context, expected_float.data(), actual_float.data(), rows, cols);
+}
+
+/**
+ * the bits of a packed image past its last column must stay 0
+ */
+static void check_padding(const char *engine, const std::string &context,
+                          const unsigned int *packed, int rows, int cols) {
+    ++num_checks;
+    int words = packed_row_words(cols);
+    int tail = cols % PACKED_BITS_PER_WORD;
+    if (tail == 0) return;
+    for (int y = 0; y < rows; ++y) {
+        if (packed[(size_t) y * words + words - 1] >> tail) {
+            ++num_failures;
+            printf("FAIL %s [%s] image %dx%d: bits set past the last column of row %d\n",
+                   engine, context.c_str(), rows, cols, y);
+            return;
+        }
+    }
+}
+
+/**
+ * 64-bit packed rows to 32-bit ones (the low half word comes first)
+ */
+static void narrow_words(const std::vector<uint64_t> &wide, std::vector<unsigned int> &narrow,
+                         int rows, int words, int words64) {
+    for (int y = 0; y < rows; ++y) {
+        for (int w = 0; w < words; ++w) {
+            narrow[(size_t) y * words + w] = (unsigned int) (wide[(size_t) y * words64 + w / 2] >> (32 * (w % 2)));
+        }
+    }
+}
+
+/**
+ * the raw packed kernels, 32 and 64 bits per word, scalar and AVX2, on a
+ * packed image and the bool image it holds
+ */
+static void check_packed_kernels(const unsigned int *packed, bool *binary, int rows, int cols,
+                                 const std::string &context, Neighborhood_T nhood,
+                                 NeighborhoodWalker_T walker) {
+    int n = rows * cols;
+    int words = packed_row_words(cols);
+    int words64 = (cols + 63) / 64;
+    int num_neighbors = nhood->num_neighbors;
+    ptrdiff_t *rc_offsets = packed_rc_offsets(nhood);
+    std::vector<ptrdiff_t> scratch(rc_offsets, rc_offsets + 2 * num_neighbors);
+    std::vector<unsigned int> in32(packed, packed + (size_t) rows * words);
+    std::vector<unsigned int> out32((size_t) rows * words);
+    std::vector<uint64_t> in64((size_t) rows * words64, 0);
+    std::vector<uint64_t> out64((size_t) rows * words64);
+    for (int y = 0; y < rows; ++y) {
+        for (int w = 0; w < words; ++w) {
+            in64[(size_t) y * words64 + w / 2] |= (uint64_t) packed[(size_t) y * words + w] << (32 * (w % 2));
+        }
+    }
+    bool *eroded = (bool *) malloc(sizeof(bool) * n);
+    bool *dilated = (bool *) calloc(n, sizeof(bool));
+    bool *actual = (bool *) malloc(sizeof(bool) * n);
+    reference_erode_logical(binary, eroded, n, walker);
+    reference_dilate_logical(binary, dilated, n, walker);
+
+    std::fill(out32.begin(), out32.end(), 0u);
+    erode_packed_uint32(in32.data(), out32.data(), words, rows, scratch.data(), num_neighbors, cols);
+    unpack_bool(out32.data(), image_view(actual, rows, cols));
+    check_same_binary("erode_packed_uint32", context, eroded, actual, rows, cols);
+
+    std::fill(out32.begin(), out32.end(), 0u);
+    dilate_packed_uint32(in32.data(), out32.data(), words, rows, rc_offsets, num_neighbors);
+    unpack_bool(out32.data(), image_view(actual, rows, cols));
+    check_same_binary("dilate_packed_uint32", context, dilated, actual, rows, cols);
+
+    for (int avx2 = 0; avx2 < 2; ++avx2) {
+        if (avx2) {
+            erode_packed_uint64_avx2(in64.data(), out64.data(), words64, rows, rc_offsets, num_neighbors, cols);
+        } else {
+            erode_packed_uint64(in64.data(), out64.data(), words64, rows, rc_offsets, num_neighbors, cols);
+        }
+        narrow_words(out64, out32, rows, words, words64);
+        unpack_bool(out32.data(), image_view(actual, rows, cols));
+        check_same_binary(avx2 ? "erode_packed_uint64_avx2" : "erode_packed_uint64",
+                          context, eroded, actual, rows, cols);
+
+        if (avx2) {
+            dilate_packed_uint64_avx2(in64.data(), out64.data(), words64, rows, rc_offsets, num_neighbors);
+        } else {
+            dilate_packed_uint64(in64.data(), out64.data(), words64, rows, rc_offsets, num_neighbors);
+        }
+        narrow_words(out64, out32, rows, words, words64);
+        unpack_bool(out32.data(), image_view(actual, rows, cols));
+        check_same_binary(avx2 ? "dilate_packed_uint64_avx2" : "dilate_packed_uint64",
+                          context, dilated, actual, rows, cols);
+    }
+
+    free(rc_offsets);
+    free(eroded);
+    free(dilated);
+    free(actual);
+}
+
+/**
+ * the bool kernels with interior/edge split and the rectangle engine, on
+ * the mask under test and on a random rectangle of up to 25x25
+ */
+static void check_logical(bool *binary, int rows, int cols, const std::string &context,
+                          const TestMask &m, Neighborhood_T nhood, NeighborhoodWalker_T walker) {
+    int n = rows * cols;
+    bool *expected = (bool *) malloc(sizeof(bool) * n);
+    bool *actual = (bool *) malloc(sizeof(bool) * n);
+
+    reference_erode_logical(binary, expected, n, walker);
+    memset(actual, 0, sizeof(bool) * n);
+    erode_logical_twod(binary, actual, cols, rows, nhood, walker);
+    check_same_binary("erode_logical_twod", context, expected, actual, rows, cols);
+    if (m.all_ones && m.center == NH_CENTER_MIDDLE_ROUNDDOWN) {
+        erode_logical_rect(binary, actual, rows, cols, m.mask_y, m.mask_x);
+        check_same_binary("erode_logical_rect", context, expected, actual, rows, cols);
+    }
+
+    memset(expected, 0, sizeof(bool) * n);
+    reference_dilate_logical(binary, expected, n, walker);
+    memset(actual, 0, sizeof(bool) * n);
+    dilate_logical_twod(binary, actual, cols, rows, nhood, walker);
+    check_same_binary("dilate_logical_twod", context, expected, actual, rows, cols);
+    if (m.all_ones && m.center == NH_CENTER_MIDDLE_ROUNDDOWN) {
+        dilate_logical_rect(binary, actual, rows, cols, m.mask_y, m.mask_x);
+        check_same_binary("dilate_logical_rect", context, expected, actual, rows, cols);
+    }
+
+    int mask_y = random_int(1, 25);
+    int mask_x = random_int(1, 25);
+    int *ones = (int *) malloc(sizeof(int) * mask_y * mask_x);
+    for (int i = 0; i < mask_y * mask_x; ++i) ones[i] = 1;
+    int mask_size[2] = {mask_x, mask_y};
+    int image_size[2] = {cols, rows};
+    Neighborhood_T rect = create_neighborhood_general_template(ones, mask_size, NH_CENTER_MIDDLE_ROUNDDOWN);
+    NeighborhoodWalker_T rect_walker = nhMakeNeighborhoodWalker(rect, image_size, NH_USE_ALL);
+    char text[64];
+    snprintf(text, sizeof(text), "rectangle %dx%d", mask_y, mask_x);
+    std::string rect_context = context + ", " + text;
+
+    reference_erode_logical(binary, expected, n, rect_walker);
+    memcpy(actual, binary, sizeof(bool) * n);
+    erode_logical_rect(actual, actual, rows, cols, mask_y, mask_x);
+    check_same_binary("erode_logical_rect(in place)", rect_context, expected, actual, rows, cols);
+
+    memset(expected, 0, sizeof(bool) * n);
+    reference_dilate_logical(binary, expected, n, rect_walker);
+    dilate_logical_rect(binary, actual, rows, cols, mask_y, mask_x);
+    check_same_binary("dilate_logical_rect", rect_context, expected, actual, rows, cols);
+
+    // a walker that skips offsets must not take the rectangle engine
+    NeighborhoodWalker_T skip_walker = nhMakeNeighborhoodWalker(rect, image_size, NH_SKIP_CENTER);
+    reference_erode_logical(binary, expected, n, skip_walker);
+    memset(actual, 0, sizeof(bool) * n);
+    erode_logical_twod(binary, actual, cols, rows, rect, skip_walker);
+    check_same_binary("erode_logical_twod(skip center)", rect_context, expected, actual, rows, cols);
+
+    memset(expected, 0, sizeof(bool) * n);
+    reference_dilate_logical(binary, expected, n, skip_walker);
+    memset(actual, 0, sizeof(bool) * n);
+    dilate_logical_twod(binary, actual, cols, rows, rect, skip_walker);
+    check_same_binary("dilate_logical_twod(skip center)", rect_context, expected, actual, rows, cols);
+    nhDestroyNeighborhoodWalker(skip_walker);
+
+    free(ones);
+    nhDestroyNeighborhoodWalker(rect_walker);
+    nhDestroyNeighborhood(rect);
+    free(expected);
+    free(actual);
+}
+
+/**
+ * run-length images: conversions, and erosion and dilation by lines and a
+ * random rectangle against the bool kernels
+ */
+static void check_rle(bool *binary, const unsigned int *packed, int rows, int cols,
+                      const std::string &context) {
+    int n = rows * cols;
+    int words = packed_row_words(cols);
+    bool *expected = (bool *) malloc(sizeof(bool) * n);
+    bool *actual = (bool *) malloc(sizeof(bool) * n);
+    std::vector<unsigned int> repacked((size_t) rows * words);
+
+    RleImage rle = rle_from_bool(image_view<const bool>(binary, rows, cols));
+    rle_to_bool(rle, image_view(actual, rows, cols));
+    check_same_binary("rle_from_bool", context, binary, actual, rows, cols);
+
+    RleImage from_packed = rle_from_packed(packed, rows, cols);
+    rle_to_bool(from_packed, image_view(actual, rows, cols));
+    check_same_binary("rle_from_packed", context, binary, actual, rows, cols);
+    rle_to_packed(rle, repacked.data());
+    ++num_checks;
+    if (memcmp(repacked.data(), packed, sizeof(unsigned int) * repacked.size()) != 0) {
+        ++num_failures;
+        printf("FAIL rle_to_packed [%s] image %dx%d: words differ\n", context.c_str(), rows, cols);
+    }
+
+    int mask_y = random_int(1, 25);
+    int mask_x = random_int(1, 25);
+    int image_size[2] = {cols, rows};
+    const int shapes[3][2] = {{1, mask_x}, {mask_y, 1}, {mask_y, mask_x}};
+    for (int s = 0; s < 3; ++s) {
+        int shape_y = shapes[s][0], shape_x = shapes[s][1];
+        int *ones = (int *) malloc(sizeof(int) * shape_y * shape_x);
+        for (int i = 0; i < shape_y * shape_x; ++i) ones[i] = 1;
+        int mask_size[2] = {shape_x, shape_y};
+        Neighborhood_T nhood = create_neighborhood_general_template(ones, mask_size, NH_CENTER_MIDDLE_ROUNDDOWN);
+        NeighborhoodWalker_T walker = nhMakeNeighborhoodWalker(nhood, image_size, NH_USE_ALL);
+        char text[64];
+        snprintf(text, sizeof(text), ", %dx%d", shape_y, shape_x);
+        std::string shape_context = context + text;
+        static const char *erode_names[3] = {"rle_erode_hline", "rle_erode_vline", "rle_erode_rect"};
+        static const char *dilate_names[3] = {"rle_dilate_hline", "rle_dilate_vline", "rle_dilate_rect"};
+
+        reference_erode_logical(binary, expected, n, walker);
+        RleImage eroded = s == 0 ? rle_erode_hline(rle, shape_x)
+                        : s == 1 ? rle_erode_vline(rle, shape_y)
+                        : rle_erode_rect(rle, shape_y, shape_x);
+        rle_to_bool(eroded, image_view(actual, rows, cols));
+        check_same_binary(erode_names[s], shape_context, expected, actual, rows, cols);
+
+        memset(expected, 0, sizeof(bool) * n);
+        reference_dilate_logical(binary, expected, n, walker);
+        RleImage dilated = s == 0 ? rle_dilate_hline(rle, shape_x)
+                         : s == 1 ? rle_dilate_vline(rle, shape_y)
+                         : rle_dilate_rect(rle, shape_y, shape_x);
+        rle_to_bool(dilated, image_view(actual, rows, cols));
+        check_same_binary(dilate_names[s], shape_context, expected, actual, rows, cols);
+
+        free(ones);
+        nhDestroyNeighborhoodWalker(walker);
+        nhDestroyNeighborhood(nhood);
+    }
+
+    free(expected);
+    free(actual);
+}
+
+/**
+ * packing, and packed erosion and dilation against the bool kernels, on a
+ * threshold of the image
+ */
+static void check_packed(float *image, int rows, int cols, int kind, const TestMask &m) {
+    int n = rows * cols;
+    int mask_size[2] = {m.mask_x, m.mask_y};
+    int image_size[2] = {cols, rows};
+    Neighborhood_T nhood = create_neighborhood_general_template(m.mask, mask_size, m.center);
+    NeighborhoodWalker_T walker = nhMakeNeighborhoodWalker(nhood, image_size, NH_USE_ALL);
+    std::string context = mask_context(kind, m);
+
+    float threshold = image[random_int(0, n - 1)];
+    bool or_equal = random_int(0, 1) == 1;
+    bool *binary = (bool *) malloc(sizeof(bool) * n);
+    for (int i = 0; i < n; ++i) binary[i] = or_equal ? image[i] >= threshold : image[i] > threshold;
+
+    int words = packed_row_words(cols);
+    std::vector<unsigned int> packed((size_t) rows * words);
+    std::vector<unsigned int> packed_out((size_t) rows * words);
+    bool *expected = (bool *) malloc(sizeof(bool) * n);
+    bool *actual = (bool *) malloc(sizeof(bool) * n);
+
+    pack_threshold(image_view<const float>(image, rows, cols), threshold, or_equal, packed.data());
+    unpack_bool(packed.data(), image_view(actual, rows, cols));
+    check_same_binary("pack_threshold", context, binary, actual, rows, cols);
+    check_padding("pack_threshold", context, packed.data(), rows, cols);
+
+    pack_bool(image_view<const bool>(binary, rows, cols), packed.data());
+    unpack_bool(packed.data(), image_view(actual, rows, cols));
+    check_same_binary("pack_bool", context, binary, actual, rows, cols);
+    check_padding("pack_bool", context, packed.data(), rows, cols);
+
+    reference_erode_logical(binary, expected, n, walker);
+    erode_packed(packed.data(), packed_out.data(), rows, cols, nhood);
+    unpack_bool(packed_out.data(), image_view(actual, rows, cols));
+    check_same_binary("erode_packed", context, expected, actual, rows, cols);
+    check_padding("erode_packed", context, packed_out.data(), rows, cols);
+
+    memset(expected, 0, sizeof(bool) * n);
+    reference_dilate_logical(binary, expected, n, walker);
+    dilate_packed(packed.data(), packed_out.data(), rows, cols, nhood);
+    unpack_bool(packed_out.data(), image_view(actual, rows, cols));
+    check_same_binary("dilate_packed", context, expected, actual, rows, cols);
+    check_padding("dilate_packed", context, packed_out.data(), rows, cols);
+
+    check_packed_kernels(packed.data(), binary, rows, cols, context, nhood, walker);
+    check_logical(binary, rows, cols, context, m, nhood, walker);
+    check_rle(binary, packed.data(), rows, cols, context);
+
+    free(binary);
+    free(expected);
+    free(actual);
+    nhDestroyNeighborhoodWalker(walker);
+    nhDestroyNeighborhood(nhood);
+}
+
+/**
+ * packed reconstruction and hole filling against the bool reference
+ * reconstruction, on a threshold of the image with seeds in it
+ */
+static void check_packed_reconstruction(float *image, int rows, int cols, int kind, int connectivity) {
+    int n = rows * cols;
+    int image_size[2] = {cols, rows};
+    Neighborhood_T nhood = nhMakeNeighborhood(connectivity, NH_CENTER_MIDDLE_ROUNDDOWN);
+    NeighborhoodWalker_T trailing = nhMakeNeighborhoodWalker(nhood, image_size,
+                                                             NH_SKIP_CENTER | NH_SKIP_LEADING);
+    NeighborhoodWalker_T leading = nhMakeNeighborhoodWalker(nhood, image_size,
+                                                            NH_SKIP_CENTER | NH_SKIP_TRAILING);
+    NeighborhoodWalker_T walker = nhMakeNeighborhoodWalker(nhood, image_size, NH_SKIP_CENTER);
+    nhDestroyNeighborhood(nhood);
+
+    char text[64];
+    snprintf(text, sizeof(text), "content %d, connectivity %d", kind, connectivity);
+    std::string context(text);
+
+    float threshold = image[random_int(0, n - 1)];
+    bool *binary = (bool *) malloc(sizeof(bool) * n);
+    bool *expected = (bool *) malloc(sizeof(bool) * n);
+    bool *actual = (bool *) malloc(sizeof(bool) * n);
+    for (int i = 0; i < n; ++i) binary[i] = image[i] >= threshold;
+    int words = packed_row_words(cols);
+    std::vector<unsigned int> mask((size_t) rows * words);
+    std::vector<unsigned int> marker((size_t) rows * words);
+    pack_bool(image_view<const bool>(binary, rows, cols), mask.data());
+
+    // a few seeds, or many
+    int one_in = random_int(0, 1) ? 2 : 200;
+    for (int i = 0; i < n; ++i) expected[i] = binary[i] && random_int(0, one_in - 1) == 0;
+    pack_bool(image_view<const bool>(expected, rows, cols), marker.data());
+    reference_compute_reconstruction(expected, binary, n, walker, trailing, leading);
+    reconstruct_packed(marker.data(), mask.data(), rows, cols, connectivity);
+    unpack_bool(marker.data(), image_view(actual, rows, cols));
+    check_same_binary("reconstruct_packed", context, expected, actual, rows, cols);
+    check_padding("reconstruct_packed", context, marker.data(), rows, cols);
+
+    // holes: the background not reached from the border
+    bool *background = (bool *) malloc(sizeof(bool) * n);
+    for (int y = 0; y < rows; ++y) {
+        for (int x = 0; x < cols; ++x) {
+            int i = y * cols + x;
+            background[i] = !binary[i];
+            bool border = y == 0 || y == rows - 1 || x == 0 || x == cols - 1;
+            expected[i] = border && background[i];
+        }
+    }
+    reference_compute_reconstruction(expected, background, n, walker, trailing, leading);
+    for (int i = 0; i < n; ++i) expected[i] = !expected[i];
+    fill_holes_packed(mask.data(), mask.data(), rows, cols, connectivity);
+    unpack_bool(mask.data(), image_view(actual, rows, cols));
+    check_same_binary("fill_holes_packed", context, expected, actual, rows, cols);
+    check_padding("fill_holes_packed", context, mask.data(), rows, cols);
+
+    free(binary);
+    free(background);
+    free(expected);
+    free(actual);
+    nhDestroyNeighborhoodWalker(trailing);
+    nhDestroyNeighborhoodWalker(leading);
+    nhDestroyNeighborhoodWalker(walker);
+}
+
+/**
+ * compute_reconstruction of image and marker brought to T by
+ * floor(v * scale + bias), clamped (which keeps marker <= image), against
+ * the reference in T
+ */
+template <typename T>
+static void check_reconstruction_type(const char *engine, const float *image, const float *marker,
+                                      int rows, int cols, double scale, double bias,
+                                      NeighborhoodWalker_T walker, NeighborhoodWalker_T trailing,
+                                      NeighborhoodWalker_T leading, const std::string &context) {
+    int n = rows * cols;
+    std::vector<T> mask(n), expected(n), actual(n);
+    for (int i = 0; i < n; ++i) {
+        for (int pass = 0; pass < 2; ++pass) {
+            double v = (pass == 0 ? image[i] : marker[i]) * scale + bias;
+            v = std::min(std::max(floor(v), (double) std::numeric_limits<T>::min()),
+                         (double) std::numeric_limits<T>::max());
+            (pass == 0 ? mask[i] : expected[i]) = (T) v;
+        }
+    }
+    actual = expected;
+    reference_compute_reconstruction(expected.data(), mask.data(), n, walker, trailing, leading);
+    ReconstructionStats stats;
+    memset(&stats, 0, sizeof(stats));
+    compute_reconstruction(actual.data(), mask.data(), n, walker, trailing, leading, &stats);
+    ++num_checks;
+    for (int i = 0; i < n; ++i) {
+        if (expected[i] != actual[i]) {
+            ++num_failures;
+            printf("FAIL %s [%s] image %dx%d: first difference at (%d, %d): expected %d got %d\n",
+                   engine, context.c_str(), rows, cols, i / cols, i % cols, (int) expected[i], (int) actual[i]);
+            break;
+        }
+    }
+}
+
+static void check_reconstruction(float *image, float *marker, int rows, int cols,
+                                 int kind, int connectivity) {
+    int n = rows * cols;
+    int image_size[2] = {cols, rows};
+    Neighborhood_T nhood = nhMakeNeighborhood(connectivity, NH_CENTER_MIDDLE_ROUNDDOWN);
+    NeighborhoodWalker_T trailing = nhMakeNeighborhoodWalker(nhood, image_size,
+                                                             NH_SKIP_CENTER | NH_SKIP_LEADING);
+    NeighborhoodWalker_T leading = nhMakeNeighborhoodWalker(nhood, image_size,
+                                                            NH_SKIP_CENTER | NH_SKIP_TRAILING);
+    NeighborhoodWalker_T walker = nhMakeNeighborhoodWalker(nhood, image_size, NH_SKIP_CENTER);
+    nhDestroyNeighborhood(nhood);
+
+    char text[64];
+    snprintf(text, sizeof(text), "content %d, connectivity %d", kind, connectivity);
+    std::string context(text);
+
+    float *expected = (float *) malloc(sizeof(float) * n);
+    float *actual = (float *) malloc(sizeof(float) * n);
+    bool *valid = (bool *) malloc(sizeof(bool) * n);
+    for (int i = 0; i < n; ++i) valid[i] = true;
+
+    memcpy(expected, marker, sizeof(float) * n);
+    reference_compute_reconstruction(expected, image, n, walker, trailing, leading);
+
+    memcpy(actual, marker, sizeof(float) * n);
+    compute_reconstruction(actual, image, n, walker, trailing, leading);
+    check_same("compute_reconstruction", context, expected, actual, rows, cols);
+
+    ReconstructionStats stats;
+    memset(&stats, 0, sizeof(stats));
+    memcpy(actual, marker, sizeof(float) * n);
+    compute_reconstruction(actual, image, n, walker, trailing, leading, &stats);
+    check_same("compute_reconstruction(stats)", context, expected, actual, rows, cols);
+
+    memcpy(actual, marker, sizeof(float) * n);
+    compute_reconstruction_masked(actual, image, valid, n, walker, trailing, leading);
+    check_same("compute_reconstruction_masked", context, expected, actual, rows, cols);
+
+    {
+        float low = PaddedImage<float>::min_sentinel();
+        PaddedImage<float> J(rows, cols, 1, low);
+        PaddedImage<float> padded_image(rows, cols, 1, low);
+        J.load(marker);
+        padded_image.load(image);
+        compute_reconstruction_padded(J, padded_image, walker, trailing, leading);
+        J.store(actual);
+        check_same("compute_reconstruction_padded", context, expected, actual, rows, cols);
+
+        // the coarse-to-fine bound only seeds the marker; the result must
+        // not change (images of 32 rows and columns or more take a level)
+        J.load(marker);
+        compute_reconstruction_pyramid(J, padded_image, walker, trailing, leading);
+        J.store(actual);
+        check_same("compute_reconstruction_pyramid", context, expected, actual, rows, cols);
+    }
+
+    if (connectivity == 8) {
+        float *out = im_reconstruct(marker, image, rows, cols);
+        check_same("im_reconstruct", context, expected, out, rows, cols);
+        free(out);
+        out = im_reconstruct(marker, image, rows, cols, NULL, true);
+        check_same("im_reconstruct(pyramid)", context, expected, out, rows, cols);
+        free(out);
+    }
+
+    // integer images take the hierarchical queue
+    check_reconstruction_type<uint8_t>("compute_reconstruction_uint8", image, marker, rows, cols,
+                                       2.0, 100.0, walker, trailing, leading, context);
+    check_reconstruction_type<int8_t>("compute_reconstruction_int8", image, marker, rows, cols,
+                                      2.0, -60.0, walker, trailing, leading, context);
+    check_reconstruction_type<int16_t>("compute_reconstruction_int16", image, marker, rows, cols,
+                                       50.0, 0.0, walker, trailing, leading, context);
+    check_reconstruction_type<uint16_t>("compute_reconstruction_uint16", image, marker, rows, cols,
+                                        100.0, 30000.0, walker, trailing, leading, context);
+
+    // with voids: invalid pixels neither feed nor carry the propagation,
+    // and keep their marker value; it is nodata or far above the image, so
+    // a void read as a neighbor or raised shows
+    {
+        float *voided = (float *) malloc(sizeof(float) * n);
+        memcpy(voided, image, sizeof(float) * n);
+        add_voids(voided, valid, rows, cols);
+        for (int i = 0; i < n; ++i) expected[i] = valid[i] ? marker[i] : (i & 1 ? VOID_NODATA : -VOID_NODATA);
+        memcpy(actual, expected, sizeof(float) * n);
+        reference_reconstruct_masked(expected, voided, valid, n, walker);
+        compute_reconstruction_masked(actual, voided, valid, n, walker, trailing, leading);
+        check_same("compute_reconstruction_masked(voids)", context, expected, actual, rows, cols);
+        if (connectivity == 8) {
+            for (int i = 0; i < n; ++i) actual[i] = valid[i] ? marker[i] : (i & 1 ? VOID_NODATA : -VOID_NODATA);
+            float *out = im_reconstruct_masked(actual, voided, valid, rows, cols);
+            check_same("im_reconstruct_masked(voids)", context, expected, out, rows, cols);
+            free(out);
+        }
+        free(voided);
+    }
+
+    free(expected);
+    free(actual);
+    free(valid);
+    nhDestroyNeighborhoodWalker(trailing);
+    nhDestroyNeighborhoodWalker(leading);
+    nhDestroyNeighborhoodWalker(walker);
+}
+
+static void crop(const float *src, int src_cols, int y, int x, int rows, int cols, float *dst) {
+    for (int i = 0; i < rows; ++i) {
+        memcpy(dst + i * cols, src + (y + i) * src_cols + x, sizeof(float) * cols);
+    }
+}
+
+/**
+ * the view entry points against the dense pipeline: a strided view of the
+ * whole image written into a window of a larger raster, and regions of
+ * interest with no halo (same as cropping first) and with a halo covering
+ * the whole image (same as cropping the full result)
+ */
+static void check_views(float *image, const float *expected, int rows, int cols,
+                        const std::string &context, const TestMask &m) {
+    int n = rows * cols;
+    int pad_y = random_int(0, 3), pad_x = random_int(0, 3);
+    int big_cols = cols + pad_x + random_int(0, 5);
+    int big_rows = rows + pad_y + random_int(0, 3);
+    float *big = (float *) malloc(sizeof(float) * big_rows * big_cols);
+    float *big_out = (float *) malloc(sizeof(float) * big_rows * big_cols);
+    for (int i = 0; i < big_rows * big_cols; ++i) big[i] = -1000.0f;
+    for (int i = 0; i < rows; ++i) {
+        memcpy(big + (pad_y + i) * big_cols + pad_x, image + i * cols, sizeof(float) * cols);
+    }
+    ImageView<const float> view = image_view<const float>(big, big_rows, big_cols).window(pad_y, pad_x, rows, cols);
+    ImageView<float> out_view = image_view(big_out, big_rows, big_cols).window(pad_y, pad_x, rows, cols);
+
+    float *actual = (float *) malloc(sizeof(float) * n);
+    top_hat_extract_view(view, out_view, m.mask, m.mask_y, m.mask_x);
+    crop(big_out, big_cols, pad_y, pad_x, rows, cols, actual);
+    check_same("top_hat_extract_view", context, expected, actual, rows, cols);
+
+    int roi_rows = random_int(1, rows), roi_cols = random_int(1, cols);
+    int roi_y = random_int(0, rows - roi_rows), roi_x = random_int(0, cols - roi_cols);
+    ImageView<float> roi_out = image_view(actual, roi_rows, roi_cols);
+    float *window = (float *) malloc(sizeof(float) * roi_rows * roi_cols);
+
+    top_hat_extract_roi(view, roi_y, roi_x, roi_rows, roi_cols, rows + cols, roi_out,
+                        m.mask, m.mask_y, m.mask_x);
+    crop(expected, cols, roi_y, roi_x, roi_rows, roi_cols, window);
+    check_same("top_hat_extract_roi(full halo)", context, window, actual, roi_rows, roi_cols);
+
+    crop(image, cols, roi_y, roi_x, roi_rows, roi_cols, window);
+    float *window_expected = top_hat_extract(window, roi_rows, roi_cols, m.mask, m.mask_y, m.mask_x);
+    top_hat_extract_roi(view, roi_y, roi_x, roi_rows, roi_cols, 0, roi_out,
+                        m.mask, m.mask_y, m.mask_x);
+    check_same("top_hat_extract_roi(no halo)", context, window_expected, actual, roi_rows, roi_cols);
+
+    free(window_expected);
+    free(window);
+    free(actual);
+    free(big);
+    free(big_out);
+}
+
+/**
+ * whole pipeline: reference erosion, reference 8-connected reconstruction
+ * and subtraction against top_hat_extract
+ */
+static void check_top_hat(float *image, int rows, int cols, int kind, const TestMask &m) {
+    if (m.center != NH_CENTER_MIDDLE_ROUNDDOWN) {
+        return;
+    }
+    int n = rows * cols;
+    int mask_size[2] = {m.mask_x, m.mask_y};
+    int image_size[2] = {cols, rows};
+    Neighborhood_T nhood = create_neighborhood_general_template(m.mask, mask_size, m.center);
+    NeighborhoodWalker_T erode_walker = nhMakeNeighborhoodWalker(nhood, image_size, NH_USE_ALL);
+    nhDestroyNeighborhood(nhood);
+    nhood = nhMakeDefaultConnectivityNeighborhood();
+    NeighborhoodWalker_T trailing = nhMakeNeighborhoodWalker(nhood, image_size,
+                                                             NH_SKIP_CENTER | NH_SKIP_LEADING);
+    NeighborhoodWalker_T leading = nhMakeNeighborhoodWalker(nhood, image_size,
+                                                            NH_SKIP_CENTER | NH_SKIP_TRAILING);
+    NeighborhoodWalker_T walker = nhMakeNeighborhoodWalker(nhood, image_size, NH_SKIP_CENTER);
+    nhDestroyNeighborhood(nhood);
+
+    float *expected = (float *) malloc(sizeof(float) * n);
+    float *marker = (float *) malloc(sizeof(float) * n);
+    reference_erode_gray_flat(image, marker, n, erode_walker);
+    memcpy(expected, marker, sizeof(float) * n);
+    reference_compute_reconstruction(expected, image, n, walker, trailing, leading);
+    for (int i = 0; i < n; ++i) expected[i] = image[i] - expected[i];
+
+    std::string context = mask_context(kind, m);
+    float *actual = top_hat_extract(image, rows, cols, m.mask, m.mask_y, m.mask_x);
+    check_same("top_hat_extract", context, expected, actual, rows, cols);
+    free(actual);
+
+    TopHatStats stats;
+    actual = top_hat_extract(image, rows, cols, m.mask, m.mask_y, m.mask_x, &stats);
+    check_same("top_hat_extract(stats)", context, expected, actual, rows, cols);
+    free(actual);
+
+    bool *valid = (bool *) malloc(sizeof(bool) * n);
+    for (int i = 0; i < n; ++i) valid[i] = true;
+    actual = top_hat_extract_masked(image, valid, rows, cols, m.mask, m.mask_y, m.mask_x);
+    check_same("top_hat_extract_masked", context, expected, actual, rows, cols);
+    free(actual);
+
+    // with voids: NaN there, and the valid pixels around them eroded and
+    // reconstructed without them
+    float *voided = (float *) malloc(sizeof(float) * n);
+    float *voided_expected = (float *) malloc(sizeof(float) * n);
+    memcpy(voided, image, sizeof(float) * n);
+    add_voids(voided, valid, rows, cols);
+    reference_erode_masked(voided, voided_expected, valid, n, erode_walker);
+    reference_reconstruct_masked(voided_expected, voided, valid, n, walker);
+    for (int i = 0; i < n; ++i) {
+        voided_expected[i] = valid[i] ? voided[i] - voided_expected[i] : std::numeric_limits<float>::quiet_NaN();
+    }
+    actual = top_hat_extract_masked(voided, valid, rows, cols, m.mask, m.mask_y, m.mask_x);
+    check_same("top_hat_extract_masked(voids)", context, voided_expected, actual, rows, cols);
+    free(actual);
+    // without a mask, the NaN pixels are the voids
+    for (int i = 0; i < n; ++i) {
+        if (!valid[i]) voided[i] = std::numeric_limits<float>::quiet_NaN();
+    }
+    actual = top_hat_extract_masked(voided, NULL, rows, cols, m.mask, m.mask_y, m.mask_x);
+    check_same("top_hat_extract_masked(NaN)", context, voided_expected, actual, rows, cols);
+    free(actual);
+    free(voided);
+    free(voided_expected);
+    free(valid);
+
+    float levels[256];
+    int num_levels = threshold_levels(image_view<const float>(image, rows, cols), 256, levels);
+    if (num_levels > 0) {
+        actual = (float *) malloc(sizeof(float) * n);
+        top_hat_extract_levels(image_view<const float>(image, rows, cols), levels, num_levels,
+                               m.mask, m.mask_y, m.mask_x, image_view(actual, rows, cols));
+        check_same("top_hat_extract_levels", context, expected, actual, rows, cols);
+        free(actual);
+    }
+
+    check_views(image, expected, rows, cols, context, m);
+
+    free(expected);
+    free(marker);
+    nhDestroyNeighborhoodWalker(erode_walker);
+    nhDestroyNeighborhoodWalker(trailing);
+    nhDestroyNeighborhoodWalker(leading);
+    nhDestroyNeighborhoodWalker(walker);
+}
+
+/**
+ * nonflat top-hat: random, separable and zero heights on the test mask
+ * against the reference nonflat erosion (clipped to the image) and the
+ * reference reconstruction; the ball entry point against the nonflat one
+ * with the ball heights
+ */
+static void check_nonflat_top_hat(float *image, int rows, int cols, int kind, const TestMask &m) {
+    if (m.center != NH_CENTER_MIDDLE_ROUNDDOWN) {
+        return;
+    }
+    int n = rows * cols;
+    int size = m.mask_y * m.mask_x;
+    int mask_size[2] = {m.mask_x, m.mask_y};
+    int image_size[2] = {cols, rows};
+    Neighborhood_T nhood = create_neighborhood_general_template(m.mask, mask_size, m.center);
+    NeighborhoodWalker_T erode_walker = nhMakeNeighborhoodWalker(nhood, image_size, NH_USE_ALL);
+    NeighborhoodWalker_T trailing, leading, walker;
+    make_reconstruction_walkers(rows, cols, &walker, &trailing, &leading);
+    std::string context = mask_context(kind, m);
+
+    std::vector<double> heights(size), used;
+    std::vector<float> expected(n);
+    for (int variant = 0; variant < 3; ++variant) {
+        const char *engine;
+        if (variant == 0) {
+            engine = "top_hat_extract_nonflat";
+            for (int i = 0; i < size; ++i) heights[i] = random_int(-8, 8) / 4.0;
+        } else if (variant == 1) {
+            if (!m.all_ones) continue;
+            engine = "top_hat_extract_nonflat(separable)";
+            std::vector<double> hx(m.mask_x), hy(m.mask_y);
+            for (int x = 0; x < m.mask_x; ++x) hx[x] = random_int(-8, 8) / 4.0;
+            for (int y = 0; y < m.mask_y; ++y) hy[y] = random_int(-8, 8) / 4.0;
+            for (int i = 0; i < size; ++i) heights[i] = hx[i % m.mask_x] + hy[i / m.mask_x];
+        } else {
+            engine = "top_hat_extract_nonflat(flat)";
+            for (int i = 0; i < size; ++i) heights[i] = 0;
+        }
+        used.clear();
+        for (int i = 0; i < size; ++i) {
+            if (m.mask[i]) used.push_back(heights[i]);
+        }
+        reference_gray_nonflat(image, expected.data(), n, erode_walker, used.data(), true);
+        for (int i = 0; i < n; ++i) expected[i] = std::min(expected[i], image[i]);
+        reference_compute_reconstruction(expected.data(), image, n, walker, trailing, leading);
+        for (int i = 0; i < n; ++i) expected[i] = image[i] - expected[i];
+
+        float *actual = top_hat_extract_nonflat(image, rows, cols, variant == 1 ? NULL : m.mask,
+                                                m.mask_y, m.mask_x, heights.data());
+        check_same(engine, context, expected.data(), actual, rows, cols);
+        free(actual);
+    }
+
+    // the ball: make_ball against sqrt(r^2 - d^2) - r, scaled to the height,
+    // then the top-hat against the reference on those heights
+    double radius = random_int(1, 12) / 2.0;
+    double height = random_int(0, 1) ? radius : radius / 4;
+    std::vector<int> ball_mask;
+    std::vector<double> ball_heights;
+    int ball_size;
+    make_ball(radius, height, ball_mask, ball_heights, &ball_size);
+    int reach = ball_size / 2;
+    ++num_checks;
+    for (int k = 0; k < ball_size * ball_size; ++k) {
+        int dx = k % ball_size - reach, dy = k / ball_size - reach;
+        double d2 = (double) (dx * dx + dy * dy);
+        bool inside = d2 <= radius * radius;
+        double exact = inside ? height / radius * (sqrt(radius * radius - d2) - radius) : 0.0;
+        if (ball_mask[k] != (int) inside || fabs(ball_heights[k] - exact) > 1e-12 * radius) {
+            ++num_failures;
+            printf("FAIL make_ball [radius %g, height %g]: offset (%d, %d): expected %d, %.17g got %d, %.17g\n",
+                   radius, height, dy, dx, (int) inside, exact, ball_mask[k], ball_heights[k]);
+            break;
+        }
+    }
+
+    int ball_dims[2] = {ball_size, ball_size};
+    Neighborhood_T ball = create_neighborhood_general_template(ball_mask.data(), ball_dims,
+                                                               NH_CENTER_MIDDLE_ROUNDDOWN);
+    NeighborhoodWalker_T ball_walker = nhMakeNeighborhoodWalker(ball, image_size, NH_USE_ALL);
+    used.clear();
+    for (int k = 0; k < ball_size * ball_size; ++k) {
+        if (ball_mask[k]) used.push_back(ball_heights[k]);
+    }
+    // the heights are not exact in float, which the kernels compute in
+    reference_gray_nonflat_typed(image, expected.data(), n, ball_walker, used.data(), true);
+    for (int i = 0; i < n; ++i) expected[i] = std::min(expected[i], image[i]);
+    reference_compute_reconstruction(expected.data(), image, n, walker, trailing, leading);
+    for (int i = 0; i < n; ++i) expected[i] = image[i] - expected[i];
+    float *actual = top_hat_extract_ball(image, rows, cols, radius, height);
+    check_same("top_hat_extract_ball", context, expected.data(), actual, rows, cols);
+    free(actual);
+    nhDestroyNeighborhoodWalker(ball_walker);
+    nhDestroyNeighborhood(ball);
+
+    nhDestroyNeighborhoodWalker(erode_walker);
+    nhDestroyNeighborhoodWalker(trailing);
+    nhDestroyNeighborhoodWalker(leading);
+    nhDestroyNeighborhoodWalker(walker);
+    nhDestroyNeighborhood(nhood);
+}
+
+/**
+ * multi-scale profile against the reference top-hat of every square. On
+ * the 60-120 pixel images the sizes take large steps (e.g. 3, 31, 63), so
+ * the difference boxes, off-centre when the step is odd, are long enough
+ * for the van Herk passes of erodeGrayBox
+ */
+static void check_profile(float *image, int rows, int cols, int kind) {
+    int n = rows * cols;
+    bool large_steps = rows >= 60 && cols >= 60;
+    int num_scales = large_steps ? 3 : random_int(1, 4);
+    std::vector<int> sizes(num_scales);
+    int size = 0;
+    for (int k = 0; k < num_scales; ++k) {
+        size += k > 0 && large_steps ? random_int(9, 32) : random_int(1, 4);
+        sizes[k] = size;
+    }
+    std::string context;
+    char text[32];
+    snprintf(text, sizeof(text), "content %d, sizes", kind);
+    context = text;
+    for (int k = 0; k < num_scales; ++k) {
+        snprintf(text, sizeof(text), " %d", sizes[k]);
+        context += text;
+    }
+
+    float *profile = top_hat_profile(image, rows, cols, sizes.data(), num_scales);
+    int image_size[2] = {cols, rows};
+    NeighborhoodWalker_T trailing, leading, walker;
+    make_reconstruction_walkers(rows, cols, &walker, &trailing, &leading);
+    std::vector<float> expected(n);
+    for (int k = 0; k < num_scales; ++k) {
+        std::vector<int> ones(sizes[k] * sizes[k], 1);
+        int mask_size[2] = {sizes[k], sizes[k]};
+        Neighborhood_T nhood = create_neighborhood_general_template(ones.data(), mask_size,
+                                                                    NH_CENTER_MIDDLE_ROUNDDOWN);
+        NeighborhoodWalker_T erode_walker = nhMakeNeighborhoodWalker(nhood, image_size, NH_USE_ALL);
+        reference_erode_gray_flat(image, expected.data(), n, erode_walker);
+        reference_compute_reconstruction(expected.data(), image, n, walker, trailing, leading);
+        for (int i = 0; i < n; ++i) expected[i] = image[i] - expected[i];
+        check_same("top_hat_profile", context, expected.data(), profile + (size_t) k * n, rows, cols);
+        nhDestroyNeighborhoodWalker(erode_walker);
+        nhDestroyNeighborhood(nhood);
+    }
+    free(profile);
+    nhDestroyNeighborhoodWalker(trailing);
+    nhDestroyNeighborhoodWalker(leading);
+    nhDestroyNeighborhoodWalker(walker);
+}
+
+/**
+ * hole filling against a priority flood from the image edge (every pixel
+ * takes the lowest level it can be reached at from the edge), and the
+ * top-hat with hole filling against the reference top-hat of the filled
+ * image
+ */
+static void check_fill_holes(float *image, int rows, int cols, int kind, const TestMask &m) {
+    int n = rows * cols;
+    std::vector<float> filled(n);
+    std::vector<bool> done(n, false);
+    typedef std::pair<float, int> Entry;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry> > flood;
+    for (int p = 0; p < n; ++p) {
+        int y = p / cols, x = p % cols;
+        if (y == 0 || y == rows - 1 || x == 0 || x == cols - 1) {
+            filled[p] = image[p];
+            done[p] = true;
+            flood.push(Entry(image[p], p));
+        }
+    }
+    while (!flood.empty()) {
+        int p = flood.top().second;
+        flood.pop();
+        int y = p / cols, x = p % cols;
+        for (int dy = -1; dy <= 1; ++dy) {
+            for (int dx = -1; dx <= 1; ++dx) {
+                int ny = y + dy, nx = x + dx;
+                if (ny < 0 || ny >= rows || nx < 0 || nx >= cols) continue;
+                int q = ny * cols + nx;
+                if (done[q]) continue;
+                done[q] = true;
+                filled[q] = image[q] > filled[p] ? image[q] : filled[p];
+                flood.push(Entry(filled[q], q));
+            }
+        }
+    }
+    char text[32];
+    snprintf(text, sizeof(text), "content %d", kind);
+    float *actual = fill_holes(image, rows, cols);
+    check_same("fill_holes", text, filled.data(), actual, rows, cols);
+    free(actual);
+
+    if (m.center != NH_CENTER_MIDDLE_ROUNDDOWN) {
+        return;
+    }
+    int mask_size[2] = {m.mask_x, m.mask_y};
+    int image_size[2] = {cols, rows};
+    Neighborhood_T nhood = create_neighborhood_general_template(m.mask, mask_size, m.center);
+    NeighborhoodWalker_T erode_walker = nhMakeNeighborhoodWalker(nhood, image_size, NH_USE_ALL);
+    nhDestroyNeighborhood(nhood);
+    NeighborhoodWalker_T trailing, leading, walker;
+    make_reconstruction_walkers(rows, cols, &walker, &trailing, &leading);
+    std::vector<float> expected(n);
+    reference_erode_gray_flat(filled.data(), expected.data(), n, erode_walker);
+    reference_compute_reconstruction(expected.data(), filled.data(), n, walker, trailing, leading);
+    for (int i = 0; i < n; ++i) expected[i] = filled[i] - expected[i];
+    std::string context = mask_context(kind, m);
+    TopHatStats stats;
+    actual = top_hat_extract(image, rows, cols, m.mask, m.mask_y, m.mask_x, &stats, true);
+    check_same("top_hat_extract(fill_holes)", context, expected.data(), actual, rows, cols);
+    free(actual);
+    nhDestroyNeighborhoodWalker(erode_walker);
+    nhDestroyNeighborhoodWalker(trailing);
+    nhDestroyNeighborhoodWalker(leading);
+    nhDestroyNeighborhoodWalker(walker);
+}
+
+/**
+ * h-maxima and h-domes (single and stacked, unsorted heights) against the
+ * reference reconstruction of a materialized image - h, and the regional
+ * maxima against a flood fill of the plateaus
+ */
+static void check_h_transforms(float *image, int rows, int cols, int kind) {
+    int n = rows * cols;
+    static const double choices[] = {0.0, 0.5, 1.0, 2.5, 4.0, 10.0, 1000.0};
+    int count = random_int(1, 4);
+    std::vector<double> h(count);
+    std::string context;
+    char text[32];
+    snprintf(text, sizeof(text), "content %d, h", kind);
+    context = text;
+    for (int k = 0; k < count; ++k) {
+        h[k] = random_int(0, 1) ? choices[random_int(0, 6)] : std::uniform_real_distribution<double>(0, 20)(rng);
+        snprintf(text, sizeof(text), " %g", h[k]);
+        context += text;
+    }
+
+    // no heights: nothing written; a negative count: invalid_argument
+    std::vector<float> untouched(image, image + n);
+    h_dome_stack_view(image_view<const float>(image, rows, cols), h.data(), 0, untouched.data());
+    check_same("h_dome_stack(count 0)", context, image, untouched.data(), rows, cols);
+    ++num_checks;
+    try {
+        h_dome_stack_view(image_view<const float>(image, rows, cols), h.data(), -1, untouched.data());
+        ++num_failures;
+        printf("FAIL h_dome_stack(count -1) [%s]: no invalid_argument\n", context.c_str());
+    } catch (const std::invalid_argument &) {
+    }
+
+    NeighborhoodWalker_T trailing, leading, walker;
+    make_reconstruction_walkers(rows, cols, &walker, &trailing, &leading);
+    float *stack = h_dome_stack(image, rows, cols, h.data(), count);
+    std::vector<float> expected(n), dome(n);
+    for (int k = 0; k < count; ++k) {
+        for (int i = 0; i < n; ++i) expected[i] = image[i] - (float) h[k];
+        reference_compute_reconstruction(expected.data(), image, n, walker, trailing, leading);
+        for (int i = 0; i < n; ++i) dome[i] = image[i] - expected[i];
+        check_same("h_dome_stack", context, dome.data(), stack + (size_t) k * n, rows, cols);
+        if (k == 0) {
+            float *single = h_dome(image, rows, cols, h[k]);
+            check_same("h_dome", context, dome.data(), single, rows, cols);
+            free(single);
+            single = h_maxima(image, rows, cols, h[k]);
+            check_same("h_maxima", context, expected.data(), single, rows, cols);
+            free(single);
+        }
+    }
+    free(stack);
+    nhDestroyNeighborhoodWalker(trailing);
+    nhDestroyNeighborhoodWalker(leading);
+    nhDestroyNeighborhoodWalker(walker);
+
+    // plateau by plateau: a maximum when no pixel next to it is higher
+    std::vector<int> label(n, -1);
+    std::vector<float> maxima(n);
+    for (int start = 0; start < n; ++start) {
+        if (label[start] >= 0) continue;
+        std::vector<int> plateau(1, start);
+        label[start] = start;
+        bool higher = false;
+        for (size_t k = 0; k < plateau.size(); ++k) {
+            int y = plateau[k] / cols, x = plateau[k] % cols;
+            for (int dy = -1; dy <= 1; ++dy) {
+                for (int dx = -1; dx <= 1; ++dx) {
+                    int ny = y + dy, nx = x + dx;
+                    if (ny < 0 || ny >= rows || nx < 0 || nx >= cols) continue;
+                    int q = ny * cols + nx;
+                    if (image[q] > image[start]) higher = true;
+                    if (image[q] == image[start] && label[q] < 0) {
+                        label[q] = start;
+                        plateau.push_back(q);
+                    }
+                }
+            }
+        }
+        for (size_t k = 0; k < plateau.size(); ++k) maxima[plateau[k]] = higher ? 0.0f : 1.0f;
+    }
+    bool *found = regional_maxima(image, rows, cols);
+    std::vector<float> actual(n);
+    for (int i = 0; i < n; ++i) actual[i] = found[i] ? 1.0f : 0.0f;
+    snprintf(text, sizeof(text), "content %d", kind);
+    check_same("regional_maxima", text, maxima.data(), actual.data(), rows, cols);
+    free(found);
+}
+
+/**
+ * attribute opening straight from the definition: for every value v of
+ * the image, label the components of {f >= v}; a component whose lowest
+ * value is v is a max-tree node, its parent's level is the highest value
+ * next to it (none for the whole image), and every pixel takes the
+ * highest level of a kept node holding it
+ */
+static void reference_attribute_opening(const float *f, int rows, int cols, int connectivity,
+                                        const AttributeCriteria &criteria, float *out) {
+    int n = rows * cols;
+    std::vector<float> values(f, f + n);
+    std::sort(values.begin(), values.end());
+    values.erase(std::unique(values.begin(), values.end()), values.end());
+    for (int i = 0; i < n; ++i) out[i] = values[0];
+
+    std::vector<int> label(n), members;
+    std::vector<int> stack;
+    for (size_t v = 0; v < values.size(); ++v) {
+        float level = values[v];
+        std::fill(label.begin(), label.end(), -1);
+        for (int seed = 0; seed < n; ++seed) {
+            if (f[seed] < level || label[seed] >= 0) continue;
+            members.clear();
+            stack.assign(1, seed);
+            label[seed] = seed;
+            float lowest = f[seed], peak = f[seed];
+            double sum = 0;
+            bool has_border = false;
+            float border = 0;
+            while (!stack.empty()) {
+                int p = stack.back();
+                stack.pop_back();
+                members.push_back(p);
+                lowest = std::min(lowest, f[p]);
+                peak = std::max(peak, f[p]);
+                sum += f[p];
+                int y = p / cols, x = p % cols;
+                for (int dy = -1; dy <= 1; ++dy) {
+                    for (int dx = -1; dx <= 1; ++dx) {
+                        int ny = y + dy, nx = x + dx;
+                        if ((dx == 0 && dy == 0) || ny < 0 || ny >= rows || nx < 0 || nx >= cols) continue;
+                        if (connectivity == 4 && dx != 0 && dy != 0) continue;
+                        int q = ny * cols + nx;
+                        if (f[q] < level) {
+                            border = has_border ? std::max(border, f[q]) : f[q];
+                            has_border = true;
+                        } else if (label[q] < 0) {
+                            label[q] = seed;
+                            stack.push_back(q);
+                        }
+                    }
+                }
+            }
+            if (lowest != level || !has_border) continue;
+            double area = (double) members.size();
+            double height = (double) peak - (double) border;
+            double volume = sum - area * (double) border;
+            if (area >= criteria.min_area && height >= criteria.min_height && volume >= criteria.min_volume) {
+                for (size_t k = 0; k < members.size(); ++k) out[members[k]] = level;
+            }
+        }
+    }
+}
+
+/**
+ * max-tree attribute openings and top-hats against the reference, with the
+ * tree built on one thread and on 2 to 5 bands
+ */
+static void check_max_tree(float *image, int rows, int cols, int kind, int connectivity) {
+    int n = rows * cols;
+    // the reference labels the image once per value
+    if (n > 1600) return;
+    char text[96];
+    snprintf(text, sizeof(text), "content %d, connectivity %d", kind, connectivity);
+    std::string context(text);
+
+    std::vector<float> expected(n), actual(n);
+    for (int pass = 0; pass < 2; ++pass) {
+        int threads = pass == 0 ? 1 : random_int(2, 5);
+        MaxTree tree(image_view<const float>(image, rows, cols), connectivity, threads);
+        for (int trial = 0; trial < 2; ++trial) {
+            AttributeCriteria criteria;
+            criteria.min_area = random_int(0, 2) ? random_int(1, 40) : 0;
+            criteria.min_height = random_int(0, 2) ? random_int(0, 400) / 16.0 + 1.0 / 64 : 0;
+            criteria.min_volume = random_int(0, 2) ? random_int(0, 4000) / 4.0 + 1.0 / 64 : 0;
+            reference_attribute_opening(image, rows, cols, connectivity, criteria, expected.data());
+            tree.attribute_opening(criteria, image_view(actual.data(), rows, cols));
+            check_same(threads == 1 ? "MaxTree::attribute_opening" : "MaxTree::attribute_opening(threads)",
+                       context, expected.data(), actual.data(), rows, cols);
+            for (int i = 0; i < n; ++i) expected[i] = image[i] - expected[i];
+            tree.attribute_top_hat(criteria, image_view(actual.data(), rows, cols));
+            check_same("MaxTree::attribute_top_hat", context, expected.data(), actual.data(), rows, cols);
+        }
+    }
+}
+
+/**
+ * image shapes: mostly small random ones, plus wide strips and the
+ * degenerate single row, single column and single pixel cases
+ */
+static void random_shape(int *rows, int *cols) {
+    int shape = random_int(0, 9);
+    if (shape == 0) {
+        *rows = 1;
+        *cols = random_int(1, 40);
+    } else if (shape == 1) {
+        *rows = random_int(1, 40);
+        *cols = 1;
+    } else if (shape == 2) {
+        *rows = random_int(1, 4);
+        *cols = random_int(1, 4);
+    } else if (shape == 3) {
+        *rows = random_int(60, 120);
+        *cols = random_int(60, 120);
+    } else if (shape == 4) {
+        // wide enough for the vectorized packed loops
+        *rows = random_int(2, 12);
+        *cols = random_int(300, 700);
+    } else {
+        *rows = random_int(2, 40);
+        *cols = random_int(2, 40);
+    }
+}
+
+int main(int argc, char **argv) {
+    int num_cases = 400;
+    unsigned int seed = 12345;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--cases") && i + 1 < argc) num_cases = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--seed") && i + 1 < argc) seed = (unsigned int) atoi(argv[++i]);
+    }
+    rng.seed(seed);
+
+    for (int c = 0; c < num_cases; ++c) {
+        int rows, cols, kind;
+        random_shape(&rows, &cols);
+        float *image = random_image(rows, cols, &kind);
+        TestMask m = random_mask();
+
+        check_erosion(image, rows, cols, kind, m);
+        check_nonflat(image, rows, cols, kind, m);
+        check_top_hat(image, rows, cols, kind, m);
+        check_paraboloid(image, rows, cols, kind);
+        check_nonflat_top_hat(image, rows, cols, kind, m);
+        check_profile(image, rows, cols, kind);
+        check_h_transforms(image, rows, cols, kind);
+        check_fill_holes(image, rows, cols, kind, m);
+        check_packed(image, rows, cols, kind, m);
+        check_packed_reconstruction(image, rows, cols, kind, 8);
+        check_packed_reconstruction(image, rows, cols, kind, 4);
+        check_max_tree(image, rows, cols, kind, 8);
+        check_max_tree(image, rows, cols, kind, 4);
+
+        // markers: an erosion (the top-hat case) and a random drop below
+        // the image (h-dome like, many separate seeds)
+        int n = rows * cols;
+        int mask_size[2] = {m.mask_x, m.mask_y};
+        int image_size[2] = {cols, rows};
+        Neighborhood_T nhood = create_neighborhood_general_template(m.mask, mask_size, m.center);
+        NeighborhoodWalker_T walker = nhMakeNeighborhoodWalker(nhood, image_size, NH_USE_ALL);
+        float *marker = (float *) malloc(sizeof(float) * n);
+        reference_erode_gray_flat(image, marker, n, walker);
+        check_reconstruction(image, marker, rows, cols, kind, 8);
+        check_reconstruction(image, marker, rows, cols, kind, 4);
+        std::uniform_real_distribution<float> drop(0.0f, 10.0f);
+        for (int i = 0; i < n; ++i) marker[i] = image[i] - (random_int(0, 3) ? drop(rng) : 0.0f);
+        check_reconstruction(image, marker, rows, cols, kind, 8);
+        check_reconstruction(image, marker, rows, cols, kind, 4);
+        // the image with a few blocks dropped: on larger images most tiles
+        // of the padded engine start settled
+        memcpy(marker, image, sizeof(float) * n);
+        for (int b = random_int(1, 3); b > 0; --b) {
+            int y0 = random_int(0, rows - 1), x0 = random_int(0, cols - 1);
+            int y1 = std::min(rows, y0 + random_int(1, 20)), x1 = std::min(cols, x0 + random_int(1, 20));
+            for (int y = y0; y < y1; ++y) {
+                for (int x = x0; x < x1; ++x) marker[y * cols + x] -= drop(rng);
+            }
+        }
+        check_reconstruction(image, marker, rows, cols, kind, 8);
+        check_reconstruction(image, marker, rows, cols, kind, 4);
+        nhDestroyNeighborhoodWalker(walker);
+        nhDestroyNeighborhood(nhood);
+
+        free(marker);
+        free(m.mask);
+        free(image);
+    }
+
+    printf("%d checks, %d failures\n", num_checks, num_failures);
+    return num_failures == 0 ? 0 : 1;
+}
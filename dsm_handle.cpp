@@ -3,13 +3,23 @@
 //
 
 #include "dsm_handle.h"
+#include "trace.h"
 #include <iostream>
+#include <cmath>
 
 /**
- * read dsm data, store it to the data and x_size, y_size
+ * read dsm data, store it to the data and x_size, y_size.
+ * pixels equal to the band's nodata value, and NaN pixels, are marked
+ * invalid in the validity mask
  * @param file_name
  */
 dsm_handle::dsm_handle(const char *file_name) {
+    data = NULL;
+    valid = NULL;
+    x_size = 0;
+    y_size = 0;
+    TRACE_SCOPE("dsm_read", "io");
+
     GDALAllRegister();
     po_dataset = (GDALDataset *) GDALOpen(file_name, GA_ReadOnly);
 
@@ -24,19 +34,33 @@ dsm_handle::dsm_handle(const char *file_name) {
     x_size = po_band->GetXSize();
     y_size = po_band->GetYSize();
 
+    int has_nodata = 0;
+    float nodata_value = (float) po_band->GetNoDataValue(&has_nodata);
+
     data = (float *)malloc(sizeof(float) * x_size * y_size);
+    valid = (bool *)malloc(sizeof(bool) * x_size * y_size);
 
     paf_scan_line = (float *)CPLMalloc(sizeof(float) * x_size);
     int index = 0;
+    int num_invalid = 0;
     for (int i = 0; i < y_size; ++i) {
         po_band->RasterIO( GF_Read, 0, i, x_size, 1,
                           paf_scan_line, x_size, 1, GDT_Float32,
                           0, 0 );
         for (int j = 0; j < x_size; ++j) {
-            data[index++] = paf_scan_line[j];
+            float v = paf_scan_line[j];
+            bool is_valid = !(std::isnan(v) || (has_nodata && v == nodata_value));
+            num_invalid += is_valid ? 0 : 1;
+            valid[index] = is_valid;
+            data[index++] = v;
         }
     }
     CPLFree(paf_scan_line);
+
+    if (num_invalid == 0) {
+        free(valid);
+        valid = NULL;
+    }
     GDALClose(po_dataset);
 }
 
@@ -44,6 +68,14 @@ float* dsm_handle::get_dsm_data() {
     return data;
 }
 
+/**
+ * validity mask of the dsm, true for valid pixels
+ * @return NULL if the dsm has no nodata or NaN pixels
+ */
+bool* dsm_handle::get_valid_mask() {
+    return valid;
+}
+
 int dsm_handle::get_x_size() {
     return x_size;
 }
@@ -56,9 +88,13 @@ dsm_handle::~dsm_handle() {
     if (data != NULL) {
         free(data);
     }
+    if (valid != NULL) {
+        free(valid);
+    }
 }
 
 void dsm_handle::write_data_to_file(const char* file, float *data, int y_input, int x_input) {
+    TRACE_SCOPE("dsm_write", "io");
     GDALDriver *pDriverTiff = GetGDALDriverManager()->GetDriverByName("GTiff");
     GDALDataset *pNewDS = pDriverTiff->Create(file, x_input, y_input, 1, GDT_Float32, NULL);
 
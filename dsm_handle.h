@@ -12,6 +12,7 @@ class dsm_handle {
 public:
     dsm_handle(const char* file_name);
     float* get_dsm_data();
+    bool* get_valid_mask();
     int get_y_size();
     int get_x_size();
     void write_data_to_file(const char* file, float *data, int y_input, int x_input);
@@ -19,6 +20,7 @@ public:
 private:
     GDALDataset *po_dataset;
     float *data;
+    bool *valid;
     int x_size;
     int y_size;
 };
@@ -1,49 +1,182 @@
 //
 // Created by xinyuangui on 9/24/18.
 //
+#ifndef TOPHAT_RECODE_DILATE_ERODE_GRAY_NONFLAT_H
+#define TOPHAT_RECODE_DILATE_ERODE_GRAY_NONFLAT_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <type_traits>
+#include <vector>
+#include "neighborhood.h"
+
+/**
+ * Nonflat grayscale erosion and dilation, templated on the pixel type.
+ *
+ * Erosion takes the minimum of in[q] - height over the in-bounds neighbors
+ * q, dilation the maximum of in[q] + height (with a walker built from the
+ * reflected neighborhood). The work is done in the pixel type:
+ *
+ * - floating point images add the heights converted to the pixel type
+ *   once, in a typed offset table;
+ * - integer images add integer heights in a wider type and saturate once
+ *   at the end, which is what saturating the sum of every neighbor gives.
+ *   The heights are rounded so the result is the one of rounding
+ *   in[q] -/+ height to the nearest integer, halves up.
+ *
+ * Pixels whose whole neighborhood is inside the image run one loop per
+ * neighbor over a run of the row (which the compiler vectorizes, as in
+ * erodeGrayFlatPadded); the rows and columns near the border test every
+ * neighbor. A pixel without an in-bounds neighbor gets the largest value
+ * of the type (erosion) or the lowest (dilation).
+ */
+
 /**
- * This file contains a function body for implementing nonflat grayscale
- * erosion and dilation.  It can be used to instantiate various
- * functions for erosion and dilation on different numeric types
- * by #defining TYPE, COMPARE_OP, INIT_VAL, DO_ROUND, MIN_VAL, and MAX_VAL.
- * Note that implementing dilation properly with this function body requires
- * passing in a neighborhood walker constructed from a reflected neighborhood.
+ * the type sums are done in, and how heights are stored and results
+ * brought back to the pixel type
  */
+template <typename T, bool is_integer = std::numeric_limits<T>::is_integer>
+struct NonflatArithmetic {
+    typedef T Wide;
+
+    static Wide height(double h, bool) { return (Wide) h; }
+    static T narrow(Wide v) { return v; }
+};
+
+template <typename T>
+struct NonflatArithmetic<T, true> {
+    // 8- and 16-bit pixels sum in 32 bits, 32-bit pixels in 64
+    typedef typename std::conditional<sizeof(T) < 4, int32_t, int64_t>::type Wide;
+
+    /*
+     * floor(x -/+ h + 0.5) is x - ceil(h - 0.5) for erosion and
+     * x + floor(h + 0.5) for dilation; heights far outside the range of T
+     * saturate every pixel anyway, so they are clamped to a size that
+     * cannot overflow Wide
+     */
+    static Wide height(double h, bool erode) {
+        double range = 2.0 * ((double) std::numeric_limits<T>::max() - (double) std::numeric_limits<T>::min()) + 1;
+        double rounded = erode ? std::ceil(h - 0.5) : std::floor(h + 0.5);
+        rounded = rounded > range ? range : (rounded < -range ? -range : rounded);
+        return (Wide) rounded;
+    }
+
+    static T narrow(Wide v) {
+        if (v < (Wide) std::numeric_limits<T>::min()) return std::numeric_limits<T>::min();
+        if (v > (Wide) std::numeric_limits<T>::max()) return std::numeric_limits<T>::max();
+        return (T) v;
+    }
+};
+
+/**
+ * gray_nonflat
+ * Nonflat grayscale erosion (erode true) or dilation of In.
+ *
+ * Inputs
+ * ======
+ * In             - pointer to first element of input array
+ * num_elements   - number of elements in input and output arrays
+ * walker         - neighborhood walker corresponding to the structuring
+ *                  element (reflected for dilation)
+ * heights        - one height per neighborhood element
+ *
+ * Output
+ * ======
+ * Out            - pointer to first element of output array; must not be In
+ */
+template <typename T, bool erode>
+void gray_nonflat(const T *In, T *Out, int num_elements, NeighborhoodWalker_T walker, const double *heights)
+{
+    typedef NonflatArithmetic<T> Arithmetic;
+    typedef typename Arithmetic::Wide Wide;
+
+    // empty combine value: never wins against a neighbor
+    const Wide none = erode ? (Wide) std::numeric_limits<T>::max() : (Wide) std::numeric_limits<T>::lowest();
 
-(TYPE *in, TYPE *out, int num_elements, NeighborhoodWalker_T walker, double *height) {
-    double val;
-    double init_val = INIT_VAL;
-    double new_val;
+    int cols = walker->image_size[0];
+    int rows = num_elements / (cols > 0 ? cols : 1);
+    if (num_elements == 0) return;
 
-    for (int p = 0; p < num_elements; p++)
+    // typed offset table of the neighbors in use
+    std::vector<ptrdiff_t> offsets;
+    std::vector<int> dx, dy;
+    std::vector<Wide> height;
+    int min_dx = 0, max_dx = 0, min_dy = 0, max_dy = 0;
+    for (int k = 0; k < walker->num_neighbors; k++)
     {
-        int q;
-        int neighbor_idx;
+        if (!walker->use[k]) continue;
+        offsets.push_back(walker->neighbor_offsets[k]);
+        dx.push_back((int) walker->array_coords[k * NUM_DIMS]);
+        dy.push_back((int) walker->array_coords[k * NUM_DIMS + 1]);
+        height.push_back(Arithmetic::height(heights[k], erode));
+        min_dx = std::min(min_dx, dx.back());
+        max_dx = std::max(max_dx, dx.back());
+        min_dy = std::min(min_dy, dy.back());
+        max_dy = std::max(max_dy, dy.back());
+    }
+    int count = (int) offsets.size();
+
+    // pixels x in [x0, x1) of rows [y0, y1) have every neighbor in the image
+    int x0 = std::min(-min_dx, cols), x1 = std::max(cols - max_dx, x0);
+    int y0 = std::min(-min_dy, rows), y1 = std::max(rows - max_dy, y0);
+
+    std::vector<Wide> acc((size_t) cols);
+    for (int y = 0; y < rows; y++)
+    {
+        const T *in_row = In + (ptrdiff_t) y * cols;
+        T *out_row = Out + (ptrdiff_t) y * cols;
+        bool interior_row = y >= y0 && y < y1;
+        int run_begin = interior_row ? x0 : cols;
+        int run_end = interior_row ? x1 : cols;
 
-        val = init_val;
-        nhSetWalkerLocation(walker, p);
-        while (nhGetNextInboundsNeighbor(walker, &q, &neighbor_idx))
+        if (run_begin < run_end)
         {
-            new_val = (double) in[q] COMBINE_OP height[neighbor_idx];
-            if (new_val COMPARE_OP val)
+            Wide *__restrict a = acc.data() + run_begin;
+            int length = run_end - run_begin;
+            for (int x = 0; x < length; x++)
+            {
+                a[x] = none;
+            }
+            for (int k = 0; k < count; k++)
+            {
+                const T *__restrict neighbor = in_row + run_begin + offsets[k];
+                Wide h = height[k];
+                for (int x = 0; x < length; x++)
+                {
+                    Wide v = erode ? (Wide) neighbor[x] - h : (Wide) neighbor[x] + h;
+                    a[x] = erode ? (v < a[x] ? v : a[x]) : (v > a[x] ? v : a[x]);
+                }
+            }
+            for (int x = 0; x < length; x++)
             {
-                val = new_val;
+                out_row[run_begin + x] = Arithmetic::narrow(a[x]);
             }
         }
-#ifdef DO_ROUND
-        val = (val < MIN_VAL) ? MIN_VAL : val;
-        val = (val > MAX_VAL) ? MAX_VAL : val;
-        val = (TYPE) floor(val + 0.5);
-#endif /* DO_ROUND */
 
-        out[p] = (TYPE) val;
+        // border pixels: the rest of the row
+        for (int x = 0; x < cols; x++)
+        {
+            if (x == run_begin)
+            {
+                x = run_end;
+                if (x == cols) break;
+            }
+            Wide val = none;
+            for (int k = 0; k < count; k++)
+            {
+                int nx = x + dx[k], ny = y + dy[k];
+                if (nx < 0 || nx >= cols || ny < 0 || ny >= rows) continue;
+                Wide v = erode ? (Wide) in_row[x + offsets[k]] - height[k]
+                               : (Wide) in_row[x + offsets[k]] + height[k];
+                val = erode ? (v < val ? v : val) : (v > val ? v : val);
+            }
+            out_row[x] = Arithmetic::narrow(val);
+        }
     }
 }
 
-#undef TYPE
-#undef INIT_VAL
-#undef DO_ROUND
-#undef MIN_VAL
-#undef MAX_VAL
-#undef COMBINE_OP
-#undef COMPARE_OP
+#endif //TOPHAT_RECODE_DILATE_ERODE_GRAY_NONFLAT_H
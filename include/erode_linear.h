@@ -19,6 +19,9 @@
  */
 
 #include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
 
 #ifndef MIN
 #define MIN(a,b) ( (a) < (b) ? (a) : (b) )
@@ -107,4 +110,154 @@ void erodeWithLine(T *f, T *g, T *h, T *r,
         r[x] = MIN(v1, v2);
     }
 }
+
+/*
+ * erodeGrayBox performs gray scale flat erosion of a row-major image by the
+ * box of offsets [y_lo, y_hi] x [x_lo, x_hi] (y_lo <= 0 <= y_hi, same for
+ * x): a pass of erodeWithLine along every row, then one along every
+ * column, so the cost per pixel does not depend on the box size. Pixels
+ * outside the image are ignored. In and Out may be the same array.
+ *
+ * Because the boxes hold the origin, eroding by [a, b] and then by [c, d]
+ * is eroding by [a + c, b + d], image border included.
+ */
+/*
+ * erodeBoxDirect is erodeGrayBox for short boxes: the minimum of every
+ * window is taken directly, one offset at a time over whole rows, which the
+ * compiler vectorizes. Along the columns the rows of the input that the
+ * rows ahead still need are kept in a ring of -y_lo rows, so In and Out may
+ * be the same array.
+ */
+template<typename T>
+void erodeBoxDirect(const T *In, T *Out, int y_input, int x_input,
+                    int y_lo, int y_hi, int x_lo, int x_hi) {
+    int ring_rows = -y_lo > 0 ? -y_lo : 1;
+    T *work = (T *) malloc(sizeof(T) * (size_t) x_input * (ring_rows + 2));
+    T *line = work;
+    T *column = line + x_input;
+    T *ring = column + x_input;
+
+    // first pass along the rows, into Out
+    for (int y = 0; y < y_input; y++) {
+        const T *in_row = In + (ptrdiff_t) y * x_input;
+        T *out_row = Out + (ptrdiff_t) y * x_input;
+        for (int x = 0; x < x_input; x++) {
+            line[x] = in_row[x];
+        }
+        // interior pixels [x0, x1) see the whole window
+        int x0 = -x_lo < x_input ? -x_lo : x_input;
+        int x1 = x_input - x_hi > x0 ? x_input - x_hi : x0;
+        for (int x = x0; x < x1; x++) {
+            out_row[x] = line[x + x_lo];
+        }
+        for (int k = x_lo + 1; k <= x_hi; k++) {
+            for (int x = x0; x < x1; x++) {
+                out_row[x] = MIN(out_row[x], line[x + k]);
+            }
+        }
+        for (int x = 0; x < x_input; x++) {
+            if (x == x0) {
+                x = x1;
+                if (x == x_input) break;
+            }
+            int a = x + x_lo > 0 ? x + x_lo : 0;
+            int b = x + x_hi < x_input - 1 ? x + x_hi : x_input - 1;
+            T v = line[a];
+            for (int k = a + 1; k <= b; k++) {
+                v = MIN(v, line[k]);
+            }
+            out_row[x] = v;
+        }
+    }
+
+    // second pass along the columns, in place
+    for (int y = 0; y < y_input; y++) {
+        int a = y + y_lo > 0 ? y + y_lo : 0;
+        int b = y + y_hi < y_input - 1 ? y + y_hi : y_input - 1;
+        for (int j = a; j <= b; j++) {
+            // rows above y were overwritten; their inputs are in the ring
+            const T *source = j < y ? ring + (ptrdiff_t) (j % ring_rows) * x_input
+                                    : Out + (ptrdiff_t) j * x_input;
+            if (j == a) {
+                for (int x = 0; x < x_input; x++) column[x] = source[x];
+            } else {
+                for (int x = 0; x < x_input; x++) column[x] = MIN(column[x], source[x]);
+            }
+        }
+        T *out_row = Out + (ptrdiff_t) y * x_input;
+        if (y_lo < 0) {
+            memcpy(ring + (ptrdiff_t) (y % ring_rows) * x_input, out_row, sizeof(T) * x_input);
+        }
+        memcpy(out_row, column, sizeof(T) * x_input);
+    }
+
+    free(work);
+}
+
+template<typename T>
+void erodeGrayBox(T *In, T *Out, int y_input, int x_input,
+                  int y_lo, int y_hi, int x_lo, int x_hi) {
+    if (y_input <= 0 || x_input <= 0) return;
+    // up to about 8 offsets the direct minimum beats the three passes of
+    // erodeWithLine
+    if (y_hi - y_lo < 8 && x_hi - x_lo < 8) {
+        erodeBoxDirect(In, Out, y_input, x_input, y_lo, y_hi, x_lo, x_hi);
+        return;
+    }
+    T pad_value = std::numeric_limits<T>::has_infinity ?
+                  std::numeric_limits<T>::infinity() : std::numeric_limits<T>::max();
+
+    int mask_y = y_hi - y_lo + 1;
+    int mask_x = x_hi - x_lo + 1;
+    int row_working = ((x_input + mask_x - 1) / mask_x) * mask_x;
+    int col_working = ((y_input + mask_y - 1) / mask_y) * mask_y;
+    int working = row_working > col_working ? row_working : col_working;
+
+    T *f = (T *) malloc(4 * sizeof(T) * working);
+    T *g = f + working;
+    T *h = g + working;
+    T *r = h + working;
+
+    for (int y = 0; y < y_input; y++) {
+        T *in_row = In + (ptrdiff_t) y * x_input;
+        T *out_row = Out + (ptrdiff_t) y * x_input;
+        for (int x = 0; x < x_input; x++) {
+            f[x] = in_row[x];
+        }
+        erodeWithLine(f, g, h, r, pad_value, mask_x, (ptrdiff_t) -x_lo,
+                      x_input, row_working);
+        for (int x = 0; x < x_input; x++) {
+            out_row[x] = r[x];
+        }
+    }
+
+    for (int x = 0; x < x_input; x++) {
+        for (int y = 0; y < y_input; y++) {
+            f[y] = Out[(ptrdiff_t) y * x_input + x];
+        }
+        erodeWithLine(f, g, h, r, pad_value, mask_y, (ptrdiff_t) -y_lo,
+                      y_input, col_working);
+        for (int y = 0; y < y_input; y++) {
+            Out[(ptrdiff_t) y * x_input + x] = r[y];
+        }
+    }
+
+    free(f);
+}
+
+/*
+ * erodeGrayRect performs gray scale flat erosion of a row-major image by a
+ * mask_y-by-mask_x rectangle of ones with erodeGrayBox.
+ *
+ * The rectangle is centered the way create_neighborhood_general_template
+ * centers it with NH_CENTER_MIDDLE_ROUNDDOWN, and pixels outside the image
+ * are ignored, so the output equals erodeGrayFlat with a ones(mask_y, mask_x)
+ * neighborhood. In and Out may be the same array.
+ */
+template<typename T>
+void erodeGrayRect(T *In, T *Out, int y_input, int x_input,
+                   int mask_y, int mask_x) {
+    erodeGrayBox(In, Out, y_input, x_input, -((mask_y - 1) / 2), mask_y / 2,
+                 -((mask_x - 1) / 2), mask_x / 2);
+}
 #endif
@@ -0,0 +1,165 @@
+#ifndef TOPHAT_RECODE_ERODE_PARABOLOID_H
+#define TOPHAT_RECODE_ERODE_PARABOLOID_H
+
+/*
+ * Grayscale erosion and dilation by a paraboloid structuring element.
+ *
+ * The erosion of f by the paraboloid of curvature a is
+ *
+ *     e(p) = min over q of f(q) + a * |p - q|^2
+ *
+ * over every pixel q of the image, i.e. the nonflat erosion with heights
+ * -a * (dx^2 + dy^2) and a mask covering the whole image; the dilation is
+ * max over q of f(q) - a * |p - q|^2. Since |p - q|^2 = dx^2 + dy^2 the
+ * minimum separates into a pass along every row and one along every
+ * column, and each 1-D pass is the lower envelope of the parabolas
+ * f(q) + a * (x - q)^2, built and read in one sweep each. The cost per
+ * pixel does not depend on a.
+ *
+ * Algorithm reference: P. Felzenszwalb and D. Huttenlocher, "Distance
+ * Transforms of Sampled Functions," Theory of Computing, 8:415-428, 2012.
+ * Variable names in lowerEnvelope follow the paper.
+ */
+
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <limits>
+#include <new>
+#include <stdexcept>
+
+/*
+ * lowerEnvelope sets d[q] = min over p of f[p] + a * (q - p)^2 for the n
+ * values of f. With a negative a it is the upper envelope, the max over p
+ * of f[p] + a * (q - p)^2: the crossings are the same as for -f and -a.
+ *
+ * v (n ints) and z (n + 1 doubles) are temporary working space: v[k] is the
+ * k-th parabola of the envelope and [z[k], z[k + 1]] the range where it is
+ * the lowest. f and d must not overlap.
+ */
+inline void lowerEnvelope(const double *f, double *d, int n, double a, int *v, double *z) {
+    if (n <= 0) return;
+    const double infinity = std::numeric_limits<double>::infinity();
+    int k = 0;
+    v[0] = 0;
+    z[0] = -infinity;
+    z[1] = infinity;
+    for (int q = 1; q < n; q++) {
+        // where the parabola of q crosses the last one of the envelope;
+        // written as a difference of the values so large q lose nothing
+        double s = (f[q] - f[v[k]]) / (2 * a * (q - v[k])) + 0.5 * (q + v[k]);
+        while (s <= z[k]) {
+            k--;
+            s = (f[q] - f[v[k]]) / (2 * a * (q - v[k])) + 0.5 * (q + v[k]);
+        }
+        k++;
+        v[k] = q;
+        z[k] = s;
+        z[k + 1] = infinity;
+    }
+    k = 0;
+    for (int q = 0; q < n; q++) {
+        while (z[k + 1] < q) k++;
+        double dq = q - v[k];
+        d[q] = f[v[k]] + a * dq * dq;
+    }
+}
+
+/*
+ * paraboloidColumns runs lowerEnvelope over the columns of a row-major
+ * double image in place; blocks of adjacent columns are gathered together
+ * so every row is read a cache line at a time.
+ */
+inline void paraboloidColumns(double *image, int rows, int cols, double a,
+                              double *f, double *d, int *v, double *z) {
+    const int block = 16;
+    for (int x0 = 0; x0 < cols; x0 += block) {
+        int width = cols - x0 < block ? cols - x0 : block;
+        for (int y = 0; y < rows; y++) {
+            const double *row = image + (ptrdiff_t) y * cols + x0;
+            for (int j = 0; j < width; j++) {
+                f[(ptrdiff_t) j * rows + y] = row[j];
+            }
+        }
+        for (int j = 0; j < width; j++) {
+            lowerEnvelope(f + (ptrdiff_t) j * rows, d + (ptrdiff_t) j * rows, rows, a, v, z);
+        }
+        for (int y = 0; y < rows; y++) {
+            double *row = image + (ptrdiff_t) y * cols + x0;
+            for (int j = 0; j < width; j++) {
+                row[j] = d[(ptrdiff_t) j * rows + y];
+            }
+        }
+    }
+}
+
+/*
+ * grayParaboloid is the erosion (erode true) or the dilation of a
+ * row-major image of floating point pixels, rows in_stride (out_stride)
+ * elements apart. The passes run in double, so
+ * with a dyadic curvature (0.25, 1, 3.5, ...) and pixels of moderate size
+ * every sum is exact and the result equals the nonflat erosion with the
+ * paraboloid heights bit for bit.
+ */
+template<typename T>
+void grayParaboloid(const T *In, ptrdiff_t in_stride, T *Out, ptrdiff_t out_stride,
+                    int y_input, int x_input, double curvature, bool erode) {
+    static_assert(!std::numeric_limits<T>::is_integer, "paraboloid erosion needs floating point pixels");
+    if (!(curvature > 0) || curvature == std::numeric_limits<double>::infinity()) {
+        throw std::invalid_argument("the paraboloid curvature must be positive and finite");
+    }
+    if (y_input <= 0 || x_input <= 0) return;
+
+    // dilation takes the upper envelopes
+    double a = erode ? curvature : -curvature;
+    int longest = y_input > x_input ? y_input : x_input;
+    size_t pixels = (size_t) y_input * x_input;
+    size_t line = (size_t) 16 * longest;
+
+    double *work = (double *) malloc(sizeof(double) * (pixels + 2 * line + longest + 1));
+    int *v = (int *) malloc(sizeof(int) * longest);
+    if (work == NULL || v == NULL) {
+        free(work);
+        free(v);
+        throw std::bad_alloc();
+    }
+    double *f = work + pixels;
+    double *d = f + line;
+    double *z = d + line;
+
+    for (int y = 0; y < y_input; y++) {
+        const T *in_row = In + y * in_stride;
+        for (int x = 0; x < x_input; x++) {
+            f[x] = (double) in_row[x];
+        }
+        lowerEnvelope(f, work + (ptrdiff_t) y * x_input, x_input, a, v, z);
+    }
+    paraboloidColumns(work, y_input, x_input, a, f, d, v, z);
+    for (int y = 0; y < y_input; y++) {
+        const double *work_row = work + (ptrdiff_t) y * x_input;
+        T *out_row = Out + y * out_stride;
+        for (int x = 0; x < x_input; x++) {
+            out_row[x] = (T) work_row[x];
+        }
+    }
+
+    free(work);
+    free(v);
+}
+
+/*
+ * erodeGrayParaboloid, dilateGrayParaboloid: erosion and dilation of a
+ * y_input-by-x_input image by the paraboloid of the given curvature (> 0).
+ * The pixels must be finite. In and Out may be the same array.
+ */
+template<typename T>
+void erodeGrayParaboloid(const T *In, T *Out, int y_input, int x_input, double curvature) {
+    grayParaboloid(In, x_input, Out, x_input, y_input, x_input, curvature, true);
+}
+
+template<typename T>
+void dilateGrayParaboloid(const T *In, T *Out, int y_input, int x_input, double curvature) {
+    grayParaboloid(In, x_input, Out, x_input, y_input, x_input, curvature, false);
+}
+
+#endif //TOPHAT_RECODE_ERODE_PARABOLOID_H
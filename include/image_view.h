@@ -0,0 +1,53 @@
+#ifndef TOPHAT_RECODE_IMAGE_VIEW_H
+#define TOPHAT_RECODE_IMAGE_VIEW_H
+
+#include <cstddef>
+#include <stdexcept>
+
+/**
+ * Non-owning view of a rows x cols image inside a larger buffer: pixel
+ * (y, x) is data[y * stride + x]. A window of a mosaic, or a region of a
+ * larger output raster, is a view with the mosaic's row stride, so neither
+ * needs to be copied out.
+ */
+template <typename T>
+struct ImageView {
+    T *data;
+    int rows;
+    int cols;
+    ptrdiff_t stride;
+
+    T *row(int y) const { return data + y * stride; }
+
+    /**
+     * the window_rows x window_cols window whose upper-left pixel is (y, x)
+     */
+    ImageView<T> window(int y, int x, int window_rows, int window_cols) const {
+        if (y < 0 || x < 0 || window_rows < 0 || window_cols < 0 ||
+            y + window_rows > rows || x + window_cols > cols) {
+            throw std::invalid_argument("window must lie inside the image");
+        }
+        ImageView<T> result = {data + y * stride + x, window_rows, window_cols, stride};
+        return result;
+    }
+
+    operator ImageView<const T>() const {
+        ImageView<const T> result = {data, rows, cols, stride};
+        return result;
+    }
+};
+
+/**
+ * view of a buffer; stride 0 means dense rows (stride == cols)
+ */
+template <typename T>
+ImageView<T> image_view(T *data, int rows, int cols, ptrdiff_t stride = 0) {
+    if (stride == 0) stride = cols;
+    if (stride < cols) {
+        throw std::invalid_argument("row stride must be at least the number of columns");
+    }
+    ImageView<T> result = {data, rows, cols, stride};
+    return result;
+}
+
+#endif //TOPHAT_RECODE_IMAGE_VIEW_H
@@ -0,0 +1,99 @@
+#ifndef TOPHAT_RECODE_MAX_TREE_H
+#define TOPHAT_RECODE_MAX_TREE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "image_view.h"
+
+/**
+ * Max-tree (component tree) of a float image, for attribute openings and
+ * top-hats.
+ *
+ * A node is a connected component of an upper level set {f >= v} holding
+ * at least one pixel of value v, its level; the parent of a node is the
+ * smallest component of a lower level containing it, and the root is the
+ * whole image. The tree is built once (union-find over the pixels in
+ * decreasing order, see max_tree.cpp); after that every attribute filter
+ * is one pass over the nodes and one over the pixels.
+ *
+ * Attributes of a node C with parent P (for the root, P = C):
+ *
+ * - area: the number of pixels of C;
+ * - height: the highest value in C minus the level of P, i.e. how far C
+ *   rises above the level at which it joins its surroundings;
+ * - volume: the sum over the pixels p of C of f(p) - level(P).
+ *
+ * All three grow from a node to its parent, so keeping the nodes that meet
+ * every threshold keeps the ancestors of any kept node, and the attribute
+ * opening gives each pixel the level of the highest kept node on its path
+ * to the root (which is always kept). On a DSM, area >= X m^2 (in pixels)
+ * and height >= Y m keep the structures larger than X and taller than Y;
+ * the attribute top-hat is what the opening removes.
+ */
+
+/**
+ * thresholds of an attribute opening; a node is kept when it meets all of
+ * them. 0 leaves the attribute unconstrained
+ */
+typedef struct AttributeCriteria_tag {
+    double min_area;
+    double min_height;
+    double min_volume;
+} AttributeCriteria;
+
+class MaxTree {
+public:
+    /**
+     * build the max-tree of image (finite values; NaN throws) with
+     * 4- or 8-connected components. With num_threads > 1 the image is cut
+     * into horizontal bands whose trees are built concurrently and then
+     * merged along the band edges, pairs of neighboring bands at a time.
+     */
+    MaxTree(ImageView<const float> image, int connectivity = 8, int num_threads = 1);
+
+    int rows() const { return rows_; }
+    int cols() const { return cols_; }
+    int num_nodes() const { return (int) level_.size(); }
+
+    /**
+     * the nodes are numbered by increasing level, so a parent comes before
+     * its children and node 0 is the root (its own parent)
+     */
+    int parent(int node) const { return parent_[node]; }
+    float level(int node) const { return level_[node]; }
+    int64_t area(int node) const { return area_[node]; }
+    double height(int node) const { return (double) peak_[node] - (double) level_[parent_[node]]; }
+    double volume(int node) const {
+        return sum_[node] - (double) area_[node] * (double) level_[parent_[node]];
+    }
+
+    /**
+     * the node of pixel (y, x): the one whose level is the pixel's value
+     */
+    int node(int y, int x) const { return pixel_node_[(size_t) y * cols_ + x]; }
+
+    /**
+     * attribute opening of the image into out (same size)
+     */
+    void attribute_opening(const AttributeCriteria &criteria, ImageView<float> out) const;
+
+    /**
+     * attribute top-hat: the image minus its attribute opening
+     */
+    void attribute_top_hat(const AttributeCriteria &criteria, ImageView<float> out) const;
+
+private:
+    void opening_levels(const AttributeCriteria &criteria, std::vector<float> &kept) const;
+
+    int rows_;
+    int cols_;
+    std::vector<int> pixel_node_;
+    std::vector<int> parent_;
+    std::vector<float> level_;
+    std::vector<float> peak_;
+    std::vector<int64_t> area_;
+    std::vector<double> sum_;
+};
+
+#endif //TOPHAT_RECODE_MAX_TREE_H
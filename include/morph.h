@@ -7,7 +7,12 @@
 
 #include <math.h>
 #include <cstdint>
+#include <cstring>
+#include <stdexcept>
 #include "neighborhood.h"
+#include "top_hat_stats.h"
+#include "static_structuring_element.h"
+#include "padded_image.h"
 
 #define BITS_PER_WORD 32
 #define LEFT_SHIFT(x,shift) (shift == 0 ? x : (shift == BITS_PER_WORD ? 0 : x << shift))
@@ -32,6 +37,8 @@ void erodeones33_edge_pixels(bool *In, bool *Out,
                              int num_elements);
 void erodeones33_interior_pixels(bool *input_data, bool *out_data,
                                  ptrdiff_t M, ptrdiff_t N);
+void erode_logical_rect(const bool *In, bool *Out, int rows, int cols, int mask_y, int mask_x);
+void dilate_logical_rect(const bool *In, bool *Out, int rows, int cols, int mask_y, int mask_x);
 
 //////////////////////////////////////////////////////////////////////////////
 // Perform flat grayscale dilation on a uint8 array.
@@ -87,32 +94,232 @@ void dilateGrayFlat(_t *In, _t *Out, int num_elements,
 // Output
 // ======
 // Out            - pointer to first element of output array
+// stats          - optional walk counters; NULL to skip counting
 //////////////////////////////////////////////////////////////////////////////
+template<typename _t, typename Counter>
+void erodeGrayFlatImpl(_t *In, _t *Out, int num_elements,
+                       NeighborhoodWalker_T walker, Counter &counter)
+{
+    // common shapes have a compile-time instantiated kernel
+    const StaticErodeKernel<_t, Counter> *kernel = find_static_erode_kernel<_t, Counter>(walker);
+    if (kernel && num_elements == walker->image_size[0] * walker->image_size[1])
+    {
+        kernel->erode(In, Out, walker->image_size[1], walker->image_size[0], walker, counter);
+        return;
+    }
+
+    NeighborhoodSpanWalker_T span_walker = nhMakeSpanWalker(walker);
+
+    for (int p = 0; p < num_elements; p++, nhSpanWalkerAdvance(span_walker))
+    {
+        int count;
+        const ptrdiff_t *span = nhSpanWalkerSpan(span_walker, &count);
+        counter.walk();
+        counter.visits(count);
+
+        _t *center = In + p;
+        _t val = count ? center[span[0]] : In[p];
+        for (int k = 1; k < count; k++)
+        {
+            _t new_val = center[span[k]];
+            if (new_val < val)
+            {
+                val = new_val;
+            }
+        }
+        Out[p] = val;
+    }
+
+    nhDestroySpanWalker(span_walker);
+}
+
 template<typename _t>
 void erodeGrayFlat(_t *In, _t *Out, int num_elements,
-                   NeighborhoodWalker_T walker)
+                   NeighborhoodWalker_T walker, WalkStats *stats = NULL)
 {
-    for (int p = 0; p < num_elements; p++)
+    if (stats)
     {
-        int q;
-        _t val;
-        _t new_val;
+        StatsCounter<true> counter(stats);
+        erodeGrayFlatImpl(In, Out, num_elements, walker, counter);
+    }
+    else
+    {
+        StatsCounter<false> counter(NULL);
+        erodeGrayFlatImpl(In, Out, num_elements, walker, counter);
+    }
+}
+
 
+//////////////////////////////////////////////////////////////////////////////
+// Perform flat grayscale erosion on a padded image.
+//
+// Inputs
+// ======
+// In             - padded input image; its border must be at least the
+//                  neighborhood reach and hold a value no smaller than any
+//                  pixel (PaddedImage::max_sentinel())
+// walker         - neighborhood walker corresponding to structuring element
+//
+// Output
+// ======
+// Out            - padded output image of the same size; only the image
+//                  pixels are written
+// stats          - optional walk counters; NULL to skip counting. Every pixel
+//                  visits the whole neighborhood, border sentinels included
+//
+// No pixel needs a bounds test, so each row runs as one loop per neighbor
+// over the whole row, which vectorizes. Shapes with a compile-time kernel
+// use its unrolled row loop instead.
+//////////////////////////////////////////////////////////////////////////////
+template<typename _t, typename Counter>
+void erodeGrayFlatPaddedImpl(const PaddedImage<_t> &In, PaddedImage<_t> &Out,
+                             NeighborhoodWalker_T walker, Counter &counter)
+{
+    if (In.rows() != Out.rows() || In.cols() != Out.cols())
+    {
+        throw std::invalid_argument("input and output images must have the same size");
+    }
+    if (padded_walker_reach(walker) > In.border())
+    {
+        throw std::invalid_argument("image border is smaller than the neighborhood reach");
+    }
+
+    int rows = In.rows();
+    int cols = In.cols();
+    int count;
+    ptrdiff_t *offsets = padded_neighbor_offsets(walker, In.stride(), &count);
+    counter.walks((long long) rows * cols);
+    counter.visits((long long) rows * cols * count);
+
+    const StaticErodeKernel<_t, Counter> *kernel = find_static_erode_kernel<_t, Counter>(walker);
+    for (int y = 0; y < rows; y++)
+    {
+        const _t *__restrict in = In.row(y);
+        _t *__restrict out = Out.row(y);
+        if (kernel)
+        {
+            kernel->erode_run(in, out, cols, In.stride());
+            continue;
+        }
+        if (count == 0)
+        {
+            memcpy(out, in, sizeof(_t) * cols);
+            continue;
+        }
+        const _t *first = in + offsets[0];
+        for (int x = 0; x < cols; x++)
+        {
+            out[x] = first[x];
+        }
+        for (int k = 1; k < count; k++)
+        {
+            const _t *neighbor = in + offsets[k];
+            for (int x = 0; x < cols; x++)
+            {
+                _t new_val = neighbor[x];
+                out[x] = new_val < out[x] ? new_val : out[x];
+            }
+        }
+    }
+    free(offsets);
+}
+
+template<typename _t>
+void erodeGrayFlatPadded(const PaddedImage<_t> &In, PaddedImage<_t> &Out,
+                         NeighborhoodWalker_T walker, WalkStats *stats = NULL)
+{
+    if (stats)
+    {
+        StatsCounter<true> counter(stats);
+        erodeGrayFlatPaddedImpl(In, Out, walker, counter);
+    }
+    else
+    {
+        StatsCounter<false> counter(NULL);
+        erodeGrayFlatPaddedImpl(In, Out, walker, counter);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Perform flat grayscale erosion on input array, skipping invalid pixels.
+//
+// Inputs
+// ======
+// In             - pointer to first element of input array
+// valid          - pointer to first element of validity mask; invalid
+//                  pixels (nodata, NaN) never take part in the minimum
+// num_elements   - number of elements in input and output arrays
+// walker         - neighborhood walker corresponding to structuring element
+//
+// Output
+// ======
+// Out            - pointer to first element of output array; invalid pixels
+//                  are copied from In unchanged
+// stats          - optional walk counters; NULL to skip counting
+//
+// Rows whose footprint contains no invalid pixel run the same loop as
+// erodeGrayFlat, so void-free parts of the image pay nothing for the mask.
+//////////////////////////////////////////////////////////////////////////////
+template<typename _t, typename Counter>
+void erodeGrayFlatMaskedImpl(_t *In, _t *Out, bool *valid, int num_elements,
+                             NeighborhoodWalker_T walker, Counter &counter)
+{
+    bool *clean_rows = nhMakeCleanRowMap(walker, valid);
+    NeighborhoodSpanWalker_T span_walker = nhMakeSpanWalker(walker);
+
+    for (int p = 0; p < num_elements; p++, nhSpanWalkerAdvance(span_walker))
+    {
+        _t val = In[p];
         bool val_set = false;
-        nhSetWalkerLocation(walker, p);
-        while (nhGetNextInboundsNeighbor(walker, &q, NULL))
+        bool clean = clean_rows[span_walker->y];
+
+        if (clean || valid[p])
         {
-            new_val = In[q];
-            if (!val_set || new_val < val)
+            int count;
+            const ptrdiff_t *span = nhSpanWalkerSpan(span_walker, &count);
+            counter.walk();
+            counter.visits(count);
+            for (int k = 0; k < count; k++)
             {
-                val_set = true;
-                val = new_val;
+                ptrdiff_t q = p + span[k];
+                if (!clean && !valid[q])
+                {
+                    continue;
+                }
+                _t new_val = In[q];
+                if (!val_set || new_val < val)
+                {
+                    val_set = true;
+                    val = new_val;
+                }
             }
         }
         Out[p] = val;
     }
+
+    nhDestroySpanWalker(span_walker);
+    free(clean_rows);
 }
 
+template<typename _t>
+void erodeGrayFlatMasked(_t *In, _t *Out, bool *valid, int num_elements,
+                         NeighborhoodWalker_T walker, WalkStats *stats = NULL)
+{
+    if (stats)
+    {
+        StatsCounter<true> counter(stats);
+        erodeGrayFlatMaskedImpl(In, Out, valid, num_elements, walker, counter);
+    }
+    else
+    {
+        StatsCounter<false> counter(NULL);
+        erodeGrayFlatMaskedImpl(In, Out, valid, num_elements, walker, counter);
+    }
+}
+
+bool *make_valid_mask(const float *data, int num_elements,
+                      bool has_nodata, float nodata_value, int *num_invalid);
+
 
 void dilate_gray_nonflat_uint8(uint8_t *In, uint8_t *Out, int num_elements,
                                NeighborhoodWalker_T walker, double *heights);
@@ -169,5 +376,28 @@ void erode_packed_uint32(unsigned int *In, unsigned int *Out, int M, int N,
                          ptrdiff_t *rc_offsets, int num_neighbors,
                          int unpacked_M);
 
+void dilate_packed_uint64(const uint64_t *In, uint64_t *Out, int M, int N,
+                          const ptrdiff_t *rc_offsets, int num_neighbors);
+
+void erode_packed_uint64(const uint64_t *In, uint64_t *Out, int M, int N,
+                         const ptrdiff_t *rc_offsets, int num_neighbors,
+                         int unpacked_M);
+
+bool packed_avx2_supported();
+
+void dilate_packed_uint32_avx2(const uint32_t *In, uint32_t *Out, int M, int N,
+                               const ptrdiff_t *rc_offsets, int num_neighbors);
+
+void erode_packed_uint32_avx2(const uint32_t *In, uint32_t *Out, int M, int N,
+                              const ptrdiff_t *rc_offsets, int num_neighbors,
+                              int unpacked_M);
+
+void dilate_packed_uint64_avx2(const uint64_t *In, uint64_t *Out, int M, int N,
+                               const ptrdiff_t *rc_offsets, int num_neighbors);
+
+void erode_packed_uint64_avx2(const uint64_t *In, uint64_t *Out, int M, int N,
+                              const ptrdiff_t *rc_offsets, int num_neighbors,
+                              int unpacked_M);
+
 
 #endif //TOPHAT_RECODE_MORPH_H
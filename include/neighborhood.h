@@ -75,6 +75,73 @@ typedef struct NeighborhoodWalker_tag {
      bool ready_for_use;
 } *NeighborhoodWalker_T;
 
+/**
+ * Raster-order companion of NeighborhoodWalker_T. Instead of handing out one
+ * neighbor per call, it returns for the current pixel the contiguous list
+ * (span) of linear offsets of all neighbors that are in use and inside the
+ * image, in the same order as the walker it was made from.
+ *
+ * In-bounds tests only depend on how close the pixel is to each image edge,
+ * so columns (and rows) are grouped into border classes: one interior class
+ * plus one class per distinct distance to the left/right (top/bottom) edge
+ * within the neighborhood reach. The span of every (row class, column class)
+ * pair is precomputed when the table is small enough; otherwise only the
+ * interior span is kept and border spans are filtered into a scratch array.
+ *
+ * The center moves one pixel at a time with nhSpanWalkerAdvance and
+ * nhSpanWalkerRetreat, which never divide; nhSpanWalkerSetLocation is there
+ * for random access (one division).
+ */
+typedef struct NeighborhoodSpanWalker_tag {
+    int image_size[NUM_DIMS];
+
+    /**
+     * number of neighbors in use, and their linear offsets and relative
+     * column/row coordinates in walker order
+     */
+    int num_neighbors;
+    ptrdiff_t *offsets;
+    int *dx;
+    int *dy;
+
+    /**
+     * border class of every column and row, and the allowed dx (dy) range
+     * of every class
+     */
+    int *col_class;
+    int *row_class;
+    int num_col_classes;
+    int num_row_classes;
+    int *col_class_range;
+    int *row_class_range;
+
+    /**
+     * num_row_classes * num_col_classes spans of num_neighbors entries, and
+     * their lengths; NULL when the table would exceed NH_SPAN_TABLE_LIMIT
+     */
+    ptrdiff_t *spans;
+    int *span_counts;
+
+    /**
+     * span of a border pixel when there is no table
+     */
+    ptrdiff_t *scratch;
+
+    /**
+     * current pixel: linear offset and coordinates
+     */
+    int p;
+    int x;
+    int y;
+} *NeighborhoodSpanWalker_T;
+
+/**
+ * largest span table (in offsets) built by nhMakeSpanWalker
+ */
+#ifndef NH_SPAN_TABLE_LIMIT
+#define NH_SPAN_TABLE_LIMIT (1 << 20)
+#endif
+
 Neighborhood_T nhMakeNeighborhood(int D, int center_location);
 NeighborhoodWalker_T nhMakeNeighborhoodWalker(Neighborhood_T nhood, const int *input_size, unsigned int flags);
 Neighborhood_T nhMakeDefaultConnectivityNeighborhood();
@@ -83,6 +150,61 @@ void nhDestroyNeighborhoodWalker(NeighborhoodWalker_T walker);
 void nhDestroyNeighborhood(Neighborhood_T nhood);
 void nhSetWalkerLocation(NeighborhoodWalker_T walker, int p);
 bool nhGetNextInboundsNeighbor(NeighborhoodWalker_T walker, int *p, int *idx);
+bool *nhMakeCleanRowMap(NeighborhoodWalker_T walker, const bool *valid);
+NeighborhoodSpanWalker_T nhMakeSpanWalker(NeighborhoodWalker_T walker);
+void nhDestroySpanWalker(NeighborhoodSpanWalker_T walker);
+const ptrdiff_t *nhSpanWalkerBorderSpan(NeighborhoodSpanWalker_T walker, int *count);
+
+/**
+ * move the span walker to pixel p
+ */
+inline void nhSpanWalkerSetLocation(NeighborhoodSpanWalker_T walker, int p) {
+    walker->p = p;
+    walker->y = p / walker->image_size[0];
+    walker->x = p - walker->y * walker->image_size[0];
+}
+
+/**
+ * move the span walker to the next pixel in raster order
+ */
+inline void nhSpanWalkerAdvance(NeighborhoodSpanWalker_T walker) {
+    ++walker->p;
+    if (++walker->x == walker->image_size[0]) {
+        walker->x = 0;
+        ++walker->y;
+    }
+}
+
+/**
+ * move the span walker to the previous pixel in raster order
+ */
+inline void nhSpanWalkerRetreat(NeighborhoodSpanWalker_T walker) {
+    --walker->p;
+    if (--walker->x < 0) {
+        walker->x = walker->image_size[0] - 1;
+        --walker->y;
+    }
+}
+
+/**
+ * offsets (relative to the current pixel) of the in-bounds neighbors of the
+ * current pixel; *count receives their number. The span stays valid until
+ * the walker is moved.
+ */
+inline const ptrdiff_t *nhSpanWalkerSpan(NeighborhoodSpanWalker_T walker, int *count) {
+    int row_class = walker->row_class[walker->y];
+    int col_class = walker->col_class[walker->x];
+    if (walker->spans) {
+        int c = row_class * walker->num_col_classes + col_class;
+        *count = walker->span_counts[c];
+        return walker->spans + (ptrdiff_t) c * walker->num_neighbors;
+    }
+    if (row_class == 0 && col_class == 0) {
+        *count = walker->num_neighbors;
+        return walker->offsets;
+    }
+    return nhSpanWalkerBorderSpan(walker, count);
+}
 
 //TODO: nhCheckDomain()
 //TODO: nhCheckConnectivityDomain
@@ -0,0 +1,122 @@
+#ifndef TOPHAT_RECODE_PACKED_BINARY_H
+#define TOPHAT_RECODE_PACKED_BINARY_H
+
+#include <cstddef>
+#include "image_view.h"
+#include "neighborhood.h"
+#include "top_hat_stats.h"
+
+/**
+ * Packed binary images.
+ *
+ * A rows x cols binary image is packed 32 pixels to an unsigned int: row y
+ * takes packed_row_words(cols) consecutive words, and pixel (y, x) is bit
+ * x % 32 of word y * packed_row_words(cols) + x / 32. The bits past the
+ * last column are 0.
+ *
+ * Our images are row-major, so this is the MATLAB column-packed layout the
+ * packed kernels (dilate_packed_uint32, erode_packed_uint32) expect for the
+ * transposed image: their M is packed_row_words(cols), their N is rows,
+ * their unpacked_M is cols, and their rc_offsets list column offsets
+ * first (see packed_rc_offsets).
+ */
+
+#define PACKED_BITS_PER_WORD 32
+
+inline int packed_row_words(int cols) {
+    return (cols + PACKED_BITS_PER_WORD - 1) / PACKED_BITS_PER_WORD;
+}
+
+/**
+ * pack_threshold
+ * Pack the pixels of a float image above a threshold.
+ *
+ * Inputs
+ * ======
+ * image     - image to threshold
+ * threshold - threshold
+ * or_equal  - set the pixels >= threshold instead of > threshold
+ *
+ * Output
+ * ======
+ * packed    - rows * packed_row_words(cols) words; NaN pixels are 0
+ */
+void pack_threshold(ImageView<const float> image, float threshold, bool or_equal, unsigned int *packed);
+
+/**
+ * pack_bool
+ * Pack a bool image; packed holds rows * packed_row_words(cols) words.
+ */
+void pack_bool(ImageView<const bool> image, unsigned int *packed);
+
+/**
+ * unpack_bool
+ * Unpack rows * packed_row_words(cols) words into a bool image.
+ */
+void unpack_bool(const unsigned int *packed, ImageView<bool> image);
+
+/**
+ * packed_rc_offsets
+ * rc_offsets of a neighborhood for the packed kernels.
+ *
+ * Inputs
+ * ======
+ * nhood - neighborhood, e.g. from create_neighborhood_general_template
+ *
+ * Return
+ * ======
+ * newly allocated num_neighbors-by-2 array (column offsets, then row
+ * offsets); the caller frees it
+ */
+ptrdiff_t *packed_rc_offsets(Neighborhood_T nhood);
+
+/**
+ * dilate_packed
+ * Dilation of a packed image by a neighborhood; same result as
+ * dilate_logical with a walker of nhood (pixels outside the image are 0).
+ * out must not be in.
+ */
+void dilate_packed(const unsigned int *in, unsigned int *out, int rows, int cols, Neighborhood_T nhood);
+
+/**
+ * erode_packed
+ * Erosion of a packed image by a neighborhood; same result as
+ * erode_logical with a walker of nhood (pixels outside the image are
+ * ignored). out must not be in.
+ */
+void erode_packed(const unsigned int *in, unsigned int *out, int rows, int cols, Neighborhood_T nhood);
+
+/**
+ * reconstruct_packed
+ * Binary reconstruction of a packed marker under a packed mask: the pixels
+ * of the mask connected to a marker pixel through mask pixels. Same result
+ * as compute_reconstruction on the bool images.
+ *
+ * Whole words are propagated with bitwise operations: a raster and an
+ * antiraster sweep grow every word from its neighbors and fill it along
+ * the runs of mask bits; the words that can still grow after the sweeps go
+ * through a FIFO of words.
+ *
+ * Inputs
+ * ======
+ * marker       - rows * packed_row_words(cols) words, inside the mask;
+ *                replaced by the reconstruction
+ * mask         - rows * packed_row_words(cols) words
+ * connectivity - 4 or 8
+ * stats        - if not NULL, raster_seconds, antiraster_seconds,
+ *                propagation_seconds and the queue counters (counting
+ *                words) are added to
+ */
+void reconstruct_packed(unsigned int *marker, const unsigned int *mask, int rows, int cols,
+                        int connectivity = 8, ReconstructionStats *stats = NULL);
+
+/**
+ * fill_holes_packed
+ * Fill the holes of a packed image: the background pixels not connected
+ * to the image border through background pixels are set (imfill's
+ * "holes"). connectivity (4 or 8) is the one of the background. out may
+ * be in.
+ */
+void fill_holes_packed(const unsigned int *in, unsigned int *out, int rows, int cols, int connectivity = 4);
+
+#endif //TOPHAT_RECODE_PACKED_BINARY_H
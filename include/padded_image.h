@@ -0,0 +1,201 @@
+#ifndef TOPHAT_RECODE_PADDED_IMAGE_H
+#define TOPHAT_RECODE_PADDED_IMAGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <new>
+#include "neighborhood.h"
+
+#define PADDED_IMAGE_ALIGNMENT 64
+
+/**
+ * Image with a frame of sentinel pixels around it.
+ *
+ * With a border at least as wide as the neighborhood reach, every neighbor
+ * of every image pixel is addressable, so kernels run the same branch-free
+ * loop on interior and border pixels. The sentinel is chosen so it never
+ * wins: +inf (or the type maximum) for erosion, -inf (or the type minimum)
+ * for reconstruction.
+ *
+ * Rows start on PADDED_IMAGE_ALIGNMENT byte boundaries at column 0 (the
+ * left border is rounded up accordingly) and stride() is a multiple of the
+ * alignment.
+ */
+template <typename T>
+class PaddedImage {
+public:
+    /**
+     * the image pixels are left uninitialized, the border is set to sentinel
+     * @param rows rows of the image
+     * @param cols cols of the image
+     * @param border sentinel pixels on each side, at least 0
+     * @param sentinel value of the border pixels
+     */
+    PaddedImage(int rows, int cols, int border, T sentinel)
+            : rows_(rows), cols_(cols), border_(border), sentinel_(sentinel) {
+        const ptrdiff_t per_line = PADDED_IMAGE_ALIGNMENT / sizeof(T);
+        left_ = round_up(border, per_line);
+        stride_ = round_up(left_ + cols + border, per_line);
+        total_rows_ = rows + 2 * (ptrdiff_t) border;
+        size_t bytes = (size_t) (stride_ * total_rows_) * sizeof(T) + PADDED_IMAGE_ALIGNMENT;
+        raw_ = malloc(bytes);
+        if (raw_ == NULL) {
+            throw std::bad_alloc();
+        }
+        uintptr_t address = ((uintptr_t) raw_ + PADDED_IMAGE_ALIGNMENT - 1) &
+                            ~(uintptr_t) (PADDED_IMAGE_ALIGNMENT - 1);
+        base_ = (T *) address;
+        origin_ = base_ + border * stride_ + left_;
+        fill_border(sentinel);
+    }
+
+    ~PaddedImage() {
+        free(raw_);
+    }
+
+    /**
+     * copy a rows x cols image in (row stride src_stride, default dense);
+     * the border is left as it is
+     */
+    void load(const T *src, ptrdiff_t src_stride = 0) {
+        if (src_stride == 0) src_stride = cols_;
+        for (int y = 0; y < rows_; ++y) {
+            memcpy(row(y), src + y * src_stride, sizeof(T) * cols_);
+        }
+    }
+
+    /**
+     * copy the image out, without the border (row stride dst_stride,
+     * default dense)
+     */
+    void store(T *dst, ptrdiff_t dst_stride = 0) const {
+        if (dst_stride == 0) dst_stride = cols_;
+        for (int y = 0; y < rows_; ++y) {
+            memcpy(dst + y * dst_stride, row(y), sizeof(T) * cols_);
+        }
+    }
+
+    /**
+     * set every pixel outside the image (the whole stride, not only border
+     * pixels within reach) to value, which becomes the new sentinel
+     */
+    void fill_border(T value) {
+        sentinel_ = value;
+        for (ptrdiff_t y = 0; y < total_rows_; ++y) {
+            T *line = base_ + y * stride_;
+            bool inside = y >= border_ && y < border_ + rows_;
+            ptrdiff_t x_begin = inside ? left_ : stride_;
+            ptrdiff_t x_end = inside ? left_ + cols_ : stride_;
+            for (ptrdiff_t x = 0; x < x_begin; ++x) line[x] = value;
+            for (ptrdiff_t x = x_end; x < stride_; ++x) line[x] = value;
+        }
+    }
+
+    /**
+     * pointer to pixel (y, x); y and x may point into the border
+     */
+    T *at(int y, int x) { return origin_ + y * stride_ + x; }
+    const T *at(int y, int x) const { return origin_ + y * stride_ + x; }
+
+    T *row(int y) { return origin_ + y * stride_; }
+    const T *row(int y) const { return origin_ + y * stride_; }
+
+    /**
+     * pixel (0, 0); pixel (y, x) is origin()[y * stride() + x]
+     */
+    T *origin() { return origin_; }
+    const T *origin() const { return origin_; }
+
+    int rows() const { return rows_; }
+    int cols() const { return cols_; }
+    int border() const { return border_; }
+    ptrdiff_t stride() const { return stride_; }
+    T sentinel() const { return sentinel_; }
+
+    /**
+     * linear index (relative to origin()) of pixel (y, x)
+     */
+    ptrdiff_t index(int y, int x) const { return y * stride_ + x; }
+
+    static T max_sentinel() {
+        return std::numeric_limits<T>::has_infinity ? std::numeric_limits<T>::infinity()
+                                                    : std::numeric_limits<T>::max();
+    }
+
+    static T min_sentinel() {
+        return std::numeric_limits<T>::has_infinity ? -std::numeric_limits<T>::infinity()
+                                                    : std::numeric_limits<T>::lowest();
+    }
+
+private:
+    PaddedImage(const PaddedImage &);
+    PaddedImage &operator=(const PaddedImage &);
+
+    static ptrdiff_t round_up(ptrdiff_t value, ptrdiff_t multiple) {
+        return (value + multiple - 1) / multiple * multiple;
+    }
+
+    int rows_;
+    int cols_;
+    int border_;
+    T sentinel_;
+    ptrdiff_t left_;
+    ptrdiff_t stride_;
+    ptrdiff_t total_rows_;
+    void *raw_;
+    T *base_;
+    T *origin_;
+};
+
+/**
+ * padded_neighbor_offsets
+ * Linear offsets of the neighbors used by a walker, in walker order, for an
+ * image with the given row stride.
+ *
+ * Inputs
+ * ======
+ * walker - NeighborhoodWalker_T object
+ * stride - row stride of the padded image
+ *
+ * Outputs
+ * =======
+ * count  - number of offsets
+ *
+ * Return
+ * ======
+ * newly allocated offsets array (at least one entry); the caller frees it
+ */
+inline ptrdiff_t *padded_neighbor_offsets(NeighborhoodWalker_T walker, ptrdiff_t stride, int *count) {
+    ptrdiff_t *offsets = (ptrdiff_t *) malloc((walker->num_neighbors + 1) * sizeof(ptrdiff_t));
+    int n = 0;
+    for (int k = 0; k < walker->num_neighbors; ++k) {
+        if (!walker->use[k]) continue;
+        offsets[n++] = walker->array_coords[k * NUM_DIMS] +
+                       walker->array_coords[k * NUM_DIMS + 1] * stride;
+    }
+    *count = n;
+    return offsets;
+}
+
+/**
+ * padded_walker_reach
+ * Largest absolute row or column offset among the neighbors used by a
+ * walker; the border a PaddedImage needs for it.
+ */
+inline int padded_walker_reach(NeighborhoodWalker_T walker) {
+    ptrdiff_t reach = 0;
+    for (int k = 0; k < walker->num_neighbors; ++k) {
+        if (!walker->use[k]) continue;
+        for (int d = 0; d < NUM_DIMS; ++d) {
+            ptrdiff_t c = walker->array_coords[k * NUM_DIMS + d];
+            if (c < 0) c = -c;
+            if (c > reach) reach = c;
+        }
+    }
+    return (int) reach;
+}
+
+#endif //TOPHAT_RECODE_PADDED_IMAGE_H
@@ -6,8 +6,17 @@
 #define TOPHAT_RECODE_RECONSTRUCT_H
 
 #include "neighborhood.h"
+#include "top_hat_stats.h"
+#include "trace.h"
+#include "static_structuring_element.h"
+#include "padded_image.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <limits>
 #include <stdexcept>
 #include <queue>
+#include <vector>
 
 
 //////////////////////////////////////////////////////////////////////////////
@@ -46,12 +55,19 @@
 //      J(q) <- min{J(p),I(q)}
 //      fifo_add(q)
 //
+//
+// If stats is not NULL, the pass times and queue/walk counters are added
+// to it. Without stats the counting code is not compiled in.
+//
 //////////////////////////////////////////////////////////////////////////////
-template <typename _T>
-void compute_reconstruction(_T *J, _T *I, int num_elements,
+template <typename _T, typename Counter>
+void compute_reconstruction_impl(_T *J, _T *I, int num_elements,
         NeighborhoodWalker_T walker,
         NeighborhoodWalker_T trailingWalker,
-        NeighborhoodWalker_T leadingWalker) {
+        NeighborhoodWalker_T leadingWalker,
+        ReconstructionStats *stats) {
+    Counter counter(stats ? &stats->walk : NULL);
+    double start;
 
     // enforce the requirement that J <= I. We need to check this here.
     // because if it isn't true, the algorithm might not terminate
@@ -64,9 +80,18 @@ void compute_reconstruction(_T *J, _T *I, int num_elements,
 
     std::queue<int> Queue;
 
+    // the scans move one pixel at a time, so they use span walkers
+    NeighborhoodSpanWalker_T trailing = nhMakeSpanWalker(trailingWalker);
+    NeighborhoodSpanWalker_T leading = nhMakeSpanWalker(leadingWalker);
+    NeighborhoodSpanWalker_T neighbors = nhMakeSpanWalker(walker);
+    int count;
+    const ptrdiff_t *span;
+
     // first pass, scan D_I in raster order (upper-left to lower-right,
     // along the columns)
-    for (int p = 0; p < num_elements; ++p) {
+    TraceScope stage("reconstruct_raster", "reconstruct");
+    start = counter.now();
+    for (int p = 0; p < num_elements; ++p, nhSpanWalkerAdvance(trailing)) {
         // "Let p be the current pixel"
         // "J(p) <- (max{J(q),q member_of N_G_plus(p) union {p}}) ^ I(p)"
 
@@ -75,21 +100,27 @@ void compute_reconstruction(_T *J, _T *I, int num_elements,
         // of (y,x).
 
         _T max_pixel = J[p];
-        nhSetWalkerLocation(trailingWalker, p);
-        int q;
-        while (nhGetNextInboundsNeighbor(trailingWalker, &q, NULL)) {
-            if (J[q] > max_pixel) {
-                max_pixel = J[q];
+        _T *center = J + p;
+        span = nhSpanWalkerSpan(trailing, &count);
+        counter.walk();
+        counter.visits(count);
+        for (int k = 0; k < count; ++k) {
+            if (center[span[k]] > max_pixel) {
+                max_pixel = center[span[k]];
             }
         }
         // Now set the (y, x) pixel of image J to the minimum
         // of max_pixel and the (y, x) pixel of image I
         J[p] = (max_pixel < I[p]) ? max_pixel : I[p];
     }
+    if (stats) counter.elapsed(&stats->raster_seconds, start);
 
     // second pass, scan D_I in antiraster order (lower-right to upper-left,
     // along the columns
-    for (int pp = 0; pp < num_elements; ++pp) {
+    stage.next("reconstruct_antiraster");
+    start = counter.now();
+    nhSpanWalkerSetLocation(leading, num_elements - 1);
+    for (int pp = 0; pp < num_elements; ++pp, nhSpanWalkerRetreat(leading)) {
         int p = num_elements - 1 - pp;
 
         // "Let p be the current pixel"
@@ -99,9 +130,11 @@ void compute_reconstruction(_T *J, _T *I, int num_elements,
         // plus all the pixels in the "minus" neighborhood
         // of (y,x).
         _T max_pixel = J[p];
-        nhSetWalkerLocation(leadingWalker, p);
-        int q;
-        while (nhGetNextInboundsNeighbor(leadingWalker, &q, NULL)) {
+        span = nhSpanWalkerSpan(leading, &count);
+        counter.walk();
+        counter.visits(count);
+        for (int k = 0; k < count; ++k) {
+            int q = p + (int) span[k];
             if (J[q] > max_pixel) {
                 max_pixel = J[q];
             }
@@ -114,25 +147,33 @@ void compute_reconstruction(_T *J, _T *I, int num_elements,
 
         // If there exists q member_of N_G_minus(p)
         // such that J(q) < J(p) and J(q) < I(q), then fifo_add(p)
-        nhSetWalkerLocation(leadingWalker, p);
-        while (nhGetNextInboundsNeighbor(leadingWalker, &q, NULL)) {
+        for (int k = 0; k < count; ++k) {
+            int q = p + (int) span[k];
             if (J[q] < J[p] && J[q] < I[q]) {
                 Queue.push(p);
+                counter.seed();
+                counter.push(Queue.size());
                 break;
             }
         }
     }
+    if (stats) counter.elapsed(&stats->antiraster_seconds, start);
 
     // Propagation step
+    stage.next("reconstruct_propagation");
+    start = counter.now();
     while (!Queue.empty()) {
         int p = Queue.front();
         Queue.pop();
         _T Jp = J[p];
 
         // for every pixel q member_of_N_g(p);
-        nhSetWalkerLocation(walker, p);
-        int q;
-        while (nhGetNextInboundsNeighbor(walker, &q, NULL)) {
+        nhSpanWalkerSetLocation(neighbors, p);
+        span = nhSpanWalkerSpan(neighbors, &count);
+        counter.walk();
+        counter.visits(count);
+        for (int k = 0; k < count; ++k) {
+            int q = p + (int) span[k];
 
             // "If J(q) < J(p) and I(q) ~= J(q), then
             //  J(q) <- min{J(p),I(q)}
@@ -142,9 +183,1091 @@ void compute_reconstruction(_T *J, _T *I, int num_elements,
             if (Jq < Jp && Iq != Jq) {
                 J[q] = (Jp < Iq) ? Jp : Iq;
                 Queue.push(q);
+                counter.push(Queue.size());
+            }
+        }
+    }
+    if (stats) {
+        counter.elapsed(&stats->propagation_seconds, start);
+        counter.add_queue_counts(stats);
+    }
+
+    nhDestroySpanWalker(trailing);
+    nhDestroySpanWalker(leading);
+    nhDestroySpanWalker(neighbors);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// compute_reconstruction_impl with the connectivity fixed at compile time.
+// The walkers must visit the members of SE (center skipped, trailing and
+// leading halves for the two scans); they are only used on border pixels.
+// Interior pixels run fully unrolled neighbor loops in the same order, so
+// the result, including the FIFO order, is identical.
+//
+//////////////////////////////////////////////////////////////////////////////
+template <typename SE, typename _T, typename Counter>
+void compute_reconstruction_static_impl(_T *J, _T *I, int num_elements,
+        NeighborhoodWalker_T walker,
+        NeighborhoodWalker_T trailingWalker,
+        NeighborhoodWalker_T leadingWalker,
+        ReconstructionStats *stats) {
+    Counter counter(stats ? &stats->walk : NULL);
+    double start;
+
+    for (int k = 0; k < num_elements; ++k) {
+        if (J[k] > I[k]) {
+            throw std::invalid_argument("Images:imreconstruct:markerGreaterThanMas: "
+                                        "MARKER pixels must be <= MASK pixels.");
+        }
+    }
+
+    int cols = walker->image_size[0];
+    int rows = walker->image_size[1];
+    const ptrdiff_t stride = cols;
+    std::queue<int> Queue;
+
+    NeighborhoodSpanWalker_T trailing = nhMakeSpanWalker(trailingWalker);
+    NeighborhoodSpanWalker_T leading = nhMakeSpanWalker(leadingWalker);
+    NeighborhoodSpanWalker_T neighbors = nhMakeSpanWalker(walker);
+    int count;
+    const ptrdiff_t *span;
+
+    // first pass, raster order
+    TraceScope stage("reconstruct_raster", "reconstruct");
+    start = counter.now();
+    auto raster_pixel = [&](int p) {
+        _T *center = J + p;
+        _T max_pixel = J[p];
+        auto fold = [&](int dy, int dx) {
+            _T value = center[dy * stride + dx];
+            if (value > max_pixel) max_pixel = value;
+        };
+        se_for_each<SE, 0, SE::center_index>(fold);
+        counter.walk();
+        counter.visits(SE::trailing_size);
+        J[p] = (max_pixel < I[p]) ? max_pixel : I[p];
+    };
+    auto raster_interior = [&](int begin, int end) {
+        for (int p = begin; p < end; ++p) raster_pixel(p);
+    };
+    auto raster_border = [&](int p) {
+        _T max_pixel = J[p];
+        nhSpanWalkerSetLocation(trailing, p);
+        span = nhSpanWalkerSpan(trailing, &count);
+        counter.walk();
+        counter.visits(count);
+        for (int k = 0; k < count; ++k) {
+            if (J[p + span[k]] > max_pixel) max_pixel = J[p + span[k]];
+        }
+        J[p] = (max_pixel < I[p]) ? max_pixel : I[p];
+    };
+    se_raster_scan<SE>(rows, cols, false, raster_interior, raster_border);
+    if (stats) counter.elapsed(&stats->raster_seconds, start);
+
+    // second pass, antiraster order
+    stage.next("reconstruct_antiraster");
+    start = counter.now();
+    auto antiraster_pixel = [&](int p) {
+        _T *center = J + p;
+        _T max_pixel = J[p];
+        auto fold = [&](int dy, int dx) {
+            _T value = center[dy * stride + dx];
+            if (value > max_pixel) max_pixel = value;
+        };
+        se_for_each<SE, SE::center_index + 1, SE::area>(fold);
+        counter.walk();
+        counter.visits(SE::leading_size);
+        J[p] = (max_pixel < I[p]) ? max_pixel : I[p];
+
+        bool found = false;
+        auto check = [&](int dy, int dx) {
+            ptrdiff_t q = p + dy * stride + dx;
+            found = found || (J[q] < J[p] && J[q] < I[q]);
+        };
+        se_for_each<SE, SE::center_index + 1, SE::area>(check);
+        if (found) {
+            Queue.push(p);
+            counter.seed();
+            counter.push(Queue.size());
+        }
+    };
+    auto antiraster_interior = [&](int begin, int end) {
+        for (int p = end - 1; p >= begin; --p) antiraster_pixel(p);
+    };
+    auto antiraster_border = [&](int p) {
+        _T max_pixel = J[p];
+        nhSpanWalkerSetLocation(leading, p);
+        span = nhSpanWalkerSpan(leading, &count);
+        counter.walk();
+        counter.visits(count);
+        for (int k = 0; k < count; ++k) {
+            if (J[p + span[k]] > max_pixel) max_pixel = J[p + span[k]];
+        }
+        J[p] = (max_pixel < I[p]) ? max_pixel : I[p];
+        for (int k = 0; k < count; ++k) {
+            int q = p + (int) span[k];
+            if (J[q] < J[p] && J[q] < I[q]) {
+                Queue.push(p);
+                counter.seed();
+                counter.push(Queue.size());
+                break;
+            }
+        }
+    };
+    se_raster_scan<SE>(rows, cols, true, antiraster_interior, antiraster_border);
+    if (stats) counter.elapsed(&stats->antiraster_seconds, start);
+
+    // Propagation step
+    stage.next("reconstruct_propagation");
+    start = counter.now();
+    while (!Queue.empty()) {
+        int p = Queue.front();
+        Queue.pop();
+        _T Jp = J[p];
+
+        auto propagate = [&](int q) {
+            _T Jq = J[q];
+            _T Iq = I[q];
+            if (Jq < Jp && Iq != Jq) {
+                J[q] = (Jp < Iq) ? Jp : Iq;
+                Queue.push(q);
+                counter.push(Queue.size());
+            }
+        };
+        nhSpanWalkerSetLocation(neighbors, p);
+        counter.walk();
+        if (se_is_interior<SE>(neighbors->y, neighbors->x, rows, cols)) {
+            auto visit = [&](int dy, int dx) {
+                propagate(p + (int) (dy * stride) + dx);
+            };
+            se_for_each<SE, 0, SE::center_index>(visit);
+            se_for_each<SE, SE::center_index + 1, SE::area>(visit);
+            counter.visits(SE::size - 1);
+        } else {
+            span = nhSpanWalkerSpan(neighbors, &count);
+            counter.visits(count);
+            for (int k = 0; k < count; ++k) {
+                propagate(p + (int) span[k]);
             }
         }
     }
+    if (stats) {
+        counter.elapsed(&stats->propagation_seconds, start);
+        counter.add_queue_counts(stats);
+    }
+
+    nhDestroySpanWalker(trailing);
+    nhDestroySpanWalker(leading);
+    nhDestroySpanWalker(neighbors);
+}
+
+template <typename SE>
+bool se_matches_reconstruction_walkers(NeighborhoodWalker_T walker,
+        NeighborhoodWalker_T trailingWalker,
+        NeighborhoodWalker_T leadingWalker) {
+    return se_matches_walker<SE>(walker, 0, SE::area, true) &&
+           se_matches_walker<SE>(trailingWalker, 0, SE::center_index, true) &&
+           se_matches_walker<SE>(leadingWalker, SE::center_index + 1, SE::area, true);
+}
+
+template <typename _T, typename Counter>
+struct StaticReconstructionKernel {
+    const char *name;
+    bool (*matches)(NeighborhoodWalker_T walker,
+                    NeighborhoodWalker_T trailingWalker,
+                    NeighborhoodWalker_T leadingWalker);
+    void (*reconstruct)(_T *J, _T *I, int num_elements,
+                        NeighborhoodWalker_T walker,
+                        NeighborhoodWalker_T trailingWalker,
+                        NeighborhoodWalker_T leadingWalker,
+                        ReconstructionStats *stats);
+};
+
+/**
+ * dispatch table of the instantiated reconstruction kernels (8- and
+ * 4-connected), terminated by an entry with a NULL name
+ */
+template <typename _T, typename Counter>
+const StaticReconstructionKernel<_T, Counter> *static_reconstruction_kernels() {
+    static const StaticReconstructionKernel<_T, Counter> kernels[] = {
+        {"rect3x3", &se_matches_reconstruction_walkers<SeRect3x3>,
+                    &compute_reconstruction_static_impl<SeRect3x3, _T, Counter>},
+        {"cross3x3", &se_matches_reconstruction_walkers<SeCross3x3>,
+                     &compute_reconstruction_static_impl<SeCross3x3, _T, Counter>},
+        {NULL, NULL, NULL}
+    };
+    return kernels;
+}
+
+// 8- and 16-bit integer images go to the hierarchical queue (below)
+template <typename _T>
+struct HierarchicalQueuePreferred {
+    static const bool value = std::numeric_limits<_T>::is_integer && sizeof(_T) <= 2;
+};
+
+template <typename _T, typename Counter>
+void compute_reconstruction_hqueue(_T *J, _T *I, int num_elements,
+        NeighborhoodWalker_T walker,
+        NeighborhoodWalker_T trailingWalker,
+        ReconstructionStats *stats);
+
+template <typename _T, typename Counter>
+void compute_reconstruction_dispatch(_T *J, _T *I, int num_elements,
+        NeighborhoodWalker_T walker,
+        NeighborhoodWalker_T trailingWalker,
+        NeighborhoodWalker_T leadingWalker,
+        ReconstructionStats *stats) {
+    if (HierarchicalQueuePreferred<_T>::value && num_elements == walker->image_size[0] * walker->image_size[1]) {
+        compute_reconstruction_hqueue<_T, Counter>(J, I, num_elements, walker, trailingWalker, stats);
+        return;
+    }
+    if (num_elements == walker->image_size[0] * walker->image_size[1]) {
+        for (const StaticReconstructionKernel<_T, Counter> *k = static_reconstruction_kernels<_T, Counter>();
+             k->name; ++k) {
+            if (k->matches(walker, trailingWalker, leadingWalker)) {
+                k->reconstruct(J, I, num_elements, walker, trailingWalker, leadingWalker, stats);
+                return;
+            }
+        }
+    }
+    compute_reconstruction_impl<_T, Counter>(J, I, num_elements,
+            walker, trailingWalker, leadingWalker, stats);
+}
+
+template <typename _T>
+void compute_reconstruction(_T *J, _T *I, int num_elements,
+        NeighborhoodWalker_T walker,
+        NeighborhoodWalker_T trailingWalker,
+        NeighborhoodWalker_T leadingWalker,
+        ReconstructionStats *stats = NULL) {
+    if (stats) {
+        compute_reconstruction_dispatch<_T, StatsCounter<true> >(J, I, num_elements,
+                walker, trailingWalker, leadingWalker, stats);
+    } else {
+        compute_reconstruction_dispatch<_T, StatsCounter<false> >(J, I, num_elements,
+                walker, trailingWalker, leadingWalker, NULL);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Neighbor sets for compute_reconstruction_padded. for_each(f) calls f with
+// the linear offset of every neighbor, in walker order.
+//
+//////////////////////////////////////////////////////////////////////////////
+struct PaddedRuntimeOffsets {
+    const ptrdiff_t *offsets;
+    int size;
+
+    template <typename F>
+    inline void for_each(F &f) const {
+        for (int k = 0; k < size; ++k) f(offsets[k]);
+    }
+};
+
+// members of SE with bit index in [BEGIN, END), origin excluded
+template <typename SE, int BEGIN, int END>
+struct PaddedStaticOffsets {
+    ptrdiff_t stride;
+    static const int size = se_range_count(SE::bits, BEGIN, END, SE::center_index);
+
+    template <typename F>
+    SE_FORCE_INLINE void for_each(F &f) const {
+        const ptrdiff_t s = stride;
+        auto g = [&](int dy, int dx) { f(dy * s + dx); };
+        se_for_each<SE, BEGIN, (END < SE::center_index ? END : SE::center_index)>(g);
+        se_for_each<SE, (BEGIN > SE::center_index ? BEGIN : SE::center_index + 1), END>(g);
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Marker sources for compute_reconstruction_padded. The first raster pass
+// takes the marker value of every pixel from marker(j, i), j and i pointing
+// at the pixel in J and I, just before the pixel is scanned; sources that
+// form the marker from I (given == false) guarantee it is <= I, so J needs
+// nothing but its border beforehand and the marker <= mask test is skipped.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+// the marker already in J
+struct PaddedMarkerGiven {
+    static const bool given = true;
+
+    template <typename _T>
+    inline _T operator()(const _T *j, const _T *) const { return *j; }
+};
+
+// I - h (h >= 0), saturated at the lowest value for integer types; with
+// warm true, the larger of that and the value in J, which must be <= I
+template <typename _T, bool warm>
+struct PaddedMarkerShifted {
+    static const bool given = false;
+    _T h;
+
+    inline _T operator()(const _T *j, const _T *i) const {
+        const _T lowest = std::numeric_limits<_T>::lowest();
+        _T v = std::numeric_limits<_T>::is_integer && *i < lowest + h ? lowest : (_T) (*i - h);
+        return warm && *j > v ? *j : v;
+    }
+};
+
+// I where an 8-connected neighbor is strictly higher, the minimum sentinel
+// elsewhere: reconstructed under I with 8-connectivity, it reaches I
+// exactly on the pixels outside the regional maxima (a plateau with a
+// higher neighbor passes its value along itself; a regional maximum is
+// only reached from lower pixels)
+template <typename _T>
+struct PaddedMarkerBelowHigher {
+    static const bool given = false;
+    ptrdiff_t stride;
+
+    inline _T operator()(const _T *, const _T *i) const {
+        const ptrdiff_t s = stride;
+        _T top = i[-s - 1];
+        top = i[-s] > top ? i[-s] : top;
+        top = i[-s + 1] > top ? i[-s + 1] : top;
+        top = i[-1] > top ? i[-1] : top;
+        top = i[1] > top ? i[1] : top;
+        top = i[s - 1] > top ? i[s - 1] : top;
+        top = i[s] > top ? i[s] : top;
+        top = i[s + 1] > top ? i[s + 1] : top;
+        return top > *i ? *i : PaddedImage<_T>::min_sentinel();
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// compute_reconstruction on padded images. J and I must have the same size
+// and border, and the border of both must hold the same value, no larger
+// than any pixel (PaddedImage::min_sentinel()). Border pixels then never
+// win a maximum, never seed the FIFO and never change (J == I there), so
+// all three steps run without bounds tests. Results are identical to
+// compute_reconstruction.
+//
+// The image is cut into RECONSTRUCTION_TILE_SIZE square tiles. With a
+// given marker, a tile where J == I everywhere (most of a DSM after an
+// erosion: every flat stretch wider than the mask) is settled and the scans
+// skip it: its pixels cannot rise above I, and none of them seeds the FIFO,
+// since the raster pass already raised every later neighbor q to
+// min(I(p), I(q)) from them. The FIFO is split by tile: pushes go to the
+// FIFO of their tile, and the propagation drains one tile at a time, in the
+// order the tiles got work, so it stays in a few cache lines instead of
+// following the front across the image. The order pixels are processed in
+// does not change the result.
+//
+//////////////////////////////////////////////////////////////////////////////
+#define RECONSTRUCTION_TILE_SIZE 64
+
+/**
+ * per-tile FIFOs of pixel offsets (from the padded origin), drained one
+ * tile at a time; tiles with work wait in a FIFO of their own
+ */
+class TileQueues {
+public:
+    TileQueues(int rows, int cols, ptrdiff_t stride)
+            : stride_(stride), tiles_x_((cols + RECONSTRUCTION_TILE_SIZE - 1) / RECONSTRUCTION_TILE_SIZE),
+              queues_((size_t) tiles_x_ * ((rows + RECONSTRUCTION_TILE_SIZE - 1) / RECONSTRUCTION_TILE_SIZE)),
+              heads_(queues_.size(), 0), waiting_(queues_.size(), false), size_(0), next_tile_(0) {}
+
+    void push(ptrdiff_t p) {
+        ptrdiff_t y = p / stride_;
+        int tile = (int) (y / RECONSTRUCTION_TILE_SIZE) * tiles_x_ +
+                   (int) ((p - y * stride_) / RECONSTRUCTION_TILE_SIZE);
+        queues_[tile].push_back(p);
+        ++size_;
+        if (!waiting_[tile]) {
+            waiting_[tile] = true;
+            tiles_.push_back(tile);
+        }
+    }
+
+    size_t size() const { return size_; }
+
+    /**
+     * the next pixel, from the tile being drained; false once every FIFO
+     * is empty
+     */
+    bool pop(ptrdiff_t *p) {
+        while (next_tile_ < tiles_.size()) {
+            int tile = tiles_[next_tile_];
+            std::vector<ptrdiff_t> &queue = queues_[tile];
+            if (heads_[tile] < queue.size()) {
+                *p = queue[heads_[tile]++];
+                --size_;
+                return true;
+            }
+            queue.clear();
+            heads_[tile] = 0;
+            waiting_[tile] = false;
+            ++next_tile_;
+            // keep the tile FIFO from growing without end
+            if (next_tile_ == tiles_.size()) {
+                tiles_.clear();
+                next_tile_ = 0;
+            }
+        }
+        return false;
+    }
+
+private:
+    ptrdiff_t stride_;
+    int tiles_x_;
+    std::vector<std::vector<ptrdiff_t> > queues_;
+    std::vector<size_t> heads_;
+    std::vector<bool> waiting_;
+    std::vector<int> tiles_;
+    size_t size_;
+    size_t next_tile_;
+};
+
+template <typename _T, typename Counter, typename Marker, typename Trailing, typename Leading, typename All>
+void compute_reconstruction_padded_impl(PaddedImage<_T> &J, const PaddedImage<_T> &I, const Marker &marker,
+        const Trailing &trailing, const Leading &leading, const All &all,
+        ReconstructionStats *stats) {
+    Counter counter(stats ? &stats->walk : NULL);
+    double start;
+    int rows = J.rows();
+    int cols = J.cols();
+    const int tile_size = RECONSTRUCTION_TILE_SIZE;
+    int tiles_y = (rows + tile_size - 1) / tile_size;
+    int tiles_x = (cols + tile_size - 1) / tile_size;
+
+    // tiles where J == I everywhere, found while checking J <= I; with a
+    // marker formed in the raster pass none is settled
+    std::vector<unsigned char> settled((size_t) tiles_y * tiles_x, Marker::given);
+    for (int y = 0; Marker::given && y < rows; ++y) {
+        const _T *jrow = J.row(y);
+        const _T *irow = I.row(y);
+        unsigned char *settled_row = settled.data() + (size_t) (y / tile_size) * tiles_x;
+        for (int tx = 0; tx < tiles_x; ++tx) {
+            int x1 = (tx + 1) * tile_size < cols ? (tx + 1) * tile_size : cols;
+            bool greater = false, equal = true;
+            for (int x = tx * tile_size; x < x1; ++x) {
+                greater |= jrow[x] > irow[x];
+                equal &= jrow[x] == irow[x];
+            }
+            if (greater) {
+                throw std::invalid_argument("Images:imreconstruct:markerGreaterThanMas: "
+                                            "MARKER pixels must be <= MASK pixels.");
+            }
+            settled_row[tx] &= equal;
+        }
+    }
+    long long active_pixels = 0;
+    for (int ty = 0; ty < tiles_y; ++ty) {
+        int height = (ty + 1) * tile_size < rows ? tile_size : rows - ty * tile_size;
+        for (int tx = 0; tx < tiles_x; ++tx) {
+            int width = (tx + 1) * tile_size < cols ? tile_size : cols - tx * tile_size;
+            if (!settled[(size_t) ty * tiles_x + tx]) active_pixels += (long long) height * width;
+        }
+    }
+
+    _T *Jp0 = J.origin();
+    const _T *Ip0 = I.origin();
+    TileQueues Queue(rows, cols, J.stride());
+
+    // first pass, raster order
+    TraceScope stage("reconstruct_raster", "reconstruct");
+    start = counter.now();
+    for (int y = 0; y < rows; ++y) {
+        _T *jrow = J.row(y);
+        const _T *irow = I.row(y);
+        const unsigned char *settled_row = settled.data() + (size_t) (y / tile_size) * tiles_x;
+        for (int tx = 0; tx < tiles_x; ++tx) {
+            if (settled_row[tx]) continue;
+            int x1 = (tx + 1) * tile_size < cols ? (tx + 1) * tile_size : cols;
+            for (int x = tx * tile_size; x < x1; ++x) {
+                _T *center = jrow + x;
+                _T max_pixel = marker(center, irow + x);
+                auto fold = [&](ptrdiff_t offset) {
+                    if (center[offset] > max_pixel) max_pixel = center[offset];
+                };
+                trailing.for_each(fold);
+                *center = (max_pixel < irow[x]) ? max_pixel : irow[x];
+            }
+        }
+    }
+    counter.walks(active_pixels);
+    counter.visits(active_pixels * trailing.size);
+    if (stats) counter.elapsed(&stats->raster_seconds, start);
+
+    // second pass, antiraster order
+    stage.next("reconstruct_antiraster");
+    start = counter.now();
+    for (int y = rows - 1; y >= 0; --y) {
+        _T *jrow = J.row(y);
+        const _T *irow = I.row(y);
+        const unsigned char *settled_row = settled.data() + (size_t) (y / tile_size) * tiles_x;
+        for (int tx = tiles_x - 1; tx >= 0; --tx) {
+            if (settled_row[tx]) continue;
+            int x1 = (tx + 1) * tile_size < cols ? (tx + 1) * tile_size : cols;
+            for (int x = x1 - 1; x >= tx * tile_size; --x) {
+                _T *center = jrow + x;
+                _T max_pixel = *center;
+                auto fold = [&](ptrdiff_t offset) {
+                    if (center[offset] > max_pixel) max_pixel = center[offset];
+                };
+                leading.for_each(fold);
+                _T Jp = (max_pixel < irow[x]) ? max_pixel : irow[x];
+                *center = Jp;
+
+                ptrdiff_t p = center - Jp0;
+                // without branches: which neighbors pass is data dependent
+                bool found = false;
+                auto check = [&](ptrdiff_t offset) {
+                    found |= (Jp0[p + offset] < Jp) & (Jp0[p + offset] < Ip0[p + offset]);
+                };
+                leading.for_each(check);
+                if (found) {
+                    Queue.push(p);
+                    counter.seed();
+                    counter.push(Queue.size());
+                }
+            }
+        }
+    }
+    counter.walks(active_pixels);
+    counter.visits(active_pixels * leading.size);
+    if (stats) counter.elapsed(&stats->antiraster_seconds, start);
+
+    // Propagation step
+    stage.next("reconstruct_propagation");
+    start = counter.now();
+    ptrdiff_t p;
+    while (Queue.pop(&p)) {
+        _T Jp = Jp0[p];
+
+        auto propagate = [&](ptrdiff_t offset) {
+            ptrdiff_t q = p + offset;
+            _T Jq = Jp0[q];
+            _T Iq = Ip0[q];
+            if (Jq < Jp && Iq != Jq) {
+                Jp0[q] = (Jp < Iq) ? Jp : Iq;
+                Queue.push(q);
+                counter.push(Queue.size());
+            }
+        };
+        all.for_each(propagate);
+        counter.walk();
+        counter.visits(all.size);
+    }
+    if (stats) {
+        counter.elapsed(&stats->propagation_seconds, start);
+        counter.add_queue_counts(stats);
+    }
+}
+
+template <typename _T, typename Counter, typename Marker>
+void compute_reconstruction_padded_dispatch(PaddedImage<_T> &J, const PaddedImage<_T> &I, const Marker &marker,
+        NeighborhoodWalker_T walker,
+        NeighborhoodWalker_T trailingWalker,
+        NeighborhoodWalker_T leadingWalker,
+        ReconstructionStats *stats) {
+    ptrdiff_t stride = J.stride();
+    if (se_matches_reconstruction_walkers<SeRect3x3>(walker, trailingWalker, leadingWalker)) {
+        typedef SeRect3x3 SE;
+        PaddedStaticOffsets<SE, 0, SE::center_index> trailing = {stride};
+        PaddedStaticOffsets<SE, SE::center_index + 1, SE::area> leading = {stride};
+        PaddedStaticOffsets<SE, 0, SE::area> all = {stride};
+        compute_reconstruction_padded_impl<_T, Counter>(J, I, marker, trailing, leading, all, stats);
+    } else if (se_matches_reconstruction_walkers<SeCross3x3>(walker, trailingWalker, leadingWalker)) {
+        typedef SeCross3x3 SE;
+        PaddedStaticOffsets<SE, 0, SE::center_index> trailing = {stride};
+        PaddedStaticOffsets<SE, SE::center_index + 1, SE::area> leading = {stride};
+        PaddedStaticOffsets<SE, 0, SE::area> all = {stride};
+        compute_reconstruction_padded_impl<_T, Counter>(J, I, marker, trailing, leading, all, stats);
+    } else {
+        PaddedRuntimeOffsets trailing, leading, all;
+        trailing.offsets = padded_neighbor_offsets(trailingWalker, stride, &trailing.size);
+        leading.offsets = padded_neighbor_offsets(leadingWalker, stride, &leading.size);
+        all.offsets = padded_neighbor_offsets(walker, stride, &all.size);
+        compute_reconstruction_padded_impl<_T, Counter>(J, I, marker, trailing, leading, all, stats);
+        free((void *) trailing.offsets);
+        free((void *) leading.offsets);
+        free((void *) all.offsets);
+    }
+}
+
+template <typename _T, typename Marker>
+void compute_reconstruction_padded(PaddedImage<_T> &J, const PaddedImage<_T> &I, const Marker &marker,
+        NeighborhoodWalker_T walker,
+        NeighborhoodWalker_T trailingWalker,
+        NeighborhoodWalker_T leadingWalker,
+        ReconstructionStats *stats = NULL) {
+    if (J.rows() != I.rows() || J.cols() != I.cols() ||
+        J.border() != I.border() || J.stride() != I.stride()) {
+        throw std::invalid_argument("marker and mask images must have the same size and border");
+    }
+    if (padded_walker_reach(walker) > J.border()) {
+        throw std::invalid_argument("image border is smaller than the neighborhood reach");
+    }
+    if (J.sentinel() != I.sentinel() || J.sentinel() != PaddedImage<_T>::min_sentinel()) {
+        throw std::invalid_argument("marker and mask borders must hold the minimum sentinel");
+    }
+    if (stats) {
+        compute_reconstruction_padded_dispatch<_T, StatsCounter<true> >(J, I, marker,
+                walker, trailingWalker, leadingWalker, stats);
+    } else {
+        compute_reconstruction_padded_dispatch<_T, StatsCounter<false> >(J, I, marker,
+                walker, trailingWalker, leadingWalker, NULL);
+    }
+}
+
+template <typename _T>
+void compute_reconstruction_padded(PaddedImage<_T> &J, const PaddedImage<_T> &I,
+        NeighborhoodWalker_T walker,
+        NeighborhoodWalker_T trailingWalker,
+        NeighborhoodWalker_T leadingWalker,
+        ReconstructionStats *stats = NULL) {
+    compute_reconstruction_padded(J, I, PaddedMarkerGiven(), walker, trailingWalker, leadingWalker, stats);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// compute_reconstruction_pyramid: compute_reconstruction_padded started
+// from a coarse-to-fine lower bound of the result, for 4- and
+// 8-connectivity.
+//
+// Cut the image into 2x2 blocks (the last block row and column are cut
+// short on odd sizes). Let Ic be the minimum of I over each block, Jc the
+// maximum of J over it clipped to Ic, and Rc the reconstruction of Jc
+// under Ic with the same connectivity, found the same way down to
+// RECONSTRUCTION_PYRAMID_MIN_SIZE. For every pixel p of block b
+//
+//     J(p) <= max{J(p), Rc(b)} <= R(p),
+//
+// R the reconstruction of J under I. Proof: Rc(b) is the largest v such
+// that a path of neighboring blocks b0, ..., bk = b has Jc(b0) >= v and
+// Ic(bi) >= v for every i. Then every pixel of those blocks has I >= v and
+// some pixel of b0 has J >= v. The pixels of a block are 4-connected, and
+// two neighboring blocks hold two neighboring pixels (only the last block
+// of a row or column is cut short), so a path of pixels with I >= v leads
+// from a pixel with J >= v to p: R(p) >= v. Reconstruction is increasing
+// and idempotent, so any marker between J and R has the reconstruction R,
+// and the fine level starts from max{J, Rc}: the long range propagation is
+// done on the coarse levels, and what is left is the mask detail narrower
+// than the blocks. Tiles the bound raises to I everywhere are settled.
+//
+// Other neighborhoods throw: a block path does not give a pixel path for
+// them. With stats, every level adds to the same counters.
+//
+//////////////////////////////////////////////////////////////////////////////
+#define RECONSTRUCTION_PYRAMID_MIN_SIZE 32
+
+/**
+ * one level down the pyramid: Ic(y, x) is the minimum of I over the block
+ * (2y .. 2y + 1, 2x .. 2x + 1), cut to the image, and Jc(y, x) the maximum
+ * of J over it, clipped to Ic(y, x); Jc and Ic are (rows + 1) / 2 by
+ * (cols + 1) / 2
+ */
+template <typename _T>
+void pyramid_reduce(const PaddedImage<_T> &J, const PaddedImage<_T> &I, PaddedImage<_T> &Jc, PaddedImage<_T> &Ic) {
+    for (int y = 0; y < Ic.rows(); ++y) {
+        int y1 = 2 * y + 1 < I.rows() ? 2 * y + 1 : 2 * y;
+        const _T *jtop = J.row(2 * y);
+        const _T *jbottom = J.row(y1);
+        const _T *itop = I.row(2 * y);
+        const _T *ibottom = I.row(y1);
+        _T *jc = Jc.row(y);
+        _T *ic = Ic.row(y);
+        for (int x = 0; x < Ic.cols(); ++x) {
+            int x0 = 2 * x;
+            int x1 = x0 + 1 < I.cols() ? x0 + 1 : x0;
+            _T high = std::max(std::max(jtop[x0], jtop[x1]), std::max(jbottom[x0], jbottom[x1]));
+            _T low = std::min(std::min(itop[x0], itop[x1]), std::min(ibottom[x0], ibottom[x1]));
+            ic[x] = low;
+            jc[x] = high < low ? high : low;
+        }
+    }
+}
+
+template <typename _T>
+void compute_reconstruction_pyramid(PaddedImage<_T> &J, const PaddedImage<_T> &I,
+        NeighborhoodWalker_T walker,
+        NeighborhoodWalker_T trailingWalker,
+        NeighborhoodWalker_T leadingWalker,
+        ReconstructionStats *stats = NULL) {
+    if (!se_matches_reconstruction_walkers<SeRect3x3>(walker, trailingWalker, leadingWalker) &&
+        !se_matches_reconstruction_walkers<SeCross3x3>(walker, trailingWalker, leadingWalker)) {
+        throw std::invalid_argument("the pyramid reconstruction needs 4- or 8-connectivity");
+    }
+    if (J.rows() >= RECONSTRUCTION_PYRAMID_MIN_SIZE && J.cols() >= RECONSTRUCTION_PYRAMID_MIN_SIZE) {
+        if (J.rows() != I.rows() || J.cols() != I.cols() || J.border() != I.border()) {
+            throw std::invalid_argument("marker and mask images must have the same size and border");
+        }
+        PaddedImage<_T> Jc((J.rows() + 1) / 2, (J.cols() + 1) / 2, J.border(), J.sentinel());
+        PaddedImage<_T> Ic((I.rows() + 1) / 2, (I.cols() + 1) / 2, I.border(), I.sentinel());
+        {
+            TRACE_SCOPE("reconstruct_pyramid_reduce", "reconstruct");
+            pyramid_reduce(J, I, Jc, Ic);
+        }
+        compute_reconstruction_pyramid(Jc, Ic, walker, trailingWalker, leadingWalker, stats);
+
+        TRACE_SCOPE("reconstruct_pyramid_expand", "reconstruct");
+        for (int y = 0; y < J.rows(); ++y) {
+            const _T *coarse = Jc.row(y / 2);
+            _T *fine = J.row(y);
+            for (int x = 0; x < J.cols(); ++x) {
+                _T bound = coarse[x / 2];
+                fine[x] = bound > fine[x] ? bound : fine[x];
+            }
+        }
+    }
+    compute_reconstruction_padded(J, I, walker, trailingWalker, leadingWalker, stats);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// compute_reconstruction for 8- and 16-bit integer images: a hierarchical
+// queue, one FIFO per gray level, replaces the antiraster scan and the
+// single FIFO.
+//
+// After the raster pass, levels are flooded from the highest down. At
+// level L the FIFO of L holds the seeds of value L (pixels p with a
+// neighbor q such that J(q) < J(p) and J(q) < I(q); no other pixel can
+// ever raise a neighbor, since J only grows) and every pixel raised to L
+// so far. Popping p:
+//
+//  For every pixel q member_of N_G(p):
+//    If J(q) < L and J(q) < I(q), then
+//      J(q) <- min{L, I(q)}
+//      add q to the FIFO of J(q)
+//
+// A pixel is raised to min{L, I(q)} at level L, so it only goes to the
+// FIFO of the current level or a lower one, and never a second time: every
+// pixel is in at most one FIFO, once, and one successor array threads all
+// of them. Each pixel is popped at most once, with O(1) priority
+// operations, and the result does not depend on how far the marker is
+// from it. The work runs on copies of J and I whose border holds the
+// largest value in the FIFO phase, so no neighbor test passes there.
+//
+// Every level a pixel is queued at lies between the lowest and the highest
+// value of J after the raster pass, so the per-level arrays (first, head,
+// tail) only span that range: at most 256 or 65536 levels, fewer when the
+// marker uses part of the type. Memory: the two copies, one int per padded
+// pixel for the links (only touched for queued pixels), two ints per seed
+// (the candidates and their sorted copy; every pixel can be a seed), and
+// three ints per level of the range.
+//
+//////////////////////////////////////////////////////////////////////////////
+template <typename _T, typename Counter, typename Trailing, typename All>
+void compute_reconstruction_hqueue_impl(PaddedImage<_T> &J, const PaddedImage<_T> &I,
+        const Trailing &trailing, const All &all, ReconstructionStats *stats) {
+    Counter counter(stats ? &stats->walk : NULL);
+
+    // the raster pass of the hybrid algorithm first: in one sequential
+    // sweep it raises most of what a dense marker (an erosion, I - h) will
+    // reach, which leaves far fewer pixels to the queues
+    TraceScope stage("reconstruct_raster", "reconstruct");
+    double start = counter.now();
+    J.fill_border(std::numeric_limits<_T>::lowest());
+    for (int y = 0; y < J.rows(); ++y) {
+        _T *jrow = J.row(y);
+        const _T *irow = I.row(y);
+        for (int x = 0; x < J.cols(); ++x) {
+            _T *center = jrow + x;
+            _T max_pixel = *center;
+            auto fold = [&](ptrdiff_t offset) {
+                if (center[offset] > max_pixel) max_pixel = center[offset];
+            };
+            trailing.for_each(fold);
+            *center = (max_pixel < irow[x]) ? max_pixel : irow[x];
+        }
+    }
+    J.fill_border(std::numeric_limits<_T>::max());
+    counter.walks((long long) J.rows() * J.cols());
+    counter.visits((long long) J.rows() * J.cols() * trailing.size);
+    if (stats) counter.elapsed(&stats->raster_seconds, start);
+    stage.next("reconstruct_hqueue");
+    start = counter.now();
+
+    int rows = J.rows();
+    int cols = J.cols();
+    ptrdiff_t stride = J.stride();
+    _T *Jp0 = J.origin();
+    const _T *Ip0 = I.origin();
+
+    // a pixel is a seed if it can raise a neighbor; the seeds are then
+    // sorted by level
+    std::vector<int> candidates;
+    std::vector<unsigned char> seed(cols);
+    _T low = std::numeric_limits<_T>::max(), high = std::numeric_limits<_T>::lowest();
+    for (int y = 0; y < rows; ++y) {
+        const _T *jrow = J.row(y);
+        const _T *irow = I.row(y);
+        unsigned char *__restrict flags = seed.data();
+        for (int x = 0; x < cols; ++x) flags[x] = 0;
+        auto test = [&](ptrdiff_t offset) {
+            const _T *jq = jrow + offset;
+            const _T *iq = irow + offset;
+            for (int x = 0; x < cols; ++x) flags[x] |= (jq[x] < jrow[x]) & (jq[x] < iq[x]);
+        };
+        all.for_each(test);
+        for (int x = 0; x < cols; ++x) {
+            if (flags[x]) candidates.push_back((int) (y * stride + x));
+        }
+        for (int x = 0; x < cols; ++x) {
+            low = jrow[x] < low ? jrow[x] : low;
+            high = jrow[x] > high ? jrow[x] : high;
+        }
+    }
+    // raised pixels go to min(L, I(q)) > J(q) for a queued level L, so
+    // every level stays in [low, high]
+    const int lowest = (int) low;
+    const int levels = (int) high - lowest + 1;
+    counter.walks((long long) rows * cols);
+    counter.visits((long long) rows * cols * all.size);
+    std::vector<int> first(levels + 1, 0);
+    for (size_t k = 0; k < candidates.size(); ++k) ++first[(int) Jp0[candidates[k]] - lowest + 1];
+    for (int level = 0; level < levels; ++level) first[level + 1] += first[level];
+    std::vector<int> seeds(candidates.size());
+    {
+        std::vector<int> fill(first.begin(), first.end() - 1);
+        for (size_t k = 0; k < candidates.size(); ++k) {
+            seeds[fill[(int) Jp0[candidates[k]] - lowest]++] = candidates[k];
+        }
+    }
+
+    // links of the FIFOs; only the entries of queued pixels are ever read
+    int *next = (int *) malloc(sizeof(int) * (size_t) rows * stride);
+    if (next == NULL) {
+        throw std::bad_alloc();
+    }
+    // FIFO per level, linked through next
+    std::vector<int> head(levels, -1), tail(levels, -1);
+    long long queued = 0;
+    auto add = [&](int q, int level) {
+        next[q] = -1;
+        if (head[level] < 0) {
+            head[level] = q;
+        } else {
+            next[tail[level]] = q;
+        }
+        tail[level] = q;
+        counter.push((size_t) ++queued);
+    };
+
+    for (int level = levels - 1; level >= 0; --level) {
+        for (int k = first[level]; k < first[level + 1]; ++k) {
+            int p = seeds[k];
+            // seeds that were raised meanwhile went out with a higher level
+            if ((int) Jp0[p] - lowest != level) continue;
+            add(p, level);
+            counter.seed();
+        }
+        const _T L = (_T) (level + lowest);
+        while (head[level] >= 0) {
+            int p = head[level];
+            head[level] = next[p];
+            --queued;
+            auto propagate = [&](ptrdiff_t offset) {
+                int q = p + (int) offset;
+                _T Jq = Jp0[q];
+                _T Iq = Ip0[q];
+                if (Jq < L && Jq < Iq) {
+                    _T v = L < Iq ? L : Iq;
+                    Jp0[q] = v;
+                    add(q, (int) v - lowest);
+                }
+            };
+            all.for_each(propagate);
+            counter.walk();
+            counter.visits(all.size);
+        }
+    }
+    free(next);
+    if (stats) {
+        counter.elapsed(&stats->propagation_seconds, start);
+        counter.add_queue_counts(stats);
+    }
+}
+
+template <typename _T, typename Counter>
+void compute_reconstruction_hqueue(_T *J, _T *I, int num_elements,
+        NeighborhoodWalker_T walker,
+        NeighborhoodWalker_T trailingWalker,
+        ReconstructionStats *stats) {
+    for (int k = 0; k < num_elements; ++k) {
+        if (J[k] > I[k]) {
+            throw std::invalid_argument("Images:imreconstruct:markerGreaterThanMas: "
+                                        "MARKER pixels must be <= MASK pixels.");
+        }
+    }
+    int cols = walker->image_size[0];
+    int rows = walker->image_size[1];
+    if (num_elements == 0) return;
+    int border = padded_walker_reach(walker);
+    if (border < 1) border = 1;
+    const _T top = std::numeric_limits<_T>::max();
+    PaddedImage<_T> padded_J(rows, cols, border, top);
+    PaddedImage<_T> padded_I(rows, cols, border, top);
+    padded_J.load(J);
+    padded_I.load(I);
+
+    ptrdiff_t stride = padded_J.stride();
+    if (se_matches_walker<SeRect3x3>(walker, 0, SeRect3x3::area, true)) {
+        PaddedStaticOffsets<SeRect3x3, 0, SeRect3x3::center_index> trailing = {stride};
+        PaddedStaticOffsets<SeRect3x3, 0, SeRect3x3::area> all = {stride};
+        compute_reconstruction_hqueue_impl<_T, Counter>(padded_J, padded_I, trailing, all, stats);
+    } else if (se_matches_walker<SeCross3x3>(walker, 0, SeCross3x3::area, true)) {
+        PaddedStaticOffsets<SeCross3x3, 0, SeCross3x3::center_index> trailing = {stride};
+        PaddedStaticOffsets<SeCross3x3, 0, SeCross3x3::area> all = {stride};
+        compute_reconstruction_hqueue_impl<_T, Counter>(padded_J, padded_I, trailing, all, stats);
+    } else {
+        PaddedRuntimeOffsets trailing, all;
+        trailing.offsets = padded_neighbor_offsets(trailingWalker, stride, &trailing.size);
+        all.offsets = padded_neighbor_offsets(walker, stride, &all.size);
+        compute_reconstruction_hqueue_impl<_T, Counter>(padded_J, padded_I, trailing, all, stats);
+        free((void *) trailing.offsets);
+        free((void *) all.offsets);
+    }
+    padded_J.store(J);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Same algorithm as compute_reconstruction, restricted to the pixels where
+// valid[p] is true. Invalid pixels (nodata, NaN) are never used as the center
+// of a scan step, never read as a neighbor and never pushed on the FIFO, so
+// voids neither feed nor block the propagation. Their J value is left as is.
+//
+// Rows whose trailing/leading footprint holds no invalid pixel run the
+// unmasked scan, so the mask only costs anything near the voids.
+//
+//////////////////////////////////////////////////////////////////////////////
+template <typename _T, typename Counter>
+void compute_reconstruction_masked_impl(_T *J, _T *I, bool *valid, int num_elements,
+        NeighborhoodWalker_T walker,
+        NeighborhoodWalker_T trailingWalker,
+        NeighborhoodWalker_T leadingWalker,
+        ReconstructionStats *stats) {
+    Counter counter(stats ? &stats->walk : NULL);
+    double start;
+
+    for (int k = 0; k < num_elements; ++k) {
+        if (valid[k] && J[k] > I[k]) {
+            throw std::invalid_argument("Images:imreconstruct:markerGreaterThanMas: "
+                                        "MARKER pixels must be <= MASK pixels.");
+        }
+    }
+
+    bool *trailing_clean = nhMakeCleanRowMap(trailingWalker, valid);
+    bool *leading_clean = nhMakeCleanRowMap(leadingWalker, valid);
+
+    std::queue<int> Queue;
+
+    NeighborhoodSpanWalker_T trailing = nhMakeSpanWalker(trailingWalker);
+    NeighborhoodSpanWalker_T leading = nhMakeSpanWalker(leadingWalker);
+    NeighborhoodSpanWalker_T neighbors = nhMakeSpanWalker(walker);
+    int count;
+    const ptrdiff_t *span;
+
+    // first pass, raster order
+    TraceScope stage("reconstruct_raster", "reconstruct");
+    start = counter.now();
+    for (int p = 0; p < num_elements; ++p, nhSpanWalkerAdvance(trailing)) {
+        bool clean = trailing_clean[trailing->y];
+        if (!clean && !valid[p]) continue;
+
+        _T max_pixel = J[p];
+        span = nhSpanWalkerSpan(trailing, &count);
+        counter.walk();
+        counter.visits(count);
+        for (int k = 0; k < count; ++k) {
+            int q = p + (int) span[k];
+            if ((clean || valid[q]) && J[q] > max_pixel) {
+                max_pixel = J[q];
+            }
+        }
+        J[p] = (max_pixel < I[p]) ? max_pixel : I[p];
+    }
+    if (stats) counter.elapsed(&stats->raster_seconds, start);
+
+    // second pass, antiraster order
+    stage.next("reconstruct_antiraster");
+    start = counter.now();
+    nhSpanWalkerSetLocation(leading, num_elements - 1);
+    for (int pp = 0; pp < num_elements; ++pp, nhSpanWalkerRetreat(leading)) {
+        int p = num_elements - 1 - pp;
+        bool clean = leading_clean[leading->y];
+        if (!clean && !valid[p]) continue;
+
+        _T max_pixel = J[p];
+        span = nhSpanWalkerSpan(leading, &count);
+        counter.walk();
+        counter.visits(count);
+        for (int k = 0; k < count; ++k) {
+            int q = p + (int) span[k];
+            if ((clean || valid[q]) && J[q] > max_pixel) {
+                max_pixel = J[q];
+            }
+        }
+        J[p] = (max_pixel < I[p]) ? max_pixel : I[p];
+
+        for (int k = 0; k < count; ++k) {
+            int q = p + (int) span[k];
+            if ((clean || valid[q]) && J[q] < J[p] && J[q] < I[q]) {
+                Queue.push(p);
+                counter.seed();
+                counter.push(Queue.size());
+                break;
+            }
+        }
+    }
+    if (stats) counter.elapsed(&stats->antiraster_seconds, start);
+
+    free(trailing_clean);
+    free(leading_clean);
+
+    // Propagation step; only valid pixels were queued
+    stage.next("reconstruct_propagation");
+    start = counter.now();
+    while (!Queue.empty()) {
+        int p = Queue.front();
+        Queue.pop();
+        _T Jp = J[p];
+
+        nhSpanWalkerSetLocation(neighbors, p);
+        span = nhSpanWalkerSpan(neighbors, &count);
+        counter.walk();
+        counter.visits(count);
+        for (int k = 0; k < count; ++k) {
+            int q = p + (int) span[k];
+            if (!valid[q]) continue;
+            _T Jq = J[q];
+            _T Iq = I[q];
+            if (Jq < Jp && Iq != Jq) {
+                J[q] = (Jp < Iq) ? Jp : Iq;
+                Queue.push(q);
+                counter.push(Queue.size());
+            }
+        }
+    }
+    if (stats) {
+        counter.elapsed(&stats->propagation_seconds, start);
+        counter.add_queue_counts(stats);
+    }
+
+    nhDestroySpanWalker(trailing);
+    nhDestroySpanWalker(leading);
+    nhDestroySpanWalker(neighbors);
+}
+
+template <typename _T>
+void compute_reconstruction_masked(_T *J, _T *I, bool *valid, int num_elements,
+        NeighborhoodWalker_T walker,
+        NeighborhoodWalker_T trailingWalker,
+        NeighborhoodWalker_T leadingWalker,
+        ReconstructionStats *stats = NULL) {
+    if (stats) {
+        compute_reconstruction_masked_impl<_T, StatsCounter<true> >(J, I, valid, num_elements,
+                walker, trailingWalker, leadingWalker, stats);
+    } else {
+        compute_reconstruction_masked_impl<_T, StatsCounter<false> >(J, I, valid, num_elements,
+                walker, trailingWalker, leadingWalker, NULL);
+    }
 }
 
 #endif //TOPHAT_RECODE_RECONSTRUCT_H
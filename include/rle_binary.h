@@ -0,0 +1,132 @@
+#ifndef TOPHAT_RECODE_RLE_BINARY_H
+#define TOPHAT_RECODE_RLE_BINARY_H
+
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+#include "image_view.h"
+
+/**
+ * Run-length encoded binary images.
+ *
+ * Every row is a list of runs of set pixels, sorted, not touching each
+ * other, inside [0, cols). For sparse masks (a threshold of the top-hat
+ * sets a few percent of the pixels) the memory and the cost of the
+ * operations below grow with the number of runs rather than the area;
+ * only the conversion from bool images has to look at every pixel.
+ *
+ * Erosion and dilation follow erode_logical and dilate_logical: pixels
+ * outside the image are ignored by erosion and are 0 for dilation, and
+ * the lines and rectangles are centered like NH_CENTER_MIDDLE_ROUNDDOWN.
+ */
+
+/**
+ * the columns [start, end) of a row
+ */
+typedef struct RleRun_tag {
+    int start;
+    int end;
+} RleRun;
+
+class RleImage {
+public:
+    /**
+     * an image with no row yet; rows are added in order with add_run and
+     * end_row
+     */
+    RleImage(int rows, int cols) : rows_(rows), cols_(cols), row_start_(1, 0) {
+        if (rows < 0 || cols < 0) {
+            throw std::invalid_argument("image size must not be negative");
+        }
+        row_start_.reserve((size_t) rows + 1);
+    }
+
+    /**
+     * add the run [start, end) to the row being built; runs come in order
+     * and must not touch the previous one
+     */
+    void add_run(int start, int end) {
+        size_t first = row_start_.back();
+        if (start < 0 || end > cols_ || start >= end ||
+            (runs_.size() > first && start <= runs_.back().end)) {
+            throw std::invalid_argument("runs must be sorted, separate and inside the row");
+        }
+        RleRun run = {start, end};
+        runs_.push_back(run);
+    }
+
+    /**
+     * close the row being built
+     */
+    void end_row() {
+        if (built_rows() == rows_) {
+            throw std::logic_error("all rows are already built");
+        }
+        row_start_.push_back(runs_.size());
+    }
+
+    int rows() const { return rows_; }
+    int cols() const { return cols_; }
+    int built_rows() const { return (int) row_start_.size() - 1; }
+    size_t num_runs() const { return runs_.size(); }
+
+    const RleRun *row_begin(int y) const { return runs_.data() + row_start_[y]; }
+    const RleRun *row_end(int y) const { return runs_.data() + row_start_[y + 1]; }
+
+private:
+    int rows_;
+    int cols_;
+    std::vector<RleRun> runs_;
+    std::vector<size_t> row_start_;
+};
+
+/**
+ * rle_from_bool
+ * Runs of a bool image.
+ */
+RleImage rle_from_bool(ImageView<const bool> image);
+
+/**
+ * rle_to_bool
+ * Write an RLE image into a bool image of the same size.
+ */
+void rle_to_bool(const RleImage &image, ImageView<bool> out);
+
+/**
+ * rle_from_packed
+ * Runs of a packed image (see packed_binary.h); empty words are skipped
+ * whole.
+ */
+RleImage rle_from_packed(const unsigned int *packed, int rows, int cols);
+
+/**
+ * rle_to_packed
+ * Write an RLE image as rows * packed_row_words(cols) packed words.
+ */
+void rle_to_packed(const RleImage &image, unsigned int *packed);
+
+/**
+ * rle_erode_hline, rle_dilate_hline
+ * Erosion and dilation by a horizontal line of length pixels: one pass
+ * over the runs.
+ *
+ * rle_erode_vline, rle_dilate_vline
+ * Erosion and dilation by a vertical line of length pixels: the
+ * intersection (union) of the rows under the line, taken from a table of
+ * the intersections (unions) of 1, 2, 4, ... consecutive rows, so the cost
+ * is the number of runs times log2(length).
+ *
+ * rle_erode_rect, rle_dilate_rect
+ * Erosion and dilation by a mask_y-by-mask_x rectangle of ones, as a
+ * horizontal then a vertical line.
+ *
+ * The lengths must be at least 1.
+ */
+RleImage rle_erode_hline(const RleImage &image, int length);
+RleImage rle_dilate_hline(const RleImage &image, int length);
+RleImage rle_erode_vline(const RleImage &image, int length);
+RleImage rle_dilate_vline(const RleImage &image, int length);
+RleImage rle_erode_rect(const RleImage &image, int mask_y, int mask_x);
+RleImage rle_dilate_rect(const RleImage &image, int mask_y, int mask_x);
+
+#endif //TOPHAT_RECODE_RLE_BINARY_H
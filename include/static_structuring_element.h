@@ -0,0 +1,329 @@
+#ifndef TOPHAT_RECODE_STATIC_STRUCTURING_ELEMENT_H
+#define TOPHAT_RECODE_STATIC_STRUCTURING_ELEMENT_H
+
+#include <cstddef>
+#include "neighborhood.h"
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Structuring elements known at compile time.
+//
+// StaticStructuringElement<H, W, Bits> is an H-by-W mask whose members are
+// the set bits of Bits, row-major (bit r * W + c is row r, column c), with
+// the origin at the middle rounded down, like create_neighborhood_general_
+// template with NH_CENTER_MIDDLE_ROUNDDOWN. Members are visited in the same
+// row-major order as the runtime walker, so kernels instantiated on them
+// give bit-identical results.
+//
+// se_for_each<SE, BEGIN, END> calls f(dy, dx) for every member with bit
+// index in [BEGIN, END); the recursion is resolved at compile time, so with
+// the offsets known the compiler unrolls the neighborhood completely and is
+// free to vectorize along the row.
+//
+// The kernels below run the unrolled loop on pixels whose whole footprint
+// is inside the image and fall back to a span walker on the border.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * the unrolled member loops must be inlined all the way down, or the
+ * compiler cannot fold the offsets and vectorize
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define SE_FORCE_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define SE_FORCE_INLINE __forceinline
+#else
+#define SE_FORCE_INLINE inline
+#endif
+
+constexpr int se_bit_count(unsigned long long bits) {
+    return bits == 0 ? 0 : (int) (bits & 1ULL) + se_bit_count(bits >> 1);
+}
+
+constexpr int se_first_bit(unsigned long long bits, int k = 0) {
+    return k >= 64 || ((bits >> k) & 1ULL) ? k : se_first_bit(bits, k + 1);
+}
+
+/**
+ * number of set bits with index in [begin, end), bit skip excluded
+ */
+constexpr int se_range_count(unsigned long long bits, int begin, int end, int skip) {
+    return begin >= end ? 0 :
+           (begin != skip && ((bits >> begin) & 1ULL) ? 1 : 0) + se_range_count(bits, begin + 1, end, skip);
+}
+
+constexpr unsigned long long se_rect_bits(int height, int width) {
+    return height * width >= 64 ? ~0ULL : (1ULL << (height * width)) - 1;
+}
+
+/**
+ * center row plus center column
+ */
+constexpr unsigned long long se_cross_bits(int height, int width, int k = 0) {
+    return k >= height * width ? 0ULL :
+           ((k / width == (height - 1) / 2 || k % width == (width - 1) / 2) ? (1ULL << k) : 0ULL) |
+           se_cross_bits(height, width, k + 1);
+}
+
+template <int H, int W, unsigned long long Bits>
+struct StaticStructuringElement {
+    static_assert(H > 0 && W > 0 && H * W <= 64, "static structuring elements hold at most 64 cells");
+    static_assert(Bits != 0, "static structuring element cannot be empty");
+
+    static const int height = H;
+    static const int width = W;
+    static const int area = H * W;
+    static const unsigned long long bits = Bits;
+    static const int center_y = (H - 1) / 2;
+    static const int center_x = (W - 1) / 2;
+    static const int center_index = center_y * W + center_x;
+    static const int size = se_bit_count(Bits);
+    static const int first = se_first_bit(Bits);
+
+    /**
+     * members before / after the origin in raster order
+     */
+    static const int trailing_size = se_bit_count(Bits & ((1ULL << center_index) - 1));
+    static const int leading_size = se_bit_count(Bits >> center_index >> 1);
+
+    static constexpr bool member(int k) { return ((Bits >> k) & 1ULL) != 0; }
+    static constexpr int dy(int k) { return k / W - center_y; }
+    static constexpr int dx(int k) { return k % W - center_x; }
+};
+
+template <int H, int W>
+using RectStructuringElement = StaticStructuringElement<H, W, se_rect_bits(H, W)>;
+
+template <int H, int W>
+using CrossStructuringElement = StaticStructuringElement<H, W, se_cross_bits(H, W)>;
+
+typedef RectStructuringElement<3, 3> SeRect3x3;
+typedef RectStructuringElement<5, 5> SeRect5x5;
+typedef RectStructuringElement<7, 7> SeRect7x7;
+typedef CrossStructuringElement<3, 3> SeCross3x3;
+typedef CrossStructuringElement<5, 5> SeCross5x5;
+typedef CrossStructuringElement<7, 7> SeCross7x7;
+
+template <typename SE, int K, int END>
+struct SeForEach {
+    template <typename F>
+    static SE_FORCE_INLINE void apply(F &f) {
+        if (SE::member(K)) {
+            f(SE::dy(K), SE::dx(K));
+        }
+        SeForEach<SE, K + 1, END>::apply(f);
+    }
+};
+
+template <typename SE, int END>
+struct SeForEach<SE, END, END> {
+    template <typename F>
+    static SE_FORCE_INLINE void apply(F &) {}
+};
+
+template <typename SE, int BEGIN, int END, typename F>
+SE_FORCE_INLINE void se_for_each(F &f) {
+    SeForEach<SE, (BEGIN < END ? BEGIN : END), END>::apply(f);
+}
+
+/**
+ * visit the pixels of a rows x cols image in raster order (antiraster order
+ * if reverse). Pixels whose SE footprint leaves the image go one by one to
+ * border(p); each row's run of interior pixels goes to interior(begin, end)
+ * as the half-open range of linear indices [begin, end), which the callback
+ * walks in the scan direction.
+ */
+template <typename SE, typename Interior, typename Border>
+inline void se_raster_scan(int rows, int cols, bool reverse, Interior &interior, Border &border) {
+    int y0 = SE::center_y;
+    int y1 = rows - (SE::height - 1 - SE::center_y);
+    int x0 = SE::center_x;
+    int x1 = cols - (SE::width - 1 - SE::center_x);
+    if (x1 < x0) x1 = x0;
+
+    for (int yy = 0; yy < rows; ++yy) {
+        int y = reverse ? rows - 1 - yy : yy;
+        int row = y * cols;
+        if (y < y0 || y >= y1 || x0 == x1) {
+            if (reverse) {
+                for (int x = cols - 1; x >= 0; --x) border(row + x);
+            } else {
+                for (int x = 0; x < cols; ++x) border(row + x);
+            }
+            continue;
+        }
+        if (reverse) {
+            for (int x = cols - 1; x >= x1; --x) border(row + x);
+            interior(row + x0, row + x1);
+            for (int x = x0 - 1; x >= 0; --x) border(row + x);
+        } else {
+            for (int x = 0; x < x0; ++x) border(row + x);
+            interior(row + x0, row + x1);
+            for (int x = x1; x < cols; ++x) border(row + x);
+        }
+    }
+}
+
+/**
+ * true if the footprint of SE around pixel (y, x) is inside the image
+ */
+template <typename SE>
+inline bool se_is_interior(int y, int x, int rows, int cols) {
+    return y >= SE::center_y && y < rows - (SE::height - 1 - SE::center_y) &&
+           x >= SE::center_x && x < cols - (SE::width - 1 - SE::center_x);
+}
+
+/**
+ * true if the used neighbors of walker are the members of SE with bit index
+ * in [begin, end), center excluded if skip_center, in the same order
+ */
+template <typename SE>
+bool se_matches_walker(NeighborhoodWalker_T walker, int begin, int end, bool skip_center) {
+    int k = begin;
+    for (int n = 0; n < walker->num_neighbors; ++n) {
+        if (!walker->use[n]) continue;
+        while (k < end && (!SE::member(k) || (skip_center && k == SE::center_index))) ++k;
+        if (k == end ||
+            walker->array_coords[n * NUM_DIMS] != SE::dx(k) ||
+            walker->array_coords[n * NUM_DIMS + 1] != SE::dy(k)) {
+            return false;
+        }
+        ++k;
+    }
+    while (k < end && (!SE::member(k) || (skip_center && k == SE::center_index))) ++k;
+    return k == end;
+}
+
+/**
+ * erosion of the interior pixels [0, n) of one row; in points at the first
+ * of them. Out must not overlap In, which lets the compiler vectorize along
+ * the row without run-time alias checks.
+ */
+template <typename SE, typename _t>
+void se_erode_interior_run(const _t *__restrict in, _t *__restrict out, int n, ptrdiff_t stride)
+{
+    for (int x = 0; x < n; ++x) {
+        const _t *center = in + x;
+        _t val = center[SE::dy(SE::first) * stride + SE::dx(SE::first)];
+        auto fold = [&](int dy, int dx) {
+            _t new_val = center[dy * stride + dx];
+            val = new_val < val ? new_val : val;
+        };
+        se_for_each<SE, SE::first + 1, SE::area>(fold);
+        out[x] = val;
+    }
+}
+
+/**
+ * flat erosion with a compile-time structuring element; walker must visit
+ * the members of SE and is used for the border pixels. In and Out must not
+ * overlap.
+ */
+template <typename SE, typename _t, typename Counter>
+void erodeGrayFlatStatic(_t *In, _t *Out, int rows, int cols,
+                         NeighborhoodWalker_T walker, Counter &counter)
+{
+    NeighborhoodSpanWalker_T span_walker = nhMakeSpanWalker(walker);
+
+    auto interior = [&](int begin, int end) {
+        se_erode_interior_run<SE>(In + begin, Out + begin, end - begin, (ptrdiff_t) cols);
+        counter.walks(end - begin);
+        counter.visits((long long) SE::size * (end - begin));
+    };
+    auto border = [&](int p) {
+        int count;
+        nhSpanWalkerSetLocation(span_walker, p);
+        const ptrdiff_t *span = nhSpanWalkerSpan(span_walker, &count);
+        counter.walk();
+        counter.visits(count);
+        _t val = count ? In[p + span[0]] : In[p];
+        for (int k = 1; k < count; ++k) {
+            _t new_val = In[p + span[k]];
+            if (new_val < val) val = new_val;
+        }
+        Out[p] = val;
+    };
+    se_raster_scan<SE>(rows, cols, false, interior, border);
+
+    nhDestroySpanWalker(span_walker);
+}
+
+template <typename _t, typename Counter>
+struct StaticErodeKernel {
+    const char *name;
+    bool (*matches)(NeighborhoodWalker_T walker);
+    bool (*matches_mask)(const int *mask, int mask_y, int mask_x);
+    void (*erode)(_t *In, _t *Out, int rows, int cols,
+                  NeighborhoodWalker_T walker, Counter &counter);
+
+    /**
+     * erosion of n pixels of one row whose footprint is addressable (the
+     * interior of an image, or any row of a padded image)
+     */
+    void (*erode_run)(const _t *in, _t *out, int n, ptrdiff_t stride);
+};
+
+template <typename SE>
+bool se_matches_full_walker(NeighborhoodWalker_T walker) {
+    return se_matches_walker<SE>(walker, 0, SE::area, false);
+}
+
+template <typename SE>
+bool se_matches_mask(const int *mask, int mask_y, int mask_x) {
+    if (mask_y != SE::height || mask_x != SE::width) return false;
+    for (int k = 0; k < SE::area; ++k) {
+        if ((mask[k] != 0) != SE::member(k)) return false;
+    }
+    return true;
+}
+
+#define STATIC_ERODE_ENTRY(name, SE) \
+    {name, &se_matches_full_walker<SE>, &se_matches_mask<SE>, &erodeGrayFlatStatic<SE, _t, Counter>, \
+     &se_erode_interior_run<SE, _t>}
+
+/**
+ * dispatch table of the instantiated erosion kernels, terminated by an
+ * entry with a NULL name
+ */
+template <typename _t, typename Counter>
+const StaticErodeKernel<_t, Counter> *static_erode_kernels() {
+    static const StaticErodeKernel<_t, Counter> kernels[] = {
+        STATIC_ERODE_ENTRY("rect3x3", SeRect3x3),
+        STATIC_ERODE_ENTRY("rect5x5", SeRect5x5),
+        STATIC_ERODE_ENTRY("rect7x7", SeRect7x7),
+        STATIC_ERODE_ENTRY("cross3x3", SeCross3x3),
+        STATIC_ERODE_ENTRY("cross5x5", SeCross5x5),
+        STATIC_ERODE_ENTRY("cross7x7", SeCross7x7),
+        {NULL, NULL, NULL, NULL, NULL}
+    };
+    return kernels;
+}
+
+#undef STATIC_ERODE_ENTRY
+
+/**
+ * the instantiated erosion kernel for an int mask (origin in the middle,
+ * rounded down), or NULL if none matches
+ */
+template <typename _t, typename Counter>
+const StaticErodeKernel<_t, Counter> *find_static_erode_kernel(const int *mask, int mask_y, int mask_x) {
+    for (const StaticErodeKernel<_t, Counter> *k = static_erode_kernels<_t, Counter>(); k->name; ++k) {
+        if (k->matches_mask(mask, mask_y, mask_x)) return k;
+    }
+    return NULL;
+}
+
+/**
+ * the instantiated erosion kernel visiting exactly the neighbors of walker,
+ * or NULL if none matches
+ */
+template <typename _t, typename Counter>
+const StaticErodeKernel<_t, Counter> *find_static_erode_kernel(NeighborhoodWalker_T walker) {
+    for (const StaticErodeKernel<_t, Counter> *k = static_erode_kernels<_t, Counter>(); k->name; ++k) {
+        if (k->matches(walker)) return k;
+    }
+    return NULL;
+}
+
+#endif //TOPHAT_RECODE_STATIC_STRUCTURING_ELEMENT_H
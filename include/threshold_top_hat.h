@@ -0,0 +1,82 @@
+#ifndef TOPHAT_RECODE_THRESHOLD_TOP_HAT_H
+#define TOPHAT_RECODE_THRESHOLD_TOP_HAT_H
+
+#include "image_view.h"
+#include "top_hat_stats.h"
+
+/**
+ * Threshold decomposition of the top-hat for quantized images.
+ *
+ * A flat erosion and a reconstruction by dilation both commute with
+ * thresholding: the level set {R >= v} of the reconstruction R of the
+ * erosion of f is the binary reconstruction of the eroded level set
+ * {f >= v} under {f >= v}. For an image with few distinct values
+ * v_0 < ... < v_{L-1}, R(p) is therefore v_k where k is the number of
+ * levels v_1..v_{L-1} whose binary reconstruction contains p, and the
+ * binary steps run on level sets packed 32 pixels to a word.
+ *
+ * The result is bit-for-bit the one of the grayscale pipeline: R only takes
+ * values of the image, and image - R is computed on the same floats.
+ */
+
+/**
+ * largest number of levels top_hat_extract tries the threshold
+ * decomposition with; 0 disables it
+ */
+#ifndef TOP_HAT_THRESHOLD_MAX_LEVELS
+#define TOP_HAT_THRESHOLD_MAX_LEVELS 32
+#endif
+
+/**
+ * threshold_levels
+ * Distinct values of an image, in increasing order.
+ *
+ * Inputs
+ * ======
+ * image      - image to scan
+ * max_levels - give up once more than max_levels values were seen
+ *
+ * Outputs
+ * =======
+ * levels     - room for max_levels values
+ *
+ * Return
+ * ======
+ * the number of levels, or -1 if there are more than max_levels or the
+ * image holds NaN or -0 (which the decomposition cannot order)
+ */
+int threshold_levels(ImageView<const float> image, int max_levels, float *levels);
+
+/**
+ * whether the threshold decomposition is expected to beat the grayscale
+ * pipeline for num_levels levels and an erosion mask of num_neighbors
+ * pixels (8-connected reconstruction)
+ */
+bool threshold_top_hat_preferred(int num_levels, int num_neighbors);
+
+/**
+ * top_hat_extract_levels
+ * Top-hat of an image whose values are all in levels, by threshold
+ * decomposition. Same result as top_hat_extract with the same mask.
+ *
+ * Inputs
+ * ======
+ * image      - image to process
+ * levels     - the distinct values of image in increasing order, as given
+ *              by threshold_levels (at most 256)
+ * num_levels - number of levels
+ * mask       - mask for the erode neighbor, NULL for 3x3 ones
+ * mask_y     - rows of the mask
+ * mask_x     - cols of the mask
+ * stats      - if not NULL, erosion_seconds (packing and packed erosion),
+ *              reconstruction.propagation_seconds, subtraction_seconds and
+ *              levels are added to
+ *
+ * Output
+ * ======
+ * out        - top-hat, same size as image; may be image itself
+ */
+void top_hat_extract_levels(ImageView<const float> image, const float *levels, int num_levels,
+        int *mask, int mask_y, int mask_x, ImageView<float> out, TopHatStats *stats = NULL);
+
+#endif //TOPHAT_RECODE_THRESHOLD_TOP_HAT_H
@@ -8,6 +8,16 @@
 
 #include "reconstruct.h"
 #include "morph.h"
+#include "trace.h"
+#include "image_view.h"
+#include "threshold_top_hat.h"
+#include "erode_paraboloid.h"
+#include "erode_linear.h"
+#include "dilate_erode_gray_nonflat.h"
+#include <algorithm>
+#include <limits>
+#include <cstring>
+#include <vector>
 /**
  * duplicate the float pointer, should clear later
  * @param data
@@ -21,16 +31,982 @@ float* duplicate(float *data, int y_input, int x_input) {
 }
 
 
-float* im_reconstruct(float *imer, float *img, int y_input, int x_input) {
+/**
+ * make the three walkers of an 8-connected reconstruction
+ */
+void make_reconstruction_walkers(int y_input, int x_input, NeighborhoodWalker_T *walker,
+        NeighborhoodWalker_T *trailing_walker, NeighborhoodWalker_T *leading_walker) {
+    int input_size[2] = {x_input, y_input};
+    Neighborhood_T nhood = nhMakeDefaultConnectivityNeighborhood();
+
+    *trailing_walker = nhMakeNeighborhoodWalker(nhood, input_size,
+                                                NH_SKIP_CENTER | NH_SKIP_LEADING);
+    *leading_walker = nhMakeNeighborhoodWalker(nhood, input_size,
+                                               NH_SKIP_CENTER | NH_SKIP_TRAILING);
+    *walker = nhMakeNeighborhoodWalker(nhood, input_size,
+                                       NH_SKIP_CENTER);
+    nhDestroyNeighborhood(nhood);
+}
+
+/**
+ * make the walker of the top-hat erosion; the default 3x3 neighborhood if
+ * mask is NULL
+ */
+NeighborhoodWalker_T make_erosion_walker(int y_input, int x_input, int *mask, int mask_y, int mask_x) {
     Neighborhood_T nhood;
+    if (mask) {
+        int mask_size[2] = {mask_x, mask_y};
+        nhood = create_neighborhood_general_template(mask, mask_size, NH_CENTER_MIDDLE_ROUNDDOWN);
+    } else {
+        nhood = nhMakeDefaultConnectivityNeighborhood();
+    }
+    int input_size[2] = {x_input, y_input};
+    NeighborhoodWalker_T walker = nhMakeNeighborhoodWalker(nhood, input_size, NH_USE_ALL);
+    nhDestroyNeighborhood(nhood);
+    return walker;
+}
+
+/**
+ * reconstruction of marker under mask, both views of the same size; the
+ * result goes to out, which may be either of them. pyramid starts it from
+ * the coarse-to-fine bound of compute_reconstruction_pyramid (same result)
+ */
+void im_reconstruct_view(ImageView<const float> marker, ImageView<const float> mask,
+        ImageView<float> out, ReconstructionStats *stats = NULL, bool pyramid = false) {
+    TRACE_SCOPE("im_reconstruct", "top_hat");
+    if (marker.rows != mask.rows || marker.cols != mask.cols ||
+        out.rows != mask.rows || out.cols != mask.cols) {
+        throw std::invalid_argument("marker, mask and output must have the same size");
+    }
     NeighborhoodWalker_T trailing_walker;
     NeighborhoodWalker_T leading_walker;
     NeighborhoodWalker_T walker;
+    make_reconstruction_walkers(mask.rows, mask.cols, &walker, &trailing_walker, &leading_walker);
 
-    // the reconstruction algorithm works in-place on a copy of the
+    // the reconstruction algorithm works in-place on a padded copy of the
     // input marker image. at the end, this copy will hold the result
+    float low = PaddedImage<float>::min_sentinel();
+    PaddedImage<float> J(mask.rows, mask.cols, 1, low);
+    PaddedImage<float> I(mask.rows, mask.cols, 1, low);
+    J.load(marker.data, marker.stride);
+    I.load(mask.data, mask.stride);
+
+    if (pyramid) {
+        compute_reconstruction_pyramid(J, I, walker, trailing_walker, leading_walker, stats);
+    } else {
+        compute_reconstruction_padded(J, I, walker, trailing_walker, leading_walker, stats);
+    }
+
+    nhDestroyNeighborhoodWalker(trailing_walker);
+    nhDestroyNeighborhoodWalker(leading_walker);
+    nhDestroyNeighborhoodWalker(walker);
+
+    J.store(out.data, out.stride);
+}
+
+float* im_reconstruct(float *imer, float *img, int y_input, int x_input,
+        ReconstructionStats *stats = NULL, bool pyramid = false) {
+    float *result = (float *)malloc(sizeof(float) * y_input * x_input);
+    im_reconstruct_view(image_view<const float>(imer, y_input, x_input),
+                        image_view<const float>(img, y_input, x_input),
+                        image_view(result, y_input, x_input), stats, pyramid);
+    return result;
+}
+
+/**
+ * erosion of a view; out (same size) may be the input itself
+ */
+void im_erode_view(ImageView<const float> img, ImageView<float> out, int *mask, int mask_y, int mask_x,
+        WalkStats *stats = NULL) {
+    TRACE_SCOPE("im_erode", "top_hat");
+    if (out.rows != img.rows || out.cols != img.cols) {
+        throw std::invalid_argument("input and output must have the same size");
+    }
+    NeighborhoodWalker_T walker = make_erosion_walker(img.rows, img.cols, mask, mask_y, mask_x);
+
+    PaddedImage<float> in(img.rows, img.cols, padded_walker_reach(walker),
+                          PaddedImage<float>::max_sentinel());
+    PaddedImage<float> eroded(img.rows, img.cols, 0, PaddedImage<float>::max_sentinel());
+    in.load(img.data, img.stride);
+
+    erodeGrayFlatPadded(in, eroded, walker, stats);
+
+    nhDestroyNeighborhoodWalker(walker);
+
+    eroded.store(out.data, out.stride);
+}
+
+float* im_erode(float *img, int y_input, int x_input, int *mask, int mask_y, int mask_x,
+        WalkStats *stats = NULL) {
+    float *out_img = (float *)malloc(sizeof(float) * y_input * x_input);
+    im_erode_view(image_view<const float>(img, y_input, x_input),
+                  image_view(out_img, y_input, x_input), mask, mask_y, mask_x, stats);
+    return out_img;
+}
+
+/**
+ * fill the pits of image (a padded image, border >= 1) in place: the
+ * grayscale reconstruction by erosion of the image from its edge pixels,
+ * 8-connected. Every pixel rises to the lowest level at which a path leads
+ * from it to the edge of the image without going higher; pits, which no
+ * such path leaves, fill up to their rim and the rest is unchanged.
+ *
+ * By duality the reconstruction by erosion of g above f is -R(-g) under
+ * -f, so image is negated in place and reconstructed by dilation with
+ * compute_reconstruction_padded into work (same size and border), whose
+ * marker is the edge of the image and the minimum sentinel inside. Both
+ * borders hold the minimum sentinel afterwards.
+ */
+void fill_holes_padded(PaddedImage<float> &image, PaddedImage<float> &work, ReconstructionStats *stats = NULL) {
+    TRACE_SCOPE("fill_holes", "top_hat");
+    int rows = image.rows(), cols = image.cols();
+    if (work.rows() != rows || work.cols() != cols || work.border() != image.border()) {
+        throw std::invalid_argument("image and work must have the same size and border");
+    }
+    if (rows == 0 || cols == 0) return;
+    const float low = PaddedImage<float>::min_sentinel();
+    for (int y = 0; y < rows; ++y) {
+        float *image_row = image.row(y);
+        float *work_row = work.row(y);
+        for (int x = 0; x < cols; ++x) image_row[x] = -image_row[x];
+        if (y == 0 || y == rows - 1) {
+            memcpy(work_row, image_row, sizeof(float) * cols);
+        } else {
+            for (int x = 1; x < cols - 1; ++x) work_row[x] = low;
+            work_row[0] = image_row[0];
+            work_row[cols - 1] = image_row[cols - 1];
+        }
+    }
+    image.fill_border(low);
+    work.fill_border(low);
+
+    NeighborhoodWalker_T trailing_walker;
+    NeighborhoodWalker_T leading_walker;
+    NeighborhoodWalker_T walker;
+    make_reconstruction_walkers(rows, cols, &walker, &trailing_walker, &leading_walker);
+    compute_reconstruction_padded(work, image, walker, trailing_walker, leading_walker, stats);
+    nhDestroyNeighborhoodWalker(trailing_walker);
+    nhDestroyNeighborhoodWalker(leading_walker);
+    nhDestroyNeighborhoodWalker(walker);
+
+    for (int y = 0; y < rows; ++y) {
+        float *image_row = image.row(y);
+        const float *work_row = work.row(y);
+        for (int x = 0; x < cols; ++x) image_row[x] = -work_row[x];
+    }
+}
+
+/**
+ * the image with its pits filled (see fill_holes_padded) into out (same
+ * size; may be the input itself)
+ */
+void fill_holes_view(ImageView<const float> image, ImageView<float> out, ReconstructionStats *stats = NULL) {
+    if (out.rows != image.rows || out.cols != image.cols) {
+        throw std::invalid_argument("input and output must have the same size");
+    }
+    PaddedImage<float> padded(image.rows, image.cols, 1, PaddedImage<float>::min_sentinel());
+    PaddedImage<float> work(image.rows, image.cols, 1, PaddedImage<float>::min_sentinel());
+    padded.load(image.data, image.stride);
+    fill_holes_padded(padded, work, stats);
+    padded.store(out.data, out.stride);
+}
+
+float* fill_holes(float *origin_img, int y_input, int x_input, ReconstructionStats *stats = NULL) {
+    float *result = (float *)malloc(sizeof(float) * y_input * x_input);
+    fill_holes_view(image_view<const float>(origin_img, y_input, x_input),
+                    image_view(result, y_input, x_input), stats);
+    return result;
+}
+
+/**
+ * top-hat of a region of interest of a larger image, without copying the
+ * region out.
+ *
+ * The computation runs on the region grown by halo pixels on every side
+ * (clipped to the image), so pixels near the region's edges see their real
+ * neighbors instead of the image border; only the region is written. With
+ * halo 0 the region is processed as an image of its own. Tiling a mosaic
+ * with a halo of a few mask sizes gives results close to processing it
+ * whole; the reconstruction is global, so only a halo covering the whole
+ * image makes them identical.
+ *
+ * @param image the full image
+ * @param roi_y upper-left row of the region
+ * @param roi_x upper-left col of the region
+ * @param roi_rows rows of the region
+ * @param roi_cols cols of the region
+ * @param halo pixels of context around the region
+ * @param out roi_rows x roi_cols output, e.g. a window of a larger raster;
+ *            may overlap image
+ * @param mask mask for the erode neighbor
+ * @param mask_y rows of the mask
+ * @param mask_x cols of the mask
+ * @param stats if not NULL, filled with per-stage times and counters
+ * @param fill_holes fill the pits of the region and its halo first (see
+ *                   fill_holes_padded), in the padded copy the pipeline
+ *                   makes anyway; the top-hat is then the one of the
+ *                   filled image
+ */
+void top_hat_extract_roi(ImageView<const float> image, int roi_y, int roi_x, int roi_rows, int roi_cols,
+        int halo, ImageView<float> out, int *mask, int mask_y, int mask_x, TopHatStats *stats = NULL,
+        bool fill_holes = false) {
+    TRACE_SCOPE("top_hat_extract", "top_hat");
+    if (out.rows != roi_rows || out.cols != roi_cols) {
+        throw std::invalid_argument("output must have the size of the region");
+    }
+    if (halo < 0) {
+        throw std::invalid_argument("halo cannot be negative");
+    }
+    image.window(roi_y, roi_x, roi_rows, roi_cols);
+
+    double start = 0, stage_start = 0;
+    if (stats) {
+        memset(stats, 0, sizeof(*stats));
+        start = stage_start = stats_now();
+    }
+
+    int y0 = roi_y - halo < 0 ? 0 : roi_y - halo;
+    int x0 = roi_x - halo < 0 ? 0 : roi_x - halo;
+    int y1 = roi_y + roi_rows + halo > image.rows ? image.rows : roi_y + roi_rows + halo;
+    int x1 = roi_x + roi_cols + halo > image.cols ? image.cols : roi_x + roi_cols + halo;
+    ImageView<const float> work = image.window(y0, x0, y1 - y0, x1 - x0);
+
+    NeighborhoodWalker_T erode_walker = make_erosion_walker(work.rows, work.cols, mask, mask_y, mask_x);
+
+    // quantized images with few levels go through the threshold
+    // decomposition on packed level sets; same result. It needs none of
+    // the padded copies below, so it is tried before they are made, unless
+    // the holes are filled first
+    auto run_levels = [&]() -> bool {
+        float levels[TOP_HAT_THRESHOLD_MAX_LEVELS + 1];
+        int num_levels = threshold_levels(work, TOP_HAT_THRESHOLD_MAX_LEVELS, levels);
+        if (num_levels <= 0 || !threshold_top_hat_preferred(num_levels, erode_walker->num_neighbors)) {
+            return false;
+        }
+        nhDestroyNeighborhoodWalker(erode_walker);
+        PaddedImage<float> hat(work.rows, work.cols, 0, 0.0f);
+        ImageView<float> hat_view = {hat.origin(), work.rows, work.cols, hat.stride()};
+        top_hat_extract_levels(work, levels, num_levels, mask, mask_y, mask_x, hat_view, stats);
+        for (int i = 0; i < roi_rows; ++i) {
+            memcpy(out.row(i), hat.row(roi_y - y0 + i) + (roi_x - x0), sizeof(float) * roi_cols);
+        }
+        if (stats) stats->total_seconds = stats_now() - start;
+        return true;
+    };
+    if (!fill_holes && run_levels()) return;
+
+    // one padded copy of the image serves every step: with a +inf border
+    // it is the erosion input, with a -inf border the reconstruction mask.
+    // the erosion writes straight into the padded marker, which the hole
+    // filling uses before it
+    int border = padded_walker_reach(erode_walker);
+    if (border < 1) border = 1;
+    PaddedImage<float> padded(work.rows, work.cols, border, PaddedImage<float>::max_sentinel());
+    PaddedImage<float> marker(work.rows, work.cols, border, PaddedImage<float>::min_sentinel());
+    if (fill_holes) {
+        padded.load(work.data, work.stride);
+        fill_holes_padded(padded, marker);
+        padded.fill_border(PaddedImage<float>::max_sentinel());
+        ImageView<const float> filled = {padded.origin(), work.rows, work.cols, padded.stride()};
+        work = filled;
+        if (stats) {
+            stats->fill_seconds = stats_now() - stage_start;
+            stage_start = stats_now();
+        }
+        if (run_levels()) return;
+    }
+
+    NeighborhoodWalker_T trailing_walker;
+    NeighborhoodWalker_T leading_walker;
+    NeighborhoodWalker_T walker;
+    make_reconstruction_walkers(work.rows, work.cols, &walker, &trailing_walker, &leading_walker);
+    if (!fill_holes) padded.load(work.data, work.stride);
+
+    {
+        TRACE_SCOPE("im_erode", "top_hat");
+        erodeGrayFlatPadded(padded, marker, erode_walker, stats ? &stats->erosion_walk : NULL);
+    }
+    if (stats) stats->erosion_seconds = stats_now() - stage_start;
+
+    {
+        TRACE_SCOPE("im_reconstruct", "top_hat");
+        padded.fill_border(PaddedImage<float>::min_sentinel());
+        compute_reconstruction_padded(marker, padded, walker, trailing_walker, leading_walker,
+                                      stats ? &stats->reconstruction : NULL);
+    }
+
+    nhDestroyNeighborhoodWalker(erode_walker);
+    nhDestroyNeighborhoodWalker(trailing_walker);
+    nhDestroyNeighborhoodWalker(leading_walker);
+    nhDestroyNeighborhoodWalker(walker);
+
+    if (stats) stage_start = stats_now();
+    TRACE_SCOPE("subtract", "top_hat");
+    for (int i = 0; i < roi_rows; ++i) {
+        const float *image_row = padded.row(roi_y - y0 + i) + (roi_x - x0);
+        const float *marker_row = marker.row(roi_y - y0 + i) + (roi_x - x0);
+        float *out_row = out.row(i);
+        for (int j = 0; j < roi_cols; ++j) {
+            out_row[j] = image_row[j] - marker_row[j];
+        }
+    }
+
+    if (stats) {
+        stats->subtraction_seconds = stats_now() - stage_start;
+        stats->total_seconds = stats_now() - start;
+    }
+}
+
+/**
+ * top-hat of a whole view into out (same size; may be the input itself)
+ */
+void top_hat_extract_view(ImageView<const float> image, ImageView<float> out,
+        int *mask, int mask_y, int mask_x, TopHatStats *stats = NULL, bool fill_holes = false) {
+    top_hat_extract_roi(image, 0, 0, image.rows, image.cols, 0, out, mask, mask_y, mask_x, stats, fill_holes);
+}
+
+/**
+ * return the tophat result
+ * @param origin_img
+ * @param y_input rows of the image
+ * @param x_input cols of the image
+ * @param mask mask for the erode neighbor
+ * @param mask_y rows of the mask
+ * @param mask_x cols of the mask
+ * @param stats if not NULL, filled with per-stage times and counters
+ * @param fill_holes fill the pits of the image before the top-hat
+ * @return tophat_result
+ */
+float* top_hat_extract(float *origin_img, int y_input, int x_input,
+        int *mask, int mask_y, int mask_x, TopHatStats *stats = NULL, bool fill_holes = false) {
+    float *reconstruct_result = (float *)malloc(sizeof(float) * y_input * x_input);
+    top_hat_extract_view(image_view<const float>(origin_img, y_input, x_input),
+                         image_view(reconstruct_result, y_input, x_input),
+                         mask, mask_y, mask_x, stats, fill_holes);
+    return reconstruct_result;
+}
+
+/**
+ * the last two steps of a top-hat of image (in padded, border >= 1) with
+ * the given marker (border >= 1, marker <= image): 8-connected
+ * reconstruction of the marker under the image, then image minus it into
+ * out. padded loses its border values
+ */
+void reconstruct_top_hat(PaddedImage<float> &padded, PaddedImage<float> &marker, ImageView<float> out,
+        TopHatStats *stats) {
+    NeighborhoodWalker_T trailing_walker;
+    NeighborhoodWalker_T leading_walker;
+    NeighborhoodWalker_T walker;
+    make_reconstruction_walkers(padded.rows(), padded.cols(), &walker, &trailing_walker, &leading_walker);
+    {
+        TRACE_SCOPE("im_reconstruct", "top_hat");
+        padded.fill_border(PaddedImage<float>::min_sentinel());
+        marker.fill_border(PaddedImage<float>::min_sentinel());
+        compute_reconstruction_padded(marker, padded, walker, trailing_walker, leading_walker,
+                                      stats ? &stats->reconstruction : NULL);
+    }
+    nhDestroyNeighborhoodWalker(trailing_walker);
+    nhDestroyNeighborhoodWalker(leading_walker);
+    nhDestroyNeighborhoodWalker(walker);
+
+    double stage_start = stats ? stats_now() : 0;
+    TRACE_SCOPE("subtract", "top_hat");
+    for (int i = 0; i < out.rows; ++i) {
+        const float *image_row = padded.row(i);
+        const float *marker_row = marker.row(i);
+        float *out_row = out.row(i);
+        for (int j = 0; j < out.cols; ++j) {
+            out_row[j] = image_row[j] - marker_row[j];
+        }
+    }
+    if (stats) stats->subtraction_seconds = stats_now() - stage_start;
+}
+
+/**
+ * top-hat with a paraboloid marker: the image minus the reconstruction of
+ * its erosion by the paraboloid of the given curvature, i.e. the nonflat
+ * erosion with heights -curvature * (dx^2 + dy^2) over the whole image
+ * (see erode_paraboloid.h). The erosion costs the same for any curvature;
+ * a smaller curvature is a wider paraboloid and keeps larger objects.
+ * A point at distance r below the apex is curvature * r^2 lower.
+ * out (same size) may be the input itself.
+ */
+void top_hat_extract_paraboloid_view(ImageView<const float> image, ImageView<float> out,
+        double curvature, TopHatStats *stats = NULL) {
+    TRACE_SCOPE("top_hat_extract", "top_hat");
+    if (out.rows != image.rows || out.cols != image.cols) {
+        throw std::invalid_argument("input and output must have the same size");
+    }
+    if (!(curvature > 0) || curvature == std::numeric_limits<double>::infinity()) {
+        throw std::invalid_argument("the paraboloid curvature must be positive and finite");
+    }
+
+    double start = 0;
+    if (stats) {
+        memset(stats, 0, sizeof(*stats));
+        start = stats_now();
+    }
+    if (image.rows == 0 || image.cols == 0) return;
+
+    PaddedImage<float> padded(image.rows, image.cols, 1, PaddedImage<float>::min_sentinel());
+    PaddedImage<float> marker(image.rows, image.cols, 1, PaddedImage<float>::min_sentinel());
+    padded.load(image.data, image.stride);
+    {
+        TRACE_SCOPE("im_erode", "top_hat");
+        grayParaboloid(padded.origin(), padded.stride(), marker.origin(), marker.stride(),
+                       image.rows, image.cols, curvature, true);
+    }
+    if (stats) stats->erosion_seconds = stats_now() - start;
+
+    reconstruct_top_hat(padded, marker, out, stats);
+    if (stats) stats->total_seconds = stats_now() - start;
+}
+
+/**
+ * return the tophat result with a paraboloid marker of the given curvature;
+ * see top_hat_extract_paraboloid_view
+ */
+float* top_hat_extract_paraboloid(float *origin_img, int y_input, int x_input, double curvature,
+        TopHatStats *stats = NULL) {
+    float *result = (float *)malloc(sizeof(float) * y_input * x_input);
+    top_hat_extract_paraboloid_view(image_view<const float>(origin_img, y_input, x_input),
+                                    image_view(result, y_input, x_input), curvature, stats);
+    return result;
+}
+
+/**
+ * nonflat erosion of image into marker (rows * cols, contiguous), clipped
+ * to the image so it can be reconstructed under it. The heights are given
+ * per element of the mask; every element counts when mask is NULL.
+ *
+ * Heights that add up as h(y, x) = h(y, cx) + h(cy, x) - h(cy, cx) over a
+ * full rectangle (e.g. a paraboloid or a pyramid cut to a rectangle) are
+ * decomposed into a row pass and a column pass, in double; other heights go
+ * through the generic nonflat kernel on the whole neighborhood.
+ */
+void nonflat_marker(ImageView<const float> image, float *marker, int *mask, int mask_y, int mask_x,
+        const double *heights) {
+    int rows = image.rows, cols = image.cols;
+    int n = rows * cols;
+    int cy = (mask_y - 1) / 2, cx = (mask_x - 1) / 2;
+    std::vector<int> ones;
+    if (mask == NULL) {
+        ones.assign((size_t) mask_y * mask_x, 1);
+        mask = ones.data();
+    }
+    int mask_size[2] = {mask_x, mask_y};
+    int input_size[2] = {cols, rows};
+
+    bool full = true, separable = mask_y > 1 && mask_x > 1;
+    std::vector<double> used;
+    for (int y = 0; y < mask_y; ++y) {
+        for (int x = 0; x < mask_x; ++x) {
+            if (!mask[y * mask_x + x]) {
+                full = false;
+                continue;
+            }
+            double h = heights[y * mask_x + x];
+            used.push_back(h);
+            separable = separable &&
+                        h == heights[y * mask_x + cx] + heights[cy * mask_x + x] - heights[cy * mask_x + cx];
+        }
+    }
+
+    if (full && separable) {
+        std::vector<double> work((size_t) n), pass((size_t) n);
+        for (int y = 0; y < rows; ++y) {
+            const float *row = image.row(y);
+            for (int x = 0; x < cols; ++x) work[(size_t) y * cols + x] = row[x];
+        }
+        std::vector<double> row_heights(heights + cy * mask_x, heights + (cy + 1) * mask_x);
+        std::vector<double> col_heights(mask_y);
+        for (int y = 0; y < mask_y; ++y) {
+            col_heights[y] = heights[y * mask_x + cx] - heights[cy * mask_x + cx];
+        }
+        int row_size[2] = {mask_x, 1}, col_size[2] = {1, mask_y};
+        std::vector<int> line_ones(mask_x > mask_y ? mask_x : mask_y, 1);
+        Neighborhood_T nhood = create_neighborhood_general_template(line_ones.data(), row_size,
+                                                                    NH_CENTER_MIDDLE_ROUNDDOWN);
+        NeighborhoodWalker_T walker = nhMakeNeighborhoodWalker(nhood, input_size, NH_USE_ALL);
+        gray_nonflat<double, true>(work.data(), pass.data(), n, walker, row_heights.data());
+        nhDestroyNeighborhoodWalker(walker);
+        nhDestroyNeighborhood(nhood);
+        nhood = create_neighborhood_general_template(line_ones.data(), col_size, NH_CENTER_MIDDLE_ROUNDDOWN);
+        walker = nhMakeNeighborhoodWalker(nhood, input_size, NH_USE_ALL);
+        gray_nonflat<double, true>(pass.data(), work.data(), n, walker, col_heights.data());
+        nhDestroyNeighborhoodWalker(walker);
+        nhDestroyNeighborhood(nhood);
+        for (int i = 0; i < n; ++i) marker[i] = (float) work[i];
+    } else {
+        std::vector<float> in((size_t) n);
+        for (int y = 0; y < rows; ++y) memcpy(in.data() + (size_t) y * cols, image.row(y), sizeof(float) * cols);
+        Neighborhood_T nhood = create_neighborhood_general_template(mask, mask_size, NH_CENTER_MIDDLE_ROUNDDOWN);
+        NeighborhoodWalker_T walker = nhMakeNeighborhoodWalker(nhood, input_size, NH_USE_ALL);
+        gray_nonflat<float, true>(in.data(), marker, n, walker, used.data());
+        nhDestroyNeighborhoodWalker(walker);
+        nhDestroyNeighborhood(nhood);
+    }
+
+    // heights below zero at the center would lift the marker over the image
+    for (int y = 0; y < rows; ++y) {
+        const float *row = image.row(y);
+        float *marker_row = marker + (size_t) y * cols;
+        for (int x = 0; x < cols; ++x) {
+            if (marker_row[x] > row[x]) marker_row[x] = row[x];
+        }
+    }
+}
+
+/**
+ * top-hat with a nonflat marker: the image minus the reconstruction of its
+ * nonflat erosion, min over the neighbors q of image(q) - height(q).
+ * heights has one value per element of the mask_y-by-mask_x mask (row
+ * major, like mask; the elements where mask is 0 are not read); mask NULL
+ * uses the whole rectangle. The marker is clipped to the image. All zero
+ * heights run the flat top_hat_extract_view (with the threshold
+ * decomposition when it pays); see nonflat_marker for the other engines.
+ * out (same size) may be the input itself.
+ */
+void top_hat_extract_nonflat_view(ImageView<const float> image, ImageView<float> out,
+        int *mask, int mask_y, int mask_x, const double *heights, TopHatStats *stats = NULL) {
+    if (out.rows != image.rows || out.cols != image.cols) {
+        throw std::invalid_argument("input and output must have the same size");
+    }
+    if (mask_y < 1 || mask_x < 1 || heights == NULL) {
+        throw std::invalid_argument("the nonflat top-hat needs a mask size and heights");
+    }
+    std::vector<int> ones;
+    if (mask == NULL) {
+        ones.assign((size_t) mask_y * mask_x, 1);
+        mask = ones.data();
+    }
+    bool flat = true;
+    for (int i = 0; i < mask_y * mask_x; ++i) {
+        flat = flat && (!mask[i] || heights[i] == 0);
+    }
+    if (flat) {
+        top_hat_extract_view(image, out, mask, mask_y, mask_x, stats);
+        return;
+    }
+
+    TRACE_SCOPE("top_hat_extract", "top_hat");
+    double start = 0;
+    if (stats) {
+        memset(stats, 0, sizeof(*stats));
+        start = stats_now();
+    }
+    if (image.rows == 0 || image.cols == 0) return;
+
+    PaddedImage<float> padded(image.rows, image.cols, 1, PaddedImage<float>::min_sentinel());
+    PaddedImage<float> marker(image.rows, image.cols, 1, PaddedImage<float>::min_sentinel());
+    padded.load(image.data, image.stride);
+    {
+        TRACE_SCOPE("im_erode", "top_hat");
+        std::vector<float> eroded((size_t) image.rows * image.cols);
+        nonflat_marker(image, eroded.data(), mask, mask_y, mask_x, heights);
+        marker.load(eroded.data(), image.cols);
+    }
+    if (stats) stats->erosion_seconds = stats_now() - start;
+
+    reconstruct_top_hat(padded, marker, out, stats);
+    if (stats) stats->total_seconds = stats_now() - start;
+}
+
+float* top_hat_extract_nonflat(float *origin_img, int y_input, int x_input,
+        int *mask, int mask_y, int mask_x, const double *heights, TopHatStats *stats = NULL) {
+    float *result = (float *)malloc(sizeof(float) * y_input * x_input);
+    top_hat_extract_nonflat_view(image_view<const float>(origin_img, y_input, x_input),
+                                 image_view(result, y_input, x_input), mask, mask_y, mask_x, heights, stats);
+    return result;
+}
+
+/**
+ * heights of a ball (a spheroid when height != radius) of the given radius
+ * in pixels, on a disk mask of 2 * floor(radius) + 1 pixels a side: at
+ * distance d from the center, height * (sqrt(1 - d^2 / radius^2) - 1)
+ */
+void make_ball(double radius, double height, std::vector<int> &mask, std::vector<double> &heights, int *size) {
+    int reach = (int) floor(radius);
+    *size = 2 * reach + 1;
+    mask.assign((size_t) *size * *size, 0);
+    heights.assign((size_t) *size * *size, 0.0);
+    for (int dy = -reach; dy <= reach; ++dy) {
+        for (int dx = -reach; dx <= reach; ++dx) {
+            double d2 = (double) (dx * dx + dy * dy);
+            if (d2 > radius * radius) continue;
+            size_t k = (size_t) (dy + reach) * *size + (dx + reach);
+            mask[k] = 1;
+            heights[k] = height * (sqrt(1 - d2 / (radius * radius)) - 1);
+        }
+    }
+}
+
+/**
+ * rolling-ball top-hat: the nonflat top-hat with the ball of make_ball,
+ * e.g. height == radius for a sphere rolled under the surface. A ball of
+ * height 0 is the flat disk and runs the flat pipeline.
+ *
+ * With paraboloid true the ball is replaced by the paraboloid that fits
+ * its top, curvature height / (2 * radius^2), which costs the same for any
+ * radius (top_hat_extract_paraboloid_view). Inside the disk the paraboloid
+ * is never below the ball: at distance d it is higher by
+ * height * (1 - d^2 / (2 * radius^2) - sqrt(1 - d^2 / radius^2)), which
+ * grows from 0 at the center to height / 2 at the rim. It also goes on
+ * past the rim, so the marker is at most the exact one and the top-hat at
+ * least the exact one.
+ */
+void top_hat_extract_ball_view(ImageView<const float> image, ImageView<float> out, double radius,
+        double height, bool paraboloid = false, TopHatStats *stats = NULL) {
+    if (!(radius > 0) || radius == std::numeric_limits<double>::infinity() ||
+        !(height >= 0) || height == std::numeric_limits<double>::infinity()) {
+        throw std::invalid_argument("the ball needs a positive radius and a height >= 0, both finite");
+    }
+    if (paraboloid && height > 0) {
+        top_hat_extract_paraboloid_view(image, out, height / (2 * radius * radius), stats);
+        return;
+    }
+    std::vector<int> mask;
+    std::vector<double> heights;
+    int size;
+    make_ball(radius, height, mask, heights, &size);
+    top_hat_extract_nonflat_view(image, out, mask.data(), size, size, heights.data(), stats);
+}
+
+float* top_hat_extract_ball(float *origin_img, int y_input, int x_input, double radius, double height,
+        bool paraboloid = false, TopHatStats *stats = NULL) {
+    float *result = (float *)malloc(sizeof(float) * y_input * x_input);
+    top_hat_extract_ball_view(image_view<const float>(origin_img, y_input, x_input),
+                              image_view(result, y_input, x_input), radius, height, paraboloid, stats);
+    return result;
+}
+
+/**
+ * differential morphological profile: the top-hats of image with the
+ * squares of sizes[0] < sizes[1] < ... < sizes[num_scales - 1] pixels a
+ * side (centered like the masks of top_hat_extract), each equal to
+ * top_hat_extract with a ones(size, size) mask.
+ *
+ * The work is shared between the scales:
+ *
+ * - each erosion is the previous one eroded by the difference of the two
+ *   squares (erodeGrayBox), so all of them together cost about as much as
+ *   the largest alone;
+ * - the markers are nested, so the reconstructions run from the largest
+ *   scale down and each starts from the maximum of its marker and the
+ *   reconstruction of the scale above, which is already below the result.
+ *
+ * out is one planar stack of num_scales dense rows * cols planes; plane k
+ * holds the top-hat of sizes[k]. The erosions are kept in it while they
+ * wait for their reconstruction, so no other full stack is allocated.
+ */
+void top_hat_profile_view(ImageView<const float> image, const int *sizes, int num_scales, float *out,
+        TopHatStats *stats = NULL) {
+    TRACE_SCOPE("top_hat_profile", "top_hat");
+    if (num_scales < 1) {
+        throw std::invalid_argument("the profile needs at least one scale");
+    }
+    for (int k = 0; k < num_scales; ++k) {
+        if (sizes[k] < 1 || (k > 0 && sizes[k] <= sizes[k - 1])) {
+            throw std::invalid_argument("profile sizes must be positive and increasing");
+        }
+    }
+    double start = 0, stage_start = 0;
+    if (stats) {
+        memset(stats, 0, sizeof(*stats));
+        start = stage_start = stats_now();
+    }
+    int rows = image.rows, cols = image.cols;
+    size_t plane = (size_t) rows * cols;
+    if (plane == 0) return;
+
+    {
+        TRACE_SCOPE("im_erode", "top_hat");
+        for (int y = 0; y < rows; ++y) memcpy(out + (size_t) y * cols, image.row(y), sizeof(float) * cols);
+        int previous = 1;
+        for (int k = 0; k < num_scales; ++k) {
+            float *source = out + (k == 0 ? 0 : (size_t) (k - 1) * plane);
+            float *eroded = out + (size_t) k * plane;
+            // square of size s: offsets [-(s - 1) / 2, s / 2]
+            int lo = -((sizes[k] - 1) / 2) + (previous - 1) / 2;
+            int hi = sizes[k] / 2 - previous / 2;
+            erodeGrayBox(source, eroded, rows, cols, lo, hi, lo, hi);
+            previous = sizes[k];
+        }
+    }
+    if (stats) stats->erosion_seconds = stats_now() - stage_start;
+
+    NeighborhoodWalker_T trailing_walker;
+    NeighborhoodWalker_T leading_walker;
+    NeighborhoodWalker_T walker;
+    make_reconstruction_walkers(rows, cols, &walker, &trailing_walker, &leading_walker);
+    PaddedImage<float> padded(rows, cols, 1, PaddedImage<float>::min_sentinel());
+    PaddedImage<float> marker(rows, cols, 1, PaddedImage<float>::min_sentinel());
+    padded.load(image.data, image.stride);
+
+    double subtraction_seconds = 0;
+    for (int k = num_scales - 1; k >= 0; --k) {
+        float *level = out + (size_t) k * plane;
+        if (k == num_scales - 1) {
+            marker.load(level, cols);
+        } else {
+            for (int y = 0; y < rows; ++y) {
+                float *marker_row = marker.row(y);
+                const float *eroded_row = level + (size_t) y * cols;
+                for (int x = 0; x < cols; ++x) {
+                    marker_row[x] = eroded_row[x] > marker_row[x] ? eroded_row[x] : marker_row[x];
+                }
+            }
+        }
+        {
+            TRACE_SCOPE("im_reconstruct", "top_hat");
+            compute_reconstruction_padded(marker, padded, walker, trailing_walker, leading_walker,
+                                          stats ? &stats->reconstruction : NULL);
+        }
+        if (stats) stage_start = stats_now();
+        for (int y = 0; y < rows; ++y) {
+            const float *image_row = padded.row(y);
+            const float *marker_row = marker.row(y);
+            float *out_row = level + (size_t) y * cols;
+            for (int x = 0; x < cols; ++x) out_row[x] = image_row[x] - marker_row[x];
+        }
+        if (stats) subtraction_seconds += stats_now() - stage_start;
+    }
+
+    nhDestroyNeighborhoodWalker(trailing_walker);
+    nhDestroyNeighborhoodWalker(leading_walker);
+    nhDestroyNeighborhoodWalker(walker);
+    if (stats) {
+        stats->subtraction_seconds = subtraction_seconds;
+        stats->total_seconds = stats_now() - start;
+    }
+}
+
+/**
+ * return the profile of top_hat_profile_view as one malloc'd stack of
+ * num_scales planes
+ */
+float* top_hat_profile(float *origin_img, int y_input, int x_input, const int *sizes, int num_scales,
+        TopHatStats *stats = NULL) {
+    float *result = (float *)malloc(sizeof(float) * y_input * x_input * (num_scales > 0 ? num_scales : 1));
+    top_hat_profile_view(image_view<const float>(origin_img, y_input, x_input), sizes, num_scales,
+                         result, stats);
+    return result;
+}
+
+/**
+ * check the h of an h-maxima or h-dome transform
+ */
+void check_dome_height(double h) {
+    if (!(h >= 0) || h == std::numeric_limits<double>::infinity()) {
+        throw std::invalid_argument("h must be non-negative and finite");
+    }
+}
+
+/**
+ * the h-maxima transforms of image for the heights h[0..count) into
+ * out[0..count) (count views of the image size), followed by image minus
+ * them when dome is true. The heights are taken from the largest down:
+ * reconstructions of image - h grow as h shrinks, so each one starts from
+ * the previous result, raised to image - h as the first raster pass goes.
+ * count 0 does nothing; a negative count is rejected.
+ */
+void h_transforms(ImageView<const float> image, const double *h, int count, ImageView<float> *out,
+        bool dome, TopHatStats *stats) {
+    if (count < 0) {
+        throw std::invalid_argument("the number of heights must not be negative");
+    }
+    if (count == 0) return;
+    for (int k = 0; k < count; ++k) {
+        check_dome_height(h[k]);
+        if (out[k].rows != image.rows || out[k].cols != image.cols) {
+            throw std::invalid_argument("input and output must have the same size");
+        }
+    }
+    double start = 0, stage_start = 0, subtraction_seconds = 0;
+    if (stats) {
+        memset(stats, 0, sizeof(*stats));
+        start = stats_now();
+    }
+    if (image.rows == 0 || image.cols == 0) return;
+
+    std::vector<int> order(count);
+    for (int k = 0; k < count; ++k) order[k] = k;
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return h[a] > h[b]; });
+
+    NeighborhoodWalker_T trailing_walker;
+    NeighborhoodWalker_T leading_walker;
+    NeighborhoodWalker_T walker;
+    make_reconstruction_walkers(image.rows, image.cols, &walker, &trailing_walker, &leading_walker);
+    PaddedImage<float> padded(image.rows, image.cols, 1, PaddedImage<float>::min_sentinel());
+    PaddedImage<float> marker(image.rows, image.cols, 1, PaddedImage<float>::min_sentinel());
+    padded.load(image.data, image.stride);
+
+    for (int i = 0; i < count; ++i) {
+        int k = order[i];
+        {
+            TRACE_SCOPE("im_reconstruct", "top_hat");
+            ReconstructionStats *reconstruction = stats ? &stats->reconstruction : NULL;
+            if (i == 0) {
+                PaddedMarkerShifted<float, false> shifted = {(float) h[k]};
+                compute_reconstruction_padded(marker, padded, shifted, walker, trailing_walker,
+                                              leading_walker, reconstruction);
+            } else {
+                PaddedMarkerShifted<float, true> shifted = {(float) h[k]};
+                compute_reconstruction_padded(marker, padded, shifted, walker, trailing_walker,
+                                              leading_walker, reconstruction);
+            }
+        }
+        if (stats) stage_start = stats_now();
+        for (int y = 0; y < image.rows; ++y) {
+            const float *image_row = padded.row(y);
+            const float *marker_row = marker.row(y);
+            float *out_row = out[k].row(y);
+            for (int x = 0; x < image.cols; ++x) {
+                out_row[x] = dome ? image_row[x] - marker_row[x] : marker_row[x];
+            }
+        }
+        if (stats) subtraction_seconds += stats_now() - stage_start;
+    }
+
+    nhDestroyNeighborhoodWalker(trailing_walker);
+    nhDestroyNeighborhoodWalker(leading_walker);
+    nhDestroyNeighborhoodWalker(walker);
+    if (stats) {
+        stats->subtraction_seconds = subtraction_seconds;
+        stats->total_seconds = stats_now() - start;
+    }
+}
+
+/**
+ * h-maxima transform: the 8-connected reconstruction of image - h under the
+ * image (h >= 0, rounded to float), which lowers every regional maximum by
+ * h and flattens the peaks less than h high. image - h is never stored:
+ * the first raster pass of the reconstruction forms it pixel by pixel.
+ * out (same size) may be the input itself.
+ */
+void h_maxima_view(ImageView<const float> image, ImageView<float> out, double h,
+        TopHatStats *stats = NULL) {
+    TRACE_SCOPE("h_maxima", "top_hat");
+    h_transforms(image, &h, 1, &out, false, stats);
+}
+
+/**
+ * h-dome transform: the image minus its h-maxima transform, i.e. the
+ * top h of every peak (less where the peak is lower), whatever its width.
+ * out (same size) may be the input itself.
+ */
+void h_dome_view(ImageView<const float> image, ImageView<float> out, double h,
+        TopHatStats *stats = NULL) {
+    TRACE_SCOPE("h_dome", "top_hat");
+    h_transforms(image, &h, 1, &out, true, stats);
+}
+
+/**
+ * h-domes of the image for h[0..count), in any order, into one planar
+ * stack of count dense rows * cols planes (plane k for h[k]). The
+ * reconstructions share their work: each starts from the one of the next
+ * larger h, so the queue only carries the difference. count 0 writes
+ * nothing.
+ */
+void h_dome_stack_view(ImageView<const float> image, const double *h, int count, float *out,
+        TopHatStats *stats = NULL) {
+    TRACE_SCOPE("h_dome", "top_hat");
+    if (count < 0) {
+        throw std::invalid_argument("the number of heights must not be negative");
+    }
+    if (count == 0) return;
+    std::vector<ImageView<float> > planes;
+    for (int k = 0; k < count; ++k) {
+        planes.push_back(image_view(out + (size_t) k * image.rows * image.cols, image.rows, image.cols));
+    }
+    h_transforms(image, h, count, planes.data(), true, stats);
+}
+
+float* h_maxima(float *origin_img, int y_input, int x_input, double h, TopHatStats *stats = NULL) {
+    float *result = (float *)malloc(sizeof(float) * y_input * x_input);
+    h_maxima_view(image_view<const float>(origin_img, y_input, x_input),
+                  image_view(result, y_input, x_input), h, stats);
+    return result;
+}
+
+float* h_dome(float *origin_img, int y_input, int x_input, double h, TopHatStats *stats = NULL) {
+    float *result = (float *)malloc(sizeof(float) * y_input * x_input);
+    h_dome_view(image_view<const float>(origin_img, y_input, x_input),
+                image_view(result, y_input, x_input), h, stats);
+    return result;
+}
+
+float* h_dome_stack(float *origin_img, int y_input, int x_input, const double *h, int count,
+        TopHatStats *stats = NULL) {
+    float *result = (float *)malloc(sizeof(float) * y_input * x_input * (count > 0 ? count : 1));
+    h_dome_stack_view(image_view<const float>(origin_img, y_input, x_input), h, count, result, stats);
+    return result;
+}
+
+/**
+ * regional maxima of the image: out is true on the 8-connected plateaus
+ * with no higher neighbor. One reconstruction, whose marker (the image
+ * where a neighbor is higher) is formed in the first raster pass; the
+ * maxima are where it stays below the image.
+ */
+void regional_maxima_view(ImageView<const float> image, ImageView<bool> out, TopHatStats *stats = NULL) {
+    TRACE_SCOPE("regional_maxima", "top_hat");
+    if (out.rows != image.rows || out.cols != image.cols) {
+        throw std::invalid_argument("input and output must have the same size");
+    }
+    double start = 0;
+    if (stats) {
+        memset(stats, 0, sizeof(*stats));
+        start = stats_now();
+    }
+    if (image.rows == 0 || image.cols == 0) return;
+
+    NeighborhoodWalker_T trailing_walker;
+    NeighborhoodWalker_T leading_walker;
+    NeighborhoodWalker_T walker;
+    make_reconstruction_walkers(image.rows, image.cols, &walker, &trailing_walker, &leading_walker);
+    PaddedImage<float> padded(image.rows, image.cols, 1, PaddedImage<float>::min_sentinel());
+    PaddedImage<float> marker(image.rows, image.cols, 1, PaddedImage<float>::min_sentinel());
+    padded.load(image.data, image.stride);
+    {
+        TRACE_SCOPE("im_reconstruct", "top_hat");
+        PaddedMarkerBelowHigher<float> below = {padded.stride()};
+        compute_reconstruction_padded(marker, padded, below, walker, trailing_walker, leading_walker,
+                                      stats ? &stats->reconstruction : NULL);
+    }
+    nhDestroyNeighborhoodWalker(trailing_walker);
+    nhDestroyNeighborhoodWalker(leading_walker);
+    nhDestroyNeighborhoodWalker(walker);
+
+    double stage_start = stats ? stats_now() : 0;
+    for (int y = 0; y < image.rows; ++y) {
+        const float *image_row = padded.row(y);
+        const float *marker_row = marker.row(y);
+        bool *out_row = out.row(y);
+        for (int x = 0; x < image.cols; ++x) out_row[x] = marker_row[x] < image_row[x];
+    }
+    if (stats) {
+        stats->subtraction_seconds = stats_now() - stage_start;
+        stats->total_seconds = stats_now() - start;
+    }
+}
+
+bool* regional_maxima(float *origin_img, int y_input, int x_input, TopHatStats *stats = NULL) {
+    bool *result = (bool *)malloc(sizeof(bool) * y_input * x_input);
+    regional_maxima_view(image_view<const float>(origin_img, y_input, x_input),
+                         image_view(result, y_input, x_input), stats);
+    return result;
+}
+
+float* im_reconstruct_masked(float *imer, float *img, bool *valid, int y_input, int x_input,
+        ReconstructionStats *stats = NULL) {
+    TRACE_SCOPE("im_reconstruct", "top_hat");
+    Neighborhood_T nhood;
+    NeighborhoodWalker_T trailing_walker;
+    NeighborhoodWalker_T leading_walker;
+    NeighborhoodWalker_T walker;
+
     float *J = duplicate(imer, y_input, x_input);
-    float *I = img;
     int num_elements = y_input * x_input;
     int input_size[2] = {x_input, y_input};
     nhood = nhMakeDefaultConnectivityNeighborhood();
@@ -43,7 +1019,7 @@ float* im_reconstruct(float *imer, float *img, int y_input, int x_input) {
                                       NH_SKIP_CENTER);
     nhDestroyNeighborhood(nhood);
 
-    compute_reconstruction(J, I, num_elements, walker, trailing_walker, leading_walker);
+    compute_reconstruction_masked(J, img, valid, num_elements, walker, trailing_walker, leading_walker, stats);
 
     nhDestroyNeighborhoodWalker(trailing_walker);
     nhDestroyNeighborhoodWalker(leading_walker);
@@ -52,7 +1028,9 @@ float* im_reconstruct(float *imer, float *img, int y_input, int x_input) {
     return J;
 }
 
-float* im_erode(float *img, int y_input, int x_input, int *mask, int mask_y, int mask_x) {
+float* im_erode_masked(float *img, bool *valid, int y_input, int x_input, int *mask, int mask_y, int mask_x,
+        WalkStats *stats = NULL) {
+    TRACE_SCOPE("im_erode", "top_hat");
     Neighborhood_T nhood;
     if (mask) {
         int mask_size[2] = {mask_x, mask_y};
@@ -63,9 +1041,9 @@ float* im_erode(float *img, int y_input, int x_input, int *mask, int mask_y, int
     int input_size[2] = {x_input, y_input};
     NeighborhoodWalker_T walker = nhMakeNeighborhoodWalker(nhood, input_size, NH_USE_ALL);
 
-    float *out_img = duplicate(img, y_input, x_input);
+    float *out_img = (float *)malloc(sizeof(float) * y_input * x_input);
 
-    erodeGrayFlat(img, out_img, y_input * x_input, walker);
+    erodeGrayFlatMasked(img, out_img, valid, y_input * x_input, walker, stats);
 
     nhDestroyNeighborhood(nhood);
     nhDestroyNeighborhoodWalker(walker);
@@ -74,28 +1052,63 @@ float* im_erode(float *img, int y_input, int x_input, int *mask, int mask_y, int
 }
 
 /**
- * return the tophat result
+ * return the tophat result of an image with voids (water, occlusions).
+ * invalid pixels are skipped by the erosion and by the reconstruction, and
+ * come out as NaN in the result.
  * @param origin_img
+ * @param valid validity mask, true for valid pixels. if NULL, NaN pixels
+ *              are treated as invalid
  * @param y_input rows of the image
  * @param x_input cols of the image
  * @param mask mask for the erode neighbor
  * @param mask_y rows of the mask
  * @param mask_x cols of the mask
+ * @param stats if not NULL, filled with per-stage times and counters
  * @return tophat_result
  */
-float* top_hat_extract(float *origin_img, int y_input, int x_input,
-        int *mask, int mask_y, int mask_x) {
-    float *imer = im_erode(origin_img, y_input, x_input, mask, mask_y, mask_y);
+float* top_hat_extract_masked(float *origin_img, bool *valid, int y_input, int x_input,
+        int *mask, int mask_y, int mask_x, TopHatStats *stats = NULL) {
+    int num_elements = y_input * x_input;
+    bool *nan_mask = NULL;
+    if (valid == NULL) {
+        int num_invalid = 0;
+        nan_mask = make_valid_mask(origin_img, num_elements, false, 0, &num_invalid);
+        if (num_invalid == 0) {
+            free(nan_mask);
+            return top_hat_extract(origin_img, y_input, x_input, mask, mask_y, mask_x, stats);
+        }
+        valid = nan_mask;
+    }
 
-    float *reconstruct_result = im_reconstruct(imer, origin_img, y_input, x_input);
+    TRACE_SCOPE("top_hat_extract_masked", "top_hat");
 
-    for (int i = 0; i < y_input; ++i) {
-        for (int j = 0; j < x_input; ++j) {
-            reconstruct_result[i * x_input + j] = origin_img[i * x_input + j] - reconstruct_result[i * x_input + j];
-        }
+    double start = 0, stage_start = 0;
+    if (stats) {
+        memset(stats, 0, sizeof(*stats));
+        start = stage_start = stats_now();
+    }
+
+    float *imer = im_erode_masked(origin_img, valid, y_input, x_input, mask, mask_y, mask_x,
+                                  stats ? &stats->erosion_walk : NULL);
+    if (stats) stats->erosion_seconds = stats_now() - stage_start;
+
+    float *reconstruct_result = im_reconstruct_masked(imer, origin_img, valid, y_input, x_input,
+                                                      stats ? &stats->reconstruction : NULL);
+
+    if (stats) stage_start = stats_now();
+    TRACE_SCOPE("subtract", "top_hat");
+    for (int i = 0; i < num_elements; ++i) {
+        reconstruct_result[i] = valid[i] ? origin_img[i] - reconstruct_result[i]
+                                         : std::numeric_limits<float>::quiet_NaN();
     }
 
     free(imer);
+    free(nan_mask);
+
+    if (stats) {
+        stats->subtraction_seconds = stats_now() - stage_start;
+        stats->total_seconds = stats_now() - start;
+    }
 
     return reconstruct_result;
 }
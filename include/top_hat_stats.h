@@ -0,0 +1,118 @@
+#ifndef TOPHAT_RECODE_TOP_HAT_STATS_H
+#define TOPHAT_RECODE_TOP_HAT_STATS_H
+
+#include <chrono>
+#include <cstddef>
+
+/**
+ * Optional instrumentation filled in by the top-hat pipeline when the caller
+ * passes a stats pointer. All times are wall-clock seconds.
+ */
+
+/**
+ * neighborhood walk counters. neighbors_visited / walks is the mean number
+ * of in-bounds pixels visited per neighborhood walk.
+ */
+typedef struct WalkStats_tag {
+    long long walks;
+    long long neighbors_visited;
+} WalkStats;
+
+typedef struct ReconstructionStats_tag {
+    double raster_seconds;
+    double antiraster_seconds;
+    double propagation_seconds;
+
+    /**
+     * pixels queued by the antiraster pass
+     */
+    long long seeded;
+
+    /**
+     * every queue push, seeds included
+     */
+    long long pushes;
+
+    /**
+     * largest queue length seen
+     */
+    long long queue_high_water;
+
+    WalkStats walk;
+} ReconstructionStats;
+
+typedef struct TopHatStats_tag {
+    double erosion_seconds;
+    double subtraction_seconds;
+    double total_seconds;
+
+    /**
+     * hole filling before the erosion, 0 unless it was asked for
+     */
+    double fill_seconds;
+    WalkStats erosion_walk;
+    ReconstructionStats reconstruction;
+
+    /**
+     * level sets of the threshold decomposition, 0 if the grayscale
+     * pipeline ran
+     */
+    int levels;
+} TopHatStats;
+
+inline double stats_now() {
+    return std::chrono::duration<double>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Counter policies for the kernels. The kernels are instantiated with
+ * StatsCounter<false> when no stats were requested, whose members are
+ * empty inline functions, so the counting compiles away entirely.
+ */
+template <bool enabled>
+struct StatsCounter {
+    explicit StatsCounter(WalkStats *) {}
+    void walk() {}
+    void visit() {}
+    void walks(long long) {}
+    void visits(long long) {}
+    void seed() {}
+    void push(size_t) {}
+    double now() { return 0; }
+    void elapsed(double *, double) {}
+    void add_queue_counts(ReconstructionStats *) {}
+};
+
+template <>
+struct StatsCounter<true> {
+    WalkStats *walk_stats;
+    long long seeded;
+    long long pushes;
+    long long queue_high_water;
+
+    explicit StatsCounter(WalkStats *stats)
+            : walk_stats(stats), seeded(0), pushes(0), queue_high_water(0) {}
+    void walk() { ++walk_stats->walks; }
+    void visit() { ++walk_stats->neighbors_visited; }
+    void walks(long long count) { walk_stats->walks += count; }
+    void visits(long long count) { walk_stats->neighbors_visited += count; }
+    void seed() { ++seeded; }
+    void push(size_t queue_size) {
+        ++pushes;
+        if ((long long) queue_size > queue_high_water) {
+            queue_high_water = (long long) queue_size;
+        }
+    }
+    double now() { return stats_now(); }
+    void elapsed(double *seconds, double start) { *seconds += stats_now() - start; }
+    void add_queue_counts(ReconstructionStats *stats) {
+        stats->seeded += seeded;
+        stats->pushes += pushes;
+        if (queue_high_water > stats->queue_high_water) {
+            stats->queue_high_water = queue_high_water;
+        }
+    }
+};
+
+#endif //TOPHAT_RECODE_TOP_HAT_STATS_H
@@ -0,0 +1,92 @@
+#ifndef TOPHAT_RECODE_TRACE_H
+#define TOPHAT_RECODE_TRACE_H
+
+#include <atomic>
+
+/**
+ * Opt-in timeline tracer. Scopes marked with TRACE_SCOPE record one complete
+ * event (begin time + duration) into a buffer owned by the calling thread,
+ * so recording never takes a lock. At exit (or on trace_write) all buffers
+ * are written as Chrome trace-event JSON, which loads in chrome://tracing
+ * and https://ui.perfetto.dev.
+ *
+ * Tracing is off unless trace_enable is called or the TOPHAT_TRACE
+ * environment variable names an output file. While off, a scope costs one
+ * relaxed atomic load.
+ *
+ * Event names and categories must be string literals (or otherwise outlive
+ * the trace); only the pointers are stored.
+ */
+
+extern std::atomic<bool> trace_active;
+
+/**
+ * start recording; events are written to file_name when the process exits
+ */
+void trace_enable(const char *file_name);
+
+/**
+ * write every event recorded so far to the file given to trace_enable.
+ * call it after worker threads have been joined.
+ * @return false if the file could not be written
+ */
+bool trace_write();
+
+/**
+ * microseconds since tracing was enabled
+ */
+double trace_now_us();
+
+/**
+ * append one complete event to the calling thread's buffer
+ * @param index tile/band/row index shown as an event argument, -1 for none
+ */
+void trace_record(const char *name, const char *category, long long index,
+                  double begin_us, double end_us);
+
+inline bool trace_is_enabled() {
+    return trace_active.load(std::memory_order_relaxed);
+}
+
+class TraceScope {
+public:
+    TraceScope(const char *name, const char *category, long long index = -1)
+            : name(name), category(category), index(index), begin_us(-1) {
+        if (trace_is_enabled()) {
+            begin_us = trace_now_us();
+        }
+    }
+
+    ~TraceScope() {
+        if (begin_us >= 0) {
+            trace_record(name, category, index, begin_us, trace_now_us());
+        }
+    }
+
+    /**
+     * close the current event and open the next stage of the same scope
+     */
+    void next(const char *next_name) {
+        if (begin_us >= 0) {
+            double now = trace_now_us();
+            trace_record(name, category, index, begin_us, now);
+            begin_us = now;
+        }
+        name = next_name;
+    }
+
+private:
+    const char *name;
+    const char *category;
+    long long index;
+    double begin_us;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name, category) \
+    TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name, category)
+#define TRACE_SCOPE_INDEX(name, category, index) \
+    TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name, category, index)
+
+#endif //TOPHAT_RECODE_TRACE_H
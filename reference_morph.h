@@ -0,0 +1,178 @@
+/**
+ * Frozen reference implementations for the differential test.
+ *
+ * These are copies of the original neighborhood-walker kernels
+ * (erodeGrayFlat, compute_reconstruction, dilate_logical, erode_logical
+ * and the nonflat function body as first written). They must
+ * not be optimized or otherwise changed: every fast path in include/ and
+ * src/ is checked bit-for-bit against them by differential_test.cpp.
+ */
+#ifndef TOPHAT_RECODE_REORGANIZE_REFERENCE_MORPH_H
+#define TOPHAT_RECODE_REORGANIZE_REFERENCE_MORPH_H
+
+#include <cmath>
+#include <limits>
+#include <queue>
+#include "neighborhood.h"
+
+template<typename _t>
+void reference_erode_gray_flat(_t *In, _t *Out, int num_elements,
+                               NeighborhoodWalker_T walker)
+{
+    for (int p = 0; p < num_elements; p++)
+    {
+        int q;
+        _t val;
+        _t new_val;
+
+        bool val_set = false;
+        nhSetWalkerLocation(walker, p);
+        while (nhGetNextInboundsNeighbor(walker, &q, NULL))
+        {
+            new_val = In[q];
+            if (!val_set || new_val < val)
+            {
+                val_set = true;
+                val = new_val;
+            }
+        }
+        Out[p] = val;
+    }
+}
+
+template <typename _T>
+void reference_compute_reconstruction(_T *J, _T *I, int num_elements,
+        NeighborhoodWalker_T walker,
+        NeighborhoodWalker_T trailingWalker,
+        NeighborhoodWalker_T leadingWalker) {
+    std::queue<int> Queue;
+
+    for (int p = 0; p < num_elements; ++p) {
+        _T max_pixel = J[p];
+        nhSetWalkerLocation(trailingWalker, p);
+        int q;
+        while (nhGetNextInboundsNeighbor(trailingWalker, &q, NULL)) {
+            if (J[q] > max_pixel) {
+                max_pixel = J[q];
+            }
+        }
+        J[p] = (max_pixel < I[p]) ? max_pixel : I[p];
+    }
+
+    for (int pp = 0; pp < num_elements; ++pp) {
+        int p = num_elements - 1 - pp;
+        _T max_pixel = J[p];
+        nhSetWalkerLocation(leadingWalker, p);
+        int q;
+        while (nhGetNextInboundsNeighbor(leadingWalker, &q, NULL)) {
+            if (J[q] > max_pixel) {
+                max_pixel = J[q];
+            }
+        }
+        J[p] = (max_pixel < I[p]) ? max_pixel : I[p];
+
+        nhSetWalkerLocation(leadingWalker, p);
+        while (nhGetNextInboundsNeighbor(leadingWalker, &q, NULL)) {
+            if (J[q] < J[p] && J[q] < I[q]) {
+                Queue.push(p);
+                break;
+            }
+        }
+    }
+
+    while (!Queue.empty()) {
+        int p = Queue.front();
+        Queue.pop();
+        _T Jp = J[p];
+
+        nhSetWalkerLocation(walker, p);
+        int q;
+        while (nhGetNextInboundsNeighbor(walker, &q, NULL)) {
+            _T Jq = J[q];
+            _T Iq = I[q];
+            if (Jq < Jp && Iq != Jq) {
+                J[q] = (Jp < Iq) ? Jp : Iq;
+                Queue.push(q);
+            }
+        }
+    }
+}
+
+/*
+ * out must be cleared by the caller
+ */
+inline void reference_dilate_logical(bool *in, bool *out, int num_elements, NeighborhoodWalker_T walker) {
+    for (int p = 0; p < num_elements; ++p) {
+        if (in[p]) {
+            int q;
+            nhSetWalkerLocation(walker, p);
+            while (nhGetNextInboundsNeighbor(walker, &q, NULL)) {
+                out[q] = 1;
+            }
+        }
+    }
+}
+
+inline void reference_erode_logical(bool *In, bool *Out, int num_elements,
+                                    NeighborhoodWalker_T walker)
+{
+    for (int p = 0; p < num_elements; p++)
+    {
+        int q;
+
+        Out[p] = 1;
+        nhSetWalkerLocation(walker, p);
+        while (nhGetNextInboundsNeighbor(walker, &q, NULL))
+        {
+            if (In[q] == 0)
+            {
+                Out[p] = 0;
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * the macro-instantiated nonflat function body: everything in double,
+ * integer results clamped and rounded with floor(val + 0.5), and the
+ * INIT_VAL of every instantiation (numeric_limits<_T>::max() for erosion,
+ * numeric_limits<_T>::min() for dilation, which for float and double is
+ * the smallest positive value)
+ */
+template <typename _T>
+void reference_gray_nonflat(_T *in, _T *out, int num_elements, NeighborhoodWalker_T walker,
+                            double *height, bool erode) {
+    double val;
+    double init_val = erode ? (double) std::numeric_limits<_T>::max()
+                            : (double) std::numeric_limits<_T>::min();
+    double new_val;
+
+    for (int p = 0; p < num_elements; p++)
+    {
+        int q;
+        int neighbor_idx;
+
+        val = init_val;
+        nhSetWalkerLocation(walker, p);
+        while (nhGetNextInboundsNeighbor(walker, &q, &neighbor_idx))
+        {
+            new_val = erode ? (double) in[q] - height[neighbor_idx]
+                            : (double) in[q] + height[neighbor_idx];
+            if (erode ? new_val < val : new_val > val)
+            {
+                val = new_val;
+            }
+        }
+        if (std::numeric_limits<_T>::is_integer)
+        {
+            val = (val < (double) std::numeric_limits<_T>::min()) ? (double) std::numeric_limits<_T>::min() : val;
+            val = (val > (double) std::numeric_limits<_T>::max()) ? (double) std::numeric_limits<_T>::max() : val;
+            val = (_T) floor(val + 0.5);
+        }
+
+        out[p] = (_T) val;
+    }
+}
+
+#endif //TOPHAT_RECODE_REORGANIZE_REFERENCE_MORPH_H
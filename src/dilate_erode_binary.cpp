@@ -2,6 +2,7 @@
 // Created by xinyuangui on 9/19/18.
 //
 #include "morph.h"
+#include <cstdlib>
 
 inline ptrdiff_t my_abs(ptrdiff_t v) {
     v = v < 0 ? -v : v;
@@ -18,6 +19,181 @@ inline int my_max(ptrdiff_t offset, int dim) {
     return offset;
 }
 
+/*
+ * logical_box
+ * Binary erosion of a row-major image by the box of offsets
+ * [y_lo, y_hi] x [x_lo, x_hi], pixels outside the image ignored, in O(1)
+ * per pixel whatever the box size.
+ *
+ * The box is separable. Along each row, run[x] is the number of set
+ * pixels ending at x, and x survives when the run ending at the right end
+ * of its (clipped) window spans the window. Down the columns the same is
+ * done with one running count per column, so every pass is a plain loop
+ * over a row.
+ *
+ * With invert set, the complement of In is eroded and the complement of
+ * the result stored: a dilation.
+ */
+static void logical_box(const bool *In, bool *Out, int rows, int cols,
+                        ptrdiff_t y_lo, ptrdiff_t y_hi, ptrdiff_t x_lo, ptrdiff_t x_hi,
+                        bool invert)
+{
+    if (rows == 0 || cols == 0)
+    {
+        return;
+    }
+    bool *h = (bool *) malloc(sizeof(bool) * rows * cols);
+    int *run = (int *) malloc(sizeof(int) * (rows > cols ? rows : cols));
+
+    for (int y = 0; y < rows; y++)
+    {
+        const bool *in_row = In + (ptrdiff_t) y * cols;
+        bool *h_row = h + (ptrdiff_t) y * cols;
+        int count = 0;
+        for (int x = 0; x < cols; x++)
+        {
+            count = (in_row[x] != invert) ? count + 1 : 0;
+            run[x] = count;
+        }
+        for (int x = 0; x < cols; x++)
+        {
+            ptrdiff_t lo = x + x_lo < 0 ? 0 : x + x_lo;
+            ptrdiff_t hi = x + x_hi >= cols ? cols - 1 : x + x_hi;
+            h_row[x] = hi < lo || run[hi] >= hi - lo + 1;
+        }
+    }
+
+    // run[x] now counts the set pixels of h ending at row r of column x;
+    // row y is done once r reaches the bottom of its window. Windows that
+    // miss the image have no pixel to erode by.
+    for (int x = 0; x < cols; x++)
+    {
+        run[x] = 0;
+    }
+    for (ptrdiff_t r = y_hi < 0 ? y_hi : 0; r < rows + (y_hi > 0 ? y_hi : 0); r++)
+    {
+        if (r >= 0 && r < rows)
+        {
+            const bool *h_row = h + r * cols;
+            for (int x = 0; x < cols; x++)
+            {
+                run[x] = h_row[x] ? run[x] + 1 : 0;
+            }
+        }
+        ptrdiff_t y = r - y_hi;
+        if (y < 0 || y >= rows)
+        {
+            continue;
+        }
+        ptrdiff_t hi = r < rows ? r : rows - 1;
+        ptrdiff_t lo = y + y_lo < 0 ? 0 : y + y_lo;
+        bool *out_row = Out + y * cols;
+        if (hi < lo)
+        {
+            for (int x = 0; x < cols; x++)
+            {
+                out_row[x] = !invert;
+            }
+            continue;
+        }
+        int span = (int) (hi - lo + 1);
+        for (int x = 0; x < cols; x++)
+        {
+            out_row[x] = (run[x] >= span) != invert;
+        }
+    }
+
+    free(run);
+    free(h);
+}
+
+/*
+ * bounding box of the offsets of a 2-D neighborhood, true if the
+ * neighborhood fills it (box[0..1]: first dimension, box[2..3]: second)
+ */
+static bool neighborhood_box(Neighborhood_T nhood, ptrdiff_t box[4])
+{
+    if (nhood->num_neighbors == 0)
+    {
+        return false;
+    }
+    box[0] = box[1] = nhood->array_coords[0];
+    box[2] = box[3] = nhood->array_coords[1];
+    for (int k = 1; k < nhood->num_neighbors; k++)
+    {
+        ptrdiff_t r = nhood->array_coords[2*k];
+        ptrdiff_t c = nhood->array_coords[2*k + 1];
+        box[0] = r < box[0] ? r : box[0];
+        box[1] = r > box[1] ? r : box[1];
+        box[2] = c < box[2] ? c : box[2];
+        box[3] = c > box[3] ? c : box[3];
+    }
+    // the offsets of a neighborhood are distinct
+    return (box[1] - box[0] + 1) * (box[3] - box[2] + 1) == nhood->num_neighbors;
+}
+
+/*
+ * true if the walker skips none of its neighbors (no NH_SKIP_* flag took
+ * effect), so that it walks the whole neighborhood
+ */
+static bool walker_uses_all(NeighborhoodWalker_T walker)
+{
+    for (int k = 0; k < walker->num_neighbors; k++)
+    {
+        if (!walker->use[k])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * erode_logical_rect
+ * Binary erosion of a row-major image by a mask_y-by-mask_x rectangle of
+ * ones, centered like NH_CENTER_MIDDLE_ROUNDDOWN, pixels outside the image
+ * ignored: the result of erode_logical with that neighborhood, at a cost
+ * per pixel independent of the rectangle size.
+ *
+ * Inputs
+ * ======
+ * In            - pointer to first element of input array
+ * rows          - number of rows in input and output arrays
+ * cols          - number of columns in input and output arrays
+ * mask_y        - rows of the rectangle
+ * mask_x        - columns of the rectangle
+ *
+ * Output ====== Out - pointer to first element of output array; may be In
+ */
+void erode_logical_rect(const bool *In, bool *Out, int rows, int cols, int mask_y, int mask_x)
+{
+    if (mask_y < 1 || mask_x < 1)
+    {
+        throw std::invalid_argument("the rectangle must have at least one row and column");
+    }
+    ptrdiff_t up = (mask_y - 1) / 2;
+    ptrdiff_t left = (mask_x - 1) / 2;
+    logical_box(In, Out, rows, cols, -up, mask_y - 1 - up, -left, mask_x - 1 - left, false);
+}
+
+/*
+ * dilate_logical_rect
+ * Binary dilation by the same rectangle: the result of dilate_logical with
+ * that neighborhood (pixels outside the image are 0) into a cleared
+ * output. Out may be In.
+ */
+void dilate_logical_rect(const bool *In, bool *Out, int rows, int cols, int mask_y, int mask_x)
+{
+    if (mask_y < 1 || mask_x < 1)
+    {
+        throw std::invalid_argument("the rectangle must have at least one row and column");
+    }
+    ptrdiff_t up = (mask_y - 1) / 2;
+    ptrdiff_t left = (mask_x - 1) / 2;
+    // dilate_logical sets p + offset for every set p: reflect the box
+    logical_box(In, Out, rows, cols, -(mask_y - 1 - up), up, -(mask_x - 1 - left), left, true);
+}
+
 /*
  * dilate_logical
  * Perform binary dilation on a logical array.
@@ -57,6 +233,21 @@ inline int my_max(ptrdiff_t offset, int dim) {
  * Output ====== Out - pointer to first element of output array
  */
 void dilate_logical_twod(bool *in, bool *out, int M, int N, Neighborhood_T nhood, NeighborhoodWalker_T walker) {
+    // a full rectangle walked without skips runs in O(1) per pixel; our
+    // column-major M-by-N image is a row-major N-by-M one
+    ptrdiff_t box[4];
+    if (walker_uses_all(walker) && neighborhood_box(nhood, box))
+    {
+        bool *dilated = (bool *) malloc(sizeof(bool) * M * N);
+        logical_box(in, dilated, N, M, -box[3], -box[2], -box[1], -box[0], true);
+        for (int p = 0; p < M * N; p++)
+        {
+            out[p] |= dilated[p];
+        }
+        free(dilated);
+        return;
+    }
+
     // determine r, r endpoints of interior image using minimum and maximum offsets in nhood
     ptrdiff_t min_r_offset = 0;
     ptrdiff_t min_c_offset = 0;
@@ -109,6 +300,7 @@ void dilate_logical_twod(bool *in, bool *out, int M, int N, Neighborhood_T nhood
             {
                 for(k = 0; k < walker->num_neighbors; k++)
                 {
+                    if (!walker->use[k]) continue;
                     idxn = idx + (int) walker->neighbor_offsets[k];
                     out[idxn] = 1;
                 }
@@ -251,6 +443,14 @@ void erode_logical(bool *In, bool *Out, int num_elements,
 void erode_logical_twod(bool *In, bool *Out, int M, int N,
                         Neighborhood_T nhood, NeighborhoodWalker_T walker)
 {
+    // a full rectangle walked without skips runs in O(1) per pixel; our
+    // column-major M-by-N image is a row-major N-by-M one
+    ptrdiff_t box[4];
+    if (walker_uses_all(walker) && neighborhood_box(nhood, box))
+    {
+        logical_box(In, Out, N, M, box[2], box[3], box[0], box[1], false);
+        return;
+    }
 
     // determine r,c endpoints of interior image using minumum and maximum
     // offsets in nhood
@@ -305,6 +505,7 @@ void erode_logical_twod(bool *In, bool *Out, int M, int N,
 
             for(k = 0; k < walker->num_neighbors; k++)
             {
+                if (!walker->use[k]) continue;
                 idxn = idx + (int) walker->neighbor_offsets[k];
 
                 if (!In[idxn])
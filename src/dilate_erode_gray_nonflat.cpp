@@ -2,116 +2,85 @@
 // Created by xinyuangui on 9/24/18.
 //
 /**
- * Functions for nonflat grayscale dilation and erosion.  The actual dilation
- * and erosion algorithm code can be found in dilate_erode_gray_nonflat.h.
-  * different numeric types by #defining TYPE, COMPARE_OP, INIT_VAL, DO_ROUND,
- * MIN_VAL, and MAX_VAL.
+ * Functions for nonflat grayscale dilation and erosion, instantiated from
+ * the gray_nonflat template in dilate_erode_gray_nonflat.h for every
+ * numeric type.
  *
  * Note that the dilation functions in this module all require reflected
  * neighborhoods.
  */
 
 #include "morph.h"
-#include <limits>
-
-#define TYPE uint8_t
-#define INIT_VAL 0
-#define DO_ROUND
-#define MIN_VAL 0
-#define MAX_VAL UINT8_MAX
-#define COMBINE_OP +
-#define COMPARE_OP >
-void dilate_gray_nonflat_uint8
 #include "dilate_erode_gray_nonflat.h"
 
 /*
- * dilate_gray_nonflat_uint16
- */
-#define TYPE uint16_t
-#define INIT_VAL 0
-#define DO_ROUND
-#define MIN_VAL 0
-#define MAX_VAL UINT16_MAX
-#define COMBINE_OP +
-#define COMPARE_OP >
-void dilate_gray_nonflat_uint16
-#include "dilate_erode_gray_nonflat.h"
-
-/*
- * dilate_gray_nonflat_uint32
- */
-#define TYPE uint32_t
-#define INIT_VAL 0
-#define DO_ROUND
-#define MIN_VAL 0
-#define MAX_VAL UINT32_MAX
-#define COMBINE_OP +
-#define COMPARE_OP >
-void dilate_gray_nonflat_uint32
-#include "dilate_erode_gray_nonflat.h"
-
-/*
- * dilate_gray_nonflat_int8
- */
-#define TYPE int8_t
-#define INIT_VAL INT8_MIN
-#define DO_ROUND
-#define MIN_VAL INT8_MIN
-#define MAX_VAL INT8_MAX
-#define COMBINE_OP +
-#define COMPARE_OP >
-void dilate_gray_nonflat_int8
-#include "dilate_erode_gray_nonflat.h"
-
-/*
- * dilate_gray_nonflat_int16
- */
-#define TYPE int16_t
-#define INIT_VAL INT16_MIN
-#define DO_ROUND
-#define MIN_VAL INT16_MIN
-#define MAX_VAL INT16_MAX
-#define COMBINE_OP +
-#define COMPARE_OP >
-void dilate_gray_nonflat_int16
-#include "dilate_erode_gray_nonflat.h"
-
-/*
- * dilate_gray_nonflat_int32
- */
-#define TYPE int32_t
-#define INIT_VAL INT32_MIN
-#define DO_ROUND
-#define MIN_VAL INT32_MIN
-#define MAX_VAL INT32_MAX
-#define COMBINE_OP +
-#define COMPARE_OP >
-void dilate_gray_nonflat_int32
-#include "dilate_erode_gray_nonflat.h"
-
-/*
- * dilate_gray_nonflat_single
- */
-#define TYPE float
-#define INIT_VAL ( std::numeric_limits<float>::min() )
-#define COMBINE_OP +
-#define COMPARE_OP >
-void dilate_gray_nonflat_single
-#include "dilate_erode_gray_nonflat.h"
-
-/*
- * dilate_gray_nonflat_double
+ * dilate_gray_nonflat_<type>
+ * Perform nonflat grayscale dilation.
+ *
+ * Inputs
+ * ======
+ * In             - pointer to first element of input array
+ * num_elements   - number of elements in input and output arrays
+ * walker         - neighborhood walker corresponding to the reflected
+ *                  structuring element
+ * height         - pointer to array of heights; one height value
+ *                  corresponding to each neighborhood element.
+ *
+ * Output
+ * ======
+ * Out            - pointer to first element of output array
  */
-#define TYPE double
-#define INIT_VAL ( std::numeric_limits<double>::min() )
-#define COMBINE_OP +
-#define COMPARE_OP >
-void dilate_gray_nonflat_double
-#include "dilate_erode_gray_nonflat.h"
+void dilate_gray_nonflat_uint8(uint8_t *In, uint8_t *Out, int num_elements,
+                               NeighborhoodWalker_T walker, double *heights)
+{
+    gray_nonflat<uint8_t, false>(In, Out, num_elements, walker, heights);
+}
+
+void dilate_gray_nonflat_uint16(uint16_t *In, uint16_t *Out, int num_elements,
+                                NeighborhoodWalker_T walker, double *heights)
+{
+    gray_nonflat<uint16_t, false>(In, Out, num_elements, walker, heights);
+}
+
+void dilate_gray_nonflat_uint32(uint32_t *In, uint32_t *Out, int num_elements,
+                                NeighborhoodWalker_T walker, double *heights)
+{
+    gray_nonflat<uint32_t, false>(In, Out, num_elements, walker, heights);
+}
+
+void dilate_gray_nonflat_int8(int8_t *In, int8_t *Out, int num_elements,
+                              NeighborhoodWalker_T walker, double *heights)
+{
+    gray_nonflat<int8_t, false>(In, Out, num_elements, walker, heights);
+}
+
+void dilate_gray_nonflat_int16(int16_t *In, int16_t *Out, int num_elements,
+                               NeighborhoodWalker_T walker, double *heights)
+{
+    gray_nonflat<int16_t, false>(In, Out, num_elements, walker, heights);
+}
+
+void dilate_gray_nonflat_int32(int32_t *In, int32_t *Out, int num_elements,
+                               NeighborhoodWalker_T walker, double *heights)
+{
+    gray_nonflat<int32_t, false>(In, Out, num_elements, walker, heights);
+}
+
+void dilate_gray_nonflat_single(float *In, float *Out, int num_elements,
+                                NeighborhoodWalker_T walker, double *heights)
+{
+    gray_nonflat<float, false>(In, Out, num_elements, walker, heights);
+}
+
+void dilate_gray_nonflat_double(double *In, double *Out, int num_elements,
+                                NeighborhoodWalker_T walker, double *heights)
+{
+    gray_nonflat<double, false>(In, Out, num_elements, walker, heights);
+}
 
 /*
- * erode_gray_nonflat_uint8
- * Perform nonflat grayscale erosion on a uint8 array.
+ * erode_gray_nonflat_<type>
+ * Perform nonflat grayscale erosion.
  *
  * Inputs
  * ======
@@ -125,98 +94,50 @@ void dilate_gray_nonflat_double
  * ======
  * Out            - pointer to first element of output array
  */
-#define TYPE uint8_t
-#define INIT_VAL UINT8_MAX
-#define DO_ROUND
-#define MIN_VAL 0
-#define MAX_VAL UINT8_MAX
-#define COMBINE_OP -
-#define COMPARE_OP <
-void erode_gray_nonflat_uint8
-#include "dilate_erode_gray_nonflat.h"
-
-/*
- * erode_gray_nonflat_uint16
- */
-#define TYPE uint16_t
-#define INIT_VAL UINT16_MAX
-#define DO_ROUND
-#define MIN_VAL 0
-#define MAX_VAL UINT16_MAX
-#define COMBINE_OP -
-#define COMPARE_OP <
-void erode_gray_nonflat_uint16
-#include "dilate_erode_gray_nonflat.h"
-
-/*
- * erode_gray_nonflat_uint32
- */
-#define TYPE uint32_t
-#define INIT_VAL UINT32_MAX
-#define DO_ROUND
-#define MIN_VAL 0
-#define MAX_VAL UINT32_MAX
-#define COMBINE_OP -
-#define COMPARE_OP <
-void erode_gray_nonflat_uint32
-#include "dilate_erode_gray_nonflat.h"
-
-/*
- * erode_gray_nonflat_int8
- */
-#define TYPE int8_t
-#define INIT_VAL INT8_MAX
-#define DO_ROUND
-#define MIN_VAL INT8_MIN
-#define MAX_VAL INT8_MAX
-#define COMBINE_OP -
-#define COMPARE_OP <
-void erode_gray_nonflat_int8
-#include "dilate_erode_gray_nonflat.h"
-
-/*
- * erode_gray_nonflat_int16
- */
-#define TYPE int16_t
-#define INIT_VAL INT16_MAX
-#define DO_ROUND
-#define MIN_VAL INT16_MIN
-#define MAX_VAL INT16_MAX
-#define COMBINE_OP -
-#define COMPARE_OP <
-void erode_gray_nonflat_int16
-#include "dilate_erode_gray_nonflat.h"
-
-/*
- * erode_gray_nonflat_int32
- */
-#define TYPE int32_t
-#define INIT_VAL INT32_MAX
-#define DO_ROUND
-#define MIN_VAL INT32_MIN
-#define MAX_VAL INT32_MAX
-#define COMBINE_OP -
-#define COMPARE_OP <
-void erode_gray_nonflat_int32
-#include "dilate_erode_gray_nonflat.h"
-
-/*
- * erode_gray_nonflat_single
- */
-#define TYPE float
-#define INIT_VAL ( std::numeric_limits<float>::max() )
-#define COMBINE_OP -
-#define COMPARE_OP <
-void erode_gray_nonflat_single
-#include "dilate_erode_gray_nonflat.h"
-
-/*
- * erode_gray_nonflat_double
- */
-#define TYPE double
-#define INIT_VAL ( std::numeric_limits<double>::max() )
-#define COMBINE_OP -
-#define COMPARE_OP <
-void erode_gray_nonflat_double
-#include "dilate_erode_gray_nonflat.h"
-
+void erode_gray_nonflat_uint8(uint8_t *In, uint8_t *Out, int num_elements,
+                              NeighborhoodWalker_T walker, double *heights)
+{
+    gray_nonflat<uint8_t, true>(In, Out, num_elements, walker, heights);
+}
+
+void erode_gray_nonflat_uint16(uint16_t *In, uint16_t *Out, int num_elements,
+                               NeighborhoodWalker_T walker, double *heights)
+{
+    gray_nonflat<uint16_t, true>(In, Out, num_elements, walker, heights);
+}
+
+void erode_gray_nonflat_uint32(uint32_t *In, uint32_t *Out, int num_elements,
+                               NeighborhoodWalker_T walker, double *heights)
+{
+    gray_nonflat<uint32_t, true>(In, Out, num_elements, walker, heights);
+}
+
+void erode_gray_nonflat_int8(int8_t *In, int8_t *Out, int num_elements,
+                             NeighborhoodWalker_T walker, double *heights)
+{
+    gray_nonflat<int8_t, true>(In, Out, num_elements, walker, heights);
+}
+
+void erode_gray_nonflat_int16(int16_t *In, int16_t *Out, int num_elements,
+                              NeighborhoodWalker_T walker, double *heights)
+{
+    gray_nonflat<int16_t, true>(In, Out, num_elements, walker, heights);
+}
+
+void erode_gray_nonflat_int32(int32_t *In, int32_t *Out, int num_elements,
+                              NeighborhoodWalker_T walker, double *heights)
+{
+    gray_nonflat<int32_t, true>(In, Out, num_elements, walker, heights);
+}
+
+void erode_gray_nonflat_single(float *In, float *Out, int num_elements,
+                               NeighborhoodWalker_T walker, double *heights)
+{
+    gray_nonflat<float, true>(In, Out, num_elements, walker, heights);
+}
+
+void erode_gray_nonflat_double(double *In, double *Out, int num_elements,
+                               NeighborhoodWalker_T walker, double *heights)
+{
+    gray_nonflat<double, true>(In, Out, num_elements, walker, heights);
+}
@@ -2,11 +2,278 @@
 // Created by xinyuangui on 9/19/18.
 //
 #include "morph.h"
+#include <algorithm>
 #include <cstdlib>
+#include <vector>
 
-#define BITS_PER_WORD 32
-#define LEFT_SHIFT(x,shift) (shift == 0 ? x : (shift == BITS_PER_WORD ? 0 : x << shift))
-#define RIGHT_SHIFT(x,shift) (shift == 0 ? x : (shift == BITS_PER_WORD ? 0 : x >> shift))
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define PACKED_AVX2_TARGET 1
+#endif
+
+/*
+ * The kernels below pull: every output word ORs in, for each neighbor, the
+ * two input words its bits come from, shifted into place. The per-neighbor
+ * word offsets and bit shifts are computed once, and the loop over words
+ * has no bounds tests (vectorized with AVX2 when asked for and supported).
+ * The result is the one of pushing every input word to its neighbors, bit
+ * for bit, including the bits that land past the last real row of the
+ * last word.
+ */
+
+template <typename Word>
+struct PackedShiftTable {
+    std::vector<ptrdiff_t> column_offset;
+    std::vector<ptrdiff_t> word_offset;
+    std::vector<int> bit_shift;
+
+    PackedShiftTable(const ptrdiff_t *rc_offsets, int num_neighbors)
+            : column_offset(num_neighbors), word_offset(num_neighbors), bit_shift(num_neighbors) {
+        const ptrdiff_t bits = 8 * sizeof(Word);
+        for (int k = 0; k < num_neighbors; k++) {
+            ptrdiff_t r = rc_offsets[k];
+            column_offset[k] = rc_offsets[k + num_neighbors];
+            word_offset[k] = r >= 0 ? r / bits : -((-r + bits - 1) / bits);
+            bit_shift[k] = (int) (r - bits * word_offset[k]);
+        }
+    }
+};
+
+/*
+ * out[r] |= in[r - a] << s | in[r - a - 1] >> (bits - s) for r in [lo, hi)
+ */
+template <typename Word>
+static void packed_pull_interior(const Word *in, Word *out, ptrdiff_t a, ptrdiff_t lo, ptrdiff_t hi, int s) {
+    const int bits = 8 * sizeof(Word);
+    if (s == 0) {
+        for (ptrdiff_t r = lo; r < hi; r++) {
+            out[r] |= in[r - a];
+        }
+    } else {
+        for (ptrdiff_t r = lo; r < hi; r++) {
+            out[r] |= (Word) (in[r - a] << s) | (Word) (in[r - a - 1] >> (bits - s));
+        }
+    }
+}
+
+/*
+ * one output column, every neighbor at once: out[r] |= OR over k of
+ * col[r + source[k]] << shift[k] | col[r + source[k] - 1] >> (bits - shift[k])
+ * (the right shift is split in two so that shift 0 gives 0)
+ */
+template <typename Word>
+static void packed_pull_column(const Word *col, Word *out, ptrdiff_t M, const ptrdiff_t *source,
+                               const int *shift, int num_neighbors) {
+    const int bits = 8 * sizeof(Word);
+    for (ptrdiff_t r = 0; r < M; r++) {
+        Word acc = out[r];
+        for (int k = 0; k < num_neighbors; k++) {
+            const Word *p = col + r + source[k];
+            acc |= (Word) (p[0] << shift[k]) | (Word) ((Word) (p[-1] >> 1) >> (bits - 1 - shift[k]));
+        }
+        out[r] = acc;
+    }
+}
+
+#ifdef PACKED_AVX2_TARGET
+/*
+ * the left and right shift counts of one neighbor, as the vector shifts
+ * take them
+ */
+typedef struct PackedShiftCounts_tag {
+    __m128i left;
+    __m128i right;
+} PackedShiftCounts;
+
+/*
+ * the same with 256-bit vectors; a vector shift by the word size gives 0.
+ * shifts holds the shift counts of every neighbor
+ */
+__attribute__((target("avx2")))
+static void packed_pull_column_avx2(const uint32_t *col, uint32_t *out, ptrdiff_t M, const ptrdiff_t *source,
+                                    const int *shift, const PackedShiftCounts *shifts, int num_neighbors) {
+    ptrdiff_t r = 0;
+    for (; r + 8 <= M; r += 8) {
+        __m256i acc = _mm256_loadu_si256((const __m256i *) (out + r));
+        for (int k = 0; k < num_neighbors; k++) {
+            const uint32_t *p = col + r + source[k];
+            __m256i v = _mm256_loadu_si256((const __m256i *) p);
+            __m256i w = _mm256_loadu_si256((const __m256i *) (p - 1));
+            acc = _mm256_or_si256(acc, _mm256_or_si256(_mm256_sll_epi32(v, shifts[k].left),
+                                                       _mm256_srl_epi32(w, shifts[k].right)));
+        }
+        _mm256_storeu_si256((__m256i *) (out + r), acc);
+    }
+    packed_pull_column(col + r, out + r, M - r, source, shift, num_neighbors);
+}
+
+__attribute__((target("avx2")))
+static void packed_pull_column_avx2(const uint64_t *col, uint64_t *out, ptrdiff_t M, const ptrdiff_t *source,
+                                    const int *shift, const PackedShiftCounts *shifts, int num_neighbors) {
+    ptrdiff_t r = 0;
+    for (; r + 4 <= M; r += 4) {
+        __m256i acc = _mm256_loadu_si256((const __m256i *) (out + r));
+        for (int k = 0; k < num_neighbors; k++) {
+            const uint64_t *p = col + r + source[k];
+            __m256i v = _mm256_loadu_si256((const __m256i *) p);
+            __m256i w = _mm256_loadu_si256((const __m256i *) (p - 1));
+            acc = _mm256_or_si256(acc, _mm256_or_si256(_mm256_sll_epi64(v, shifts[k].left),
+                                                       _mm256_srl_epi64(w, shifts[k].right)));
+        }
+        _mm256_storeu_si256((__m256i *) (out + r), acc);
+    }
+    packed_pull_column(col + r, out + r, M - r, source, shift, num_neighbors);
+}
+#endif
+
+bool packed_avx2_supported() {
+#ifdef PACKED_AVX2_TARGET
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+#else
+    return false;
+#endif
+}
+
+#ifndef PACKED_BLOCK_BYTES
+#define PACKED_BLOCK_BYTES 8192
+#endif
+
+/*
+ * Out |= dilation of In (M-by-N packed words) by rc_offsets.
+ *
+ * The columns are copied into a buffer framed by zeros: guard words above
+ * and below every column, as many as the largest word offset plus one,
+ * and guard columns on both sides, as many as the largest column offset.
+ * Every source word of every output word is then addressable and the
+ * guards contribute nothing, so no loop has a bounds test.
+ *
+ * The scalar kernel applies one neighbor at a time to a block of columns
+ * that stays in cache (a flat loop the compiler vectorizes); the AVX2
+ * kernel computes each output vector once, in a register, over all the
+ * neighbors.
+ */
+template <typename Word>
+static void packed_dilate_pull(const Word *In, Word *Out, ptrdiff_t M, ptrdiff_t N,
+                               const ptrdiff_t *rc_offsets, int num_neighbors, bool vector) {
+    PackedShiftTable<Word> table(rc_offsets, num_neighbors);
+#ifdef PACKED_AVX2_TARGET
+    vector = vector && packed_avx2_supported();
+#else
+    vector = false;
+#endif
+    if (M == 0 || N == 0) return;
+
+    // neighbors N or more columns away reach no pixel of the image
+    std::vector<ptrdiff_t> source;
+    std::vector<int> shift;
+    ptrdiff_t guard = 1;
+    ptrdiff_t guard_columns = 0;
+    for (int k = 0; k < num_neighbors; k++)
+    {
+        if (std::abs(table.column_offset[k]) >= N)
+        {
+            continue;
+        }
+        guard = std::max(guard, std::abs(table.word_offset[k]) + 1);
+        guard_columns = std::max(guard_columns, std::abs(table.column_offset[k]));
+    }
+    ptrdiff_t stride = M + 2*guard;
+    for (int k = 0; k < num_neighbors; k++)
+    {
+        if (std::abs(table.column_offset[k]) < N)
+        {
+            source.push_back(-(table.column_offset[k]*stride + table.word_offset[k]));
+            shift.push_back(table.bit_shift[k]);
+        }
+    }
+    int count = (int) source.size();
+
+    std::vector<Word> in((size_t) (stride*(N + 2*guard_columns)), (Word) 0);
+    Word *origin = in.data() + guard_columns*stride + guard;
+    for (ptrdiff_t c = 0; c < N; c++)
+    {
+        std::copy(In + c*M, In + c*M + M, origin + c*stride);
+    }
+
+#ifdef PACKED_AVX2_TARGET
+    if (vector)
+    {
+        std::vector<PackedShiftCounts> shifts((size_t) count);
+        for (int k = 0; k < count; k++)
+        {
+            shifts[k].left = _mm_cvtsi32_si128(shift[k]);
+            shifts[k].right = _mm_cvtsi32_si128((int) (8 * sizeof(Word)) - shift[k]);
+        }
+        for (ptrdiff_t c = 0; c < N; c++)
+        {
+            packed_pull_column_avx2(origin + c*stride, Out + c*M, M, source.data(), shift.data(),
+                                    shifts.data(), count);
+        }
+        return;
+    }
+#endif
+
+    std::vector<Word> out((size_t) (stride*N), (Word) 0);
+    for (ptrdiff_t c = 0; c < N; c++)
+    {
+        std::copy(Out + c*M, Out + c*M + M, out.begin() + c*stride + guard);
+    }
+    ptrdiff_t block = std::max((ptrdiff_t) 1, (ptrdiff_t) (PACKED_BLOCK_BYTES / (stride*sizeof(Word))));
+    for (ptrdiff_t c0 = 0; c0 < N; c0 += block)
+    {
+        ptrdiff_t c1 = std::min(N, c0 + block);
+        // the real words of columns c0..c1-1, and the guards between them
+        ptrdiff_t lo = c0*stride + guard;
+        ptrdiff_t hi = (c1 - 1)*stride + guard + M;
+        for (int k = 0; k < count; k++)
+        {
+            packed_pull_interior(in.data() + guard_columns*stride, out.data(), -source[k], lo, hi, shift[k]);
+        }
+    }
+    for (ptrdiff_t c = 0; c < N; c++)
+    {
+        std::copy(out.begin() + c*stride + guard, out.begin() + c*stride + guard + M, Out + c*M);
+    }
+}
+
+/*
+ * Out = erosion of In by the negation of negated_offsets: the complement of
+ * the dilation of the complement, with the bits past the last real row
+ * counting as foreground and cleared in the result
+ */
+template <typename Word>
+static void packed_erode_pull(const Word *In, Word *Out, ptrdiff_t M, ptrdiff_t N,
+                              const ptrdiff_t *negated_offsets, int num_neighbors,
+                              int unpacked_M, bool vector) {
+    const int bits = 8 * sizeof(Word);
+    int num_real_bits_in_last_row = unpacked_M % bits;
+    Word last_row_mask = num_real_bits_in_last_row == 0
+                         ? (Word) ~(Word) 0
+                         : (Word) (((Word) 1 << num_real_bits_in_last_row) - 1);
+
+    std::vector<Word> complement((size_t) (M * N));
+    for (ptrdiff_t c = 0; c < N; c++)
+    {
+        for (ptrdiff_t r = 0; r < M; r++)
+        {
+            complement[c*M + r] = (Word) ~In[c*M + r];
+        }
+        if (M > 0) complement[c*M + M - 1] &= last_row_mask;
+    }
+
+    std::fill(Out, Out + M*N, (Word) 0);
+    packed_dilate_pull(complement.data(), Out, M, N, negated_offsets, num_neighbors, vector);
+
+    for (ptrdiff_t k = 0; k < M*N; k++)
+    {
+        Out[k] = (Word) ~Out[k];
+    }
+    for (ptrdiff_t c = 0; c < N && M > 0; c++)
+    {
+        Out[c*M + M - 1] &= last_row_mask;
+    }
+}
 
 /*
  * dilate_packed_uint32
@@ -24,72 +291,13 @@
  *
  * Output
  * ======
- * Out           - pointer to first element of output array
+ * Out           - pointer to first element of output array; the dilation
+ *                 is ORed into it, so clear it first
  */
 void dilate_packed_uint32(unsigned int *In, unsigned int *Out, int MM, int NN,
                           ptrdiff_t *rc_offsets, int num_neighbors)
 {
-    ptrdiff_t M = static_cast<ptrdiff_t>(MM);
-    ptrdiff_t N = static_cast<ptrdiff_t>(NN);
-    ptrdiff_t *column_offset;
-    ptrdiff_t *row_offset1;
-    ptrdiff_t *row_offset2;
-    ptrdiff_t *bit_shift1;
-    ptrdiff_t *bit_shift2;
-    unsigned int val;
-    unsigned int shifted_val;
-
-    column_offset = (ptrdiff_t *) std::calloc(num_neighbors, sizeof(*column_offset));
-    row_offset1 = (ptrdiff_t *) std::calloc(num_neighbors, sizeof(*row_offset1));
-    row_offset2 = (ptrdiff_t *) std::calloc(num_neighbors, sizeof(*row_offset2));
-    bit_shift1 = (ptrdiff_t *) std::calloc(num_neighbors, sizeof(*bit_shift1));
-    bit_shift2 = (ptrdiff_t *) std::calloc(num_neighbors, sizeof(*bit_shift2));
-
-    for (int k = 0; k < num_neighbors; k++)
-    {
-        column_offset[k] = rc_offsets[k + num_neighbors];
-        ptrdiff_t r = rc_offsets[k];
-        row_offset1[k] = (ptrdiff_t) floor((double) r / BITS_PER_WORD);
-        row_offset2[k] = row_offset1[k] + 1;
-        bit_shift1[k] = r - BITS_PER_WORD*row_offset1[k];
-        bit_shift2[k] = BITS_PER_WORD - bit_shift1[k];
-    }
-
-    for (ptrdiff_t c = 0; c < N; c++)
-    {
-        for (ptrdiff_t r = 0; r < M; r++)
-        {
-            val = *In++;
-            if (val != 0)
-            {
-                for (int k = 0; k < num_neighbors; k++)
-                {
-                    ptrdiff_t cc = c + column_offset[k];
-                    if ((cc >= 0) && (cc < N))
-                    {
-                        ptrdiff_t rr = r + row_offset1[k];
-                        if ((rr >= 0) && (rr < M))
-                        {
-                            shifted_val = LEFT_SHIFT(val,bit_shift1[k]);
-                            Out[cc*M + rr] |= shifted_val;
-                        }
-                        rr = r + row_offset2[k];
-                        if ((rr >= 0) && (rr < M))
-                        {
-                            shifted_val = RIGHT_SHIFT(val,bit_shift2[k]);
-                            Out[cc*M + rr] |= shifted_val;
-                        }
-                    }
-                }
-            }
-        }
-    }
-
-    free(column_offset);
-    free(row_offset1);
-    free(row_offset2);
-    free(bit_shift1);
-    free(bit_shift2);
+    packed_dilate_pull(In, Out, MM, NN, rc_offsets, num_neighbors, false);
 }
 
 
@@ -111,108 +319,87 @@ void dilate_packed_uint32(unsigned int *In, unsigned int *Out, int MM, int NN,
  * Output
  * ======
  * Out           - pointer to first element of output array
+ *
+ * rc_offsets is negated in place.
  */
 void erode_packed_uint32(unsigned int *In, unsigned int *Out, int MM, int NN,
                          ptrdiff_t *rc_offsets, int num_neighbors,
                          int unpacked_M)
 {
-    ptrdiff_t M = static_cast<ptrdiff_t>(MM);
-    ptrdiff_t N = static_cast<ptrdiff_t>(NN);
-
-    ptrdiff_t *column_offset;
-    ptrdiff_t *row_offset1;
-    ptrdiff_t *row_offset2;
-    ptrdiff_t *bit_shift1;
-    ptrdiff_t *bit_shift2;
-    unsigned int val;
-    unsigned int shifted_val;
-    unsigned int last_row_mask;
-    int num_real_bits_in_last_row;
-
-    column_offset = (ptrdiff_t *) std::calloc(num_neighbors, sizeof(*column_offset));
-    row_offset1 = (ptrdiff_t *) std::calloc(num_neighbors, sizeof(*row_offset1));
-    row_offset2 = (ptrdiff_t *) std::calloc(num_neighbors, sizeof(*row_offset2));
-    bit_shift1 = (ptrdiff_t *) std::calloc(num_neighbors, sizeof(*bit_shift1));
-    bit_shift2 = (ptrdiff_t *) std::calloc(num_neighbors, sizeof(*bit_shift2));
-
     for (int k = 0; k < 2*num_neighbors; k++)
     {
         rc_offsets[k] = -rc_offsets[k];
     }
+    packed_erode_pull(In, Out, MM, NN, rc_offsets, num_neighbors, unpacked_M, false);
+}
 
-    for (int k = 0; k < num_neighbors; k++)
-    {
-        column_offset[k] = (ptrdiff_t) rc_offsets[k + num_neighbors];
-        ptrdiff_t r = (ptrdiff_t) rc_offsets[k];
-        row_offset1[k] = (ptrdiff_t) floor((double) r / BITS_PER_WORD);
-        row_offset2[k] = row_offset1[k] + 1;
-        bit_shift1[k] = r - BITS_PER_WORD*row_offset1[k];
-        bit_shift2[k] = BITS_PER_WORD - bit_shift1[k];
-    }
 
-    num_real_bits_in_last_row = unpacked_M % BITS_PER_WORD;
-    if (num_real_bits_in_last_row == 0)
-    {
-        num_real_bits_in_last_row = BITS_PER_WORD;
-    }
+/*
+ * dilate_packed_uint64, erode_packed_uint64
+ * The same on 64 pixels per word: M is the number of 64-bit words per
+ * column. Unlike the uint32 kernels, Out is overwritten and rc_offsets is
+ * left alone.
+ *
+ * dilate_packed_uint32_avx2, erode_packed_uint32_avx2,
+ * dilate_packed_uint64_avx2, erode_packed_uint64_avx2
+ * The same with 256-bit vectors; they run the scalar kernels on CPUs
+ * without AVX2 (see packed_avx2_supported).
+ */
+template <typename Word>
+static void packed_dilate(const Word *In, Word *Out, int M, int N,
+                          const ptrdiff_t *rc_offsets, int num_neighbors, bool vector)
+{
+    std::fill(Out, Out + (ptrdiff_t) M*N, (Word) 0);
+    packed_dilate_pull(In, Out, M, N, rc_offsets, num_neighbors, vector);
+}
 
-    last_row_mask = 0;
-    for (int k = 0; k < num_real_bits_in_last_row; k++)
+template <typename Word>
+static void packed_erode(const Word *In, Word *Out, int M, int N,
+                         const ptrdiff_t *rc_offsets, int num_neighbors, int unpacked_M, bool vector)
+{
+    std::vector<ptrdiff_t> negated(rc_offsets, rc_offsets + 2*num_neighbors);
+    for (size_t k = 0; k < negated.size(); k++)
     {
-        last_row_mask |= 1 << k;
+        negated[k] = -negated[k];
     }
+    packed_erode_pull(In, Out, M, N, negated.data(), num_neighbors, unpacked_M, vector);
+}
 
-    for (ptrdiff_t c = 0; c < N; c++)
-    {
-        for (ptrdiff_t r = 0; r < M; r++)
-        {
-            val = ~(*In++);
-            if (r == (M - 1))
-            {
-                val = val & last_row_mask;
-            }
-            if (val != 0)
-            {
-                for (int k = 0; k < num_neighbors; k++)
-                {
-                    ptrdiff_t cc = c + column_offset[k];
-                    if ((cc >= 0) && (cc < N))
-                    {
-                        ptrdiff_t rr = r + row_offset1[k];
-                        if ((rr >= 0) && (rr < M))
-                        {
-                            shifted_val = LEFT_SHIFT(val,bit_shift1[k]);
-                            Out[cc*M + rr] |= shifted_val;
-                        }
-                        rr = r + row_offset2[k];
-                        if ((rr >= 0) && (rr < M))
-                        {
-                            shifted_val = RIGHT_SHIFT(val,bit_shift2[k]);
-                            Out[cc*M + rr] |= shifted_val;
-                        }
-                    }
-                }
-            }
-        }
-    }
+void dilate_packed_uint64(const uint64_t *In, uint64_t *Out, int M, int N,
+                          const ptrdiff_t *rc_offsets, int num_neighbors)
+{
+    packed_dilate(In, Out, M, N, rc_offsets, num_neighbors, false);
+}
 
-    for (ptrdiff_t k = 0; k < M*N; k++)
-    {
-        Out[k] = ~Out[k];
-    }
+void erode_packed_uint64(const uint64_t *In, uint64_t *Out, int M, int N,
+                         const ptrdiff_t *rc_offsets, int num_neighbors,
+                         int unpacked_M)
+{
+    packed_erode(In, Out, M, N, rc_offsets, num_neighbors, unpacked_M, false);
+}
 
-    /*
-     * Mask out extraneous bits in the last row.
-     */
-    for (ptrdiff_t c = 0; c < N; c++)
-    {
-        Out[c*M + M - 1] &= last_row_mask;
-    }
+void dilate_packed_uint32_avx2(const uint32_t *In, uint32_t *Out, int M, int N,
+                               const ptrdiff_t *rc_offsets, int num_neighbors)
+{
+    packed_dilate(In, Out, M, N, rc_offsets, num_neighbors, true);
+}
 
-    free(column_offset);
-    free(row_offset1);
-    free(row_offset2);
-    free(bit_shift1);
-    free(bit_shift2);
+void erode_packed_uint32_avx2(const uint32_t *In, uint32_t *Out, int M, int N,
+                              const ptrdiff_t *rc_offsets, int num_neighbors,
+                              int unpacked_M)
+{
+    packed_erode(In, Out, M, N, rc_offsets, num_neighbors, unpacked_M, true);
 }
 
+void dilate_packed_uint64_avx2(const uint64_t *In, uint64_t *Out, int M, int N,
+                               const ptrdiff_t *rc_offsets, int num_neighbors)
+{
+    packed_dilate(In, Out, M, N, rc_offsets, num_neighbors, true);
+}
+
+void erode_packed_uint64_avx2(const uint64_t *In, uint64_t *Out, int M, int N,
+                              const ptrdiff_t *rc_offsets, int num_neighbors,
+                              int unpacked_M)
+{
+    packed_erode(In, Out, M, N, rc_offsets, num_neighbors, unpacked_M, true);
+}
@@ -0,0 +1,320 @@
+//
+// Max-tree construction: union-find over the pixels in decreasing order on
+// horizontal bands, merged along the band edges, then numbered and
+// attributed in one pass each.
+//
+// Algorithm references: C. Berger, T. Geraud, R. Levillain, N. Widynski,
+// A. Baillard and E. Bertin, "Effective Component Tree Computation with
+// Application to Pattern Recognition in Astronomical Imaging," ICIP 2007
+// (the union-find build); M. Wilkinson, H. Gao, W. Hesselink, J. Jonker and
+// A. Meijster, "Concurrent Computation of Attribute Filters on Shared
+// Memory Parallel Machines," IEEE PAMI 30(10), 2008 (the merge of the band
+// trees).
+//
+#include "max_tree.h"
+#include "trace.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+/*
+ * unsigned key that sorts like the float; -0 and +0 get different keys but
+ * sort next to each other, which is all the build needs
+ */
+static inline uint32_t sort_key(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits & 0x80000000u ? ~bits : bits | 0x80000000u;
+}
+
+/*
+ * the pixel indices sorted by increasing value: LSD radix sort on 11-bit
+ * digits
+ */
+static void sort_pixels(const std::vector<float> &f, std::vector<int> &order) {
+    const int digit_bits = 11, buckets = 1 << digit_bits;
+    size_t n = f.size();
+    std::vector<uint32_t> keys(n), keys_tmp(n);
+    std::vector<int> order_tmp(n);
+    order.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        keys[i] = sort_key(f[i]);
+        order[i] = (int) i;
+    }
+    std::vector<size_t> count(buckets);
+    for (int shift = 0; shift < 32; shift += digit_bits) {
+        std::fill(count.begin(), count.end(), 0);
+        for (size_t i = 0; i < n; ++i) ++count[(keys[i] >> shift) & (buckets - 1)];
+        // a digit every key shares leaves the order as it is
+        if (count[(keys[0] >> shift) & (buckets - 1)] == n) continue;
+        size_t total = 0;
+        for (int b = 0; b < buckets; ++b) {
+            size_t c = count[b];
+            count[b] = total;
+            total += c;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            size_t slot = count[(keys[i] >> shift) & (buckets - 1)]++;
+            keys_tmp[slot] = keys[i];
+            order_tmp[slot] = order[i];
+        }
+        keys.swap(keys_tmp);
+        order.swap(order_tmp);
+    }
+}
+
+typedef struct BuildContext_tag {
+    const float *f;
+    int rows;
+    int cols;
+    int connectivity;
+    int *parent;
+    int *zpar;
+} BuildContext;
+
+/*
+ * root of the union-find set of p, halving the path on the way
+ */
+static inline int find_root(int *zpar, int p) {
+    while (zpar[p] != p) {
+        zpar[p] = zpar[zpar[p]];
+        p = zpar[p];
+    }
+    return p;
+}
+
+/*
+ * the max-tree of the rows [y0, y1), from the band's pixels in increasing
+ * order: every pixel, from the highest, becomes the parent of the sets of
+ * its already visited neighbors
+ */
+static void build_band(const BuildContext &context, const int *order, size_t count, int y0, int y1) {
+    int cols = context.cols;
+    int *parent = context.parent;
+    int *zpar = context.zpar;
+    std::fill(zpar + (size_t) y0 * cols, zpar + (size_t) y1 * cols, -1);
+    for (size_t i = count; i-- > 0;) {
+        int p = order[i];
+        parent[p] = p;
+        zpar[p] = p;
+        int y = p / cols, x = p % cols;
+        for (int dy = -1; dy <= 1; ++dy) {
+            int ny = y + dy;
+            if (ny < y0 || ny >= y1) continue;
+            for (int dx = -1; dx <= 1; ++dx) {
+                int nx = x + dx;
+                if ((dx == 0 && dy == 0) || nx < 0 || nx >= cols) continue;
+                if (context.connectivity == 4 && dx != 0 && dy != 0) continue;
+                int q = ny * cols + nx;
+                if (zpar[q] < 0) continue;
+                int r = find_root(zpar, q);
+                if (r != p) {
+                    parent[r] = p;
+                    zpar[r] = p;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * the level root of p: the top of its chain of parents of the same value,
+ * which the chain is shortened to
+ */
+static inline int level_root(const float *f, int *parent, int p) {
+    int r = p;
+    while (parent[r] != r && f[parent[r]] == f[r]) r = parent[r];
+    while (p != r) {
+        int next = parent[p];
+        parent[p] = r;
+        p = next;
+    }
+    return r;
+}
+
+/*
+ * join the trees of two neighboring pixels: walk up both root paths,
+ * always from the higher node, and hang every node under the highest node
+ * of the other path that is not above it
+ */
+static void connect(const float *f, int *parent, int p, int q) {
+    int x = level_root(f, parent, p);
+    int y = level_root(f, parent, q);
+    if (f[y] > f[x]) std::swap(x, y);
+    while (x != y && y >= 0) {
+        int z = parent[x] == x ? -1 : level_root(f, parent, parent[x]);
+        if (z >= 0 && f[z] >= f[y]) {
+            x = z;
+        } else {
+            parent[x] = y;
+            x = y;
+            y = z;
+        }
+    }
+}
+
+/*
+ * join the trees of the bands on both sides of row y (the first row of the
+ * lower band)
+ */
+static void merge_bands(const BuildContext &context, int y) {
+    int cols = context.cols;
+    for (int x = 0; x < cols; ++x) {
+        int p = (y - 1) * cols + x;
+        for (int dx = -1; dx <= 1; ++dx) {
+            int nx = x + dx;
+            if (nx < 0 || nx >= cols || (context.connectivity == 4 && dx != 0)) continue;
+            connect(context.f, context.parent, p, y * cols + nx);
+        }
+    }
+}
+
+/*
+ * run task(0) .. task(count - 1) on up to count threads
+ */
+template <typename Task>
+static void run_parallel(int count, const Task &task) {
+    if (count == 1) {
+        task(0);
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (int i = 1; i < count; ++i) threads.push_back(std::thread(task, i));
+    task(0);
+    for (size_t i = 0; i < threads.size(); ++i) threads[i].join();
+}
+
+MaxTree::MaxTree(ImageView<const float> image, int connectivity, int num_threads)
+        : rows_(image.rows), cols_(image.cols) {
+    TRACE_SCOPE("max_tree_build", "max_tree");
+    if (connectivity != 4 && connectivity != 8) {
+        throw std::invalid_argument("connectivity must be 4 or 8");
+    }
+    if (num_threads < 1) {
+        throw std::invalid_argument("num_threads must be at least 1");
+    }
+    if (rows_ < 0 || cols_ < 0) {
+        throw std::invalid_argument("image size must not be negative");
+    }
+    size_t n = (size_t) rows_ * cols_;
+    if (n == 0) return;
+
+    std::vector<float> f(n);
+    for (int y = 0; y < rows_; ++y) {
+        const float *row = image.row(y);
+        for (int x = 0; x < cols_; ++x) {
+            if (row[x] != row[x]) throw std::invalid_argument("the max-tree needs an image without NaN");
+            f[(size_t) y * cols_ + x] = row[x];
+        }
+    }
+    std::vector<int> order;
+    sort_pixels(f, order);
+
+    // split the sorted pixels by band, keeping their order
+    int bands = std::min(num_threads, rows_);
+    std::vector<int> band_of_row(rows_), band_begin(bands + 1, 0);
+    for (int b = 0; b < bands; ++b) band_begin[b + 1] = (int) ((long long) rows_ * (b + 1) / bands);
+    for (int b = 0; b < bands; ++b) {
+        for (int y = band_begin[b]; y < band_begin[b + 1]; ++y) band_of_row[y] = b;
+    }
+    std::vector<size_t> band_start(bands + 1, 0);
+    for (size_t i = 0; i < n; ++i) ++band_start[band_of_row[order[i] / cols_] + 1];
+    for (int b = 0; b < bands; ++b) band_start[b + 1] += band_start[b];
+    std::vector<int> band_order(n);
+    {
+        std::vector<size_t> fill(band_start.begin(), band_start.end() - 1);
+        for (size_t i = 0; i < n; ++i) band_order[fill[band_of_row[order[i] / cols_]]++] = order[i];
+    }
+
+    std::vector<int> parent(n), zpar(n);
+    BuildContext context = {f.data(), rows_, cols_, connectivity, parent.data(), zpar.data()};
+    run_parallel(bands, [&](int b) {
+        build_band(context, band_order.data() + band_start[b], band_start[b + 1] - band_start[b],
+                   band_begin[b], band_begin[b + 1]);
+    });
+    // merge bands [b, b + span) with [b + span, b + 2 * span); the merges
+    // of one round touch separate bands
+    for (int span = 1; span < bands; span *= 2) {
+        int merges = (bands - span + 2 * span - 1) / (2 * span);
+        run_parallel(merges, [&](int m) {
+            merge_bands(context, band_begin[2 * span * m + span]);
+        });
+    }
+    zpar.clear();
+    zpar.shrink_to_fit();
+
+    // canonical form: every pixel points at its level root, every level
+    // root at the level root of its parent
+    for (size_t p = 0; p < n; ++p) level_root(f.data(), parent.data(), (int) p);
+    for (size_t p = 0; p < n; ++p) {
+        if (parent[p] != (int) p && f[parent[p]] != f[p]) {
+            parent[p] = level_root(f.data(), parent.data(), parent[p]);
+        }
+    }
+
+    // nodes numbered by increasing level: parents come first
+    pixel_node_.assign(n, -1);
+    for (size_t i = 0; i < n; ++i) {
+        int p = order[i];
+        bool is_root = parent[p] == p || f[parent[p]] != f[p];
+        if (!is_root) continue;
+        int id = (int) level_.size();
+        pixel_node_[p] = id;
+        level_.push_back(f[p]);
+        parent_.push_back(parent[p] == p ? id : pixel_node_[parent[p]]);
+    }
+    int num_nodes = (int) level_.size();
+    area_.assign(num_nodes, 0);
+    sum_.assign(num_nodes, 0.0);
+    peak_.assign(level_.begin(), level_.end());
+    for (size_t p = 0; p < n; ++p) {
+        int id = pixel_node_[p] >= 0 ? pixel_node_[p] : pixel_node_[parent[p]];
+        pixel_node_[p] = id;
+        ++area_[id];
+        sum_[id] += f[p];
+    }
+    for (int id = num_nodes - 1; id > 0; --id) {
+        int up = parent_[id];
+        area_[up] += area_[id];
+        sum_[up] += sum_[id];
+        if (peak_[id] > peak_[up]) peak_[up] = peak_[id];
+    }
+}
+
+void MaxTree::opening_levels(const AttributeCriteria &criteria, std::vector<float> &kept) const {
+    int num_nodes = (int) level_.size();
+    kept.resize(num_nodes);
+    for (int id = 0; id < num_nodes; ++id) {
+        bool keep = id == 0 ||
+                    ((double) area_[id] >= criteria.min_area && height(id) >= criteria.min_height &&
+                     volume(id) >= criteria.min_volume);
+        kept[id] = keep ? level_[id] : kept[parent_[id]];
+    }
+}
+
+void MaxTree::attribute_opening(const AttributeCriteria &criteria, ImageView<float> out) const {
+    if (out.rows != rows_ || out.cols != cols_) {
+        throw std::invalid_argument("output must have the size of the image");
+    }
+    std::vector<float> kept;
+    opening_levels(criteria, kept);
+    for (int y = 0; y < rows_; ++y) {
+        const int *nodes = pixel_node_.data() + (size_t) y * cols_;
+        float *out_row = out.row(y);
+        for (int x = 0; x < cols_; ++x) out_row[x] = kept[nodes[x]];
+    }
+}
+
+void MaxTree::attribute_top_hat(const AttributeCriteria &criteria, ImageView<float> out) const {
+    if (out.rows != rows_ || out.cols != cols_) {
+        throw std::invalid_argument("output must have the size of the image");
+    }
+    std::vector<float> kept;
+    opening_levels(criteria, kept);
+    for (int y = 0; y < rows_; ++y) {
+        const int *nodes = pixel_node_.data() + (size_t) y * cols_;
+        float *out_row = out.row(y);
+        for (int x = 0; x < cols_; ++x) out_row[x] = level_[nodes[x]] - kept[nodes[x]];
+    }
+}
@@ -3,3 +3,29 @@
 //
 
 #include "morph.h"
+#include <cmath>
+
+/**
+ * build the validity mask of a float raster. NaN pixels are always invalid,
+ * pixels equal to nodata_value are invalid when has_nodata is set.
+ * @param data
+ * @param num_elements
+ * @param has_nodata
+ * @param nodata_value
+ * @param num_invalid if not NULL, receives the number of invalid pixels
+ * @return newly allocated mask, true for valid pixels. should free later
+ */
+bool *make_valid_mask(const float *data, int num_elements,
+                      bool has_nodata, float nodata_value, int *num_invalid) {
+    bool *valid = (bool *) malloc(sizeof(bool) * num_elements);
+    int count = 0;
+    for (int i = 0; i < num_elements; ++i) {
+        float v = data[i];
+        valid[i] = !(std::isnan(v) || (has_nodata && v == nodata_value));
+        if (!valid[i]) ++count;
+    }
+    if (num_invalid != NULL) {
+        *num_invalid = count;
+    }
+    return valid;
+}
@@ -597,3 +597,252 @@ void ind_to_sub(int p, int *cumprod, ptrdiff_t *coords) {
 }
 
 
+
+
+/**
+ * nhMakeCleanRowMap
+ * Find the image rows whose whole walker footprint is free of invalid
+ * pixels. Kernels that honour a validity mask use this to run the plain
+ * (unmasked) inner loop on every row that cannot see a void.
+ *
+ * Inputs
+ * ======
+ * walker - NeighborhoodWalker_T object; only the neighbors in use count
+ * valid  - validity mask with one entry per image pixel
+ *
+ * Return
+ * ======
+ * newly allocated array with one entry per image row; true if neither the
+ * row itself nor any row reached by the walker contains an invalid pixel.
+ * The caller should free it.
+ */
+bool *nhMakeCleanRowMap(NeighborhoodWalker_T walker, const bool *valid) {
+    if (walker == NULL) {
+        throw std::invalid_argument("walker cannot be NULL");
+    }
+    if (valid == NULL) {
+        throw std::invalid_argument("valid cannot be NULL");
+    }
+
+    int cols = walker->image_size[0];
+    int rows = walker->image_size[1];
+
+    // the center row always counts, even if the walker skips the center
+    ptrdiff_t min_dy = 0;
+    ptrdiff_t max_dy = 0;
+    for (int k = 0; k < walker->num_neighbors; ++k) {
+        if (!walker->use[k]) continue;
+        ptrdiff_t dy = walker->array_coords[k * NUM_DIMS + 1];
+        if (dy < min_dy) min_dy = dy;
+        if (dy > max_dy) max_dy = dy;
+    }
+
+    // void_rows[r] holds the number of rows before r containing a void
+    int *void_rows = (int *) malloc((rows + 1) * sizeof(int));
+    void_rows[0] = 0;
+    for (int r = 0; r < rows; ++r) {
+        const bool *row = valid + (ptrdiff_t) r * cols;
+        bool has_void = false;
+        for (int c = 0; c < cols; ++c) {
+            if (!row[c]) {
+                has_void = true;
+                break;
+            }
+        }
+        void_rows[r + 1] = void_rows[r] + (has_void ? 1 : 0);
+    }
+
+    bool *clean = (bool *) malloc(rows * sizeof(bool));
+    for (int r = 0; r < rows; ++r) {
+        ptrdiff_t first = r + min_dy < 0 ? 0 : r + min_dy;
+        ptrdiff_t last = r + max_dy >= rows ? rows - 1 : r + max_dy;
+        clean[r] = void_rows[last + 1] == void_rows[first];
+    }
+
+    free(void_rows);
+    return clean;
+}
+
+/**
+ * assign_border_classes
+ * Group the positions 0..size-1 along one dimension by which neighbor
+ * offsets stay inside the image. Class 0 is the interior (all offsets in
+ * [lo_reach, hi_reach] allowed) and exists even if no position uses it.
+ *
+ * Inputs
+ * ======
+ * size     - image size along the dimension
+ * lo_reach - most negative neighbor offset along the dimension (<= 0)
+ * hi_reach - most positive neighbor offset along the dimension (>= 0)
+ *
+ * Outputs
+ * =======
+ * classes  - class of every position (size entries)
+ * ranges   - newly allocated array with the allowed [lo, hi] offsets of
+ *            every class, 2 entries per class
+ *
+ * Return
+ * ======
+ * number of classes
+ */
+static int assign_border_classes(int size, int lo_reach, int hi_reach,
+                                 int *classes, int **ranges) {
+    int left = -lo_reach;
+    int right = hi_reach;
+    int num_keys = (left + 1) * (right + 1);
+    int *key_class = (int *) malloc(num_keys * sizeof(int));
+    for (int k = 0; k < num_keys; ++k) {
+        key_class[k] = -1;
+    }
+
+    // a position is keyed by its distance to both edges, clipped to the reach
+    *ranges = (int *) malloc(2 * (num_keys < size + 1 ? num_keys : size + 1) * sizeof(int));
+    int num_classes = 1;
+    key_class[num_keys - 1] = 0;
+    (*ranges)[0] = lo_reach;
+    (*ranges)[1] = hi_reach;
+    for (int i = 0; i < size; ++i) {
+        int to_lo = i < left ? i : left;
+        int to_hi = size - 1 - i < right ? size - 1 - i : right;
+        int key = to_lo * (right + 1) + to_hi;
+        if (key_class[key] < 0) {
+            key_class[key] = num_classes;
+            (*ranges)[2 * num_classes] = -to_lo;
+            (*ranges)[2 * num_classes + 1] = to_hi;
+            ++num_classes;
+        }
+        classes[i] = key_class[key];
+    }
+
+    free(key_class);
+    return num_classes;
+}
+
+/**
+ * nhMakeSpanWalker
+ * Make a span walker that visits the same neighbors, in the same order, as
+ * a neighborhood walker.
+ *
+ * Input
+ * =====
+ * walker - NeighborhoodWalker_T object; its flags and image size are used
+ *
+ * Return
+ * ======
+ * NeighborhoodSpanWalker_T object, positioned at pixel 0. Free it with
+ * nhDestroySpanWalker.
+ */
+NeighborhoodSpanWalker_T nhMakeSpanWalker(NeighborhoodWalker_T walker) {
+    if (walker == NULL) {
+        throw std::invalid_argument("walker cannot be NULL");
+    }
+
+    NeighborhoodSpanWalker_T result = (NeighborhoodSpanWalker_T) calloc(1, sizeof(*result));
+    int cols = walker->image_size[0];
+    int rows = walker->image_size[1];
+    result->image_size[0] = cols;
+    result->image_size[1] = rows;
+
+    int num_neighbors = 0;
+    for (int k = 0; k < walker->num_neighbors; ++k) {
+        if (walker->use[k]) ++num_neighbors;
+    }
+    result->num_neighbors = num_neighbors;
+    result->offsets = (ptrdiff_t *) malloc((num_neighbors + 1) * sizeof(ptrdiff_t));
+    result->scratch = (ptrdiff_t *) malloc((num_neighbors + 1) * sizeof(ptrdiff_t));
+    result->dx = (int *) malloc((num_neighbors + 1) * sizeof(int));
+    result->dy = (int *) malloc((num_neighbors + 1) * sizeof(int));
+
+    int dx_lo = 0, dx_hi = 0, dy_lo = 0, dy_hi = 0;
+    int n = 0;
+    for (int k = 0; k < walker->num_neighbors; ++k) {
+        if (!walker->use[k]) continue;
+        int dx = (int) walker->array_coords[k * NUM_DIMS];
+        int dy = (int) walker->array_coords[k * NUM_DIMS + 1];
+        result->offsets[n] = walker->neighbor_offsets[k];
+        result->dx[n] = dx;
+        result->dy[n] = dy;
+        if (dx < dx_lo) dx_lo = dx;
+        if (dx > dx_hi) dx_hi = dx;
+        if (dy < dy_lo) dy_lo = dy;
+        if (dy > dy_hi) dy_hi = dy;
+        ++n;
+    }
+
+    result->col_class = (int *) malloc((cols + 1) * sizeof(int));
+    result->row_class = (int *) malloc((rows + 1) * sizeof(int));
+    result->num_col_classes = assign_border_classes(cols, dx_lo, dx_hi,
+                                                    result->col_class, &result->col_class_range);
+    result->num_row_classes = assign_border_classes(rows, dy_lo, dy_hi,
+                                                    result->row_class, &result->row_class_range);
+
+    long long num_classes = (long long) result->num_row_classes * result->num_col_classes;
+    if (num_classes * num_neighbors <= NH_SPAN_TABLE_LIMIT) {
+        result->spans = (ptrdiff_t *) malloc((num_classes * num_neighbors + 1) * sizeof(ptrdiff_t));
+        result->span_counts = (int *) malloc(num_classes * sizeof(int));
+        for (int rc = 0; rc < result->num_row_classes; ++rc) {
+            int dy_min = result->row_class_range[2 * rc];
+            int dy_max = result->row_class_range[2 * rc + 1];
+            for (int cc = 0; cc < result->num_col_classes; ++cc) {
+                int dx_min = result->col_class_range[2 * cc];
+                int dx_max = result->col_class_range[2 * cc + 1];
+                int c = rc * result->num_col_classes + cc;
+                ptrdiff_t *span = result->spans + (ptrdiff_t) c * num_neighbors;
+                int count = 0;
+                for (int k = 0; k < num_neighbors; ++k) {
+                    if (result->dx[k] >= dx_min && result->dx[k] <= dx_max &&
+                        result->dy[k] >= dy_min && result->dy[k] <= dy_max) {
+                        span[count++] = result->offsets[k];
+                    }
+                }
+                result->span_counts[c] = count;
+            }
+        }
+    }
+
+    nhSpanWalkerSetLocation(result, 0);
+    return result;
+}
+
+/**
+ * nhSpanWalkerBorderSpan
+ * Span of the current pixel, filtered on the fly. Used by nhSpanWalkerSpan
+ * for border pixels when the span table was too large to build.
+ */
+const ptrdiff_t *nhSpanWalkerBorderSpan(NeighborhoodSpanWalker_T walker, int *count) {
+    int dx_min = -walker->x;
+    int dx_max = walker->image_size[0] - 1 - walker->x;
+    int dy_min = -walker->y;
+    int dy_max = walker->image_size[1] - 1 - walker->y;
+    int n = 0;
+    for (int k = 0; k < walker->num_neighbors; ++k) {
+        if (walker->dx[k] >= dx_min && walker->dx[k] <= dx_max &&
+            walker->dy[k] >= dy_min && walker->dy[k] <= dy_max) {
+            walker->scratch[n++] = walker->offsets[k];
+        }
+    }
+    *count = n;
+    return walker->scratch;
+}
+
+/**
+ * free space allocated by span walker object
+ */
+void nhDestroySpanWalker(NeighborhoodSpanWalker_T walker) {
+    if (walker == NULL) {
+        throw std::invalid_argument("walker cannot be NULL");
+    }
+
+    free(walker->offsets);
+    free(walker->dx);
+    free(walker->dy);
+    free(walker->col_class);
+    free(walker->row_class);
+    free(walker->col_class_range);
+    free(walker->row_class_range);
+    free(walker->spans);
+    free(walker->span_counts);
+    free(walker->scratch);
+
+    free(walker);
+}
@@ -0,0 +1,373 @@
+//
+// Packing, unpacking and packed binary morphology on row-major images.
+//
+#include "packed_binary.h"
+#include "morph.h"
+#include <cstdlib>
+#include <cstring>
+#include <queue>
+#include <stdexcept>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/*
+ * pixel x of a row, for the scalar tails
+ */
+static inline unsigned int threshold_bit(float value, float threshold, bool or_equal) {
+    return (unsigned int) (or_equal ? value >= threshold : value > threshold);
+}
+
+/*
+ * one full word of 32 pixels
+ */
+static inline unsigned int pack_threshold_word(const float *pixels, float threshold, bool or_equal) {
+#if defined(__AVX__)
+    __m256 t = _mm256_set1_ps(threshold);
+    unsigned int word = 0;
+    for (int b = 0; b < PACKED_BITS_PER_WORD; b += 8) {
+        __m256 v = _mm256_loadu_ps(pixels + b);
+        __m256 m = or_equal ? _mm256_cmp_ps(v, t, _CMP_GE_OQ) : _mm256_cmp_ps(v, t, _CMP_GT_OQ);
+        word |= (unsigned int) _mm256_movemask_ps(m) << b;
+    }
+    return word;
+#elif defined(__SSE2__)
+    __m128 t = _mm_set1_ps(threshold);
+    unsigned int word = 0;
+    for (int b = 0; b < PACKED_BITS_PER_WORD; b += 4) {
+        __m128 v = _mm_loadu_ps(pixels + b);
+        __m128 m = or_equal ? _mm_cmpge_ps(v, t) : _mm_cmpgt_ps(v, t);
+        word |= (unsigned int) _mm_movemask_ps(m) << b;
+    }
+    return word;
+#else
+    unsigned int word = 0;
+    for (int b = PACKED_BITS_PER_WORD - 1; b >= 0; --b) {
+        word = (word << 1) | threshold_bit(pixels[b], threshold, or_equal);
+    }
+    return word;
+#endif
+}
+
+void pack_threshold(ImageView<const float> image, float threshold, bool or_equal, unsigned int *packed) {
+    int words = packed_row_words(image.cols);
+    int full_words = image.cols / PACKED_BITS_PER_WORD;
+    for (int y = 0; y < image.rows; ++y) {
+        const float *row = image.row(y);
+        unsigned int *line = packed + (ptrdiff_t) y * words;
+        for (int w = 0; w < full_words; ++w) {
+            line[w] = pack_threshold_word(row + w * PACKED_BITS_PER_WORD, threshold, or_equal);
+        }
+        if (full_words < words) {
+            const float *pixels = row + full_words * PACKED_BITS_PER_WORD;
+            unsigned int word = 0;
+            for (int b = image.cols - full_words * PACKED_BITS_PER_WORD - 1; b >= 0; --b) {
+                word = (word << 1) | threshold_bit(pixels[b], threshold, or_equal);
+            }
+            line[full_words] = word;
+        }
+    }
+}
+
+static inline unsigned int pack_bool_word(const bool *pixels) {
+#if defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    __m128i low = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) pixels), zero);
+    __m128i high = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (pixels + 16)), zero);
+    unsigned int zeros = (unsigned int) _mm_movemask_epi8(low) |
+                         (unsigned int) _mm_movemask_epi8(high) << 16;
+    return ~zeros;
+#else
+    unsigned int word = 0;
+    for (int b = PACKED_BITS_PER_WORD - 1; b >= 0; --b) {
+        word = (word << 1) | (unsigned int) pixels[b];
+    }
+    return word;
+#endif
+}
+
+void pack_bool(ImageView<const bool> image, unsigned int *packed) {
+    int words = packed_row_words(image.cols);
+    int full_words = image.cols / PACKED_BITS_PER_WORD;
+    for (int y = 0; y < image.rows; ++y) {
+        const bool *row = image.row(y);
+        unsigned int *line = packed + (ptrdiff_t) y * words;
+        for (int w = 0; w < full_words; ++w) {
+            line[w] = pack_bool_word(row + w * PACKED_BITS_PER_WORD);
+        }
+        if (full_words < words) {
+            const bool *pixels = row + full_words * PACKED_BITS_PER_WORD;
+            unsigned int word = 0;
+            for (int b = image.cols - full_words * PACKED_BITS_PER_WORD - 1; b >= 0; --b) {
+                word = (word << 1) | (unsigned int) pixels[b];
+            }
+            line[full_words] = word;
+        }
+    }
+}
+
+static inline void unpack_bool_word(unsigned int word, bool *pixels) {
+#if defined(__SSE2__)
+    // every byte of a 16 pixel half picks its own bit of the replicated
+    // half word
+    const __m128i select = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                         1, 2, 4, 8, 16, 32, 64, -128);
+    const __m128i one = _mm_set1_epi8(1);
+    for (int half = 0; half < 2; ++half) {
+        __m128i v = _mm_cvtsi32_si128((int) (word >> (16 * half)) & 0xffff);
+        v = _mm_unpacklo_epi8(v, v);
+        v = _mm_unpacklo_epi16(v, v);
+        v = _mm_unpacklo_epi32(v, v);
+        v = _mm_cmpeq_epi8(_mm_and_si128(v, select), select);
+        _mm_storeu_si128((__m128i *) (pixels + 16 * half), _mm_and_si128(v, one));
+    }
+#else
+    for (int b = 0; b < PACKED_BITS_PER_WORD; ++b) {
+        pixels[b] = (word >> b) & 1u;
+    }
+#endif
+}
+
+void unpack_bool(const unsigned int *packed, ImageView<bool> image) {
+    int words = packed_row_words(image.cols);
+    int full_words = image.cols / PACKED_BITS_PER_WORD;
+    for (int y = 0; y < image.rows; ++y) {
+        bool *row = image.row(y);
+        const unsigned int *line = packed + (ptrdiff_t) y * words;
+        for (int w = 0; w < full_words; ++w) {
+            unpack_bool_word(line[w], row + w * PACKED_BITS_PER_WORD);
+        }
+        for (int x = full_words * PACKED_BITS_PER_WORD; x < image.cols; ++x) {
+            row[x] = (line[full_words] >> (x % PACKED_BITS_PER_WORD)) & 1u;
+        }
+    }
+}
+
+ptrdiff_t *packed_rc_offsets(Neighborhood_T nhood) {
+    int n = nhood->num_neighbors;
+    ptrdiff_t *rc_offsets = (ptrdiff_t *) malloc((2 * (size_t) n + 1) * sizeof(ptrdiff_t));
+    for (int k = 0; k < n; ++k) {
+        // the packed "rows" are our columns
+        rc_offsets[k] = nhood->array_coords[k * NUM_DIMS];
+        rc_offsets[k + n] = nhood->array_coords[k * NUM_DIMS + 1];
+    }
+    return rc_offsets;
+}
+
+void dilate_packed(const unsigned int *in, unsigned int *out, int rows, int cols, Neighborhood_T nhood) {
+    int words = packed_row_words(cols);
+    ptrdiff_t *rc_offsets = packed_rc_offsets(nhood);
+    dilate_packed_uint32_avx2(in, out, words, rows, rc_offsets, nhood->num_neighbors);
+    free(rc_offsets);
+    // the kernel shifts bits into the padding past the last column
+    int tail = cols % PACKED_BITS_PER_WORD;
+    if (tail != 0) {
+        unsigned int last_word_mask = (1u << tail) - 1;
+        for (int y = 0; y < rows; ++y) {
+            out[(ptrdiff_t) y * words + words - 1] &= last_word_mask;
+        }
+    }
+}
+
+void erode_packed(const unsigned int *in, unsigned int *out, int rows, int cols, Neighborhood_T nhood) {
+    int words = packed_row_words(cols);
+    ptrdiff_t *rc_offsets = packed_rc_offsets(nhood);
+    erode_packed_uint32_avx2(in, out, words, rows, rc_offsets, nhood->num_neighbors, cols);
+    free(rc_offsets);
+}
+
+/*
+ * grow seed bits along the runs of mask bits they sit in, both ways
+ * (log-step prefix propagation)
+ */
+static inline unsigned int fill_runs(unsigned int seed, unsigned int mask) {
+    unsigned int g = seed & mask;
+    unsigned int p = mask;
+    g |= p & (g << 1);  p &= p << 1;
+    g |= p & (g << 2);  p &= p << 2;
+    g |= p & (g << 4);  p &= p << 4;
+    g |= p & (g << 8);  p &= p << 8;
+    g |= p & (g << 16);
+    p = mask;
+    g |= p & (g >> 1);  p &= p >> 1;
+    g |= p & (g >> 2);  p &= p >> 2;
+    g |= p & (g >> 4);  p &= p >> 4;
+    g |= p & (g >> 8);  p &= p >> 8;
+    g |= p & (g >> 16);
+    return g;
+}
+
+/*
+ * what word w of a row passes vertically to the rows next to it: the word
+ * itself, and with 8-connectivity its horizontal neighbors too (the edge
+ * bits of the adjacent words included)
+ */
+template <bool eight>
+static inline unsigned int vertical_reach(const unsigned int *line, int w, int words) {
+    unsigned int v = line[w];
+    if (!eight) return v;
+    unsigned int r = v | (v << 1) | (v >> 1);
+    if (w > 0) r |= line[w - 1] >> (PACKED_BITS_PER_WORD - 1);
+    if (w + 1 < words) r |= line[w + 1] << (PACKED_BITS_PER_WORD - 1);
+    return r;
+}
+
+/*
+ * the mask bits of word (y, w) its neighbor words reach and it lacks
+ */
+template <bool eight>
+static inline unsigned int word_growth(const unsigned int *recon, const unsigned int *mask,
+                                       int y, int w, int rows, int words) {
+    const unsigned int *line = recon + (ptrdiff_t) y * words;
+    unsigned int grow = 0;
+    if (w > 0) grow |= line[w - 1] >> (PACKED_BITS_PER_WORD - 1);
+    if (w + 1 < words) grow |= line[w + 1] << (PACKED_BITS_PER_WORD - 1);
+    if (y > 0) grow |= vertical_reach<eight>(line - words, w, words);
+    if (y + 1 < rows) grow |= vertical_reach<eight>(line + words, w, words);
+    return grow & mask[(ptrdiff_t) y * words + w] & ~line[w];
+}
+
+/*
+ * add to word (y, w) everything its neighbors reach inside the mask; true
+ * if it changed
+ */
+template <bool eight>
+static inline bool update_word(unsigned int *recon, const unsigned int *mask,
+                               int y, int w, int rows, int words) {
+    unsigned int grow = word_growth<eight>(recon, mask, y, w, rows, words);
+    if (grow == 0) return false;
+    ptrdiff_t k = (ptrdiff_t) y * words + w;
+    recon[k] = fill_runs(recon[k] | grow, mask[k]);
+    return true;
+}
+
+template <bool eight, typename Counter>
+static void reconstruct_packed_impl(unsigned int *recon, const unsigned int *mask, int rows, int words,
+                                    ReconstructionStats *stats) {
+    Counter counter(stats ? &stats->walk : NULL);
+    std::queue<ptrdiff_t> queue;
+    ptrdiff_t total = (ptrdiff_t) rows * words;
+
+    // raster sweep: every word grows from the words above and to its left
+    // (and whatever the others already hold), and along its own runs
+    double start = counter.now();
+    for (ptrdiff_t k = 0; k < total; ++k) {
+        recon[k] = fill_runs(recon[k], mask[k]);
+    }
+    for (int y = 0; y < rows; ++y) {
+        for (int w = 0; w < words; ++w) {
+            update_word<eight>(recon, mask, y, w, rows, words);
+        }
+    }
+    if (stats) counter.elapsed(&stats->raster_seconds, start);
+
+    // antiraster sweep; a word that can still pass bits to a word this
+    // sweep already visited is queued
+    start = counter.now();
+    const int below = eight ? 1 : 0;
+    for (int y = rows - 1; y >= 0; --y) {
+        for (int w = words - 1; w >= 0; --w) {
+            if (!update_word<eight>(recon, mask, y, w, rows, words)) continue;
+            bool seed = w + 1 < words && word_growth<eight>(recon, mask, y, w + 1, rows, words);
+            for (int v = w - below; !seed && y + 1 < rows && v <= w + below; ++v) {
+                seed = v >= 0 && v < words && word_growth<eight>(recon, mask, y + 1, v, rows, words);
+            }
+            if (seed) {
+                queue.push((ptrdiff_t) y * words + w);
+                counter.seed();
+                counter.push(queue.size());
+            }
+        }
+    }
+    if (stats) counter.elapsed(&stats->antiraster_seconds, start);
+
+    // propagation: a word taken off the queue updates its neighbor words,
+    // and the ones that changed are queued in turn
+    start = counter.now();
+    while (!queue.empty()) {
+        ptrdiff_t k = queue.front();
+        queue.pop();
+        int y = (int) (k / words);
+        int w = (int) (k % words);
+        for (int dy = -1; dy <= 1; ++dy) {
+            int qy = y + dy;
+            if (qy < 0 || qy >= rows) continue;
+            // with 4-connectivity only the same word of the rows above and
+            // below is reached
+            int reach = eight || dy == 0 ? 1 : 0;
+            for (int qw = w - reach; qw <= w + reach; ++qw) {
+                if (qw < 0 || qw >= words || (dy == 0 && qw == w)) continue;
+                if (update_word<eight>(recon, mask, qy, qw, rows, words)) {
+                    queue.push((ptrdiff_t) qy * words + qw);
+                    counter.push(queue.size());
+                }
+            }
+        }
+    }
+    if (stats) {
+        counter.elapsed(&stats->propagation_seconds, start);
+        counter.add_queue_counts(stats);
+    }
+}
+
+void reconstruct_packed(unsigned int *marker, const unsigned int *mask, int rows, int cols,
+                        int connectivity, ReconstructionStats *stats) {
+    if (connectivity != 4 && connectivity != 8) {
+        throw std::invalid_argument("packed reconstruction supports connectivity 4 and 8");
+    }
+    int words = packed_row_words(cols);
+    ptrdiff_t total = (ptrdiff_t) rows * words;
+    for (ptrdiff_t k = 0; k < total; ++k) {
+        if (marker[k] & ~mask[k]) {
+            throw std::invalid_argument("Images:imreconstruct:markerGreaterThanMask: "
+                                        "MARKER pixels must be <= MASK pixels.");
+        }
+    }
+    if (connectivity == 8) {
+        if (stats) reconstruct_packed_impl<true, StatsCounter<true> >(marker, mask, rows, words, stats);
+        else reconstruct_packed_impl<true, StatsCounter<false> >(marker, mask, rows, words, stats);
+    } else {
+        if (stats) reconstruct_packed_impl<false, StatsCounter<true> >(marker, mask, rows, words, stats);
+        else reconstruct_packed_impl<false, StatsCounter<false> >(marker, mask, rows, words, stats);
+    }
+}
+
+void fill_holes_packed(const unsigned int *in, unsigned int *out, int rows, int cols, int connectivity) {
+    if (rows == 0 || cols == 0) return;
+    int words = packed_row_words(cols);
+    ptrdiff_t total = (ptrdiff_t) rows * words;
+    int tail = cols % PACKED_BITS_PER_WORD;
+    unsigned int last_word_mask = tail == 0 ? ~0u : (1u << tail) - 1;
+
+    // the background, and its pixels on the border as the marker
+    std::vector<unsigned int> background((size_t) total);
+    for (int y = 0; y < rows; ++y) {
+        for (int w = 0; w < words; ++w) {
+            ptrdiff_t k = (ptrdiff_t) y * words + w;
+            background[k] = ~in[k] & (w + 1 == words ? last_word_mask : ~0u);
+        }
+    }
+    for (int y = 0; y < rows; ++y) {
+        unsigned int *line = out + (ptrdiff_t) y * words;
+        const unsigned int *mask_line = background.data() + (ptrdiff_t) y * words;
+        if (y == 0 || y == rows - 1) {
+            memcpy(line, mask_line, sizeof(unsigned int) * words);
+        } else {
+            memset(line, 0, sizeof(unsigned int) * words);
+            line[0] |= mask_line[0] & 1u;
+            line[words - 1] |= mask_line[words - 1] & (1u << ((cols - 1) % PACKED_BITS_PER_WORD));
+        }
+    }
+    reconstruct_packed(out, background.data(), rows, cols, connectivity);
+
+    // everything but the background reached from the border
+    for (int y = 0; y < rows; ++y) {
+        unsigned int *line = out + (ptrdiff_t) y * words;
+        for (int w = 0; w < words; ++w) {
+            line[w] = ~line[w];
+        }
+        line[words - 1] &= last_word_mask;
+    }
+}
@@ -0,0 +1,270 @@
+//
+// Run-length encoded binary images: conversions, and erosion and dilation
+// by lines and rectangles on the runs.
+//
+#include "rle_binary.h"
+#include "packed_binary.h"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+RleImage rle_from_bool(ImageView<const bool> image) {
+    RleImage result(image.rows, image.cols);
+    for (int y = 0; y < image.rows; ++y) {
+        const bool *row = image.row(y);
+        int x = 0;
+        while (x < image.cols) {
+            while (x < image.cols && !row[x]) ++x;
+            if (x == image.cols) break;
+            int start = x;
+            while (x < image.cols && row[x]) ++x;
+            result.add_run(start, x);
+        }
+        result.end_row();
+    }
+    return result;
+}
+
+void rle_to_bool(const RleImage &image, ImageView<bool> out) {
+    if (out.rows != image.rows() || out.cols != image.cols()) {
+        throw std::invalid_argument("input and output must have the same size");
+    }
+    for (int y = 0; y < image.rows(); ++y) {
+        bool *row = out.row(y);
+        memset(row, 0, sizeof(bool) * image.cols());
+        for (const RleRun *run = image.row_begin(y); run != image.row_end(y); ++run) {
+            memset(row + run->start, 1, sizeof(bool) * (run->end - run->start));
+        }
+    }
+}
+
+RleImage rle_from_packed(const unsigned int *packed, int rows, int cols) {
+    RleImage result(rows, cols);
+    int words = packed_row_words(cols);
+    for (int y = 0; y < rows; ++y) {
+        const unsigned int *line = packed + (ptrdiff_t) y * words;
+        bool in_run = false;
+        int start = 0;
+        for (int w = 0; w < words; ++w) {
+            unsigned int word = line[w];
+            // the common cases: nothing starts, nothing ends
+            if (word == (in_run ? ~0u : 0u)) continue;
+            int base = w * PACKED_BITS_PER_WORD;
+            int pos = 0;
+            while (pos < PACKED_BITS_PER_WORD) {
+                // next bit that ends or starts a run
+                unsigned int rest = (in_run ? ~word : word) >> pos;
+                if (rest == 0) break;
+                pos += __builtin_ctz(rest);
+                if (in_run) {
+                    result.add_run(start, base + pos);
+                } else {
+                    start = base + pos;
+                }
+                in_run = !in_run;
+            }
+        }
+        if (in_run) result.add_run(start, cols);
+        result.end_row();
+    }
+    return result;
+}
+
+void rle_to_packed(const RleImage &image, unsigned int *packed) {
+    int words = packed_row_words(image.cols());
+    for (int y = 0; y < image.rows(); ++y) {
+        unsigned int *line = packed + (ptrdiff_t) y * words;
+        memset(line, 0, sizeof(unsigned int) * words);
+        for (const RleRun *run = image.row_begin(y); run != image.row_end(y); ++run) {
+            int first = run->start / PACKED_BITS_PER_WORD;
+            int last = (run->end - 1) / PACKED_BITS_PER_WORD;
+            unsigned int head = ~0u << (run->start % PACKED_BITS_PER_WORD);
+            unsigned int tail = ~0u >> (PACKED_BITS_PER_WORD - 1 - (run->end - 1) % PACKED_BITS_PER_WORD);
+            if (first == last) {
+                line[first] |= head & tail;
+                continue;
+            }
+            line[first] |= head;
+            for (int w = first + 1; w < last; ++w) line[w] = ~0u;
+            line[last] |= tail;
+        }
+    }
+}
+
+/*
+ * a list of rows of runs, for the intermediate results
+ */
+typedef struct RunRows_tag {
+    std::vector<RleRun> runs;
+    std::vector<size_t> start;
+} RunRows;
+
+static void push_run(std::vector<RleRun> &runs, size_t row_first, int start, int end) {
+    // merge runs that overlap or touch
+    if (runs.size() > row_first && start <= runs.back().end) {
+        runs.back().end = std::max(runs.back().end, end);
+        return;
+    }
+    RleRun run = {start, end};
+    runs.push_back(run);
+}
+
+/*
+ * intersection or union of two sorted lists of separate runs
+ */
+static void combine_runs(const RleRun *a, const RleRun *a_end, const RleRun *b, const RleRun *b_end,
+                         bool intersect, std::vector<RleRun> &out) {
+    size_t first = out.size();
+    if (intersect) {
+        while (a != a_end && b != b_end) {
+            int start = std::max(a->start, b->start);
+            int end = std::min(a->end, b->end);
+            if (start < end) {
+                RleRun run = {start, end};
+                out.push_back(run);
+            }
+            if (a->end < b->end) ++a;
+            else ++b;
+        }
+        return;
+    }
+    while (a != a_end || b != b_end) {
+        const RleRun *next;
+        if (b == b_end || (a != a_end && a->start < b->start)) next = a++;
+        else next = b++;
+        push_run(out, first, next->start, next->end);
+    }
+}
+
+static void append_rows(RleImage &result, const RunRows &rows) {
+    for (size_t y = 0; y + 1 < rows.start.size(); ++y) {
+        for (size_t k = rows.start[y]; k < rows.start[y + 1]; ++k) {
+            result.add_run(rows.runs[k].start, rows.runs[k].end);
+        }
+        result.end_row();
+    }
+}
+
+/*
+ * every row eroded by the offsets [lo, hi] (a run touching the image edge
+ * goes on past it), or dilated by them
+ */
+static RleImage horizontal_line(const RleImage &image, int lo, int hi, bool erode) {
+    RleImage result(image.rows(), image.cols());
+    int cols = image.cols();
+    std::vector<RleRun> runs;
+    for (int y = 0; y < image.rows(); ++y) {
+        runs.clear();
+        for (const RleRun *run = image.row_begin(y); run != image.row_end(y); ++run) {
+            long long start, end;
+            if (erode) {
+                start = run->start == 0 ? 0 : (long long) run->start - lo;
+                end = run->end == cols ? cols : (long long) run->end - hi;
+            } else {
+                start = (long long) run->start + lo;
+                end = (long long) run->end + hi;
+            }
+            start = std::max(start, 0LL);
+            end = std::min(end, (long long) cols);
+            if (start < end) push_run(runs, 0, (int) start, (int) end);
+        }
+        for (size_t k = 0; k < runs.size(); ++k) result.add_run(runs[k].start, runs[k].end);
+        result.end_row();
+    }
+    return result;
+}
+
+/*
+ * row y becomes the intersection (erode) or union of the rows
+ * [y + lo, y + hi] inside the image; the rows outside do not change the
+ * result
+ */
+static RleImage vertical_line(const RleImage &image, int lo, int hi, bool erode) {
+    int rows = image.rows();
+    RleImage result(rows, image.cols());
+    if (rows == 0) return result;
+
+    // table[k] row y combines the rows y .. y + 2^k - 1
+    std::vector<RunRows> table(1);
+    for (int y = 0; y < rows; ++y) {
+        table[0].start.push_back(table[0].runs.size());
+        table[0].runs.insert(table[0].runs.end(), image.row_begin(y), image.row_end(y));
+    }
+    table[0].start.push_back(table[0].runs.size());
+    int longest = std::min(hi - lo + 1, rows);
+    for (int span = 2; span <= longest; span *= 2) {
+        const RunRows &previous = table.back();
+        RunRows next;
+        int half = span / 2;
+        for (int y = 0; y + span <= rows; ++y) {
+            next.start.push_back(next.runs.size());
+            combine_runs(previous.runs.data() + previous.start[y], previous.runs.data() + previous.start[y + 1],
+                         previous.runs.data() + previous.start[y + half],
+                         previous.runs.data() + previous.start[y + half + 1], erode, next.runs);
+        }
+        next.start.push_back(next.runs.size());
+        table.push_back(next);
+    }
+
+    RunRows out;
+    for (int y = 0; y < rows; ++y) {
+        out.start.push_back(out.runs.size());
+        int a = std::max(y + lo, 0);
+        int b = std::min(y + hi, rows - 1);
+        if (a > b) {
+            // no row under the line
+            if (erode && image.cols() > 0) {
+                RleRun full = {0, image.cols()};
+                out.runs.push_back(full);
+            }
+            continue;
+        }
+        int k = 0;
+        while ((2 << k) <= b - a + 1) ++k;
+        const RunRows &level = table[k];
+        int second = b - (1 << k) + 1;
+        combine_runs(level.runs.data() + level.start[a], level.runs.data() + level.start[a + 1],
+                     level.runs.data() + level.start[second], level.runs.data() + level.start[second + 1],
+                     erode, out.runs);
+    }
+    out.start.push_back(out.runs.size());
+    append_rows(result, out);
+    return result;
+}
+
+static void check_length(int length) {
+    if (length < 1) {
+        throw std::invalid_argument("the line must have at least one pixel");
+    }
+}
+
+// a line of length pixels covers the offsets [-(length - 1) / 2, length / 2];
+// dilate_logical sets p + offset for every set p, so dilation reflects them
+
+RleImage rle_erode_hline(const RleImage &image, int length) {
+    check_length(length);
+    return horizontal_line(image, -((length - 1) / 2), length / 2, true);
+}
+
+RleImage rle_dilate_hline(const RleImage &image, int length) {
+    check_length(length);
+    return horizontal_line(image, -((length - 1) / 2), length / 2, false);
+}
+
+RleImage rle_erode_vline(const RleImage &image, int length) {
+    check_length(length);
+    return vertical_line(image, -((length - 1) / 2), length / 2, true);
+}
+
+RleImage rle_dilate_vline(const RleImage &image, int length) {
+    check_length(length);
+    return vertical_line(image, -(length / 2), (length - 1) / 2, false);
+}
+
+RleImage rle_erode_rect(const RleImage &image, int mask_y, int mask_x) {
+    return rle_erode_vline(rle_erode_hline(image, mask_x), mask_y);
+}
+
+RleImage rle_dilate_rect(const RleImage &image, int mask_y, int mask_x) {
+    return rle_dilate_vline(rle_dilate_hline(image, mask_x), mask_y);
+}
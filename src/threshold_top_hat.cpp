@@ -0,0 +1,125 @@
+//
+// Threshold decomposition of the top-hat on packed level sets.
+//
+#include "threshold_top_hat.h"
+#include "packed_binary.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+int threshold_levels(ImageView<const float> image, int max_levels, float *levels) {
+    int count = 0;
+    uint32_t last_bits = 0;
+    bool have_last = false;
+    for (int y = 0; y < image.rows; ++y) {
+        const float *row = image.row(y);
+        for (int x = 0; x < image.cols; ++x) {
+            float v = row[x];
+            uint32_t bits;
+            memcpy(&bits, &v, sizeof(bits));
+            // DSMs are mostly runs of equal values; compare the bits so +0
+            // and -0 are told apart
+            if (have_last && bits == last_bits) continue;
+            if (v != v || (v == 0 && std::signbit(v))) return -1;
+            float *position = std::lower_bound(levels, levels + count, v);
+            if (position == levels + count || *position != v) {
+                if (count == max_levels) return -1;
+                memmove(position + 1, position, sizeof(float) * (levels + count - position));
+                *position = v;
+                ++count;
+            }
+            last_bits = bits;
+            have_last = true;
+        }
+    }
+    return count;
+}
+
+bool threshold_top_hat_preferred(int num_levels, int num_neighbors) {
+    // measured on 1024x1024 DSMs, in ns per pixel: each level set costs
+    // about 2.2 + num_neighbors / 200 (packing, packed erosion and
+    // reconstruction), the grayscale pipeline about 22 + 0.45 * num_neighbors
+    if (num_levels <= 1) return true;
+    return (num_levels - 1) * (440 + num_neighbors) <= 4400 + 90 * num_neighbors;
+}
+
+void top_hat_extract_levels(ImageView<const float> image, const float *levels, int num_levels,
+        int *mask, int mask_y, int mask_x, ImageView<float> out, TopHatStats *stats) {
+    if (out.rows != image.rows || out.cols != image.cols) {
+        throw std::invalid_argument("input and output must have the same size");
+    }
+    if (num_levels < 1 || num_levels > 256) {
+        throw std::invalid_argument("the threshold decomposition needs 1 to 256 levels");
+    }
+    int rows = image.rows;
+    int cols = image.cols;
+    if (rows == 0 || cols == 0) return;
+
+    Neighborhood_T nhood;
+    if (mask) {
+        int mask_size[2] = {mask_x, mask_y};
+        nhood = create_neighborhood_general_template(mask, mask_size, NH_CENTER_MIDDLE_ROUNDDOWN);
+    } else {
+        nhood = nhMakeDefaultConnectivityNeighborhood();
+    }
+
+    int words = packed_row_words(cols);
+    size_t total = (size_t) rows * words;
+    std::vector<unsigned int> level_set(total);
+    std::vector<unsigned int> recon(total);
+    std::vector<unsigned char> count((size_t) rows * cols, 0);
+
+    double erosion_seconds = 0, reconstruction_seconds = 0, start = 0;
+    for (int level = 1; level < num_levels; ++level) {
+        if (stats) start = stats_now();
+        pack_threshold(image, levels[level], true, level_set.data());
+        erode_packed(level_set.data(), recon.data(), rows, cols, nhood);
+        if (stats) {
+            erosion_seconds += stats_now() - start;
+            start = stats_now();
+        }
+
+        // the eroded level sets are nested: once one is empty, so are the
+        // ones above it
+        bool any = false;
+        for (size_t k = 0; k < total; ++k) {
+            recon[k] &= level_set[k];
+            any |= recon[k] != 0;
+        }
+        if (!any) {
+            if (stats) reconstruction_seconds += stats_now() - start;
+            break;
+        }
+        reconstruct_packed(recon.data(), level_set.data(), rows, cols);
+        if (stats) reconstruction_seconds += stats_now() - start;
+
+        for (int y = 0; y < rows; ++y) {
+            const unsigned int *line = recon.data() + (size_t) y * words;
+            unsigned char *count_row = count.data() + (size_t) y * cols;
+            for (int x = 0; x < cols; ++x) {
+                count_row[x] += (line[x / PACKED_BITS_PER_WORD] >> (x % PACKED_BITS_PER_WORD)) & 1u;
+            }
+        }
+    }
+
+    nhDestroyNeighborhood(nhood);
+
+    if (stats) start = stats_now();
+    for (int y = 0; y < rows; ++y) {
+        const float *image_row = image.row(y);
+        const unsigned char *count_row = count.data() + (size_t) y * cols;
+        float *out_row = out.row(y);
+        for (int x = 0; x < cols; ++x) {
+            out_row[x] = image_row[x] - levels[count_row[x]];
+        }
+    }
+    if (stats) {
+        stats->subtraction_seconds += stats_now() - start;
+        stats->erosion_seconds += erosion_seconds;
+        stats->reconstruction.propagation_seconds += reconstruction_seconds;
+        stats->levels = num_levels;
+    }
+}
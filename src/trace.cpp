@@ -0,0 +1,125 @@
+#include "trace.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <vector>
+
+std::atomic<bool> trace_active(false);
+
+typedef struct TraceEvent_tag {
+    const char *name;
+    const char *category;
+    long long index;
+    double begin_us;
+    double dur_us;
+} TraceEvent;
+
+/**
+ * events of one thread. only the owning thread appends; the registry keeps
+ * the buffer alive after the thread exits so its events still get written.
+ */
+typedef struct TraceBuffer_tag {
+    int tid;
+    std::vector<TraceEvent> events;
+} TraceBuffer;
+
+static std::mutex registry_mutex;
+static std::vector<TraceBuffer *> registry;
+static std::string trace_file;
+static std::chrono::steady_clock::time_point trace_start;
+static thread_local TraceBuffer *local_buffer = NULL;
+
+/**
+ * register the calling thread's buffer; the only locked step, once per thread
+ */
+static TraceBuffer *thread_buffer() {
+    if (local_buffer == NULL) {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        local_buffer = new TraceBuffer;
+        local_buffer->tid = (int) registry.size() + 1;
+        local_buffer->events.reserve(1024);
+        registry.push_back(local_buffer);
+    }
+    return local_buffer;
+}
+
+static void write_at_exit() {
+    trace_write();
+}
+
+void trace_enable(const char *file_name) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    bool first = trace_file.empty();
+    trace_file = file_name;
+    if (first) {
+        trace_start = std::chrono::steady_clock::now();
+        atexit(write_at_exit);
+    }
+    trace_active.store(true, std::memory_order_relaxed);
+}
+
+/**
+ * honour TOPHAT_TRACE=<file> without any code change in the caller
+ */
+static bool enable_from_environment() {
+    const char *file_name = getenv("TOPHAT_TRACE");
+    if (file_name != NULL && file_name[0] != '\0') {
+        trace_enable(file_name);
+        return true;
+    }
+    return false;
+}
+
+static bool enabled_from_environment = enable_from_environment();
+
+double trace_now_us() {
+    return std::chrono::duration<double, std::micro>(
+            std::chrono::steady_clock::now() - trace_start).count();
+}
+
+void trace_record(const char *name, const char *category, long long index,
+                  double begin_us, double end_us) {
+    TraceEvent event;
+    event.name = name;
+    event.category = category;
+    event.index = index;
+    event.begin_us = begin_us;
+    event.dur_us = end_us - begin_us;
+    thread_buffer()->events.push_back(event);
+}
+
+bool trace_write() {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    if (trace_file.empty()) {
+        return false;
+    }
+
+    FILE *file = fopen(trace_file.c_str(), "w");
+    if (file == NULL) {
+        return false;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    for (size_t b = 0; b < registry.size(); ++b) {
+        TraceBuffer *buffer = registry[b];
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                      "\"args\":{\"name\":\"thread %d\"}}",
+                first ? "" : ",\n", buffer->tid, buffer->tid);
+        first = false;
+        for (size_t k = 0; k < buffer->events.size(); ++k) {
+            const TraceEvent &e = buffer->events[k];
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                          "\"ts\":%.3f,\"dur\":%.3f",
+                    e.name, e.category, buffer->tid, e.begin_us, e.dur_us);
+            if (e.index >= 0) {
+                fprintf(file, ",\"args\":{\"index\":%lld}", e.index);
+            }
+            fprintf(file, "}");
+        }
+    }
+    fprintf(file, "\n]}\n");
+    return fclose(file) == 0;
+}
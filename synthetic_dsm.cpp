@@ -0,0 +1,119 @@
+#include "synthetic_dsm.h"
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <random>
+
+void synthetic_dsm_default_params(SyntheticDsmParams *params) {
+    params->seed = 1;
+    params->terrain_amplitude = 20.0;
+    params->terrain_wavelength = 400.0;
+    params->building_density = 0.15;
+    params->building_min_size = 6;
+    params->building_max_size = 40;
+    params->building_min_height = 3.0;
+    params->building_max_height = 30.0;
+    params->tree_density = 0.05;
+    params->tree_min_radius = 1.5;
+    params->tree_max_radius = 5.0;
+    params->tree_max_height = 15.0;
+    params->noise_sigma = 0.1;
+}
+
+float *synthetic_dsm_generate(int y_size, int x_size, const SyntheticDsmParams *params) {
+    std::mt19937 rng(params->seed);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    const double two_pi = 6.283185307179586;
+    ptrdiff_t num_elements = (ptrdiff_t) y_size * x_size;
+
+    // terrain: a few random plane waves, separable into per-row and
+    // per-column tables so generation stays linear in the pixel count
+    const int num_waves = 4;
+    float *ground = (float *) malloc(sizeof(float) * num_elements);
+    double *row_phase = (double *) malloc(sizeof(double) * y_size);
+    double *col_phase = (double *) malloc(sizeof(double) * x_size);
+    for (ptrdiff_t i = 0; i < num_elements; ++i) {
+        ground[i] = 0;
+    }
+    for (int w = 0; w < num_waves; ++w) {
+        double angle = two_pi * unit(rng);
+        double wavelength = params->terrain_wavelength * (0.5 + unit(rng));
+        double amplitude = params->terrain_amplitude / (w + 1);
+        double phase = two_pi * unit(rng);
+        double ky = two_pi * sin(angle) / wavelength;
+        double kx = two_pi * cos(angle) / wavelength;
+        for (int y = 0; y < y_size; ++y) row_phase[y] = ky * y + phase;
+        for (int x = 0; x < x_size; ++x) col_phase[x] = kx * x;
+        for (int y = 0; y < y_size; ++y) {
+            float *row = ground + (ptrdiff_t) y * x_size;
+            for (int x = 0; x < x_size; ++x) {
+                row[x] += (float) (amplitude * sin(row_phase[y] + col_phase[x]));
+            }
+        }
+    }
+    free(row_phase);
+    free(col_phase);
+
+    float *dsm = (float *) malloc(sizeof(float) * num_elements);
+    for (ptrdiff_t i = 0; i < num_elements; ++i) {
+        dsm[i] = ground[i];
+    }
+
+    // buildings: flat roofs at ground level of the footprint center
+    double mean_size = 0.5 * (params->building_min_size + params->building_max_size);
+    long long num_buildings = (long long) (params->building_density * num_elements /
+                                           (mean_size * mean_size));
+    std::uniform_int_distribution<int> size_dist(params->building_min_size,
+                                                 params->building_max_size);
+    for (long long b = 0; b < num_buildings; ++b) {
+        int h = size_dist(rng);
+        int w = size_dist(rng);
+        int y0 = (int) (unit(rng) * y_size);
+        int x0 = (int) (unit(rng) * x_size);
+        double height = params->building_min_height +
+                        unit(rng) * (params->building_max_height - params->building_min_height);
+        int cy = y0 + h / 2 < y_size ? y0 + h / 2 : y_size - 1;
+        int cx = x0 + w / 2 < x_size ? x0 + w / 2 : x_size - 1;
+        float roof = (float) (ground[(ptrdiff_t) cy * x_size + cx] + height);
+        for (int y = y0; y < y0 + h && y < y_size; ++y) {
+            float *row = dsm + (ptrdiff_t) y * x_size;
+            for (int x = x0; x < x0 + w && x < x_size; ++x) {
+                if (roof > row[x]) row[x] = roof;
+            }
+        }
+    }
+
+    // trees: spherical-cap crowns on top of the ground
+    double mean_radius = 0.5 * (params->tree_min_radius + params->tree_max_radius);
+    long long num_trees = (long long) (params->tree_density * num_elements /
+                                       (3.14159 * mean_radius * mean_radius));
+    for (long long t = 0; t < num_trees; ++t) {
+        double radius = params->tree_min_radius +
+                        unit(rng) * (params->tree_max_radius - params->tree_min_radius);
+        double height = params->tree_max_height * (0.3 + 0.7 * unit(rng));
+        double cy = unit(rng) * y_size;
+        double cx = unit(rng) * x_size;
+        int r = (int) ceil(radius);
+        for (int y = (int) cy - r; y <= (int) cy + r; ++y) {
+            if (y < 0 || y >= y_size) continue;
+            for (int x = (int) cx - r; x <= (int) cx + r; ++x) {
+                if (x < 0 || x >= x_size) continue;
+                double d2 = ((y - cy) * (y - cy) + (x - cx) * (x - cx)) / (radius * radius);
+                if (d2 >= 1.0) continue;
+                ptrdiff_t i = (ptrdiff_t) y * x_size + x;
+                float crown = (float) (ground[i] + height * sqrt(1.0 - d2));
+                if (crown > dsm[i]) dsm[i] = crown;
+            }
+        }
+    }
+
+    if (params->noise_sigma > 0) {
+        std::normal_distribution<float> noise(0.0f, (float) params->noise_sigma);
+        for (ptrdiff_t i = 0; i < num_elements; ++i) {
+            dsm[i] += noise(rng);
+        }
+    }
+
+    free(ground);
+    return dsm;
+}
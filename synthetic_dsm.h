@@ -0,0 +1,47 @@
+#ifndef TOPHAT_RECODE_REORGANIZE_SYNTHETIC_DSM_H
+#define TOPHAT_RECODE_REORGANIZE_SYNTHETIC_DSM_H
+
+/**
+ * Seeded synthetic DSM for benchmarks and tests: rolling terrain, flat-roofed
+ * box buildings, rounded tree crowns and sensor noise. The same parameters
+ * and seed always give the same raster. Heights are in meters, sizes in
+ * pixels.
+ */
+typedef struct SyntheticDsmParams_tag {
+    unsigned int seed;
+
+    double terrain_amplitude;
+    double terrain_wavelength;
+
+    /**
+     * fraction of the image covered by building footprints
+     */
+    double building_density;
+    int building_min_size;
+    int building_max_size;
+    double building_min_height;
+    double building_max_height;
+
+    /**
+     * fraction of the image covered by tree crowns
+     */
+    double tree_density;
+    double tree_min_radius;
+    double tree_max_radius;
+    double tree_max_height;
+
+    /**
+     * standard deviation of the additive gaussian noise
+     */
+    double noise_sigma;
+} SyntheticDsmParams;
+
+void synthetic_dsm_default_params(SyntheticDsmParams *params);
+
+/**
+ * generate a y_size-by-x_size row-major DSM
+ * @return newly allocated raster, should free later
+ */
+float *synthetic_dsm_generate(int y_size, int x_size, const SyntheticDsmParams *params);
+
+#endif //TOPHAT_RECODE_REORGANIZE_SYNTHETIC_DSM_H
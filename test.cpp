@@ -46,7 +46,7 @@ int main() {
     int mask[5 * 5];
     for (int i = 0; i < 25; ++i) mask[i] = 1;
 
-    float *tophat = top_hat_extract(data, y_inputs, x_inputs, mask, 5, 5);
+    float *tophat = top_hat_extract_masked(data, handler.get_valid_mask(), y_inputs, x_inputs, mask, 5, 5);
 
 
 